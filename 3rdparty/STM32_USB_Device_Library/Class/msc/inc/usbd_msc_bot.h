@@ -112,6 +112,7 @@ MSC_BOT_CSW_TypeDef;
   */
 
 extern uint8_t              MSC_BOT_Data[];
+extern uint8_t              MSC_BOT_Data1[];
 extern uint16_t             MSC_BOT_DataLen;
 extern uint8_t              MSC_BOT_State;
 extern uint8_t              MSC_BOT_BurstMode;
@@ -65,6 +65,13 @@ typedef struct _USBD_STORAGE
   int8_t (* Write)(uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
   int8_t (* GetMaxLun)(void);
   int8_t *pInquiry;
+  int8_t (* Sync)(uint8_t lun);    /* Optional (may be NULL) : waits for the writes
+                                      (and prefetches) still going on after Write
+                                      returned. Also called on BOT reset and abort */
+  int8_t (* Prefetch)(uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
+                                   /* Optional (may be NULL) : starts reading the
+                                      next packet into buf, Read of the same
+                                      buf/blk_addr/blk_len then only waits for it */
   
 }USBD_STORAGE_cb_TypeDef;
 /**
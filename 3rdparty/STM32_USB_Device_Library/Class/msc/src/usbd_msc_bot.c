@@ -80,6 +80,15 @@ uint8_t              MSC_BOT_Status;
 #endif /* USB_OTG_HS_INTERNAL_DMA_ENABLED */
 __ALIGN_BEGIN uint8_t              MSC_BOT_Data[MSC_MEDIA_PACKET] __ALIGN_END ;
 
+#ifdef USB_OTG_HS_INTERNAL_DMA_ENABLED
+  #if defined ( __ICCARM__ ) /*!< IAR Compiler */
+    #pragma data_alignment=4   
+  #endif
+#endif /* USB_OTG_HS_INTERNAL_DMA_ENABLED */
+/* Second data buffer : READ10/WRITE10 packets alternate between MSC_BOT_Data and
+   this one, so that the storage can DMA into one while the other is on the bus */
+__ALIGN_BEGIN uint8_t              MSC_BOT_Data1[MSC_MEDIA_PACKET] __ALIGN_END ;
+
 #ifdef USB_OTG_HS_INTERNAL_DMA_ENABLED
   #if defined ( __ICCARM__ ) /*!< IAR Compiler */
     #pragma data_alignment=4   
@@ -108,6 +117,8 @@ static void MSC_BOT_SendData (USB_OTG_CORE_HANDLE  *pdev,
                               uint16_t len);
 
 static void MSC_BOT_Abort(USB_OTG_CORE_HANDLE  *pdev);
+
+static void MSC_BOT_Sync(void);
 /**
   * @}
   */ 
@@ -148,6 +159,7 @@ void MSC_BOT_Init (USB_OTG_CORE_HANDLE  *pdev)
 */
 void MSC_BOT_Reset (USB_OTG_CORE_HANDLE  *pdev)
 {
+  MSC_BOT_Sync();
   MSC_BOT_State = BOT_IDLE;
   MSC_BOT_Status = BOT_STATE_RECOVERY;
   /* Prapare EP to Receive First BOT Cmd */
@@ -165,6 +177,7 @@ void MSC_BOT_Reset (USB_OTG_CORE_HANDLE  *pdev)
 */
 void MSC_BOT_DeInit (USB_OTG_CORE_HANDLE  *pdev)
 {
+  MSC_BOT_Sync();
   MSC_BOT_State = BOT_IDLE;
 }
 
@@ -344,6 +357,7 @@ void  MSC_BOT_SendCSW (USB_OTG_CORE_HANDLE  *pdev,
 
 static void  MSC_BOT_Abort (USB_OTG_CORE_HANDLE  *pdev)
 {
+  MSC_BOT_Sync();
 
   if ((MSC_BOT_cbw.bmFlags == 0) && 
       (MSC_BOT_cbw.dDataLength != 0) &&
@@ -372,6 +386,8 @@ static void  MSC_BOT_Abort (USB_OTG_CORE_HANDLE  *pdev)
 
 void  MSC_BOT_CplClrFeature (USB_OTG_CORE_HANDLE  *pdev, uint8_t epnum)
 {
+  MSC_BOT_Sync();
+  
   if(MSC_BOT_Status == BOT_STATE_ERROR )/* Bad CBW Signature */
   {
     DCD_EP_Stall(pdev, MSC_IN_EP);
@@ -383,6 +399,22 @@ void  MSC_BOT_CplClrFeature (USB_OTG_CORE_HANDLE  *pdev, uint8_t epnum)
   }
   
 }
+/**
+* @brief  MSC_BOT_Sync
+*         Wait for the storage transfers still running in the background (a
+*         prefetch or a write on MSC_BOT_Data / MSC_BOT_Data1) before the BOT
+*         machine is reset : the buffers are reused right after
+* @param  None
+* @retval None
+*/
+
+static void  MSC_BOT_Sync (void)
+{
+  if (USBD_STORAGE_fops->Sync != NULL)
+  {
+    USBD_STORAGE_fops->Sync(MSC_BOT_cbw.bLUN);
+  }
+}
 /**
   * @}
   */ 
@@ -82,6 +82,10 @@ uint32_t  SCSI_blk_nbr;
 uint32_t  SCSI_blk_addr;
 uint32_t  SCSI_blk_len;
 
+/* Buffer of the current READ10/WRITE10 packet, MSC_BOT_Data or MSC_BOT_Data1.
+   The storage Write may still be reading from it after it returned. */
+static uint8_t   *SCSI_blk_buf = MSC_BOT_Data;
+
 USB_OTG_CORE_HANDLE  *cdev;
 /**
   * @}
@@ -486,6 +490,7 @@ static int8_t SCSI_Read10(uint8_t lun , uint8_t *params)
     MSC_BOT_State = BOT_DATA_IN;
     SCSI_blk_addr *= SCSI_blk_size;
     SCSI_blk_len  *= SCSI_blk_size;
+    SCSI_blk_buf = MSC_BOT_Data;
     
     /* cases 4,5 : Hi <> Dn */
     if (MSC_BOT_cbw.dDataLength != SCSI_blk_len)
@@ -570,9 +575,10 @@ static int8_t SCSI_Write10 (uint8_t lun , uint8_t *params)
     
     /* Prepare EP to receive first data packet */
     MSC_BOT_State = BOT_DATA_OUT;  
+    SCSI_blk_buf = MSC_BOT_Data;
     DCD_EP_PrepareRx (cdev,
                       MSC_OUT_EP,
-                      MSC_BOT_Data, 
+                      SCSI_blk_buf, 
                       MIN (SCSI_blk_len, MSC_MEDIA_PACKET));  
   }
   else /* Write Process ongoing */
@@ -638,7 +644,7 @@ static int8_t SCSI_ProcessRead (uint8_t lun)
   len = MIN(SCSI_blk_len , MSC_MEDIA_PACKET); 
   
   if( USBD_STORAGE_fops->Read(lun ,
-                              MSC_BOT_Data, 
+                              SCSI_blk_buf, 
                               SCSI_blk_addr / SCSI_blk_size, 
                               len / SCSI_blk_size) < 0)
   {
@@ -650,7 +656,7 @@ static int8_t SCSI_ProcessRead (uint8_t lun)
   
   DCD_EP_Tx (cdev, 
              MSC_IN_EP,
-             MSC_BOT_Data,
+             SCSI_blk_buf,
              len);
   
   
@@ -664,6 +670,15 @@ static int8_t SCSI_ProcessRead (uint8_t lun)
   {
     MSC_BOT_State = BOT_LAST_DATA_IN;
   }
+  else if (USBD_STORAGE_fops->Prefetch != NULL)
+  {
+    /* Fill the other buffer while this one goes to the host */
+    SCSI_blk_buf = (SCSI_blk_buf == MSC_BOT_Data) ? MSC_BOT_Data1 : MSC_BOT_Data;
+    USBD_STORAGE_fops->Prefetch(lun ,
+                                SCSI_blk_buf, 
+                                SCSI_blk_addr / SCSI_blk_size, 
+                                MIN (SCSI_blk_len, MSC_MEDIA_PACKET) / SCSI_blk_size);
+  }
   return 0;
 }
 
@@ -681,7 +696,7 @@ static int8_t SCSI_ProcessWrite (uint8_t lun)
   len = MIN(SCSI_blk_len , MSC_MEDIA_PACKET); 
   
   if(USBD_STORAGE_fops->Write(lun ,
-                              MSC_BOT_Data, 
+                              SCSI_blk_buf, 
                               SCSI_blk_addr / SCSI_blk_size, 
                               len / SCSI_blk_size) < 0)
   {
@@ -698,14 +713,27 @@ static int8_t SCSI_ProcessWrite (uint8_t lun)
   
   if (SCSI_blk_len == 0)
   {
+    /* The storage may write in the background, wait for the last packet */
+    if((USBD_STORAGE_fops->Sync != NULL) && (USBD_STORAGE_fops->Sync(lun) < 0))
+    {
+      SCSI_SenseCode(lun, HARDWARE_ERROR, WRITE_FAULT);
+      return -1;
+    }
+    
     MSC_BOT_SendCSW (cdev, CSW_CMD_PASSED);
   }
   else
   {
-    /* Prapare EP to Receive next packet */
+    /* Prapare EP to Receive next packet, into the other buffer if the storage
+       writes in the background (Write returns once the previous one is done) */
+    if (USBD_STORAGE_fops->Sync != NULL)
+    {
+      SCSI_blk_buf = (SCSI_blk_buf == MSC_BOT_Data) ? MSC_BOT_Data1 : MSC_BOT_Data;
+    }
+    
     DCD_EP_PrepareRx (cdev,
                       MSC_OUT_EP,
-                      MSC_BOT_Data, 
+                      SCSI_blk_buf, 
                       MIN (SCSI_blk_len, MSC_MEDIA_PACKET)); 
   }
   
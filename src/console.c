@@ -0,0 +1,227 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <string.h>
+#include "console.h"
+
+#if (CONSOLE_TX_SIZE & (CONSOLE_TX_SIZE - 1)) != 0
+#error "CONSOLE_TX_SIZE must be a power of 2"
+#endif
+
+/*
+ * Head and Tail are free running byte counts, the ring holds [Tail, Head). The DMA
+ * sends the DmaLen bytes from Tail, at most up to the end of the ring. Both ends
+ * are only modified with interrupts disabled (PRIMASK saved and restored, the
+ * callers may have them off already).
+ */
+static uint8_t TxRing[CONSOLE_TX_SIZE];
+static __IO uint32_t Head = 0;
+static __IO uint32_t Tail = 0;
+static __IO uint32_t DmaLen = 0;
+static Console_Policy Policy = CONSOLE_POLICY;
+static Console_Stats Stats;
+
+static void Kick (void);
+static void Poll (void);
+
+/**
+ * @brief  Configures USART1 (8N1) and its TX DMA stream. The pins and the NVIC
+ *         channel (CONSOLE_DMA_IRQn) are set up by the application.
+ * @param  baud: baud rate.
+ * @retval None
+ */
+void Console_Init (uint32_t baud)
+{
+        USART_InitTypeDef USART_InitStructure;
+        DMA_InitTypeDef DMA_InitStructure;
+        RCC_ClocksTypeDef clocks;
+
+        RCC_APB2PeriphClockCmd (RCC_APB2Periph_USART1, ENABLE);
+        RCC_AHB1PeriphClockCmd (RCC_AHB1Periph_DMA2, ENABLE);
+        RCC_GetClocksFreq (&clocks);
+
+        /*!< USART_Init reads OVER8 to compute the divider */
+        USART_OverSampling8Cmd (CONSOLE_USART, (baud > clocks.PCLK2_Frequency / 16) ? ENABLE : DISABLE);
+
+        USART_InitStructure.USART_BaudRate = baud;
+        USART_InitStructure.USART_WordLength = USART_WordLength_8b;
+        USART_InitStructure.USART_StopBits = USART_StopBits_1;
+        USART_InitStructure.USART_Parity = USART_Parity_No;
+        USART_InitStructure.USART_Mode = USART_Mode_Rx | USART_Mode_Tx;
+        USART_InitStructure.USART_HardwareFlowControl = USART_HardwareFlowControl_None;
+        USART_Init (CONSOLE_USART, &USART_InitStructure);
+
+        DMA_Cmd (CONSOLE_DMA_STREAM, DISABLE);
+        DMA_DeInit (CONSOLE_DMA_STREAM);
+        DMA_InitStructure.DMA_Channel = CONSOLE_DMA_CHANNEL;
+        DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t) &CONSOLE_USART->DR;
+        DMA_InitStructure.DMA_Memory0BaseAddr = (uint32_t) TxRing;
+        DMA_InitStructure.DMA_DIR = DMA_DIR_MemoryToPeripheral;
+        DMA_InitStructure.DMA_BufferSize = 1;
+        DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+        DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
+        DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+        DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+        DMA_InitStructure.DMA_Mode = DMA_Mode_Normal;
+        DMA_InitStructure.DMA_Priority = DMA_Priority_Low;
+        DMA_InitStructure.DMA_FIFOMode = DMA_FIFOMode_Disable;
+        DMA_InitStructure.DMA_FIFOThreshold = DMA_FIFOThreshold_Full;
+        DMA_InitStructure.DMA_MemoryBurst = DMA_MemoryBurst_Single;
+        DMA_InitStructure.DMA_PeripheralBurst = DMA_PeripheralBurst_Single;
+        DMA_Init (CONSOLE_DMA_STREAM, &DMA_InitStructure);
+        DMA_ITConfig (CONSOLE_DMA_STREAM, DMA_IT_TC, ENABLE);
+
+        Head = Tail = DmaLen = 0;
+        memset (&Stats, 0, sizeof (Stats));
+
+        USART_DMACmd (CONSOLE_USART, USART_DMAReq_Tx, ENABLE);
+        USART_Cmd (CONSOLE_USART, ENABLE);
+}
+
+/**
+ * @brief  What Console_Write does when the ring is full.
+ * @param  policy: CONSOLE_BLOCK or CONSOLE_DROP.
+ * @retval The previous policy, to restore it.
+ */
+Console_Policy Console_SetPolicy (Console_Policy policy)
+{
+        Console_Policy previous = Policy;
+
+        Policy = policy;
+        return (previous);
+}
+
+/**
+ * @brief  Queues bytes for sending, called by _write. Returns as soon as they are
+ *         in the ring.
+ * @param  ptr: data.
+ * @param  len: its length.
+ * @retval len, dropped bytes are only counted.
+ */
+int Console_Write (const char *ptr, int len)
+{
+        uint32_t left = (uint32_t) len;
+        uint32_t n, start, first, primask;
+
+        while (left) {
+                primask = __get_PRIMASK ();
+                __disable_irq ();
+                n = CONSOLE_TX_SIZE - (Head - Tail);
+
+                if (n > left) {
+                        n = left;
+                }
+
+                start = Head & (CONSOLE_TX_SIZE - 1);
+                first = (n < CONSOLE_TX_SIZE - start) ? n : CONSOLE_TX_SIZE - start;
+                memcpy (&TxRing[start], ptr, first);
+                memcpy (TxRing, ptr + first, n - first);
+                Head = Head + n;
+                Stats.Written += n;
+                Kick ();
+                __set_PRIMASK (primask);
+
+                ptr += n;
+                left -= n;
+
+                if (left && (n == 0)) {
+                        if (Policy == CONSOLE_DROP) {
+                                Stats.DroppedBytes += left;
+                                Stats.DroppedWrites++;
+                                break;
+                        }
+
+                        Poll ();
+                }
+        }
+
+        return (len);
+}
+
+/**
+ * @brief  Waits until everything queued has been sent.
+ * @param  None
+ * @retval None
+ */
+void Console_Flush (void)
+{
+        while (Head != Tail) {
+                Poll ();
+        }
+
+        while (USART_GetFlagStatus (CONSOLE_USART, USART_FLAG_TC) == RESET) {
+        }
+}
+
+/**
+ * @brief  Copies the counters.
+ * @param  stats: destination.
+ * @retval None
+ */
+void Console_GetStats (Console_Stats *stats)
+{
+        uint32_t primask = __get_PRIMASK ();
+
+        __disable_irq ();
+        *stats = Stats;
+        __set_PRIMASK (primask);
+}
+
+/**
+ * @brief  DMA transfer complete : frees the bytes sent and starts the next chunk.
+ * @param  None
+ * @retval None
+ */
+void Console_ProcessDMAIRQ (void)
+{
+        if (DMA_GetFlagStatus (CONSOLE_DMA_STREAM, CONSOLE_DMA_FLAG_TCIF) != RESET) {
+                DMA_ClearFlag (CONSOLE_DMA_STREAM, CONSOLE_DMA_FLAG_ALL);
+                Tail = Tail + DmaLen;
+                DmaLen = 0;
+                Kick ();
+        }
+}
+
+/**
+ * @brief  Starts the DMA on the oldest contiguous bytes, unless it is running.
+ *         Interrupts disabled.
+ */
+static void Kick (void)
+{
+        uint32_t start;
+
+        if (DmaLen || (Head == Tail)) {
+                return;
+        }
+
+        start = Tail & (CONSOLE_TX_SIZE - 1);
+        DmaLen = Head - Tail;
+
+        if (DmaLen > CONSOLE_TX_SIZE - start) {
+                DmaLen = CONSOLE_TX_SIZE - start;
+        }
+
+        DMA_ClearFlag (CONSOLE_DMA_STREAM, CONSOLE_DMA_FLAG_ALL);
+        CONSOLE_DMA_STREAM ->M0AR = (uint32_t) &TxRing[start];
+        CONSOLE_DMA_STREAM ->NDTR = DmaLen;
+        DMA_Cmd (CONSOLE_DMA_STREAM, ENABLE);
+}
+
+/**
+ * @brief  Does the work of the DMA interrupt in place, so that waiting for room
+ *         also works from interrupt handlers, with interrupts off, or before the
+ *         NVIC channel is enabled.
+ */
+static void Poll (void)
+{
+        uint32_t primask = __get_PRIMASK ();
+
+        __disable_irq ();
+        Console_ProcessDMAIRQ ();
+        __set_PRIMASK (primask);
+}
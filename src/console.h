@@ -0,0 +1,66 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef CONSOLE_H_
+#define CONSOLE_H_
+
+#include <stm32f4xx.h>
+
+/*
+ * USART1 console. _write copies into a TX ring which USART1 TX DMA (DMA2 Stream7
+ * Channel4) drains in the background, so printf costs a memcpy instead of a
+ * character time per byte. When the ring is full the policy decides : block until
+ * the DMA made room, or drop the rest and count it.
+ */
+
+/**
+ * @brief  Default baud rate, cmake -DCONSOLE_BAUD=... Above APB2 / 16 (5.25 Mbaud
+ *         at 168 MHz) 8x oversampling is used, up to APB2 / 8.
+ */
+#ifndef CONSOLE_BAUD
+#define CONSOLE_BAUD                  115200
+#endif
+
+/**
+ * @brief  TX ring size in bytes, a power of 2.
+ */
+#ifndef CONSOLE_TX_SIZE
+#define CONSOLE_TX_SIZE               2048
+#endif
+
+#ifndef CONSOLE_POLICY
+#define CONSOLE_POLICY                CONSOLE_BLOCK
+#endif
+
+#define CONSOLE_USART                 USART1
+#define CONSOLE_DMA_STREAM            DMA2_Stream7
+#define CONSOLE_DMA_CHANNEL           DMA_Channel_4
+#define CONSOLE_DMA_FLAG_TCIF         DMA_FLAG_TCIF7
+#define CONSOLE_DMA_FLAG_ALL          (DMA_FLAG_TCIF7 | DMA_FLAG_HTIF7 | DMA_FLAG_TEIF7 | DMA_FLAG_DMEIF7 | DMA_FLAG_FEIF7)
+#define CONSOLE_DMA_IRQn              DMA2_Stream7_IRQn
+#define CONSOLE_DMA_IRQHANDLER        DMA2_Stream7_IRQHandler
+
+typedef enum {
+        CONSOLE_BLOCK = 0, /*!< Wait for room (polls the DMA, works with interrupts off too) */
+        CONSOLE_DROP = 1 /*!< Drop what does not fit */
+} Console_Policy;
+
+typedef struct {
+        uint32_t Written; /*!< Bytes queued */
+        uint32_t DroppedBytes;
+        uint32_t DroppedWrites; /*!< _write calls which lost data */
+} Console_Stats;
+
+void Console_Init (uint32_t baud);
+Console_Policy Console_SetPolicy (Console_Policy policy);
+int Console_Write (const char *ptr, int len);
+void Console_Flush (void);
+void Console_GetStats (Console_Stats *stats);
+void Console_ProcessDMAIRQ (void);
+
+#endif /* CONSOLE_H_ */
@@ -0,0 +1,107 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include "dlog.h"
+
+#if (DLOG_DEPTH & (DLOG_DEPTH - 1)) != 0
+#error "DLOG_DEPTH must be a power of 2"
+#endif
+
+/*
+ * Head counts the records claimed, Tail the records printed. Writers claim a slot
+ * with LDREX/STREX on Head and publish it by setting its Seq last, so a reader
+ * never prints a record an interrupted writer is still filling.
+ */
+static DLog_Record Ring[DLOG_DEPTH];
+static __IO uint32_t Head = 0;
+static __IO uint32_t Tail = 0;
+static __IO uint32_t Overflows = 0;
+
+/**
+ * @brief  Stores one record, callable from any context. Never blocks, never
+ *         formats : a record which does not fit is dropped and counted.
+ * @param  fmt: printf format, must outlive the record.
+ * @param  a0: first argument.
+ * @param  a1: second argument.
+ * @param  a2: third argument.
+ * @retval None
+ */
+void DLog_Push (const char *fmt, uint32_t a0, uint32_t a1, uint32_t a2)
+{
+        DLog_Record *record;
+        uint32_t index, n;
+
+        do {
+                index = __LDREXW ((uint32_t *) &Head);
+
+                if (index - Tail >= DLOG_DEPTH) {
+                        __CLREX ();
+
+                        do {
+                                n = __LDREXW ((uint32_t *) &Overflows);
+                        } while (__STREXW (n + 1, (uint32_t *) &Overflows));
+
+                        return;
+                }
+        } while (__STREXW (index + 1, (uint32_t *) &Head));
+
+        record = &Ring[index & (DLOG_DEPTH - 1)];
+        record->Fmt = fmt;
+        record->Args[0] = a0;
+        record->Args[1] = a1;
+        record->Args[2] = a2;
+        __DMB ();
+        record->Seq = index + 1;
+}
+
+/**
+ * @brief  Prints the pending records, oldest first. Call from the main loop only.
+ *         Stops early at a record still being written by an interrupted handler.
+ * @param  None
+ * @retval Number of records printed.
+ */
+uint32_t DLog_Process (void)
+{
+        static uint32_t reported = 0;
+        DLog_Record *record;
+        uint32_t count = 0, overflows;
+
+        while (Tail != Head) {
+                record = &Ring[Tail & (DLOG_DEPTH - 1)];
+
+                if (record->Seq != Tail + 1) {
+                        break;
+                }
+
+                __DMB ();
+                printf (record->Fmt, (unsigned int) record->Args[0], (unsigned int) record->Args[1], (unsigned int) record->Args[2]);
+                __DMB ();
+                Tail = Tail + 1;
+                count++;
+        }
+
+        overflows = Overflows;
+
+        if (overflows != reported) {
+                printf ("dlog : %u records dropped\r\n", (unsigned int) (overflows - reported));
+                reported = overflows;
+        }
+
+        return (count);
+}
+
+/**
+ * @brief  Records dropped because the ring was full, since the reset.
+ * @param  None
+ * @retval Number of records.
+ */
+uint32_t DLog_GetOverflows (void)
+{
+        return (Overflows);
+}
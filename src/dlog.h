@@ -0,0 +1,49 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef DLOG_H_
+#define DLOG_H_
+
+#include <stm32f4xx.h>
+
+/*
+ * Deferred logger for interrupt handlers. dlogf stores a fixed size record (format
+ * pointer and up to 3 word arguments) in a lock-free ring in constant time,
+ * nothing is formatted there. DLog_Process, called from the main loop, formats the
+ * records and prints them. The format string must stay valid (a literal) and use
+ * 32 bit conversions only (%u %d %x %c).
+ *
+ *   dlogf ("SDIO IRQ : STA = %08x\r\n", SDIO->STA);
+ */
+
+/**
+ * @brief  Records kept in the ring, a power of 2.
+ */
+#ifndef DLOG_DEPTH
+#define DLOG_DEPTH                    64
+#endif
+
+typedef struct {
+        __IO uint32_t Seq; /*!< Index + 1 once the record is complete */
+        const char *Fmt;
+        uint32_t Args[3];
+} DLog_Record;
+
+#ifndef NDEBUG
+#define dlogf(...) DLOG_PUSH_ (__VA_ARGS__, 0, 0, 0, 0)
+#else
+#define dlogf(...)
+#endif
+
+#define DLOG_PUSH_(fmt, a0, a1, a2, ...) DLog_Push ((fmt), (uint32_t) (a0), (uint32_t) (a1), (uint32_t) (a2))
+
+void DLog_Push (const char *fmt, uint32_t a0, uint32_t a1, uint32_t a2);
+uint32_t DLog_Process (void);
+uint32_t DLog_GetOverflows (void);
+
+#endif /* DLOG_H_ */
@@ -2,6 +2,12 @@
 #include <stdio.h>
 #include "sdio_high_level.h"
 #include "simplesdio.h"
+#include "sd_recovery.h"
+#include "sd_time.h"
+#include "sd_bench.h"
+#include "sd_trace.h"
+#include "dlog.h"
+#include "console.h"
 #include "logf.h"
 
 /* Private typedef -----------------------------------------------------------*/
@@ -15,17 +21,26 @@ typedef enum {
 #define NUMBER_OF_BLOCKS      100  /* For Multi Blocks operation (Read/Write) */
 #define MULTI_BUFFER_SIZE    (BLOCK_SIZE * NUMBER_OF_BLOCKS)
 
+#define DOUBLE_BUFFER_BLOCKS  4    /* Each of the two DMA buffers, NUMBER_OF_BLOCKS must be a multiple */
+#define DOUBLE_BUFFER_SIZE   (BLOCK_SIZE * DOUBLE_BUFFER_BLOCKS)
+
+#define BENCH_BLOCKS          SD_BENCH_MAX_BLOCKS
+#define BENCH_ADDRESS         0x01000000 /* 16 MB, after the test area */
+
 #define SD_OPERATION_ERASE          0
 #define SD_OPERATION_BLOCK          1
 #define SD_OPERATION_MULTI_BLOCK    2
-#define SD_OPERATION_END            3
+#define SD_OPERATION_BENCH          3
+#define SD_OPERATION_END            4
 
 /* Private macro -------------------------------------------------------------*/
 /* Private variables ---------------------------------------------------------*/
 uint8_t aBuffer_Block_Tx[BLOCK_SIZE];
 uint8_t aBuffer_Block_Rx[BLOCK_SIZE];
-uint8_t aBuffer_MultiBlock_Tx[MULTI_BUFFER_SIZE];
-uint8_t aBuffer_MultiBlock_Rx[MULTI_BUFFER_SIZE];
+uint8_t aBuffer_Double0[DOUBLE_BUFFER_SIZE] __attribute__ ((aligned (4)));
+uint8_t aBuffer_Double1[DOUBLE_BUFFER_SIZE] __attribute__ ((aligned (4)));
+uint8_t aBuffer_Bench[BENCH_BLOCKS * BLOCK_SIZE] __attribute__ ((aligned (4)));
+__IO uint32_t uwDoubleBufferOffset = 0;
 __IO TestStatus EraseStatus = FAILED;
 __IO TestStatus TransferStatus1 = FAILED;
 __IO TestStatus TransferStatus2 = FAILED;
@@ -39,14 +54,20 @@ static void SD_EraseTest (void);
 static void SD_SingleBlockTest (void);
 static void SD_MultiBlockTest (void);
 static void Fill_Buffer (uint8_t *pBuffer, uint32_t BufferLength, uint32_t Offset);
+static void EraseBufferDone (uint8_t *buffer, void *context);
+static void WriteBufferDone (uint8_t *buffer, void *context);
+static void ReadBufferDone (uint8_t *buffer, void *context);
 
 static TestStatus Buffercmp (uint8_t* pBuffer1, uint8_t* pBuffer2, uint32_t BufferLength);
 static TestStatus eBuffercmp (uint8_t* pBuffer, uint32_t BufferLength);
+static TestStatus Fillcmp (uint8_t* pBuffer, uint32_t BufferLength, uint32_t Offset);
 
 /* Private functions ---------------------------------------------------------*/
 
 /**
- * @brief  Configures SDIO IRQ channel.
+ * @brief  Configures SDIO IRQ channel. 4 preemption levels : 0 the SDIO, 1 its DMA
+ *         stream and the D0 busy EXTI, 2 for the interrupts that wait for SD
+ *         transfers (the USB OTG one, see usbd_storage_sd.c), 3 SysTick and PendSV.
  * @param  None
  * @retval None
  */
@@ -55,7 +76,7 @@ static void NVIC_Configuration (void)
         NVIC_InitTypeDef NVIC_InitStructure;
 
         /* Configure the NVIC Preemption Priority Bits */
-        NVIC_PriorityGroupConfig (NVIC_PriorityGroup_1);
+        NVIC_PriorityGroupConfig (NVIC_PriorityGroup_2);
 
         NVIC_InitStructure.NVIC_IRQChannel = SDIO_IRQn;
         NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 0;
@@ -65,6 +86,14 @@ static void NVIC_Configuration (void)
         NVIC_InitStructure.NVIC_IRQChannel = SD_SDIO_DMA_IRQn;
         NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 1;
         NVIC_Init (&NVIC_InitStructure);
+        NVIC_InitStructure.NVIC_IRQChannel = SD_BUSY_IRQn;
+        NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 1;
+        NVIC_Init (&NVIC_InitStructure);
+        /*!< Console TX DMA, below the SD interrupts */
+        NVIC_InitStructure.NVIC_IRQChannel = CONSOLE_DMA_IRQn;
+        NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 1;
+        NVIC_InitStructure.NVIC_IRQChannelSubPriority = 1;
+        NVIC_Init (&NVIC_InitStructure);
 }
 
 /**
@@ -86,7 +115,9 @@ static void SD_EraseTest (void)
         if (Status == SD_OK) {
                 logf ("SD_Erase OK, performing SD_ReadMultiBlocks\r\n");
 
-                Status = SD_ReadMultiBlocks (aBuffer_MultiBlock_Rx, 0x00, BLOCK_SIZE, NUMBER_OF_BLOCKS);
+                /* Each buffer is checked in EraseBufferDone as soon as it is full */
+                EraseStatus = PASSED;
+                Status = SD_ReadMultiBlocksDoubleBuffer (aBuffer_Double0, aBuffer_Double1, DOUBLE_BUFFER_BLOCKS, 0x00, NUMBER_OF_BLOCKS, EraseBufferDone, NULL);
 
                 if (Status == SD_OK) {
                         logf ("SD_ReadMultiBlocks OK\r\n");
@@ -104,20 +135,9 @@ static void SD_EraseTest (void)
                 else {
                         logf ("SD_WaitReadOperation failed\r\n");
                 }
-
-                /* Wait until end of DMA transfer */
-                while (SD_GetStatus () != SD_TRANSFER_OK)
-                        ;
-
-                logf ("SD_TRANSFER_OK\r\n");
-        }
-
-        /* Check the correctness of erased blocks */
-        if (Status == SD_OK) {
-                EraseStatus = eBuffercmp (aBuffer_MultiBlock_Rx, MULTI_BUFFER_SIZE);
         }
 
-        if (EraseStatus == PASSED) {
+        if ((Status == SD_OK) && (EraseStatus == PASSED)) {
                 logf ("SD erase test passed\r\n");
         }
         else {
@@ -137,21 +157,13 @@ static void SD_SingleBlockTest (void)
         Fill_Buffer (aBuffer_Block_Tx, BLOCK_SIZE, 0x320F);
 
         if (Status == SD_OK) {
-                /* Write block of 512 bytes on address 0 */
-                Status = SD_WriteBlock (aBuffer_Block_Tx, 0x00, BLOCK_SIZE);
-                /* Check if the Transfer is finished */
-                Status = SD_WaitWriteOperation ();
-                while (SD_GetStatus () != SD_TRANSFER_OK)
-                        ;
+                /* Write block of 512 bytes on address 0, retried on bus errors */
+                Status = SD_RecoveryWrite (aBuffer_Block_Tx, 0x00, 1);
         }
 
         if (Status == SD_OK) {
-                /* Read block of 512 bytes from address 0 */
-                Status = SD_ReadBlock (aBuffer_Block_Rx, 0x00, BLOCK_SIZE);
-                /* Check if the Transfer is finished */
-                Status = SD_WaitReadOperation ();
-                while (SD_GetStatus () != SD_TRANSFER_OK)
-                        ;
+                /* Read block of 512 bytes from address 0, retried on bus errors */
+                Status = SD_RecoveryRead (aBuffer_Block_Rx, 0x00, 1);
         }
 
         /* Check the correctness of written data */
@@ -174,35 +186,34 @@ static void SD_SingleBlockTest (void)
  */
 static void SD_MultiBlockTest (void)
 {
-        /* Fill the buffer to send */
-        Fill_Buffer (aBuffer_MultiBlock_Tx, MULTI_BUFFER_SIZE, 0x0);
+        /* Fill both buffers, the rest is generated in WriteBufferDone */
+        Fill_Buffer (aBuffer_Double0, DOUBLE_BUFFER_SIZE, 0x0);
+        Fill_Buffer (aBuffer_Double1, DOUBLE_BUFFER_SIZE, DOUBLE_BUFFER_SIZE);
+        uwDoubleBufferOffset = 2 * DOUBLE_BUFFER_SIZE;
 
         if (Status == SD_OK) {
                 /* Write multiple block of many bytes on address 0 */
-                Status = SD_WriteMultiBlocks (aBuffer_MultiBlock_Tx, 0, BLOCK_SIZE, NUMBER_OF_BLOCKS);
+                Status = SD_WriteMultiBlocksDoubleBuffer (aBuffer_Double0, aBuffer_Double1, DOUBLE_BUFFER_BLOCKS, 0, NUMBER_OF_BLOCKS, WriteBufferDone, NULL);
 
                 /* Check if the Transfer is finished */
                 Status = SD_WaitWriteOperation ();
-                while (SD_GetStatus () != SD_TRANSFER_OK)
-                        ;
+
+                if (Status == SD_OK) {
+                        Status = SD_WaitReady ();
+                }
         }
 
         if (Status == SD_OK) {
-                /* Read block of many bytes from address 0 */
-                Status = SD_ReadMultiBlocks (aBuffer_MultiBlock_Rx, 0, BLOCK_SIZE, NUMBER_OF_BLOCKS);
+                /* Read block of many bytes from address 0, checked in ReadBufferDone */
+                TransferStatus2 = PASSED;
+                uwDoubleBufferOffset = 0;
+                Status = SD_ReadMultiBlocksDoubleBuffer (aBuffer_Double0, aBuffer_Double1, DOUBLE_BUFFER_BLOCKS, 0, NUMBER_OF_BLOCKS, ReadBufferDone, NULL);
 
                 /* Check if the Transfer is finished */
                 Status = SD_WaitReadOperation ();
-                while (SD_GetStatus () != SD_TRANSFER_OK)
-                        ;
         }
 
-        /* Check the correctness of written data */
-        if (Status == SD_OK) {
-                TransferStatus2 = Buffercmp (aBuffer_MultiBlock_Tx, aBuffer_MultiBlock_Rx, MULTI_BUFFER_SIZE);
-        }
-
-        if (TransferStatus2 == PASSED) {
+        if ((Status == SD_OK) && (TransferStatus2 == PASSED)) {
                 logf ("Multiple block test passed\r\n");
         }
         else {
@@ -210,6 +221,50 @@ static void SD_MultiBlockTest (void)
         }
 }
 
+/**
+ * @brief  Double buffer callback of the erase test : checks the buffer just read.
+ * @param  buffer: full buffer.
+ * @param  context: unused.
+ * @retval None
+ */
+static void EraseBufferDone (uint8_t *buffer, void *context)
+{
+        if (eBuffercmp (buffer, DOUBLE_BUFFER_SIZE) != PASSED) {
+                EraseStatus = FAILED;
+        }
+}
+
+/**
+ * @brief  Double buffer callback of the multi block write : generates the next part
+ *         of the test pattern into the buffer just sent.
+ * @param  buffer: buffer to refill.
+ * @param  context: unused.
+ * @retval None
+ */
+static void WriteBufferDone (uint8_t *buffer, void *context)
+{
+        if (uwDoubleBufferOffset < MULTI_BUFFER_SIZE) {
+                Fill_Buffer (buffer, DOUBLE_BUFFER_SIZE, uwDoubleBufferOffset);
+                uwDoubleBufferOffset += DOUBLE_BUFFER_SIZE;
+        }
+}
+
+/**
+ * @brief  Double buffer callback of the multi block read : compares the buffer
+ *         just read with the pattern written by SD_MultiBlockTest.
+ * @param  buffer: full buffer.
+ * @param  context: unused.
+ * @retval None
+ */
+static void ReadBufferDone (uint8_t *buffer, void *context)
+{
+        if (Fillcmp (buffer, DOUBLE_BUFFER_SIZE, uwDoubleBufferOffset) != PASSED) {
+                TransferStatus2 = FAILED;
+        }
+
+        uwDoubleBufferOffset += DOUBLE_BUFFER_SIZE;
+}
+
 /**
  * @brief  Compares two buffers.
  * @param  pBuffer1, pBuffer2: buffers to be compared.
@@ -248,6 +303,27 @@ static void Fill_Buffer (uint8_t *pBuffer, uint32_t BufferLength, uint32_t Offse
         }
 }
 
+/**
+ * @brief  Checks a buffer against the Fill_Buffer pattern.
+ * @param  pBuffer: buffer to be compared.
+ * @param  BufferLength: buffer's length
+ * @param  Offset: first value of the pattern
+ * @retval PASSED: pBuffer holds the pattern
+ *         FAILED: pBuffer differs from the pattern
+ */
+static TestStatus Fillcmp (uint8_t* pBuffer, uint32_t BufferLength, uint32_t Offset)
+{
+        uint32_t index;
+
+        for (index = 0; index < BufferLength; index++) {
+                if (pBuffer[index] != (uint8_t) (index + Offset)) {
+                        return FAILED;
+                }
+        }
+
+        return PASSED;
+}
+
 /**
  * @brief  Checks if a buffer has all its values are equal to zero.
  * @param  pBuffer: buffer to be compared.
@@ -274,10 +350,9 @@ static TestStatus eBuffercmp (uint8_t* pBuffer, uint32_t BufferLength)
  */
 void initUsart (void)
 {
-#define USE_USART 1
+/* USART1 only : the console (console.c) drains it with DMA2 Stream7 */
 #define USE_PIN_SET 1
 
-#if USE_USART == 1
         #define USART USART1
         #define RCC_USART RCC_APB2Periph_USART1
         #define RCC_APBxPeriphClockCmd RCC_APB2PeriphClockCmd
@@ -300,32 +375,6 @@ void initUsart (void)
                #define TX_PIN GPIO_Pin_9
                #define RX_PIN GPIO_Pin_10
         #endif
-#endif
-
-#if USE_USART == 2
-        #define USART USART2
-        #define RCC_USART RCC_APB1Periph_USART2
-        #define RCC_APBxPeriphClockCmd RCC_APB1PeriphClockCmd
-        #define GPIO_AF_USART GPIO_AF_USART2
-
-         #if USE_PIN_SET == 1
-                #define RCC_GPIO RCC_AHB1Periph_GPIOA
-                #define PORT GPIOA
-                #define TX_PIN_SOURCE GPIO_PinSource2
-                #define RX_PIN_SOURCE GPIO_PinSource3
-                #define TX_PIN GPIO_Pin_2
-                #define RX_PIN GPIO_Pin_3
-         #endif
-
-        #if USE_PIN_SET == 2
-               #define RCC_GPIO RCC_AHB1Periph_GPIOA
-               #define PORT GPIOA
-               #define TX_PIN_SOURCE GPIO_PinSource9
-               #define RX_PIN_SOURCE GPIO_PinSource10
-               #define TX_PIN GPIO_Pin_9
-               #define RX_PIN GPIO_Pin_10
-        #endif
-#endif
 
         RCC_APBxPeriphClockCmd (RCC_USART, ENABLE);
         GPIO_InitTypeDef gpioInitStruct;
@@ -340,15 +389,8 @@ void initUsart (void)
         GPIO_PinAFConfig (PORT, TX_PIN_SOURCE, GPIO_AF_USART); // TX
         GPIO_PinAFConfig (PORT, RX_PIN_SOURCE, GPIO_AF_USART); // RX
 
-        USART_InitTypeDef usartInitStruct;
-        usartInitStruct.USART_BaudRate = 9600;
-        usartInitStruct.USART_WordLength = USART_WordLength_8b;
-        usartInitStruct.USART_StopBits = USART_StopBits_1;
-        usartInitStruct.USART_Parity = USART_Parity_No;
-        usartInitStruct.USART_Mode = USART_Mode_Rx | USART_Mode_Tx;
-        usartInitStruct.USART_HardwareFlowControl = USART_HardwareFlowControl_None;
-        USART_Init (USART, &usartInitStruct);
-        USART_Cmd (USART, ENABLE);
+        /*!< USART1, TX drained by DMA, see console.h */
+        Console_Init (CONSOLE_BAUD);
 }
 
 int main (void)
@@ -373,9 +415,16 @@ int main (void)
         }
         else {
                 logf ("SD_Init OK\r\n");
+                SD_RecoveryInit ();
         }
 
         while ((Status == SD_OK) && (uwSDCardOperation != SD_OPERATION_END) && (SD_Detect () == SD_PRESENT)) {
+                /*!< Messages from the interrupt handlers */
+                DLog_Process ();
+
+                /*!< Idle time is measured per test */
+                SD_IdleReset ();
+
                 switch (uwSDCardOperation) {
                         /*-------------------------- SD Single Block Test --------------------- */
                         case (SD_OPERATION_BLOCK):
@@ -395,13 +444,32 @@ int main (void)
                         case (SD_OPERATION_MULTI_BLOCK):
                         {
                                 SD_MultiBlockTest ();
+                                uwSDCardOperation = SD_OPERATION_BENCH;
+                                break;
+                        }
+                        /*-------------------------- Benchmark -------------------------------- */
+                        case (SD_OPERATION_BENCH):
+                        {
+                                SD_BenchRun (aBuffer_Bench, BENCH_BLOCKS, BENCH_ADDRESS);
                                 uwSDCardOperation = SD_OPERATION_END;
                                 break;
                         }
                 }
+
+                logf ("CPU idle during the test : %u%%\r\n", (unsigned int) SD_IdlePercent ());
         }
 
+        DLog_Process ();
+
+        SD_RecoveryStats stats;
+        SD_RecoveryGetStats (&stats);
+        logf ("Recovery : %u retries, %u failures, %u CRC, %u timeouts, %u down, %u up\r\n", (unsigned int) stats.Retries, (unsigned int) stats.Failures,
+                        (unsigned int) stats.CrcErrors, (unsigned int) stats.Timeouts, (unsigned int) stats.Downshifts, (unsigned int) stats.Upshifts);
+
+        SD_TraceDump ();
+
         /* Infinite loop */
         while (1) {
+                DLog_Process ();
         }
 }
@@ -0,0 +1,202 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+/*
+ * Throughput and latency benchmark. Timing comes from the DWT cycle counter
+ * (sd_time). Results are printed one record per line, as space separated
+ * key=value pairs after a tag, e.g. :
+ *
+ *   BENCH test=seq_read blocks=8 ops=32 err=0 us=5120 kBps=25600 iops=6250 p50_us=150 p99_us=190 max_us=190
+ *   HIST test=seq_read blocks=8 0 0 0 0 0 0 0 30 2 0 ...
+ *
+ * The tests write to the card, the data in [BaseAddr, BaseAddr + span) is lost.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stm32f4xx.h>
+#include "sd_bench.h"
+#include "sd_time.h"
+#include "console.h"
+
+static uint32_t Latency[SD_BENCH_OPS];
+static uint32_t Seed = 0x12345678;
+
+static SD_Error Transfer (uint8_t *buffer, uint64_t address, uint32_t blocks, uint8_t write);
+static uint32_t Random (void);
+static void Report (const char *test, SD_BenchResult *result);
+
+/**
+ * @brief  Runs the whole suite : sequential write and read at 1, 2, 4 ...
+ *         SD_BENCH_MAX_BLOCKS blocks per request, then random 4 KB writes and
+ *         reads, and prints the results.
+ * @param  buffer: word aligned work buffer.
+ * @param  BufferBlocks: its size in blocks, caps the request size.
+ * @param  BaseAddr: start of the card area used, in bytes.
+ * @retval None
+ */
+void SD_BenchRun (uint8_t *buffer, uint32_t BufferBlocks, uint64_t BaseAddr)
+{
+        SD_BenchResult result;
+        SD_CardInfo cardinfo;
+        uint32_t blocks, i;
+
+        for (i = 0; i < BufferBlocks * 512; i++) {
+                buffer[i] = (uint8_t) i;
+        }
+
+        SD_GetCardInfo (&cardinfo);
+        printf ("BENCH_BEGIN core_hz=%u bus_hz=%u ops=%u\r\n", (unsigned int) SD_TIME_HZ, (unsigned int) cardinfo.BusClock, (unsigned int) SD_BENCH_OPS);
+
+        for (blocks = 1; (blocks <= SD_BENCH_MAX_BLOCKS) && (blocks <= BufferBlocks); blocks *= 2) {
+                SD_BenchMeasure (&result, buffer, blocks, BaseAddr, 1, 0);
+                Report ("seq_write", &result);
+                SD_BenchMeasure (&result, buffer, blocks, BaseAddr, 0, 0);
+                Report ("seq_read", &result);
+        }
+
+        if (BufferBlocks >= SD_BENCH_RANDOM_BLOCKS) {
+                SD_BenchMeasure (&result, buffer, SD_BENCH_RANDOM_BLOCKS, BaseAddr, 1, 1);
+                Report ("rand_write", &result);
+                SD_BenchMeasure (&result, buffer, SD_BENCH_RANDOM_BLOCKS, BaseAddr, 0, 1);
+                Report ("rand_read", &result);
+        }
+
+        printf ("BENCH_END\r\n");
+}
+
+/**
+ * @brief  Times SD_BENCH_OPS requests of one size. Sequential requests follow each
+ *         other from BaseAddr, random ones are request aligned and spread over
+ *         SD_BENCH_SPAN_BLOCKS. Writes include the end of programming.
+ * @param  result: destination.
+ * @param  buffer: word aligned, blocks * 512 bytes.
+ * @param  blocks: request size.
+ * @param  BaseAddr: start of the card area used, in bytes.
+ * @param  write: 1 for writes, 0 for reads.
+ * @param  random: 1 for random addresses, 0 for sequential.
+ * @retval None
+ */
+void SD_BenchMeasure (SD_BenchResult *result, uint8_t *buffer, uint32_t blocks, uint64_t BaseAddr, uint8_t write, uint8_t random)
+{
+        Console_Policy policy;
+        uint64_t address, total = 0;
+        uint32_t i, j, start, us, bucket;
+
+        /*!< No console DMA on the bus while timing, and no print may wait for it */
+        Console_Flush ();
+        policy = Console_SetPolicy (CONSOLE_DROP);
+
+        memset (result, 0, sizeof (*result));
+        result->Blocks = blocks;
+        result->Ops = SD_BENCH_OPS;
+
+        for (i = 0; i < SD_BENCH_OPS; i++) {
+                if (random) {
+                        address = BaseAddr + (uint64_t) (Random () % (SD_BENCH_SPAN_BLOCKS / blocks)) * blocks * 512;
+                }
+                else {
+                        address = BaseAddr + (uint64_t) i * blocks * 512;
+                }
+
+                start = SD_TIME_NOW ();
+
+                if (Transfer (buffer, address, blocks, write) != SD_OK) {
+                        result->Errors++;
+                }
+
+                us = SD_TimeElapsedUs (start);
+                total += us;
+
+                for (bucket = 0; (bucket < SD_BENCH_HIST_BUCKETS - 1) && (us >> (bucket + 1)); bucket++)
+                        ;
+
+                result->Histogram[bucket]++;
+
+                /*!< Insertion sort, for the percentiles */
+                for (j = i; (j > 0) && (Latency[j - 1] > us); j--) {
+                        Latency[j] = Latency[j - 1];
+                }
+
+                Latency[j] = us;
+        }
+
+        Console_SetPolicy (policy);
+        result->TotalUs = (total > 0xFFFFFFFF) ? 0xFFFFFFFF : (uint32_t) total;
+
+        if (total) {
+                result->KBps = (uint32_t) ((uint64_t) SD_BENCH_OPS * blocks * 512 * 1000 / total);
+                result->Iops = (uint32_t) ((uint64_t) SD_BENCH_OPS * 1000000 / total);
+        }
+
+        result->P50Us = Latency[(SD_BENCH_OPS - 1) / 2];
+        result->P99Us = Latency[(SD_BENCH_OPS * 99 + 99) / 100 - 1];
+        result->MaxUs = Latency[SD_BENCH_OPS - 1];
+}
+
+/**
+ * @brief  One blocking request, back in the transfer state on return.
+ * @retval SD_Error
+ */
+static SD_Error Transfer (uint8_t *buffer, uint64_t address, uint32_t blocks, uint8_t write)
+{
+        SD_Error errorstatus;
+
+        if (write) {
+                errorstatus = SD_WriteMultiBlocks (buffer, address, 512, blocks);
+
+                if (errorstatus == SD_OK) {
+                        errorstatus = SD_WaitWriteOperation ();
+                }
+
+                if (errorstatus == SD_OK) {
+                        errorstatus = SD_WaitReady ();
+                }
+                else {
+                        SD_WaitReady ();
+                }
+        }
+        else {
+                errorstatus = SD_ReadMultiBlocks (buffer, address, 512, blocks);
+
+                if (errorstatus == SD_OK) {
+                        errorstatus = SD_WaitReadOperation ();
+                }
+        }
+
+        return (errorstatus);
+}
+
+/**
+ * @brief  Linear congruential generator, same sequence on every run.
+ */
+static uint32_t Random (void)
+{
+        Seed = Seed * 1664525 + 1013904223;
+        return (Seed >> 8);
+}
+
+/**
+ * @brief  Prints a result as a BENCH and a HIST line.
+ */
+static void Report (const char *test, SD_BenchResult *result)
+{
+        uint32_t i;
+
+        printf ("BENCH test=%s blocks=%u ops=%u err=%u us=%u kBps=%u iops=%u p50_us=%u p99_us=%u max_us=%u\r\n", test, (unsigned int) result->Blocks,
+                        (unsigned int) result->Ops, (unsigned int) result->Errors, (unsigned int) result->TotalUs, (unsigned int) result->KBps,
+                        (unsigned int) result->Iops, (unsigned int) result->P50Us, (unsigned int) result->P99Us, (unsigned int) result->MaxUs);
+
+        printf ("HIST test=%s blocks=%u", test, (unsigned int) result->Blocks);
+
+        for (i = 0; i < SD_BENCH_HIST_BUCKETS; i++) {
+                printf (" %u", (unsigned int) result->Histogram[i]);
+        }
+
+        printf ("\r\n");
+}
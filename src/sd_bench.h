@@ -0,0 +1,69 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef SD_BENCH_H_
+#define SD_BENCH_H_
+
+#include <stm32f4xx.h>
+#include "sdio_high_level.h"
+
+/**
+ * @brief  Requests timed per test and request size.
+ */
+#ifndef SD_BENCH_OPS
+#define SD_BENCH_OPS                  32
+#endif
+
+/**
+ * @brief  Largest request size, in 512 byte blocks. Sizes go 1, 2, 4 ... up to this
+ *         (or the buffer given to SD_BenchRun).
+ */
+#ifndef SD_BENCH_MAX_BLOCKS
+#define SD_BENCH_MAX_BLOCKS           128
+#endif
+
+/**
+ * @brief  Size of the random I/O requests (4 KB).
+ */
+#ifndef SD_BENCH_RANDOM_BLOCKS
+#define SD_BENCH_RANDOM_BLOCKS        8
+#endif
+
+/**
+ * @brief  Area the random requests are spread over, in blocks (32 MB).
+ */
+#ifndef SD_BENCH_SPAN_BLOCKS
+#define SD_BENCH_SPAN_BLOCKS          65536
+#endif
+
+/**
+ * @brief  Latency histogram buckets : bucket i counts the requests which took
+ *         [2^i, 2^(i+1)) us, the first one also 0 us, the last one everything above.
+ */
+#define SD_BENCH_HIST_BUCKETS         20
+
+/**
+ * @brief  Result of one test at one request size. Times are in microseconds.
+ */
+typedef struct {
+        uint32_t Blocks; /*!< Request size */
+        uint32_t Ops;
+        uint32_t Errors;
+        uint32_t TotalUs;
+        uint32_t KBps; /*!< Throughput, 1000 bytes per second */
+        uint32_t Iops;
+        uint32_t P50Us;
+        uint32_t P99Us;
+        uint32_t MaxUs;
+        uint32_t Histogram[SD_BENCH_HIST_BUCKETS];
+} SD_BenchResult;
+
+void SD_BenchRun (uint8_t *buffer, uint32_t BufferBlocks, uint64_t BaseAddr);
+void SD_BenchMeasure (SD_BenchResult *result, uint8_t *buffer, uint32_t blocks, uint64_t BaseAddr, uint8_t write, uint8_t random);
+
+#endif /* SD_BENCH_H_ */
@@ -0,0 +1,332 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <stddef.h>
+#include "sd_blockdev.h"
+#include "sd_time.h"
+
+/*
+ * Completion of a blocking transfer, on the caller's stack.
+ */
+typedef struct {
+        __IO uint8_t Done;
+        __IO SD_Error Status;
+} Waiter;
+
+static SD_Error SdioInit (SD_BlockDev *dev);
+static SD_Error SdioGetInfo (SD_BlockDev *dev, SD_BlockDevInfo *info);
+static SD_Error SdioReadAsync (SD_BlockDev *dev, uint8_t *buffer, uint32_t block, uint32_t count, SD_TransferCallback callback, void *context);
+static SD_Error SdioWriteAsync (SD_BlockDev *dev, const uint8_t *buffer, uint32_t block, uint32_t count, SD_TransferCallback callback, void *context);
+static SD_Error SdioWaitReady (SD_BlockDev *dev);
+static SD_Error SdioErase (SD_BlockDev *dev, uint32_t block, uint32_t count);
+static void WaiterDone (SD_Error status, void *context);
+static SD_Error Wait (Waiter *waiter);
+static SD_Error SdioWaitWrite (void);
+
+static const SD_BlockDevOps SdioOps = {
+        SdioInit,
+        SdioGetInfo,
+        SdioReadAsync,
+        SdioWriteAsync,
+        SdioWaitReady,
+        SdioErase
+};
+
+/*
+ * The SDIO driver (sdio_high_level.c) keeps its context internally, there is only
+ * one SDIO peripheral.
+ */
+SD_BlockDev SD_SdioDev = { &SdioOps, NULL, "sdio" };
+
+/*
+ * A write or an erase was started through SD_SdioDev and not waited for since.
+ */
+static uint8_t SdioProgramming = 0;
+
+/**
+ * @brief  Initializes the card.
+ * @param  dev: device.
+ * @retval SD_Error
+ */
+SD_Error SD_DevInit (SD_BlockDev *dev)
+{
+        return (dev->Ops->Init (dev));
+}
+
+/**
+ * @brief  Capacity and allocation unit.
+ * @param  dev: device.
+ * @param  info: destination.
+ * @retval SD_Error
+ */
+SD_Error SD_DevGetInfo (SD_BlockDev *dev, SD_BlockDevInfo *info)
+{
+        return (dev->Ops->GetInfo (dev, info));
+}
+
+/**
+ * @brief  Starts reading, see SD_BlockDevOps.
+ * @param  dev: device.
+ * @param  buffer: word aligned destination.
+ * @param  block: first block.
+ * @param  count: number of blocks.
+ * @param  callback: called in interrupt context at the end. May be NULL.
+ * @param  context: passed to the callback.
+ * @retval SD_Error: status of the start.
+ */
+SD_Error SD_DevReadAsync (SD_BlockDev *dev, uint8_t *buffer, uint32_t block, uint32_t count, SD_TransferCallback callback, void *context)
+{
+        return (dev->Ops->ReadAsync (dev, buffer, block, count, callback, context));
+}
+
+/**
+ * @brief  Starts writing, see SD_BlockDevOps.
+ * @param  dev: device.
+ * @param  buffer: word aligned data.
+ * @param  block: first block.
+ * @param  count: number of blocks.
+ * @param  callback: called in interrupt context at the end. May be NULL.
+ * @param  context: passed to the callback.
+ * @retval SD_Error: status of the start.
+ */
+SD_Error SD_DevWriteAsync (SD_BlockDev *dev, const uint8_t *buffer, uint32_t block, uint32_t count, SD_TransferCallback callback, void *context)
+{
+        return (dev->Ops->WriteAsync (dev, buffer, block, count, callback, context));
+}
+
+/**
+ * @brief  Waits for the end of programming.
+ * @param  dev: device.
+ * @retval SD_Error
+ */
+SD_Error SD_DevWaitReady (SD_BlockDev *dev)
+{
+        return (dev->Ops->WaitReady (dev));
+}
+
+/**
+ * @brief  Erases blocks.
+ * @param  dev: device.
+ * @param  block: first block.
+ * @param  count: number of blocks.
+ * @retval SD_Error
+ */
+SD_Error SD_DevErase (SD_BlockDev *dev, uint32_t block, uint32_t count)
+{
+        return (dev->Ops->Erase (dev, block, count));
+}
+
+/**
+ * @brief  Reads blocks, sleeping until the data is in.
+ * @param  dev: device.
+ * @param  buffer: word aligned destination.
+ * @param  block: first block.
+ * @param  count: number of blocks.
+ * @retval SD_Error
+ */
+SD_Error SD_DevRead (SD_BlockDev *dev, uint8_t *buffer, uint32_t block, uint32_t count)
+{
+        Waiter waiter = { 0, SD_OK };
+        SD_Error errorstatus = SD_DevReadAsync (dev, buffer, block, count, WaiterDone, &waiter);
+
+        if (errorstatus != SD_OK) {
+                return (errorstatus);
+        }
+
+        return (Wait (&waiter));
+}
+
+/**
+ * @brief  Writes blocks, sleeping until the card is done programming them.
+ * @param  dev: device.
+ * @param  buffer: word aligned data.
+ * @param  block: first block.
+ * @param  count: number of blocks.
+ * @retval SD_Error
+ */
+SD_Error SD_DevWrite (SD_BlockDev *dev, const uint8_t *buffer, uint32_t block, uint32_t count)
+{
+        Waiter waiter = { 0, SD_OK };
+        SD_Error errorstatus = SD_DevWriteAsync (dev, buffer, block, count, WaiterDone, &waiter);
+
+        if (errorstatus != SD_OK) {
+                return (errorstatus);
+        }
+
+        errorstatus = Wait (&waiter);
+
+        if (errorstatus == SD_OK) {
+                errorstatus = SD_DevWaitReady (dev);
+        }
+        else {
+                SD_DevWaitReady (dev);
+        }
+
+        return (errorstatus);
+}
+
+/**
+ * @brief  Allocation unit in blocks from the AU_SIZE field of the SD status.
+ * @param  AuSize: AU_SIZE.
+ * @retval Number of blocks, 1 if not defined.
+ */
+uint32_t SD_AuBlocks (uint8_t AuSize)
+{
+        /*!< AU_SIZE 0xB.. 0xF (SD 3.0) : 12, 16, 24, 32 and 64 MB */
+        static const uint16_t LargeAuMB[] = { 12, 16, 24, 32, 64 };
+
+        if ((AuSize == 0) || (AuSize > 0xF)) {
+                return (1);
+        }
+
+        /*!< 0x1 .. 0xA : 16 KB << (AU_SIZE - 1) */
+        if (AuSize <= 0xA) {
+                return ((16 * 1024 / SD_BLOCKDEV_BLOCK_SIZE) << (AuSize - 1));
+        }
+
+        return ((uint32_t) LargeAuMB[AuSize - 0xB] * (1024 * 1024 / SD_BLOCKDEV_BLOCK_SIZE));
+}
+
+/**
+ * @brief  CRC16-CCITT (x^16 + x^12 + x^5 + 1), initial value 0 : the SD data block
+ *         CRC. Byte at a time without a table.
+ * @param  data: bytes.
+ * @param  length: their number.
+ * @retval CRC
+ */
+uint16_t SD_Crc16 (const uint8_t *data, uint32_t length)
+{
+        uint16_t crc = 0;
+        uint32_t i;
+
+        for (i = 0; i < length; i++) {
+                crc = (uint16_t) ((crc >> 8) | (crc << 8));
+                crc ^= data[i];
+                crc ^= (crc & 0xFF) >> 4;
+                crc ^= crc << 12;
+                crc ^= (crc & 0xFF) << 5;
+        }
+
+        return (crc);
+}
+
+/**
+ * @brief  Completion of a blocking transfer, in interrupt context.
+ */
+static void WaiterDone (SD_Error status, void *context)
+{
+        Waiter *waiter = (Waiter *) context;
+
+        waiter->Status = status;
+        waiter->Done = 1;
+}
+
+/**
+ * @brief  Sleeps until WaiterDone was called.
+ */
+static SD_Error Wait (Waiter *waiter)
+{
+        __disable_irq ();
+
+        while (!waiter->Done) {
+                SD_AsyncSleep ();
+                __enable_irq ();
+                __disable_irq ();
+        }
+
+        __enable_irq ();
+        return (waiter->Status);
+}
+
+/*--------------------------------------------------------------------------*/
+/* SDIO transport                                                           */
+/*--------------------------------------------------------------------------*/
+
+static SD_Error SdioInit (SD_BlockDev *dev)
+{
+        return (SD_Init ());
+}
+
+static SD_Error SdioGetInfo (SD_BlockDev *dev, SD_BlockDevInfo *info)
+{
+        SD_CardInfo cardinfo;
+        SD_CardStatus cardstatus;
+        SD_Error errorstatus = SD_GetCardInfo (&cardinfo);
+
+        if (errorstatus != SD_OK) {
+                return (errorstatus);
+        }
+
+        info->Blocks = (uint32_t) (cardinfo.CardCapacity / SD_BLOCKDEV_BLOCK_SIZE);
+        info->AuBlocks = (SD_GetCardStatus (&cardstatus) == SD_OK) ? SD_AuBlocks (cardstatus.AU_SIZE) : 1;
+        return (SD_OK);
+}
+
+/*
+ * The driver does not queue : a transfer may only start once the card is out of
+ * the programming state of the previous write. SD_WaitReady always costs a CMD13,
+ * so it is skipped when no write was issued since the last wait.
+ */
+static SD_Error SdioReadAsync (SD_BlockDev *dev, uint8_t *buffer, uint32_t block, uint32_t count, SD_TransferCallback callback, void *context)
+{
+        SD_Error errorstatus = SdioWaitWrite ();
+
+        if (errorstatus != SD_OK) {
+                return (errorstatus);
+        }
+
+        return (SD_ReadMultiBlocksAsync (buffer, (uint64_t) block * SD_BLOCKDEV_BLOCK_SIZE, SD_BLOCKDEV_BLOCK_SIZE, count, callback, context));
+}
+
+static SD_Error SdioWriteAsync (SD_BlockDev *dev, const uint8_t *buffer, uint32_t block, uint32_t count, SD_TransferCallback callback, void *context)
+{
+        SD_Error errorstatus = SdioWaitWrite ();
+
+        if (errorstatus != SD_OK) {
+                return (errorstatus);
+        }
+
+        /*!< Set first : the card may be programming even if the start failed half way */
+        SdioProgramming = 1;
+        return (SD_WriteMultiBlocksAsync ((uint8_t *) buffer, (uint64_t) block * SD_BLOCKDEV_BLOCK_SIZE, SD_BLOCKDEV_BLOCK_SIZE, count, callback, context));
+}
+
+static SD_Error SdioWaitReady (SD_BlockDev *dev)
+{
+        SD_Error errorstatus = SD_WaitReady ();
+
+        if (errorstatus == SD_OK) {
+                SdioProgramming = 0;
+        }
+
+        return (errorstatus);
+}
+
+static SD_Error SdioErase (SD_BlockDev *dev, uint32_t block, uint32_t count)
+{
+        if (count == 0) {
+                return (SD_OK);
+        }
+
+        SdioProgramming = 1;
+
+        /*!< CMD33 takes the address of the last block */
+        return (SD_Erase ((uint64_t) block * SD_BLOCKDEV_BLOCK_SIZE, (uint64_t) (block + count - 1) * SD_BLOCKDEV_BLOCK_SIZE));
+}
+
+/**
+ * @brief  Waits for the end of the last write or erase, if one is outstanding.
+ */
+static SD_Error SdioWaitWrite (void)
+{
+        if (!SdioProgramming) {
+                return (SD_OK);
+        }
+
+        return (SdioWaitReady (&SD_SdioDev));
+}
@@ -0,0 +1,69 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef SD_BLOCKDEV_H_
+#define SD_BLOCKDEV_H_
+
+#include <stm32f4xx.h>
+#include "sdio_high_level.h"
+
+/*
+ * Block device layer : one card behind a transport (SDIO + DMA, SPI ...) given as a
+ * table of operations, and a context owned by that transport. Addresses and counts
+ * are in 512 byte blocks. Transfers are asynchronous, completion is reported from
+ * the transport's interrupt, so transfers on two devices can run at the same time.
+ * SD_DevRead / SD_DevWrite are the blocking versions.
+ */
+
+#define SD_BLOCKDEV_BLOCK_SIZE        512
+
+typedef struct SD_BlockDev SD_BlockDev;
+
+typedef struct {
+        uint32_t Blocks; /*!< Capacity */
+        uint32_t AuBlocks; /*!< Allocation unit (SD status AU_SIZE), 1 if not reported */
+} SD_BlockDevInfo;
+
+/**
+ * @brief  Transport operations. ReadAsync / WriteAsync return once the transfer
+ *         is started and call callback in interrupt context at its end ; the
+ *         buffer belongs to the transport until then. Only one transfer per device
+ *         may be in flight. After a write the card programs, WaitReady waits for it.
+ */
+typedef struct {
+        SD_Error (*Init) (SD_BlockDev *dev);
+        SD_Error (*GetInfo) (SD_BlockDev *dev, SD_BlockDevInfo *info);
+        SD_Error (*ReadAsync) (SD_BlockDev *dev, uint8_t *buffer, uint32_t block, uint32_t count, SD_TransferCallback callback, void *context);
+        SD_Error (*WriteAsync) (SD_BlockDev *dev, const uint8_t *buffer, uint32_t block, uint32_t count, SD_TransferCallback callback, void *context);
+        SD_Error (*WaitReady) (SD_BlockDev *dev);
+        SD_Error (*Erase) (SD_BlockDev *dev, uint32_t block, uint32_t count);
+} SD_BlockDevOps;
+
+struct SD_BlockDev {
+        const SD_BlockDevOps *Ops;
+        void *Context; /*!< Transport state */
+        const char *Name;
+};
+
+/**
+ * @brief  The card in the SDIO slot.
+ */
+extern SD_BlockDev SD_SdioDev;
+
+SD_Error SD_DevInit (SD_BlockDev *dev);
+SD_Error SD_DevGetInfo (SD_BlockDev *dev, SD_BlockDevInfo *info);
+SD_Error SD_DevReadAsync (SD_BlockDev *dev, uint8_t *buffer, uint32_t block, uint32_t count, SD_TransferCallback callback, void *context);
+SD_Error SD_DevWriteAsync (SD_BlockDev *dev, const uint8_t *buffer, uint32_t block, uint32_t count, SD_TransferCallback callback, void *context);
+SD_Error SD_DevWaitReady (SD_BlockDev *dev);
+SD_Error SD_DevErase (SD_BlockDev *dev, uint32_t block, uint32_t count);
+SD_Error SD_DevRead (SD_BlockDev *dev, uint8_t *buffer, uint32_t block, uint32_t count);
+SD_Error SD_DevWrite (SD_BlockDev *dev, const uint8_t *buffer, uint32_t block, uint32_t count);
+uint32_t SD_AuBlocks (uint8_t AuSize);
+uint16_t SD_Crc16 (const uint8_t *data, uint32_t length);
+
+#endif /* SD_BLOCKDEV_H_ */
@@ -0,0 +1,389 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <stddef.h>
+#include <string.h>
+#include <stm32f4xx.h>
+#include "sd_cache.h"
+#include "sd_recovery.h"
+
+#define SD_CACHE_LINES                (SD_CACHE_SETS * SD_CACHE_WAYS)
+
+/**
+ * @brief  Tag of one cache line. Lines of set s are [s * SD_CACHE_WAYS, (s + 1) *
+ *         SD_CACHE_WAYS).
+ */
+typedef struct {
+        uint32_t block; /*!< Card block number (address / 512) */
+        uint32_t used; /*!< Clock value of the last access, for LRU */
+        uint8_t valid;
+        uint8_t dirty;
+} CacheLine;
+
+static CacheLine Lines[SD_CACHE_LINES];
+static uint8_t Data[SD_CACHE_LINES][SD_CACHE_BLOCK_SIZE] __attribute__ ((aligned (4)));
+static uint32_t Clock = 0;
+static SD_CacheStats Stats;
+
+static int32_t Lookup (uint32_t block);
+static void Touch (uint32_t index);
+static SD_Error Allocate (uint32_t block, uint32_t *index);
+static SD_Error WriteBack (uint32_t index);
+
+/**
+ * @brief  Drops every line (dirty ones are lost) and resets the counters. Call
+ *         after SD_Init.
+ * @param  None
+ * @retval None
+ */
+void SD_CacheInit (void)
+{
+        memset (Lines, 0, sizeof (Lines));
+        Clock = 0;
+        Stats = (SD_CacheStats) { 0 };
+}
+
+/**
+ * @brief  Reads through the cache. Cached blocks are copied from RAM, runs of
+ *         missing blocks are read with one CMD18 each, into the cache if they are
+ *         short, or straight into readbuff if they are SD_CACHE_BYPASS_BLOCKS or
+ *         longer (and readbuff is word aligned).
+ * @param  readbuff: pointer to the buffer that will contain the received data.
+ * @param  ReadAddr: Address from where data are to be read, in bytes, block aligned.
+ * @param  NumberOfBlocks: number of 512 byte blocks to read.
+ * @retval SD_Error: SD Card Error code.
+ */
+SD_Error SD_CacheRead (uint8_t *readbuff, uint64_t ReadAddr, uint32_t NumberOfBlocks)
+{
+        SD_Error errorstatus = SD_OK;
+        SD_IoVec vec[SD_CACHE_SETS];
+        uint32_t index[SD_CACHE_SETS];
+        uint32_t block = (uint32_t) (ReadAddr / SD_CACHE_BLOCK_SIZE);
+        uint32_t i = 0, run, k;
+        int32_t hit;
+
+        while (i < NumberOfBlocks) {
+                hit = Lookup (block + i);
+
+                if (hit >= 0) {
+                        memcpy (readbuff + i * SD_CACHE_BLOCK_SIZE, Data[hit], SD_CACHE_BLOCK_SIZE);
+                        Touch (hit);
+                        Stats.Hits++;
+                        i++;
+                        continue;
+                }
+
+                /*!< Run of blocks missing from the cache */
+                for (run = 1; (i + run < NumberOfBlocks) && (Lookup (block + i + run) < 0); run++)
+                        ;
+
+                Stats.Misses += run;
+
+                if ((run >= SD_CACHE_BYPASS_BLOCKS) && !((uint32_t) (readbuff + i * SD_CACHE_BLOCK_SIZE) & 0x03)) {
+                        errorstatus = SD_RecoveryRead (readbuff + i * SD_CACHE_BLOCK_SIZE, (uint64_t) (block + i) * SD_CACHE_BLOCK_SIZE, run);
+
+                        if (errorstatus != SD_OK) {
+                                return (errorstatus);
+                        }
+
+                        Stats.Bypassed += run;
+                        i += run;
+                        continue;
+                }
+
+                /*!< At most one block per set, so that the lines of the run do not evict each other */
+                if (run > SD_CACHE_SETS) {
+                        Stats.Misses -= run - SD_CACHE_SETS;
+                        run = SD_CACHE_SETS;
+                }
+
+                for (k = 0; k < run; k++) {
+                        errorstatus = Allocate (block + i + k, &index[k]);
+
+                        if (errorstatus != SD_OK) {
+                                /*!< The lines taken so far hold no data yet */
+                                while (k--) {
+                                        Lines[index[k]].valid = 0;
+                                }
+
+                                return (errorstatus);
+                        }
+
+                        vec[k].buffer = Data[index[k]];
+                        vec[k].NumberOfBlocks = 1;
+                }
+
+                errorstatus = SD_ReadMultiBlocksVec (vec, run, (uint64_t) (block + i) * SD_CACHE_BLOCK_SIZE);
+
+                if (errorstatus == SD_OK) {
+                        errorstatus = SD_WaitReadOperation ();
+                }
+
+                if (errorstatus != SD_OK) {
+                        for (k = 0; k < run; k++) {
+                                Lines[index[k]].valid = 0;
+                        }
+
+                        return (errorstatus);
+                }
+
+                for (k = 0; k < run; k++) {
+                        memcpy (readbuff + (i + k) * SD_CACHE_BLOCK_SIZE, Data[index[k]], SD_CACHE_BLOCK_SIZE);
+                }
+
+                i += run;
+        }
+
+        return (errorstatus);
+}
+
+/**
+ * @brief  Writes through the cache. Short writes only update (or allocate) lines
+ *         and mark them dirty, the card is written on eviction or SD_CacheFlush.
+ *         Writes of SD_CACHE_BYPASS_BLOCKS or more from a word aligned buffer go
+ *         straight to the card, updating the lines which hold any of the blocks.
+ * @param  writebuff: pointer to the buffer that contain the data to be transferred.
+ * @param  WriteAddr: Address where data are to be written, in bytes, block aligned.
+ * @param  NumberOfBlocks: number of 512 byte blocks to write.
+ * @retval SD_Error: SD Card Error code.
+ */
+SD_Error SD_CacheWrite (const uint8_t *writebuff, uint64_t WriteAddr, uint32_t NumberOfBlocks)
+{
+        SD_Error errorstatus = SD_OK;
+        uint32_t block = (uint32_t) (WriteAddr / SD_CACHE_BLOCK_SIZE);
+        uint32_t i, index;
+        int32_t hit;
+
+        if ((NumberOfBlocks >= SD_CACHE_BYPASS_BLOCKS) && !((uint32_t) writebuff & 0x03)) {
+                errorstatus = SD_RecoveryWrite ((uint8_t *) writebuff, WriteAddr, NumberOfBlocks);
+
+                if (errorstatus != SD_OK) {
+                        return (errorstatus);
+                }
+
+                /*!< The card has the latest data now, cached copies become clean */
+                for (i = 0; i < NumberOfBlocks; i++) {
+                        if ((hit = Lookup (block + i)) >= 0) {
+                                memcpy (Data[hit], writebuff + i * SD_CACHE_BLOCK_SIZE, SD_CACHE_BLOCK_SIZE);
+                                Lines[hit].dirty = 0;
+                        }
+                }
+
+                Stats.Bypassed += NumberOfBlocks;
+                return (errorstatus);
+        }
+
+        for (i = 0; i < NumberOfBlocks; i++) {
+                hit = Lookup (block + i);
+
+                if (hit >= 0) {
+                        index = hit;
+                        Stats.Hits++;
+                }
+                else {
+                        /*!< Whole block overwritten, nothing to read first */
+                        errorstatus = Allocate (block + i, &index);
+                        Stats.Misses++;
+
+                        if (errorstatus != SD_OK) {
+                                return (errorstatus);
+                        }
+                }
+
+                memcpy (Data[index], writebuff + i * SD_CACHE_BLOCK_SIZE, SD_CACHE_BLOCK_SIZE);
+                Lines[index].dirty = 1;
+                Touch (index);
+        }
+
+        return (errorstatus);
+}
+
+/**
+ * @brief  Writes every dirty line back to the card, consecutive blocks together.
+ * @param  None
+ * @retval SD_Error: first error met. Lines which could not be written stay dirty.
+ */
+SD_Error SD_CacheFlush (void)
+{
+        SD_Error errorstatus = SD_OK, status;
+        uint32_t i;
+
+        for (i = 0; i < SD_CACHE_LINES; i++) {
+                if (Lines[i].valid && Lines[i].dirty) {
+                        status = WriteBack (i);
+
+                        if (errorstatus == SD_OK) {
+                                errorstatus = status;
+                        }
+                }
+        }
+
+        return (errorstatus);
+}
+
+/**
+ * @brief  Flushes and drops every line, e.g. before the card is accessed other than
+ *         through the cache.
+ * @param  None
+ * @retval SD_Error: error of the flush. Nothing is dropped if it failed.
+ */
+SD_Error SD_CacheInvalidate (void)
+{
+        SD_Error errorstatus = SD_CacheFlush ();
+        uint32_t i;
+
+        if (errorstatus != SD_OK) {
+                return (errorstatus);
+        }
+
+        for (i = 0; i < SD_CACHE_LINES; i++) {
+                Lines[i].valid = 0;
+        }
+
+        return (errorstatus);
+}
+
+/**
+ * @brief  Copies the counters.
+ * @param  stats: destination.
+ * @retval None
+ */
+void SD_CacheGetStats (SD_CacheStats *stats)
+{
+        *stats = Stats;
+}
+
+/**
+ * @brief  Finds the line holding a block.
+ * @retval Line index, -1 if the block is not cached.
+ */
+static int32_t Lookup (uint32_t block)
+{
+        uint32_t i = (block % SD_CACHE_SETS) * SD_CACHE_WAYS;
+        uint32_t end = i + SD_CACHE_WAYS;
+
+        for (; i < end; i++) {
+                if (Lines[i].valid && (Lines[i].block == block)) {
+                        return (i);
+                }
+        }
+
+        return (-1);
+}
+
+/**
+ * @brief  Marks a line as the most recently used one of its set.
+ */
+static void Touch (uint32_t index)
+{
+        Lines[index].used = ++Clock;
+}
+
+/**
+ * @brief  Takes a line for a block : a free way of its set, or the least recently
+ *         used one, written back first if dirty. The line is valid and clean on
+ *         return, its data is undefined.
+ * @retval SD_Error: error of the write back.
+ */
+static SD_Error Allocate (uint32_t block, uint32_t *index)
+{
+        SD_Error errorstatus = SD_OK;
+        uint32_t i = (block % SD_CACHE_SETS) * SD_CACHE_WAYS;
+        uint32_t end = i + SD_CACHE_WAYS;
+        uint32_t victim = i;
+
+        for (; i < end; i++) {
+                if (!Lines[i].valid) {
+                        victim = i;
+                        break;
+                }
+
+                /*!< Oldest by age, so that a wrapping Clock does not matter */
+                if (Clock - Lines[i].used > Clock - Lines[victim].used) {
+                        victim = i;
+                }
+        }
+
+        if (Lines[victim].valid) {
+                Stats.Evictions++;
+
+                if (Lines[victim].dirty && ((errorstatus = WriteBack (victim)) != SD_OK)) {
+                        return (errorstatus);
+                }
+        }
+
+        Lines[victim].block = block;
+        Lines[victim].valid = 1;
+        Lines[victim].dirty = 0;
+        Touch (victim);
+        *index = victim;
+        return (errorstatus);
+}
+
+/**
+ * @brief  Writes a dirty line back together with its dirty neighbours on the card
+ *         (up to SD_CACHE_MAX_RUN blocks), gathered into one CMD25.
+ * @retval SD_Error: SD Card Error code.
+ */
+static SD_Error WriteBack (uint32_t index)
+{
+        SD_Error errorstatus = SD_OK;
+        SD_IoVec vec[SD_CACHE_MAX_RUN];
+        uint32_t run[SD_CACHE_MAX_RUN];
+        uint32_t start = Lines[index].block;
+        uint32_t n, k;
+        int32_t i;
+
+        /*!< Go back to the first dirty block of the run, keeping index in it */
+        for (n = 1; (n < SD_CACHE_MAX_RUN) && (start > 0); n++) {
+                i = Lookup (start - 1);
+
+                if ((i < 0) || !Lines[i].dirty) {
+                        break;
+                }
+
+                start--;
+        }
+
+        for (n = 0; n < SD_CACHE_MAX_RUN; n++) {
+                i = Lookup (start + n);
+
+                if ((i < 0) || !Lines[i].dirty) {
+                        break;
+                }
+
+                run[n] = i;
+                vec[n].buffer = Data[i];
+                vec[n].NumberOfBlocks = 1;
+        }
+
+        errorstatus = SD_WriteMultiBlocksVec (vec, n, (uint64_t) start * SD_CACHE_BLOCK_SIZE);
+
+        if (errorstatus == SD_OK) {
+                errorstatus = SD_WaitWriteOperation ();
+        }
+
+        if (errorstatus == SD_OK) {
+                errorstatus = SD_WaitReady ();
+        }
+        else {
+                SD_WaitReady ();
+        }
+
+        if (errorstatus != SD_OK) {
+                return (errorstatus);
+        }
+
+        for (k = 0; k < n; k++) {
+                Lines[run[k]].dirty = 0;
+        }
+
+        Stats.WriteBacks++;
+        Stats.BlocksWritten += n;
+        return (errorstatus);
+}
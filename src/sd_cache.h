@@ -0,0 +1,66 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef SD_CACHE_H_
+#define SD_CACHE_H_
+
+#include <stm32f4xx.h>
+#include "sdio_high_level.h"
+
+/**
+ * @brief  Number of sets. A block goes to set (block % SD_CACHE_SETS), so runs of
+ *         consecutive blocks spread over all the sets.
+ */
+#ifndef SD_CACHE_SETS
+#define SD_CACHE_SETS                 8
+#endif
+
+/**
+ * @brief  Lines per set. RAM used is SD_CACHE_SETS * SD_CACHE_WAYS * 512 bytes.
+ */
+#ifndef SD_CACHE_WAYS
+#define SD_CACHE_WAYS                 4
+#endif
+
+/**
+ * @brief  Transfers of this many blocks or more go straight to the card and do not
+ *         allocate lines, so that bulk data does not evict the metadata.
+ */
+#ifndef SD_CACHE_BYPASS_BLOCKS
+#define SD_CACHE_BYPASS_BLOCKS        4
+#endif
+
+/**
+ * @brief  Maximum number of dirty neighbours written back with one CMD25.
+ */
+#ifndef SD_CACHE_MAX_RUN
+#define SD_CACHE_MAX_RUN              SD_CACHE_SETS
+#endif
+
+#define SD_CACHE_BLOCK_SIZE           512
+
+/**
+ * @brief  Cache counters, in blocks.
+ */
+typedef struct {
+        uint32_t Hits;
+        uint32_t Misses;
+        uint32_t Bypassed; /*!< Blocks transferred without going through a line */
+        uint32_t Evictions; /*!< Valid lines replaced */
+        uint32_t WriteBacks; /*!< Card writes issued for dirty lines */
+        uint32_t BlocksWritten; /*!< Dirty blocks written back */
+} SD_CacheStats;
+
+void SD_CacheInit (void);
+SD_Error SD_CacheRead (uint8_t *readbuff, uint64_t ReadAddr, uint32_t NumberOfBlocks);
+SD_Error SD_CacheWrite (const uint8_t *writebuff, uint64_t WriteAddr, uint32_t NumberOfBlocks);
+SD_Error SD_CacheFlush (void);
+SD_Error SD_CacheInvalidate (void);
+void SD_CacheGetStats (SD_CacheStats *stats);
+
+#endif /* SD_CACHE_H_ */
@@ -0,0 +1,186 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+/*
+ * FatFs low level disk I/O (drive 0) on the SDIO driver. Built with -DWITH_FATFS=ON
+ * and FATFS_DIR pointing to FatFs, see build/CMakeLists.txt.
+ */
+
+#ifdef USE_FATFS
+
+#include <stm32f4xx.h>
+#include "diskio.h"
+#include "sdio_high_level.h"
+#include "sd_recovery.h"
+#include "sd_blockdev.h"
+
+#define SD_DISKIO_SECTOR_SIZE         512
+
+static volatile DSTATUS Stat = STA_NOINIT;
+
+/**
+ * @brief  Initializes the card (SD_Init) and the recovery layer.
+ * @param  drv: physical drive number, only 0.
+ * @retval Drive status.
+ */
+DSTATUS disk_initialize (BYTE drv)
+{
+        if (drv) {
+                return (STA_NOINIT);
+        }
+
+        if (SD_Detect () != SD_PRESENT) {
+                Stat = STA_NOINIT | STA_NODISK;
+                return (Stat);
+        }
+
+        if (SD_Init () == SD_OK) {
+                SD_RecoveryInit ();
+                Stat &= ~(STA_NOINIT | STA_NODISK);
+        }
+        else {
+                Stat |= STA_NOINIT;
+        }
+
+        return (Stat);
+}
+
+/**
+ * @brief  Drive status.
+ * @param  drv: physical drive number, only 0.
+ * @retval Drive status.
+ */
+DSTATUS disk_status (BYTE drv)
+{
+        if (drv) {
+                return (STA_NOINIT);
+        }
+
+        return (Stat);
+}
+
+/**
+ * @brief  Reads sectors with one CMD18. Any buffer alignment, unaligned buffers are
+ *         handled by the DMA (byte wide memory side), not sector by sector.
+ * @param  drv: physical drive number, only 0.
+ * @param  buff: destination.
+ * @param  sector: start sector (LBA).
+ * @param  count: sector count (1..255).
+ * @retval Result.
+ */
+DRESULT disk_read (BYTE drv, BYTE *buff, DWORD sector, BYTE count)
+{
+        if (drv || !count) {
+                return (RES_PARERR);
+        }
+
+        if (Stat & STA_NOINIT) {
+                return (RES_NOTRDY);
+        }
+
+        if (SD_RecoveryRead (buff, (uint64_t) sector * SD_DISKIO_SECTOR_SIZE, count) != SD_OK) {
+                return (RES_ERROR);
+        }
+
+        return (RES_OK);
+}
+
+#if _READONLY == 0
+/**
+ * @brief  Writes sectors with one ACMD23/CMD25, see disk_read.
+ * @param  drv: physical drive number, only 0.
+ * @param  buff: data to be written.
+ * @param  sector: start sector (LBA).
+ * @param  count: sector count (1..255).
+ * @retval Result.
+ */
+DRESULT disk_write (BYTE drv, const BYTE *buff, DWORD sector, BYTE count)
+{
+        if (drv || !count) {
+                return (RES_PARERR);
+        }
+
+        if (Stat & STA_NOINIT) {
+                return (RES_NOTRDY);
+        }
+
+        if (Stat & STA_PROTECT) {
+                return (RES_WRPRT);
+        }
+
+        if (SD_RecoveryWrite ((uint8_t *) buff, (uint64_t) sector * SD_DISKIO_SECTOR_SIZE, count) != SD_OK) {
+                return (RES_ERROR);
+        }
+
+        return (RES_OK);
+}
+#endif /* _READONLY == 0 */
+
+#if _USE_IOCTL != 0
+/**
+ * @brief  Erase block size in sectors, from the AU size in the SD status (ACMD13),
+ *         which is what the card wants whole writes in. 1 if not reported.
+ */
+static DWORD AllocationUnitSectors (void)
+{
+        SD_CardStatus cardstatus;
+
+        if (SD_GetCardStatus (&cardstatus) != SD_OK) {
+                return (1);
+        }
+
+        return ((DWORD) SD_AuBlocks (cardstatus.AU_SIZE) * (SD_BLOCKDEV_BLOCK_SIZE / SD_DISKIO_SECTOR_SIZE));
+}
+
+/**
+ * @brief  Miscellaneous functions.
+ * @param  drv: physical drive number, only 0.
+ * @param  ctrl: control code.
+ * @param  buff: control data.
+ * @retval Result.
+ */
+DRESULT disk_ioctl (BYTE drv, BYTE ctrl, void *buff)
+{
+        SD_CardInfo cardinfo;
+
+        if (drv) {
+                return (RES_PARERR);
+        }
+
+        if (Stat & STA_NOINIT) {
+                return (RES_NOTRDY);
+        }
+
+        switch (ctrl) {
+        case CTRL_SYNC:
+                /*!< Writes are blocking, only the programming may still be going on */
+                return ((SD_WaitReady () == SD_OK) ? RES_OK : RES_ERROR);
+
+        case GET_SECTOR_COUNT:
+                if (SD_GetCardInfo (&cardinfo) != SD_OK) {
+                        return (RES_ERROR);
+                }
+
+                *(DWORD *) buff = (DWORD) (cardinfo.CardCapacity / SD_DISKIO_SECTOR_SIZE);
+                return (RES_OK);
+
+        case GET_SECTOR_SIZE:
+                *(WORD *) buff = SD_DISKIO_SECTOR_SIZE;
+                return (RES_OK);
+
+        case GET_BLOCK_SIZE:
+                *(DWORD *) buff = AllocationUnitSectors ();
+                return (RES_OK);
+
+        default:
+                return (RES_PARERR);
+        }
+}
+#endif /* _USE_IOCTL != 0 */
+
+#endif /* USE_FATFS */
@@ -0,0 +1,448 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <string.h>
+#include "sd_logstore.h"
+#include "sd_blockdev.h"
+#include "sd_recovery.h"
+
+#if SD_LOG_HEADER_SIZE != 16
+#error "SD_LogBlockHeader must be SD_LOG_HEADER_SIZE bytes"
+#endif
+
+/*
+ * Geometry and the segment index : sequence number of each segment, 0 if it holds
+ * nothing valid.
+ */
+static uint32_t Base = 0;
+static uint32_t SegmentBlocks = 0;
+static uint32_t SegmentCount = 0;
+static uint32_t SegmentSeq[SD_LOG_MAX_SEGMENTS];
+
+/*
+ * Write head : segment Head, sequence Seq. Blocks [0, NextBlock) are on the card,
+ * the next Buffered ones are complete in Buffer, the one after is being filled up
+ * to Offset.
+ */
+static uint32_t Head = 0;
+static uint32_t Seq = 0;
+static uint32_t NextBlock = 0;
+static uint32_t Buffered = 0;
+static uint16_t Offset = 0;
+static uint8_t StreamOpen = 0;
+static uint32_t Buffer[SD_LOG_BUFFER_BLOCKS * 128];
+static SD_LogStats Stats;
+
+static SD_Error CloseBlock (void);
+static SD_Error MakeRoom (void);
+static SD_Error Flush (void);
+static SD_Error EndStream (void);
+static uint8_t *BlockData (uint32_t index);
+static void Seal (uint8_t *block, uint32_t seq, uint32_t index, uint16_t used);
+static uint8_t IsValid (uint8_t *block, uint32_t seq, uint32_t index);
+static SD_Error ReadBlock (uint8_t *block, uint32_t segment, uint32_t index);
+
+/**
+ * @brief  Sets the store up on Segments AU sized segments from BaseBlock (rounded up
+ *         to an AU boundary) and recovers the write head from the card.
+ * @param  BaseBlock: start of the area, in blocks.
+ * @param  Segments: number of segments, up to SD_LOG_MAX_SEGMENTS.
+ * @retval SD_Error
+ */
+SD_Error SD_LogInit (uint32_t BaseBlock, uint32_t Segments)
+{
+        SD_CardStatus cardstatus;
+        SD_Error errorstatus;
+        uint8_t *block = (uint8_t *) Buffer;
+        uint32_t i, lo, hi, mid;
+
+        if ((Segments == 0) || (Segments > SD_LOG_MAX_SEGMENTS)) {
+                return (SD_INVALID_PARAMETER);
+        }
+
+        memset (&Stats, 0, sizeof (Stats));
+        StreamOpen = 0;
+        Buffered = 0;
+        Offset = 0;
+
+        SegmentBlocks = (SD_GetCardStatus (&cardstatus) == SD_OK) ? SD_AuBlocks (cardstatus.AU_SIZE) : 1;
+
+        if (SegmentBlocks < 2) {
+                SegmentBlocks = SD_LOG_DEFAULT_SEGMENT_BLOCKS;
+        }
+
+        Base = (BaseBlock + SegmentBlocks - 1) / SegmentBlocks * SegmentBlocks;
+        SegmentCount = Segments;
+
+        /*!< Segment headers */
+        Head = 0;
+        Seq = 0;
+
+        for (i = 0; i < SegmentCount; i++) {
+                if ((errorstatus = ReadBlock (block, i, 0)) != SD_OK) {
+                        return (errorstatus);
+                }
+
+                SegmentSeq[i] = (IsValid (block, 0, 0)) ? ((SD_LogBlockHeader *) block)->Seq : 0;
+
+                if (SegmentSeq[i] > Seq) {
+                        Seq = SegmentSeq[i];
+                        Head = i;
+                }
+        }
+
+        if (Seq == 0) {
+                /*!< Empty store */
+                Seq = 1;
+                SegmentSeq[Head] = Seq;
+                NextBlock = 0;
+                return (SD_OK);
+        }
+
+        /*!< The blocks of the head segment are a valid prefix : find its end */
+        lo = 1;
+        hi = SegmentBlocks;
+
+        while (lo < hi) {
+                mid = lo + (hi - lo) / 2;
+
+                if ((errorstatus = ReadBlock (block, Head, mid)) != SD_OK) {
+                        return (errorstatus);
+                }
+
+                if (IsValid (block, Seq, mid)) {
+                        lo = mid + 1;
+                }
+                else {
+                        hi = mid;
+                }
+        }
+
+        NextBlock = lo;
+
+        if (NextBlock == SegmentBlocks) {
+                Head = (Head + 1) % SegmentCount;
+                SegmentSeq[Head] = ++Seq;
+                NextBlock = 0;
+        }
+
+        return (SD_OK);
+}
+
+/**
+ * @brief  Appends one record. It is on the card after the next SD_LogSync, or once
+ *         SD_LOG_BUFFER_BLOCKS blocks are full.
+ * @param  record: data.
+ * @param  length: 1 .. SD_LOG_MAX_RECORD bytes.
+ * @retval SD_Error
+ */
+SD_Error SD_LogAppend (const void *record, uint16_t length)
+{
+        SD_Error errorstatus;
+        uint8_t *payload;
+
+        if ((SegmentCount == 0) || (length == 0) || (length > SD_LOG_MAX_RECORD)) {
+                return (SD_INVALID_PARAMETER);
+        }
+
+        if ((errorstatus = MakeRoom ()) != SD_OK) {
+                return (errorstatus);
+        }
+
+        if ((Offset + 2 + length > SD_LOG_PAYLOAD_SIZE) && ((errorstatus = CloseBlock ()) != SD_OK)) {
+                return (errorstatus);
+        }
+
+        payload = BlockData (Buffered) + SD_LOG_HEADER_SIZE + Offset;
+        payload[0] = (uint8_t) length;
+        payload[1] = (uint8_t) (length >> 8);
+        memcpy (payload + 2, record, length);
+        Offset += 2 + length;
+        Stats.Records++;
+        return (SD_OK);
+}
+
+/**
+ * @brief  Writes the partly filled block (the rest of it is lost, the next record
+ *         goes to the next block), ends the CMD25 and waits for the programming.
+ * @param  None
+ * @retval SD_Error
+ */
+SD_Error SD_LogSync (void)
+{
+        SD_Error errorstatus;
+
+        if (Offset && ((errorstatus = CloseBlock ()) != SD_OK)) {
+                return (errorstatus);
+        }
+
+        if ((errorstatus = Flush ()) != SD_OK) {
+                return (errorstatus);
+        }
+
+        return (EndStream ());
+}
+
+/**
+ * @brief  Starts reading the records back, oldest first. Syncs the store.
+ * @param  cursor: reader state.
+ * @retval SD_Error
+ */
+SD_Error SD_LogReadOpen (SD_LogCursor *cursor)
+{
+        memset (cursor, 0, sizeof (*cursor));
+        cursor->Segment = (Head + 1) % SegmentCount;
+        return (SD_LogSync ());
+}
+
+/**
+ * @brief  Reads the next record. The segments are visited from the one after the
+ *         head (the oldest) to the head, each up to its first invalid block.
+ * @param  cursor: reader state.
+ * @param  record: destination.
+ * @param  max: its size, longer records are truncated.
+ * @param  length: length of the record, 0 at the end of the log.
+ * @retval SD_Error
+ */
+SD_Error SD_LogReadNext (SD_LogCursor *cursor, void *record, uint16_t max, uint16_t *length)
+{
+        SD_LogBlockHeader *header = (SD_LogBlockHeader *) cursor->Data;
+        uint8_t *payload = (uint8_t *) cursor->Data + SD_LOG_HEADER_SIZE;
+        SD_Error errorstatus;
+        uint16_t n;
+
+        *length = 0;
+
+        while (cursor->Visited < SegmentCount) {
+                if (!cursor->Loaded) {
+                        /*!< End of this segment : past the write head, the segment or its valid blocks */
+                        if (((cursor->Segment == Head) && (cursor->Block >= NextBlock)) || (cursor->Block >= SegmentBlocks)
+                                        || (SegmentSeq[cursor->Segment] == 0)) {
+                                cursor->Segment = (cursor->Segment + 1) % SegmentCount;
+                                cursor->Visited++;
+                                cursor->Block = 0;
+                                continue;
+                        }
+
+                        if ((errorstatus = ReadBlock ((uint8_t *) cursor->Data, cursor->Segment, cursor->Block)) != SD_OK) {
+                                return (errorstatus);
+                        }
+
+                        if (!IsValid ((uint8_t *) cursor->Data, SegmentSeq[cursor->Segment], cursor->Block)) {
+                                cursor->Block = SegmentBlocks;
+                                continue;
+                        }
+
+                        cursor->Loaded = 1;
+                        cursor->Offset = 0;
+                }
+
+                if (cursor->Offset + 2 > header->Used) {
+                        cursor->Loaded = 0;
+                        cursor->Block++;
+                        continue;
+                }
+
+                n = (uint16_t) (payload[cursor->Offset] | (payload[cursor->Offset + 1] << 8));
+
+                if ((n == 0) || (cursor->Offset + 2 + n > header->Used)) {
+                        cursor->Loaded = 0;
+                        cursor->Block++;
+                        continue;
+                }
+
+                memcpy (record, &payload[cursor->Offset + 2], (n < max) ? n : max);
+                cursor->Offset += 2 + n;
+                *length = n;
+                return (SD_OK);
+        }
+
+        return (SD_OK);
+}
+
+/**
+ * @brief  Copies the statistics.
+ * @param  stats: destination.
+ * @retval None
+ */
+void SD_LogGetStats (SD_LogStats *stats)
+{
+        *stats = Stats;
+        stats->Segments = SegmentCount;
+        stats->SegmentBlocks = SegmentBlocks;
+        stats->Head = Head;
+        stats->Seq = Seq;
+        stats->NextBlock = NextBlock;
+}
+
+/**
+ * @brief  Seals the block being filled, flushes the buffer when it is full or
+ *         reaches the end of the segment.
+ */
+static SD_Error CloseBlock (void)
+{
+        SD_Error errorstatus;
+
+        if ((errorstatus = MakeRoom ()) != SD_OK) {
+                return (errorstatus);
+        }
+
+        Seal (BlockData (Buffered), Seq, NextBlock + Buffered, Offset);
+        Buffered++;
+        Offset = 0;
+
+        if ((Buffered == SD_LOG_BUFFER_BLOCKS) || (NextBlock + Buffered == SegmentBlocks)) {
+                return (Flush ());
+        }
+
+        return (SD_OK);
+}
+
+/**
+ * @brief  Retries the flush of a full buffer (or one reaching the end of the
+ *         segment) which failed before. Until it succeeds there is no room for
+ *         another block, and nothing new is accepted.
+ */
+static SD_Error MakeRoom (void)
+{
+        if ((Buffered == SD_LOG_BUFFER_BLOCKS) || (NextBlock + Buffered == SegmentBlocks)) {
+                return (Flush ());
+        }
+
+        return (SD_OK);
+}
+
+/**
+ * @brief  Pushes the sealed blocks into the stream of the head segment, opening it
+ *         if needed. At the end of the segment the stream is closed and the next
+ *         segment, the oldest one, becomes the head.
+ */
+static SD_Error Flush (void)
+{
+        SD_Error errorstatus;
+        uint64_t address;
+
+        if (Buffered) {
+                if (!StreamOpen) {
+                        address = (uint64_t) (Base + Head * SegmentBlocks + NextBlock) * 512;
+
+                        if ((errorstatus = SD_StreamOpen (address, SegmentBlocks - NextBlock)) != SD_OK) {
+                                return (errorstatus);
+                        }
+
+                        StreamOpen = 1;
+                        Stats.Streams++;
+                }
+
+                errorstatus = SD_StreamWrite ((uint8_t *) Buffer, Buffered);
+
+                if (errorstatus == SD_OK) {
+                        errorstatus = SD_WaitWriteOperation ();
+                }
+
+                if (errorstatus != SD_OK) {
+                        EndStream ();
+                        return (errorstatus);
+                }
+
+                NextBlock += Buffered;
+                Stats.Blocks += Buffered;
+                Buffered = 0;
+        }
+
+        /*!< Also retried here if closing the full segment failed the last time */
+        if (NextBlock == SegmentBlocks) {
+                if ((errorstatus = EndStream ()) != SD_OK) {
+                        return (errorstatus);
+                }
+
+                Head = (Head + 1) % SegmentCount;
+                SegmentSeq[Head] = ++Seq;
+                NextBlock = 0;
+        }
+
+        return (SD_OK);
+}
+
+/**
+ * @brief  CMD12 and the end of programming.
+ */
+static SD_Error EndStream (void)
+{
+        SD_Error errorstatus;
+
+        if (!StreamOpen) {
+                return (SD_OK);
+        }
+
+        StreamOpen = 0;
+        errorstatus = SD_StreamClose ();
+
+        if (errorstatus == SD_OK) {
+                errorstatus = SD_WaitReady ();
+        }
+        else {
+                SD_WaitReady ();
+        }
+
+        return (errorstatus);
+}
+
+static uint8_t *BlockData (uint32_t index)
+{
+        return ((uint8_t *) Buffer + index * 512);
+}
+
+/**
+ * @brief  Fills the header of a block.
+ */
+static void Seal (uint8_t *block, uint32_t seq, uint32_t index, uint16_t used)
+{
+        SD_LogBlockHeader *header = (SD_LogBlockHeader *) block;
+
+        header->Magic = SD_LOG_MAGIC;
+        header->Seq = seq;
+        header->Block = index;
+        header->Used = used;
+        header->Crc = 0;
+        header->Crc = SD_Crc16 (block, SD_LOG_HEADER_SIZE + used);
+}
+
+/**
+ * @brief  Checks the magic, the CRC, and the position of a block read back.
+ * @param  seq: expected sequence number, 0 for any.
+ */
+static uint8_t IsValid (uint8_t *block, uint32_t seq, uint32_t index)
+{
+        SD_LogBlockHeader *header = (SD_LogBlockHeader *) block;
+        uint16_t crc;
+        uint8_t valid;
+
+        if ((header->Magic != SD_LOG_MAGIC) || (header->Used > SD_LOG_PAYLOAD_SIZE) || (header->Block != index) || (header->Seq == 0)) {
+                return (0);
+        }
+
+        if (seq && (header->Seq != seq)) {
+                return (0);
+        }
+
+        /*!< The CRC was computed with its own field cleared */
+        crc = header->Crc;
+        header->Crc = 0;
+        valid = (SD_Crc16 (block, SD_LOG_HEADER_SIZE + header->Used) == crc);
+        header->Crc = crc;
+        return (valid);
+}
+
+/**
+ * @brief  Reads one block of a segment, retrying per sd_recovery.
+ */
+static SD_Error ReadBlock (uint8_t *block, uint32_t segment, uint32_t index)
+{
+        return (SD_RecoveryRead (block, (uint64_t) (Base + segment * SegmentBlocks + index) * 512, 1));
+}
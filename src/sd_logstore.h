@@ -0,0 +1,105 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef SD_LOGSTORE_H_
+#define SD_LOGSTORE_H_
+
+#include <stm32f4xx.h>
+#include "sdio_high_level.h"
+
+/*
+ * Append only record store on the SDIO card. The area is split in segments of one
+ * allocation unit (AU_SIZE of the SD status), aligned on AU boundaries, used in a
+ * circle : when the last one is full the oldest one is reused.
+ *
+ * Records are packed into 512 byte blocks, each block starting with a header
+ * (segment sequence number, block index, CRC). Full blocks are buffered in RAM and
+ * pushed with the stream API, so a segment is written as one long CMD25 opened with
+ * ACMD23 = the rest of the segment. Nothing is ever written in place.
+ *
+ * On boot SD_LogInit reads the first block of each segment (the segment header) to
+ * rebuild the segment index, takes the segment with the highest sequence number as
+ * the head and finds its first missing block with a binary search. A block torn by
+ * a power cut fails its CRC and is written over.
+ *
+ * The store owns the card while a stream is open : other users must call
+ * SD_LogSync first.
+ */
+
+/**
+ * @brief  Segments managed at most.
+ */
+#ifndef SD_LOG_MAX_SEGMENTS
+#define SD_LOG_MAX_SEGMENTS           64
+#endif
+
+/**
+ * @brief  Blocks buffered before a stream write (4 KB).
+ */
+#ifndef SD_LOG_BUFFER_BLOCKS
+#define SD_LOG_BUFFER_BLOCKS          8
+#endif
+
+/**
+ * @brief  Segment size when the card does not report its AU (4 MB).
+ */
+#ifndef SD_LOG_DEFAULT_SEGMENT_BLOCKS
+#define SD_LOG_DEFAULT_SEGMENT_BLOCKS 8192
+#endif
+
+#define SD_LOG_MAGIC                  0x474F4C53 /*!< "SLOG" */
+#define SD_LOG_HEADER_SIZE            16
+#define SD_LOG_PAYLOAD_SIZE           (512 - SD_LOG_HEADER_SIZE)
+
+/**
+ * @brief  Longest record : one per block, after its 2 byte length.
+ */
+#define SD_LOG_MAX_RECORD             (SD_LOG_PAYLOAD_SIZE - 2)
+
+/**
+ * @brief  Block header. Crc covers the header (Crc being 0) and the Used bytes.
+ */
+typedef struct {
+        uint32_t Magic;
+        uint32_t Seq; /*!< Segment sequence number, 1 for the first segment written */
+        uint32_t Block; /*!< Index in the segment */
+        uint16_t Used; /*!< Payload bytes holding records */
+        uint16_t Crc;
+} SD_LogBlockHeader;
+
+/**
+ * @brief  Sequential reader position, see SD_LogReadOpen.
+ */
+typedef struct {
+        uint32_t Segment;
+        uint32_t Visited; /*!< Segments done */
+        uint32_t Block;
+        uint16_t Offset;
+        uint8_t Loaded;
+        uint32_t Data[128]; /*!< Current block */
+} SD_LogCursor;
+
+typedef struct {
+        uint32_t Segments;
+        uint32_t SegmentBlocks;
+        uint32_t Head; /*!< Segment being written */
+        uint32_t Seq; /*!< Its sequence number */
+        uint32_t NextBlock; /*!< Next block to be written in it */
+        uint32_t Records; /*!< Appended since SD_LogInit */
+        uint32_t Blocks; /*!< Written since SD_LogInit */
+        uint32_t Streams; /*!< CMD25 sessions opened */
+} SD_LogStats;
+
+SD_Error SD_LogInit (uint32_t BaseBlock, uint32_t Segments);
+SD_Error SD_LogAppend (const void *record, uint16_t length);
+SD_Error SD_LogSync (void);
+SD_Error SD_LogReadOpen (SD_LogCursor *cursor);
+SD_Error SD_LogReadNext (SD_LogCursor *cursor, void *record, uint16_t max, uint16_t *length);
+void SD_LogGetStats (SD_LogStats *stats);
+
+#endif /* SD_LOGSTORE_H_ */
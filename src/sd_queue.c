@@ -0,0 +1,339 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <stddef.h>
+#include <stm32f4xx.h>
+#include "sd_queue.h"
+#include "sd_time.h"
+
+/**
+ * @brief  Upper limit of a merged transfer (SDIO DPSM data length is 25 bits).
+ */
+#define SD_QUEUE_MAX_BLOCKS           ((uint32_t)0x01FFFFFF / SD_QUEUE_BLOCK_SIZE)
+
+/*
+ * Ring of requests. Submit (thread, or a callback in PendSV) only moves Tail, with
+ * the IRQs off, completion (PendSV, see SD_ProcessAsync) only moves Head. Requests
+ * [Head, Head + Merged) are the ones on the bus right now. Busy is taken with the
+ * IRQs off by whoever sends a command : a transfer or the CMD13 after a write.
+ */
+static SD_QueueRequest Queue[SD_QUEUE_DEPTH];
+static __IO uint32_t Head = 0, Tail = 0, Count = 0;
+static __IO uint32_t Merged = 0;
+static __IO uint32_t Busy = 0;
+static __IO uint32_t CardProgramming = 0;
+static __IO SD_Error LastError = SD_OK;
+
+static void QueueKick (void);
+static void QueueTransferDone (SD_Error status, void *context);
+static void QueueCardReady (SD_Error status, void *context);
+static void QueueCheckCard (void);
+static uint8_t QueueClaimCheck (void);
+
+/**
+ * @brief  Drops all the requests and resets the queue. Must not be called while a
+ *         transfer is in flight.
+ * @param  None
+ * @retval None
+ */
+void SD_QueueInit (void)
+{
+        Head = Tail = Count = 0;
+        Merged = 0;
+        Busy = 0;
+        CardProgramming = 0;
+        LastError = SD_OK;
+}
+
+/**
+ * @brief  Queues a read or a write and starts it if the bus is idle. Requests
+ *         adjacent both on the card and in memory are merged into one CMD18/CMD25.
+ * @param  dir: SD_QUEUE_READ or SD_QUEUE_WRITE.
+ * @param  buffer: data buffer, must stay valid until the callback is called.
+ * @param  address: card address in bytes.
+ * @param  NumberOfBlocks: number of 512 byte blocks.
+ * @param  callback: called on completion, from PendSV (see SD_ProcessAsync).
+ *         May be NULL. It may submit more requests.
+ * @param  context: passed to the callback.
+ * @retval SD_Error: SD_REQUEST_PENDING if the queue is full.
+ */
+SD_Error SD_QueueSubmit (SD_QueueDir dir, uint8_t *buffer, uint64_t address, uint32_t NumberOfBlocks, SD_TransferCallback callback, void *context)
+{
+        SD_QueueRequest *req;
+
+        if ((NumberOfBlocks == 0) || (NumberOfBlocks > SD_QUEUE_MAX_BLOCKS)) {
+                return (SD_INVALID_PARAMETER);
+        }
+
+        /*!< A completion callback (PendSV) may submit too : check, fill and queue at once */
+        __disable_irq ();
+
+        if (Count >= SD_QUEUE_DEPTH) {
+                __enable_irq ();
+                return (SD_REQUEST_PENDING);
+        }
+
+        req = &Queue[Tail];
+        req->buffer = buffer;
+        req->address = address;
+        req->NumberOfBlocks = NumberOfBlocks;
+        req->dir = dir;
+        req->callback = callback;
+        req->context = context;
+        Tail = (Tail + 1) % SD_QUEUE_DEPTH;
+        Count++;
+        __enable_irq ();
+
+        QueueKick ();
+        return (SD_OK);
+}
+
+/**
+ * @brief  Restarts the queue if it got stuck. After a write the next transfer is
+ *         chained from the end of busy (D0) notification, this is only a fallback
+ *         for a missed edge. Call this from the main loop.
+ * @param  None
+ * @retval None
+ */
+void SD_QueueProcess (void)
+{
+        if (QueueClaimCheck ()) {
+                if (!SD_IsBusy ()) {
+                        QueueCheckCard ();
+                }
+
+                Busy = 0;
+        }
+
+        QueueKick ();
+}
+
+/**
+ * @brief  Waits until every queued request is done and the card is idle.
+ * @param  None
+ * @retval SD_Error: first error reported since the previous SD_QueueSync.
+ */
+SD_Error SD_QueueSync (void)
+{
+        SD_Error errorstatus;
+
+        while (Count || Busy || CardProgramming) {
+                SD_QueueProcess ();
+
+                /*!< The IRQs clear Busy and CardProgramming, sleep until they come */
+                __disable_irq ();
+
+                if (Busy || (CardProgramming && SD_IsBusy ())) {
+                        SD_AsyncSleep ();
+                }
+
+                __enable_irq ();
+        }
+
+        errorstatus = LastError;
+        LastError = SD_OK;
+        return (errorstatus);
+}
+
+/**
+ * @brief  Number of requests queued or in flight.
+ * @param  None
+ * @retval Request count.
+ */
+uint32_t SD_QueuePending (void)
+{
+        return (Count);
+}
+
+/**
+ * @brief  Starts the next (merged) transfer if the bus is free. Called both from
+ *         the thread (submit) and from PendSV (completion, end of busy).
+ * @param  None
+ * @retval None
+ */
+static void QueueKick (void)
+{
+        SD_QueueRequest *first, *prev, *next;
+        uint32_t blocks, n, i, index;
+        SD_Error errorstatus;
+
+        while (1) {
+                __disable_irq ();
+
+                if (Busy || CardProgramming || (Count == 0)) {
+                        __enable_irq ();
+                        return;
+                }
+
+                Busy = 1;
+                __enable_irq ();
+
+                first = prev = &Queue[Head];
+                blocks = first->NumberOfBlocks;
+                n = 1;
+
+                /*!< Merge requests which continue the previous one on the card and in RAM */
+                while (n < Count) {
+                        next = &Queue[(Head + n) % SD_QUEUE_DEPTH];
+
+                        if ((next->dir != first->dir) || (next->address != prev->address + (uint64_t) prev->NumberOfBlocks * SD_QUEUE_BLOCK_SIZE)
+                                        || (next->buffer != prev->buffer + prev->NumberOfBlocks * SD_QUEUE_BLOCK_SIZE)
+                                        || (blocks + next->NumberOfBlocks > SD_QUEUE_MAX_BLOCKS)) {
+                                break;
+                        }
+
+                        blocks += next->NumberOfBlocks;
+                        prev = next;
+                        n++;
+                }
+
+                Merged = n;
+
+                if (first->dir == SD_QUEUE_READ) {
+                        errorstatus = SD_ReadMultiBlocksAsync (first->buffer, first->address, SD_QUEUE_BLOCK_SIZE, blocks, QueueTransferDone, NULL);
+                }
+                else {
+                        errorstatus = SD_WriteMultiBlocksAsync (first->buffer, first->address, SD_QUEUE_BLOCK_SIZE, blocks, QueueTransferDone, NULL);
+                }
+
+                if (errorstatus == SD_OK) {
+                        return;
+                }
+
+                /*!< Command phase failed, no IRQ will come. Fail the batch and go on. */
+                for (i = 0; i < n; i++) {
+                        index = (Head + i) % SD_QUEUE_DEPTH;
+
+                        if (Queue[index].callback) {
+                                Queue[index].callback (errorstatus, Queue[index].context);
+                        }
+                }
+
+                __disable_irq ();
+                Head = (Head + n) % SD_QUEUE_DEPTH;
+                Count -= n;
+                Merged = 0;
+                Busy = 0;
+                __enable_irq ();
+
+                if (LastError == SD_OK) {
+                        LastError = errorstatus;
+                }
+        }
+}
+
+/**
+ * @brief  Async completion of a merged transfer. Completes every request in the
+ *         batch and chains the next one right away, or after a write once the card
+ *         releases D0.
+ * @param  status: result of the transfer.
+ * @param  context: unused.
+ * @retval None
+ */
+static void QueueTransferDone (SD_Error status, void *context)
+{
+        SD_TransferCallback callback;
+        void *ctx;
+        uint32_t i, n = Merged;
+        uint8_t write = (Queue[Head].dir == SD_QUEUE_WRITE);
+
+        if (write) {
+                CardProgramming = 1;
+        }
+
+        if ((status != SD_OK) && (LastError == SD_OK)) {
+                LastError = status;
+        }
+
+        for (i = 0; i < n; i++) {
+                callback = Queue[Head].callback;
+                ctx = Queue[Head].context;
+                Head = (Head + 1) % SD_QUEUE_DEPTH;
+                Count--;
+
+                if (callback) {
+                        callback (status, ctx);
+                }
+        }
+
+        Merged = 0;
+        Busy = 0;
+
+        if (write) {
+                SD_NotifyWhenReady (QueueCardReady, NULL);
+        }
+        else {
+                QueueKick ();
+        }
+}
+
+/**
+ * @brief  End of busy after a write (D0 released), the card takes commands again.
+ * @param  status: unused.
+ * @param  context: unused.
+ * @retval None
+ */
+static void QueueCardReady (SD_Error status, void *context)
+{
+        /*!< The thread may be checking already (SD_QueueProcess), it finishes the job */
+        if (QueueClaimCheck ()) {
+                QueueCheckCard ();
+                Busy = 0;
+        }
+
+        QueueKick ();
+}
+
+/**
+ * @brief  Takes the bus for the CMD13 after a write, like QueueKick does for a
+ *         transfer : the thread (SD_QueueProcess) and PendSV (QueueCardReady) both
+ *         check the card, only one may build a command at a time.
+ * @param  None
+ * @retval 1 if the card has to be checked and the caller owns Busy now, 0 otherwise.
+ */
+static uint8_t QueueClaimCheck (void)
+{
+        uint8_t claimed;
+
+        __disable_irq ();
+        claimed = (CardProgramming && !Busy);
+
+        if (claimed) {
+                Busy = 1;
+        }
+
+        __enable_irq ();
+        return (claimed);
+}
+
+/**
+ * @brief  One CMD13 per write, once D0 is high : D0 only tells that the card
+ *         stopped programming, the status tells whether the data made it (the
+ *         errors the card found while programming are reported there). If the card
+ *         is not back in tran yet CardProgramming stays set and SD_QueueProcess
+ *         asks again.
+ * @param  None
+ * @retval None
+ */
+static void QueueCheckCard (void)
+{
+        SD_Error errorstatus;
+        uint32_t cardstatus = 0;
+
+        errorstatus = SD_SendStatus (&cardstatus);
+
+        if ((errorstatus == SD_OK) && ((SDCardState) ((cardstatus >> 9) & 0x0F) != SD_CARD_TRANSFER)) {
+                return;
+        }
+
+        if ((errorstatus != SD_OK) && (LastError == SD_OK)) {
+                LastError = errorstatus;
+        }
+
+        CardProgramming = 0;
+}
@@ -0,0 +1,47 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef SD_QUEUE_H_
+#define SD_QUEUE_H_
+
+#include <stm32f4xx.h>
+#include "sdio_high_level.h"
+
+/**
+ * @brief  Maximum number of outstanding requests.
+ */
+#ifndef SD_QUEUE_DEPTH
+#define SD_QUEUE_DEPTH                8
+#endif
+
+#define SD_QUEUE_BLOCK_SIZE           512
+
+typedef enum {
+        SD_QUEUE_READ = 0, SD_QUEUE_WRITE = 1
+} SD_QueueDir;
+
+/**
+ * @brief  One queued read or write. Addresses are in bytes, like in the rest of the
+ *         driver API.
+ */
+typedef struct {
+        uint8_t *buffer;
+        uint64_t address;
+        uint32_t NumberOfBlocks;
+        SD_QueueDir dir;
+        SD_TransferCallback callback;
+        void *context;
+} SD_QueueRequest;
+
+void SD_QueueInit (void);
+SD_Error SD_QueueSubmit (SD_QueueDir dir, uint8_t *buffer, uint64_t address, uint32_t NumberOfBlocks, SD_TransferCallback callback, void *context);
+void SD_QueueProcess (void);
+SD_Error SD_QueueSync (void);
+uint32_t SD_QueuePending (void);
+
+#endif /* SD_QUEUE_H_ */
@@ -0,0 +1,521 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <string.h>
+#include "sd_raid.h"
+#include "sd_time.h"
+
+static SD_Error RaidInit (SD_BlockDev *dev);
+static SD_Error RaidGetInfo (SD_BlockDev *dev, SD_BlockDevInfo *info);
+static SD_Error RaidReadAsync (SD_BlockDev *dev, uint8_t *buffer, uint32_t block, uint32_t count, SD_TransferCallback callback, void *context);
+static SD_Error RaidWriteAsync (SD_BlockDev *dev, const uint8_t *buffer, uint32_t block, uint32_t count, SD_TransferCallback callback, void *context);
+static SD_Error RaidWaitReady (SD_BlockDev *dev);
+static SD_Error RaidErase (SD_BlockDev *dev, uint32_t block, uint32_t count);
+
+static SD_Error StripeTransfer (SD_Raid *raid, uint8_t *buffer, uint32_t block, uint32_t count, uint8_t write);
+static SD_Error MirrorRead (SD_Raid *raid, uint8_t *buffer, uint32_t block, uint32_t count);
+static SD_Error MirrorWrite (SD_Raid *raid, const uint8_t *buffer, uint32_t block, uint32_t count);
+static uint32_t Map (uint32_t block, uint32_t *member, uint32_t *MemberBlock);
+static SD_Error Issue (SD_RaidMember *member, uint8_t *buffer, uint32_t block, uint32_t count, uint8_t write);
+static void MemberDone (SD_Error status, void *context);
+static void WaitMembers (SD_Raid *raid);
+static void Account (SD_Raid *raid, SD_RaidMember *member, uint8_t stale);
+
+static const SD_BlockDevOps RaidOps = {
+        RaidInit,
+        RaidGetInfo,
+        RaidReadAsync,
+        RaidWriteAsync,
+        RaidWaitReady,
+        RaidErase
+};
+
+/**
+ * @brief  Makes dev the RAID device of two members. No I/O, SD_DevInit (dev)
+ *         initializes the members.
+ * @param  raid: RAID state, must live as long as dev.
+ * @param  dev: device to set up.
+ * @param  level: SD_RAID_0 or SD_RAID_1.
+ * @param  member0: first member.
+ * @param  member1: second member.
+ * @retval None
+ */
+void SD_RaidCreate (SD_Raid *raid, SD_BlockDev *dev, SD_RaidLevel level, SD_BlockDev *member0, SD_BlockDev *member1)
+{
+        memset (raid, 0, sizeof (*raid));
+        raid->Level = level;
+        raid->Member[0].Dev = member0;
+        raid->Member[1].Dev = member1;
+
+        dev->Ops = &RaidOps;
+        dev->Context = raid;
+        dev->Name = (level == SD_RAID_0) ? "raid0" : "raid1";
+}
+
+/**
+ * @brief  Copies the statistics of the members.
+ * @param  raid: RAID state.
+ * @param  stats: SD_RAID_MEMBERS entries.
+ * @retval None
+ */
+void SD_RaidGetStats (SD_Raid *raid, SD_RaidMemberStats *stats)
+{
+        SD_RaidMember *member;
+        uint32_t i;
+
+        for (i = 0; i < SD_RAID_MEMBERS; i++) {
+                member = &raid->Member[i];
+                stats[i].Ops = member->Ops;
+                stats[i].Errors = member->Errors;
+                stats[i].AvgUs = (member->Ops) ? (uint32_t) (member->TotalCycles / member->Ops / (SD_TIME_HZ / 1000000)) : 0;
+                stats[i].MaxUs = member->MaxCycles / (SD_TIME_HZ / 1000000);
+                stats[i].Failed = member->Failed;
+        }
+}
+
+/**
+ * @brief  Tells if a mirror member was dropped.
+ * @param  raid: RAID state.
+ * @retval 1 if degraded, 0 otherwise.
+ */
+uint8_t SD_RaidIsDegraded (SD_Raid *raid)
+{
+        return (raid->Member[0].Failed || raid->Member[1].Failed);
+}
+
+/**
+ * @brief  Initializes the members. A mirror starts degraded if one of them fails.
+ */
+static SD_Error RaidInit (SD_BlockDev *dev)
+{
+        SD_Raid *raid = (SD_Raid *) dev->Context;
+        SD_Error errorstatus = SD_OK;
+        SD_Error status;
+        uint32_t i, ok = 0;
+
+        for (i = 0; i < SD_RAID_MEMBERS; i++) {
+                status = SD_DevInit (raid->Member[i].Dev);
+                raid->Member[i].Failed = (status != SD_OK);
+                raid->Member[i].ErrorRun = 0;
+
+                if (status == SD_OK) {
+                        ok++;
+                }
+                else {
+                        errorstatus = status;
+                }
+        }
+
+        if ((raid->Level == SD_RAID_1) && ok) {
+                return (SD_OK);
+        }
+
+        return (errorstatus);
+}
+
+/**
+ * @brief  Capacity : twice the smaller member (whole stripes) for RAID 0, the smaller
+ *         member for RAID 1.
+ */
+static SD_Error RaidGetInfo (SD_BlockDev *dev, SD_BlockDevInfo *info)
+{
+        SD_Raid *raid = (SD_Raid *) dev->Context;
+        SD_BlockDevInfo member;
+        SD_Error errorstatus;
+        uint32_t i, blocks = 0xFFFFFFFF, au = 1;
+
+        for (i = 0; i < SD_RAID_MEMBERS; i++) {
+                if (raid->Member[i].Failed) {
+                        continue;
+                }
+
+                if ((errorstatus = SD_DevGetInfo (raid->Member[i].Dev, &member)) != SD_OK) {
+                        return (errorstatus);
+                }
+
+                if (member.Blocks < blocks) {
+                        blocks = member.Blocks;
+                }
+
+                if (member.AuBlocks > au) {
+                        au = member.AuBlocks;
+                }
+        }
+
+        if (blocks == 0xFFFFFFFF) {
+                return (SD_ERROR);
+        }
+
+        if (raid->Level == SD_RAID_0) {
+                blocks = blocks / SD_RAID_STRIPE_BLOCKS * SD_RAID_STRIPE_BLOCKS * SD_RAID_MEMBERS;
+
+                /*!< An AU made of whole stripes spans both members */
+                if ((au % SD_RAID_STRIPE_BLOCKS) == 0) {
+                        au *= SD_RAID_MEMBERS;
+                }
+        }
+
+        info->Blocks = blocks;
+        info->AuBlocks = au;
+        return (SD_OK);
+}
+
+static SD_Error RaidReadAsync (SD_BlockDev *dev, uint8_t *buffer, uint32_t block, uint32_t count, SD_TransferCallback callback, void *context)
+{
+        SD_Raid *raid = (SD_Raid *) dev->Context;
+        SD_Error errorstatus;
+
+        if (raid->Level == SD_RAID_0) {
+                errorstatus = StripeTransfer (raid, buffer, block, count, 0);
+        }
+        else {
+                errorstatus = MirrorRead (raid, buffer, block, count);
+        }
+
+        if (callback) {
+                callback (errorstatus, context);
+        }
+
+        return (SD_OK);
+}
+
+static SD_Error RaidWriteAsync (SD_BlockDev *dev, const uint8_t *buffer, uint32_t block, uint32_t count, SD_TransferCallback callback, void *context)
+{
+        SD_Raid *raid = (SD_Raid *) dev->Context;
+        SD_Error errorstatus;
+
+        if (raid->Level == SD_RAID_0) {
+                errorstatus = StripeTransfer (raid, (uint8_t *) buffer, block, count, 1);
+        }
+        else {
+                errorstatus = MirrorWrite (raid, buffer, block, count);
+        }
+
+        if (callback) {
+                callback (errorstatus, context);
+        }
+
+        return (SD_OK);
+}
+
+/**
+ * @brief  Waits for both members to finish programming.
+ */
+static SD_Error RaidWaitReady (SD_BlockDev *dev)
+{
+        SD_Raid *raid = (SD_Raid *) dev->Context;
+        SD_Error errorstatus = SD_OK;
+        SD_Error status;
+        uint32_t i;
+
+        for (i = 0; i < SD_RAID_MEMBERS; i++) {
+                if (!raid->Member[i].Failed && ((status = SD_DevWaitReady (raid->Member[i].Dev)) != SD_OK)) {
+                        errorstatus = status;
+                }
+        }
+
+        return (errorstatus);
+}
+
+/**
+ * @brief  Erases the member blocks behind [block, block + count), stripe by stripe
+ *         for RAID 0.
+ */
+static SD_Error RaidErase (SD_BlockDev *dev, uint32_t block, uint32_t count)
+{
+        SD_Raid *raid = (SD_Raid *) dev->Context;
+        SD_Error errorstatus = SD_OK;
+        uint32_t i, n, member, MemberBlock;
+
+        if (raid->Level == SD_RAID_1) {
+                for (i = 0; i < SD_RAID_MEMBERS; i++) {
+                        if (!raid->Member[i].Failed && (SD_DevErase (raid->Member[i].Dev, block, count) != SD_OK)) {
+                                errorstatus = SD_ERROR;
+                        }
+                }
+
+                return (errorstatus);
+        }
+
+        while (count) {
+                n = Map (block, &member, &MemberBlock);
+                n = (n < count) ? n : count;
+
+                if ((errorstatus = SD_DevErase (raid->Member[member].Dev, MemberBlock, n)) != SD_OK) {
+                        return (errorstatus);
+                }
+
+                block += n;
+                count -= n;
+        }
+
+        return (SD_OK);
+}
+
+/**
+ * @brief  RAID 0 transfer. Two consecutive pieces of a request are always on
+ *         different members, so a step is the next two pieces, in parallel.
+ */
+static SD_Error StripeTransfer (SD_Raid *raid, uint8_t *buffer, uint32_t block, uint32_t count, uint8_t write)
+{
+        SD_Error errorstatus = SD_OK;
+        uint32_t n, member, MemberBlock, piece, i;
+
+        while (count) {
+                for (piece = 0; (piece < SD_RAID_MEMBERS) && count; piece++) {
+                        n = Map (block, &member, &MemberBlock);
+                        n = (n < count) ? n : count;
+
+                        if (Issue (&raid->Member[member], buffer, MemberBlock, n, write) != SD_OK) {
+                                errorstatus = SD_ERROR;
+                                break;
+                        }
+
+                        buffer += n * SD_BLOCKDEV_BLOCK_SIZE;
+                        block += n;
+                        count -= n;
+                }
+
+                WaitMembers (raid);
+
+                for (i = 0; i < SD_RAID_MEMBERS; i++) {
+                        if (raid->Member[i].Status != SD_OK) {
+                                errorstatus = raid->Member[i].Status;
+                        }
+
+                        Account (raid, &raid->Member[i], 0);
+                }
+
+                if (errorstatus != SD_OK) {
+                        return (errorstatus);
+                }
+        }
+
+        return (SD_OK);
+}
+
+/**
+ * @brief  RAID 1 read : the first half from member 0, the second one from member 1
+ *         at the same time. A half which fails is read again from the other member.
+ */
+static SD_Error MirrorRead (SD_Raid *raid, uint8_t *buffer, uint32_t block, uint32_t count)
+{
+        SD_RaidMember *member[SD_RAID_MEMBERS];
+        uint8_t *piece[SD_RAID_MEMBERS];
+        uint32_t start[SD_RAID_MEMBERS], length[SD_RAID_MEMBERS];
+        SD_Error status[SD_RAID_MEMBERS];
+        SD_RaidMember *other;
+        uint32_t i, n = 0;
+
+        if (count == 0) {
+                return (SD_OK);
+        }
+
+        for (i = 0; i < SD_RAID_MEMBERS; i++) {
+                if (!raid->Member[i].Failed) {
+                        member[n++] = &raid->Member[i];
+                }
+        }
+
+        if (n == 0) {
+                return (SD_ERROR);
+        }
+
+        if (count < 2) {
+                n = 1;
+        }
+
+        /*!< n pieces, one per healthy member */
+        piece[0] = buffer;
+        start[0] = block;
+        length[0] = count / n;
+        piece[1] = buffer + length[0] * SD_BLOCKDEV_BLOCK_SIZE;
+        start[1] = block + length[0];
+        length[1] = count - length[0];
+
+        for (i = 0; i < n; i++) {
+                Issue (member[i], piece[i], start[i], length[i], 0);
+        }
+
+        WaitMembers (raid);
+
+        for (i = 0; i < n; i++) {
+                status[i] = member[i]->Status;
+                Account (raid, member[i], 0);
+        }
+
+        for (i = 0; i < n; i++) {
+                if (status[i] == SD_OK) {
+                        continue;
+                }
+
+                if ((n < 2) || (status[1 - i] != SD_OK)) {
+                        return (status[i]);
+                }
+
+                other = member[1 - i];
+                Issue (other, piece[i], start[i], length[i], 0);
+                WaitMembers (raid);
+                status[i] = other->Status;
+                Account (raid, other, 0);
+
+                if (status[i] != SD_OK) {
+                        return (status[i]);
+                }
+        }
+
+        return (SD_OK);
+}
+
+/**
+ * @brief  RAID 1 write : both members at the same time. A member whose copy failed
+ *         is dropped, the write succeeds if one copy was made. If none was, both
+ *         members are kept and the error is returned.
+ */
+static SD_Error MirrorWrite (SD_Raid *raid, const uint8_t *buffer, uint32_t block, uint32_t count)
+{
+        SD_Error errorstatus = SD_ERROR;
+        uint32_t i, copies = 0;
+
+        if (count == 0) {
+                return (SD_OK);
+        }
+
+        for (i = 0; i < SD_RAID_MEMBERS; i++) {
+                if (!raid->Member[i].Failed) {
+                        Issue (&raid->Member[i], (uint8_t *) buffer, block, count, 1);
+                }
+        }
+
+        WaitMembers (raid);
+
+        for (i = 0; i < SD_RAID_MEMBERS; i++) {
+                if (raid->Member[i].Failed) {
+                        continue;
+                }
+
+                if (raid->Member[i].Status == SD_OK) {
+                        copies++;
+                }
+                else if (errorstatus == SD_ERROR) {
+                        errorstatus = raid->Member[i].Status;
+                }
+        }
+
+        for (i = 0; i < SD_RAID_MEMBERS; i++) {
+                if (!raid->Member[i].Failed) {
+                        Account (raid, &raid->Member[i], copies > 0);
+                }
+        }
+
+        return ((copies) ? SD_OK : errorstatus);
+}
+
+/**
+ * @brief  RAID 0 address translation.
+ * @param  block: RAID block.
+ * @param  member: member holding it.
+ * @param  MemberBlock: its address on that member.
+ * @retval Blocks left in that stripe.
+ */
+static uint32_t Map (uint32_t block, uint32_t *member, uint32_t *MemberBlock)
+{
+        uint32_t stripe = block / SD_RAID_STRIPE_BLOCKS;
+        uint32_t offset = block % SD_RAID_STRIPE_BLOCKS;
+
+        *member = stripe % SD_RAID_MEMBERS;
+        *MemberBlock = (stripe / SD_RAID_MEMBERS) * SD_RAID_STRIPE_BLOCKS + offset;
+        return (SD_RAID_STRIPE_BLOCKS - offset);
+}
+
+/**
+ * @brief  Starts a transfer on one member. Status is set when it is over (or did
+ *         not start), Busy is cleared by the completion interrupt.
+ */
+static SD_Error Issue (SD_RaidMember *member, uint8_t *buffer, uint32_t block, uint32_t count, uint8_t write)
+{
+        SD_Error errorstatus;
+
+        member->Status = SD_OK;
+        member->Busy = 1;
+        member->Start = SD_TIME_NOW ();
+
+        if (write) {
+                errorstatus = SD_DevWriteAsync (member->Dev, buffer, block, count, MemberDone, member);
+        }
+        else {
+                errorstatus = SD_DevReadAsync (member->Dev, buffer, block, count, MemberDone, member);
+        }
+
+        if (errorstatus != SD_OK) {
+                member->Status = errorstatus;
+                member->Busy = 0;
+        }
+
+        member->Ops++;
+        return (errorstatus);
+}
+
+/**
+ * @brief  Completion of a member transfer, in interrupt context.
+ */
+static void MemberDone (SD_Error status, void *context)
+{
+        SD_RaidMember *member = (SD_RaidMember *) context;
+        uint32_t cycles = SD_TIME_NOW () - member->Start;
+
+        member->TotalCycles += cycles;
+
+        if (cycles > member->MaxCycles) {
+                member->MaxCycles = cycles;
+        }
+
+        member->Status = status;
+        member->Busy = 0;
+}
+
+/**
+ * @brief  Sleeps until no member transfer is running.
+ */
+static void WaitMembers (SD_Raid *raid)
+{
+        __disable_irq ();
+
+        while (raid->Member[0].Busy || raid->Member[1].Busy) {
+                SD_AsyncSleep ();
+                __enable_irq ();
+                __disable_irq ();
+        }
+
+        __enable_irq ();
+}
+
+/**
+ * @brief  Error accounting after a step, drops a failing mirror member. Clears
+ *         Status for the next step.
+ * @param  stale: the step was a write the other member completed, the copy on
+ *         this one is out of date if it failed.
+ */
+static void Account (SD_Raid *raid, SD_RaidMember *member, uint8_t stale)
+{
+        SD_RaidMember *other = &raid->Member[(member == &raid->Member[0]) ? 1 : 0];
+
+        if (member->Status == SD_OK) {
+                member->ErrorRun = 0;
+                return;
+        }
+
+        member->Errors++;
+        member->ErrorRun++;
+        member->Status = SD_OK;
+
+        /*!< The last healthy member is never dropped, its errors are returned */
+        if ((raid->Level == SD_RAID_1) && !other->Failed && (stale || (member->ErrorRun >= SD_RAID_MAX_ERRORS))) {
+                member->Failed = 1;
+        }
+}
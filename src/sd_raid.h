@@ -0,0 +1,89 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef SD_RAID_H_
+#define SD_RAID_H_
+
+#include <stm32f4xx.h>
+#include "sd_blockdev.h"
+
+/*
+ * Two block devices (e.g. SD_SdioDev and an SPI card) as one, itself a SD_BlockDev :
+ *
+ * - SD_RAID_0 stripes : SD_RAID_STRIPE_BLOCKS go to member 0, the next ones to member
+ *   1 and so on. Both members transfer at the same time.
+ * - SD_RAID_1 mirrors : writes go to both members at the same time, reads are split
+ *   in two halves, one per member.
+ *
+ * Requests are cut in steps of at most one transfer per member ; a step starts the
+ * transfers on both members and sleeps until both are over. The ReadAsync /
+ * WriteAsync operations of the RAID device therefore complete before they return
+ * (the callback is called from the caller's context).
+ *
+ * A mirror member which fails a write, or SD_RAID_MAX_ERRORS reads in a row, is
+ * dropped and the mirror goes on with the other one (degraded). The last member
+ * is never dropped : its errors are returned to the caller. A stripe cannot
+ * lose a member : the requests touching it fail, the others still work.
+ */
+
+/**
+ * @brief  Stripe size in blocks (32 KB).
+ */
+#ifndef SD_RAID_STRIPE_BLOCKS
+#define SD_RAID_STRIPE_BLOCKS         64
+#endif
+
+/**
+ * @brief  Consecutive read errors after which a mirror member is dropped.
+ */
+#ifndef SD_RAID_MAX_ERRORS
+#define SD_RAID_MAX_ERRORS            3
+#endif
+
+#define SD_RAID_MEMBERS               2
+
+typedef enum {
+        SD_RAID_0 = 0, /*!< Striping */
+        SD_RAID_1 = 1 /*!< Mirroring */
+} SD_RaidLevel;
+
+/**
+ * @brief  Per member statistics. Latencies are from the start of a transfer to its
+ *         completion interrupt, in microseconds.
+ */
+typedef struct {
+        uint32_t Ops;
+        uint32_t Errors;
+        uint32_t AvgUs;
+        uint32_t MaxUs;
+        uint8_t Failed; /*!< Dropped from the mirror */
+} SD_RaidMemberStats;
+
+typedef struct {
+        SD_BlockDev *Dev;
+        uint8_t Failed;
+        uint8_t ErrorRun; /*!< Consecutive errors */
+        __IO uint8_t Busy;
+        __IO SD_Error Status;
+        uint32_t Start;
+        uint32_t Ops;
+        uint32_t Errors;
+        uint64_t TotalCycles;
+        uint32_t MaxCycles;
+} SD_RaidMember;
+
+typedef struct {
+        SD_RaidLevel Level;
+        SD_RaidMember Member[SD_RAID_MEMBERS];
+} SD_Raid;
+
+void SD_RaidCreate (SD_Raid *raid, SD_BlockDev *dev, SD_RaidLevel level, SD_BlockDev *member0, SD_BlockDev *member1);
+void SD_RaidGetStats (SD_Raid *raid, SD_RaidMemberStats *stats);
+uint8_t SD_RaidIsDegraded (SD_Raid *raid);
+
+#endif /* SD_RAID_H_ */
@@ -0,0 +1,245 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <stddef.h>
+#include <string.h>
+#include <stm32f4xx.h>
+#include "sd_readahead.h"
+#include "sd_recovery.h"
+#include "sd_time.h"
+
+/*
+ * Prefetch buffer and the blocks it holds, [PrefetchStart, PrefetchStart +
+ * PrefetchBlocks). UsedEnd is the high-water mark of the reads served from it
+ * (overlapping reads are not counted twice). InFlight and PrefetchStatus are set
+ * by the completion IRQ.
+ */
+static uint8_t Buffer[SD_READAHEAD_MAX_BLOCKS][SD_READAHEAD_BLOCK_SIZE] __attribute__ ((aligned (4)));
+static uint8_t Valid = 0;
+static __IO uint8_t InFlight = 0;
+static __IO SD_Error PrefetchStatus = SD_OK;
+static uint32_t PrefetchStart = 0;
+static uint32_t PrefetchBlocks = 0;
+static uint32_t UsedEnd = 0;
+
+static uint32_t NextBlock = 0xFFFFFFFF;
+static uint32_t Window = SD_READAHEAD_MIN_BLOCKS;
+static uint32_t CardBlocks = 0;
+static SD_ReadAheadStats Stats;
+
+static void PrefetchDone (SD_Error status, void *context);
+static void WaitPrefetch (void);
+static void Drop (void);
+static void Prefetch (uint32_t block, uint32_t blocks);
+
+/**
+ * @brief  Resets the prefetcher and its counters. Call after SD_Init.
+ * @param  None
+ * @retval None
+ */
+void SD_ReadAheadInit (void)
+{
+        SD_CardInfo info;
+
+        WaitPrefetch ();
+        Valid = 0;
+        NextBlock = 0xFFFFFFFF;
+        Window = SD_READAHEAD_MIN_BLOCKS;
+        Stats = (SD_ReadAheadStats) { 0 };
+
+        SD_GetCardInfo (&info);
+        CardBlocks = (uint32_t) (info.CardCapacity / SD_READAHEAD_BLOCK_SIZE);
+}
+
+/**
+ * @brief  Blocking read with read-ahead. Once two reads in a row are sequential,
+ *         the blocks following the read are fetched with an async CMD18 while the
+ *         caller works on the data. The window doubles each time a prefetch is
+ *         read to the end and halves when one is dropped unread.
+ * @note   The card can not take other commands while a prefetch is in flight,
+ *         call SD_ReadAheadInvalidate before any other access (writes included).
+ * @param  readbuff: pointer to the buffer that will contain the received data.
+ *         Word aligned.
+ * @param  ReadAddr: Address from where data are to be read, in bytes, block aligned.
+ * @param  NumberOfBlocks: number of 512 byte blocks to read.
+ * @retval SD_Error: SD Card Error code.
+ */
+SD_Error SD_ReadAheadRead (uint8_t *readbuff, uint64_t ReadAddr, uint32_t NumberOfBlocks)
+{
+        SD_Error errorstatus = SD_OK;
+        uint32_t block = (uint32_t) (ReadAddr / SD_READAHEAD_BLOCK_SIZE);
+        uint32_t offset, count = 0;
+        uint8_t sequential = (block == NextBlock);
+
+        Stats.Reads++;
+
+        if (Valid && (block >= PrefetchStart) && (block < PrefetchStart + PrefetchBlocks)) {
+                WaitPrefetch ();
+
+                if (PrefetchStatus == SD_OK) {
+                        offset = block - PrefetchStart;
+                        count = PrefetchBlocks - offset;
+
+                        if (count > NumberOfBlocks) {
+                                count = NumberOfBlocks;
+                        }
+
+                        memcpy (readbuff, Buffer[offset], count * SD_READAHEAD_BLOCK_SIZE);
+                        Stats.HitBlocks += count;
+
+                        if (offset + count > UsedEnd) {
+                                UsedEnd = offset + count;
+                        }
+
+                        /*!< Read to the end : the window was not too big */
+                        if (offset + count == PrefetchBlocks) {
+                                if (Window < SD_READAHEAD_MAX_BLOCKS) {
+                                        Window *= 2;
+                                }
+
+                                Drop ();
+                        }
+                }
+                else {
+                        Valid = 0;
+                        Window = SD_READAHEAD_MIN_BLOCKS;
+                }
+        }
+        else if (Valid) {
+                /*!< Wrong guess */
+                Drop ();
+                Window = (Window / 2 < SD_READAHEAD_MIN_BLOCKS) ? SD_READAHEAD_MIN_BLOCKS : Window / 2;
+        }
+
+        if (count < NumberOfBlocks) {
+                errorstatus = SD_RecoveryRead (readbuff + count * SD_READAHEAD_BLOCK_SIZE, (uint64_t) (block + count) * SD_READAHEAD_BLOCK_SIZE, NumberOfBlocks - count);
+                Stats.MissBlocks += NumberOfBlocks - count;
+
+                if (errorstatus != SD_OK) {
+                        NextBlock = 0xFFFFFFFF;
+                        return (errorstatus);
+                }
+        }
+
+        NextBlock = block + NumberOfBlocks;
+
+        /*!< Start the next one, at least as big as this read */
+        if ((sequential || count) && !Valid) {
+                Prefetch (NextBlock, (NumberOfBlocks > Window) ? NumberOfBlocks : Window);
+        }
+
+        return (errorstatus);
+}
+
+/**
+ * @brief  Waits for the prefetch in flight and drops it, so that the card is free
+ *         and no stale data is served after a write.
+ * @param  None
+ * @retval None
+ */
+void SD_ReadAheadInvalidate (void)
+{
+        Drop ();
+        NextBlock = 0xFFFFFFFF;
+}
+
+/**
+ * @brief  Copies the counters.
+ * @param  stats: destination.
+ * @retval None
+ */
+void SD_ReadAheadGetStats (SD_ReadAheadStats *stats)
+{
+        *stats = Stats;
+        stats->Window = Window;
+}
+
+/**
+ * @brief  Share of the blocks served from the prefetch buffer.
+ * @param  None
+ * @retval Hit rate in percent.
+ */
+uint32_t SD_ReadAheadHitRate (void)
+{
+        uint32_t total = Stats.HitBlocks + Stats.MissBlocks;
+
+        return ((total) ? (uint32_t) ((uint64_t) Stats.HitBlocks * 100 / total) : 0);
+}
+
+/**
+ * @brief  Completion of the prefetch, in interrupt context.
+ */
+static void PrefetchDone (SD_Error status, void *context)
+{
+        PrefetchStatus = status;
+        InFlight = 0;
+}
+
+/**
+ * @brief  Sleeps until the prefetch in flight (if any) is over.
+ */
+static void WaitPrefetch (void)
+{
+        __disable_irq ();
+
+        while (InFlight) {
+                SD_AsyncSleep ();
+                __enable_irq ();
+                __disable_irq ();
+        }
+
+        __enable_irq ();
+}
+
+/**
+ * @brief  Drops the prefetch buffer, counting what was not read as wasted.
+ */
+static void Drop (void)
+{
+        WaitPrefetch ();
+
+        if (Valid && (PrefetchStatus == SD_OK)) {
+                Stats.WastedBytes += (PrefetchBlocks - UsedEnd) * SD_READAHEAD_BLOCK_SIZE;
+        }
+
+        Valid = 0;
+}
+
+/**
+ * @brief  Starts an async read of the blocks following the reader, clipped to the
+ *         buffer and to the end of the card.
+ */
+static void Prefetch (uint32_t block, uint32_t blocks)
+{
+        if (blocks > SD_READAHEAD_MAX_BLOCKS) {
+                blocks = SD_READAHEAD_MAX_BLOCKS;
+        }
+
+        if (block >= CardBlocks) {
+                return;
+        }
+
+        if (blocks > CardBlocks - block) {
+                blocks = CardBlocks - block;
+        }
+
+        PrefetchStart = block;
+        PrefetchBlocks = blocks;
+        UsedEnd = 0;
+        PrefetchStatus = SD_OK;
+        InFlight = 1;
+
+        if (SD_ReadMultiBlocksAsync (Buffer[0], (uint64_t) block * SD_READAHEAD_BLOCK_SIZE, SD_READAHEAD_BLOCK_SIZE, blocks, PrefetchDone, NULL) != SD_OK) {
+                InFlight = 0;
+                return;
+        }
+
+        Valid = 1;
+        Stats.Prefetches++;
+        Stats.PrefetchedBlocks += blocks;
+}
@@ -0,0 +1,50 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef SD_READAHEAD_H_
+#define SD_READAHEAD_H_
+
+#include <stm32f4xx.h>
+#include "sdio_high_level.h"
+
+/**
+ * @brief  Size of the prefetch buffer, the largest window, in 512 byte blocks.
+ */
+#ifndef SD_READAHEAD_MAX_BLOCKS
+#define SD_READAHEAD_MAX_BLOCKS       16
+#endif
+
+/**
+ * @brief  Window after a reset or a wrong guess.
+ */
+#ifndef SD_READAHEAD_MIN_BLOCKS
+#define SD_READAHEAD_MIN_BLOCKS       2
+#endif
+
+#define SD_READAHEAD_BLOCK_SIZE       512
+
+/**
+ * @brief  Read-ahead counters. Blocks are 512 bytes.
+ */
+typedef struct {
+        uint32_t Reads; /*!< Calls to SD_ReadAheadRead */
+        uint32_t HitBlocks; /*!< Blocks copied from the prefetch buffer */
+        uint32_t MissBlocks; /*!< Blocks read from the card on demand */
+        uint32_t Prefetches; /*!< CMD18 issued ahead of the reader */
+        uint32_t PrefetchedBlocks;
+        uint32_t WastedBytes; /*!< Prefetched and dropped without being read */
+        uint32_t Window; /*!< Current window, in blocks */
+} SD_ReadAheadStats;
+
+void SD_ReadAheadInit (void);
+SD_Error SD_ReadAheadRead (uint8_t *readbuff, uint64_t ReadAddr, uint32_t NumberOfBlocks);
+void SD_ReadAheadInvalidate (void);
+void SD_ReadAheadGetStats (SD_ReadAheadStats *stats);
+uint32_t SD_ReadAheadHitRate (void);
+
+#endif /* SD_READAHEAD_H_ */
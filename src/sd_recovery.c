@@ -0,0 +1,223 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <stm32f4xx.h>
+#include "sd_recovery.h"
+#include "logf.h"
+
+/*
+ * Fastest step allowed (the one SD_Init negotiated), the error run and the clean
+ * streak driving the clock changes.
+ */
+static SD_BusSpeed FastestSpeed = SD_BUS_SPEED_DEFAULT;
+static uint32_t ErrorRun = 0;
+static uint32_t CleanStreak = 0;
+static SD_RecoveryStats Stats;
+
+static SD_Error Transfer (uint8_t *buffer, uint64_t address, uint32_t NumberOfBlocks, uint8_t write);
+static void Settle (void);
+static void CountError (SD_Error errorstatus);
+static void Downshift (void);
+static void Upshift (void);
+
+/**
+ * @brief  Resets the counters and takes the current bus clock (the one negotiated
+ *         by SD_Init) as the upper limit. Call after SD_Init.
+ * @param  None
+ * @retval None
+ */
+void SD_RecoveryInit (void)
+{
+        FastestSpeed = SD_GetBusSpeed ();
+        ErrorRun = 0;
+        CleanStreak = 0;
+        Stats = (SD_RecoveryStats) { 0 };
+}
+
+/**
+ * @brief  Blocking read, repeated on CRC/timeout/FIFO errors. The clock is
+ *         stepped down after SD_RECOVERY_DOWNSHIFT_ERRORS bus errors in a row,
+ *         and back up after SD_RECOVERY_UPSHIFT_STREAK clean transfers.
+ * @param  readbuff: pointer to the buffer that will contain the received data.
+ * @param  ReadAddr: Address from where data are to be read, in bytes.
+ * @param  NumberOfBlocks: number of 512 byte blocks to read.
+ * @retval SD_Error: SD_OK, or the error of the last attempt.
+ */
+SD_Error SD_RecoveryRead (uint8_t *readbuff, uint64_t ReadAddr, uint32_t NumberOfBlocks)
+{
+        return (Transfer (readbuff, ReadAddr, NumberOfBlocks, 0));
+}
+
+/**
+ * @brief  Blocking write, see SD_RecoveryRead. Rewriting the same blocks is safe,
+ *         so the whole transfer is simply sent again.
+ * @param  writebuff: pointer to the buffer that contain the data to be transferred.
+ * @param  WriteAddr: Address where data are to be written, in bytes.
+ * @param  NumberOfBlocks: number of 512 byte blocks to write.
+ * @retval SD_Error: SD_OK, or the error of the last attempt.
+ */
+SD_Error SD_RecoveryWrite (uint8_t *writebuff, uint64_t WriteAddr, uint32_t NumberOfBlocks)
+{
+        return (Transfer (writebuff, WriteAddr, NumberOfBlocks, 1));
+}
+
+/**
+ * @brief  Copies the event counters.
+ * @param  stats: destination.
+ * @retval None
+ */
+void SD_RecoveryGetStats (SD_RecoveryStats *stats)
+{
+        __disable_irq ();
+        *stats = Stats;
+        __enable_irq ();
+}
+
+/**
+ * @brief  Runs one transfer with retries. Errors other than bus errors (address,
+ *         locked card...) are not retried.
+ * @retval SD_Error
+ */
+static SD_Error Transfer (uint8_t *buffer, uint64_t address, uint32_t NumberOfBlocks, uint8_t write)
+{
+        SD_Error errorstatus = SD_OK;
+        uint32_t attempt;
+
+        Stats.Transfers++;
+
+        for (attempt = 0; attempt < SD_RECOVERY_ATTEMPTS; attempt++) {
+                if (attempt) {
+                        Stats.Retries++;
+                }
+
+                if (write) {
+                        errorstatus = SD_WriteMultiBlocks (buffer, address, 512, NumberOfBlocks);
+
+                        if (errorstatus == SD_OK) {
+                                errorstatus = SD_WaitWriteOperation ();
+                        }
+                }
+                else {
+                        errorstatus = SD_ReadMultiBlocks (buffer, address, 512, NumberOfBlocks);
+
+                        if (errorstatus == SD_OK) {
+                                errorstatus = SD_WaitReadOperation ();
+                        }
+                }
+
+                /*!< Back to the transfer state (end of programming) before anything else */
+                if (errorstatus == SD_OK) {
+                        errorstatus = SD_WaitReady ();
+                }
+                else {
+                        Settle ();
+                }
+
+                if (errorstatus == SD_OK) {
+                        ErrorRun = 0;
+
+                        if (++CleanStreak >= SD_RECOVERY_UPSHIFT_STREAK) {
+                                CleanStreak = 0;
+                                Upshift ();
+                        }
+
+                        return (errorstatus);
+                }
+
+                if (!SD_IsBusError (errorstatus)) {
+                        break;
+                }
+
+                CountError (errorstatus);
+                CleanStreak = 0;
+
+                if (++ErrorRun >= SD_RECOVERY_DOWNSHIFT_ERRORS) {
+                        ErrorRun = 0;
+                        Downshift ();
+                }
+        }
+
+        Stats.Failures++;
+        return (errorstatus);
+}
+
+/**
+ * @brief  Gets the card back to the transfer state after a failed transfer. A
+ *         CRC error on the CMD18/CMD25 response does not mean the card missed the
+ *         command : it may still be sending or receiving, and would take the retry
+ *         as an illegal command. CMD12 only then, in any other state it would be
+ *         illegal itself.
+ * @param  None
+ * @retval None
+ */
+static void Settle (void)
+{
+        SDCardState state = SD_GetState ();
+
+        if ((state == SD_CARD_SENDING) || (state == SD_CARD_RECEIVING)) {
+                SD_StopTransfer ();
+        }
+
+        SD_WaitReady ();
+}
+
+/**
+ * @brief  Sorts a bus error into the counters.
+ * @param  errorstatus: the error.
+ * @retval None
+ */
+static void CountError (SD_Error errorstatus)
+{
+        if ((errorstatus == SD_CMD_CRC_FAIL) || (errorstatus == SD_DATA_CRC_FAIL)) {
+                Stats.CrcErrors++;
+        }
+        else if ((errorstatus == SD_CMD_RSP_TIMEOUT) || (errorstatus == SD_DATA_TIMEOUT)) {
+                Stats.Timeouts++;
+        }
+        else {
+                Stats.OtherErrors++;
+        }
+}
+
+/**
+ * @brief  One clock step down, unless already at the slowest one.
+ * @param  None
+ * @retval None
+ */
+static void Downshift (void)
+{
+        SD_BusSpeed speed = SD_GetBusSpeed ();
+
+        if (speed >= SD_BUS_SPEED_INIT) {
+                return;
+        }
+
+        if (SD_SetBusSpeed (speed + 1) == SD_OK) {
+                Stats.Downshifts++;
+                logf ("SD clock down to step %d\r\n", speed + 1);
+        }
+}
+
+/**
+ * @brief  One clock step up, never past the speed negotiated at init.
+ * @param  None
+ * @retval None
+ */
+static void Upshift (void)
+{
+        SD_BusSpeed speed = SD_GetBusSpeed ();
+
+        if (speed <= FastestSpeed) {
+                return;
+        }
+
+        if (SD_SetBusSpeed (speed - 1) == SD_OK) {
+                Stats.Upshifts++;
+                logf ("SD clock up to step %d\r\n", speed - 1);
+        }
+}
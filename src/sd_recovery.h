@@ -0,0 +1,55 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef SD_RECOVERY_H_
+#define SD_RECOVERY_H_
+
+#include <stm32f4xx.h>
+#include "sdio_high_level.h"
+
+/**
+ * @brief  Attempts per transfer, the first one included.
+ */
+#ifndef SD_RECOVERY_ATTEMPTS
+#define SD_RECOVERY_ATTEMPTS          4
+#endif
+
+/**
+ * @brief  Consecutive bus errors after which the clock goes one step down.
+ */
+#ifndef SD_RECOVERY_DOWNSHIFT_ERRORS
+#define SD_RECOVERY_DOWNSHIFT_ERRORS  2
+#endif
+
+/**
+ * @brief  Clean transfers in a row after which the clock goes one step back up.
+ */
+#ifndef SD_RECOVERY_UPSHIFT_STREAK
+#define SD_RECOVERY_UPSHIFT_STREAK    256
+#endif
+
+/**
+ * @brief  Event counters of the recovery layer.
+ */
+typedef struct {
+        uint32_t Transfers; /*!< Calls to SD_RecoveryRead / SD_RecoveryWrite */
+        uint32_t Retries; /*!< Transfers repeated after a bus error */
+        uint32_t Failures; /*!< Transfers given up */
+        uint32_t CrcErrors; /*!< Command and data CRC failures */
+        uint32_t Timeouts; /*!< Command and data timeouts */
+        uint32_t OtherErrors; /*!< FIFO and start bit errors */
+        uint32_t Downshifts;
+        uint32_t Upshifts;
+} SD_RecoveryStats;
+
+void SD_RecoveryInit (void);
+SD_Error SD_RecoveryRead (uint8_t *readbuff, uint64_t ReadAddr, uint32_t NumberOfBlocks);
+SD_Error SD_RecoveryWrite (uint8_t *writebuff, uint64_t WriteAddr, uint32_t NumberOfBlocks);
+void SD_RecoveryGetStats (SD_RecoveryStats *stats);
+
+#endif /* SD_RECOVERY_H_ */
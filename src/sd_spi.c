@@ -0,0 +1,848 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifdef USE_SD_SPI
+
+#include <stddef.h>
+#include <string.h>
+#include "sd_spi.h"
+#include "sd_time.h"
+
+#if ((SD_SPI_POLL_CHUNK & (SD_SPI_POLL_CHUNK - 1)) != 0) || (SD_SPI_POLL_CHUNK >= 512)
+#error "SD_SPI_POLL_CHUNK must be a power of 2 below 512"
+#endif
+
+#define SPI_BLOCK_SIZE                512
+
+#define SPI_CMD_GO_IDLE_STATE         0
+#define SPI_CMD_SEND_IF_COND          8
+#define SPI_CMD_SEND_CSD              9
+#define SPI_CMD_STOP_TRANSMISSION     12
+#define SPI_CMD_SEND_STATUS           13
+#define SPI_CMD_SET_BLOCKLEN          16
+#define SPI_CMD_READ_SINGLE_BLOCK     17
+#define SPI_CMD_READ_MULT_BLOCK       18
+#define SPI_CMD_WRITE_SINGLE_BLOCK    24
+#define SPI_CMD_WRITE_MULT_BLOCK      25
+#define SPI_CMD_ERASE_WR_BLK_START    32
+#define SPI_CMD_ERASE_WR_BLK_END      33
+#define SPI_CMD_ERASE                 38
+#define SPI_CMD_APP_CMD               55
+#define SPI_CMD_READ_OCR              58
+#define SPI_CMD_CRC_ON_OFF            59
+#define SPI_ACMD_SD_STATUS            13
+#define SPI_ACMD_SD_SEND_OP_COND      41
+
+#define SPI_R1_IDLE                   0x01
+#define SPI_R1_ILLEGAL_CMD            0x04
+#define SPI_R1_CRC_ERROR              0x08
+
+#define SPI_TOKEN_START_BLOCK         0xFE
+#define SPI_TOKEN_START_MULT_WRITE    0xFC
+#define SPI_TOKEN_STOP_TRAN           0xFD
+#define SPI_DATA_RESPONSE_MASK        0x1F
+#define SPI_DATA_ACCEPTED             0x05
+#define SPI_DATA_CRC_REJECTED         0x0B
+
+#define SPI_INIT_TIMEOUT_US           1000000
+
+typedef enum {
+        SPI_STATE_IDLE = 0,
+        SPI_STATE_RX_TOKEN, /*!< Polling for the start block token */
+        SPI_STATE_RX_DATA, /*!< DMA of the rest of a block */
+        SPI_STATE_TX_DATA, /*!< DMA of a block */
+        SPI_STATE_TX_BUSY, /*!< Polling for the end of programming */
+        SPI_STATE_STOP_BUSY /*!< Same, after the stop token */
+} SpiState;
+
+/*
+ * Card state and the transfer in flight. Only touched by the thread while State is
+ * SPI_STATE_IDLE, by the DMA interrupt otherwise.
+ */
+typedef struct {
+        uint8_t HighCapacity; /*!< Block addressed (SDHC / SDXC) */
+        uint32_t Blocks;
+        uint8_t AuSize; /*!< AU_SIZE from the SD status */
+
+        __IO SpiState State;
+        uint8_t Multi; /*!< CMD18 / CMD25 */
+        uint8_t *Buffer; /*!< Current block */
+        uint32_t Left; /*!< Blocks left, current one included */
+        SD_Deadline Deadline;
+        SD_TransferCallback Callback;
+        void *Context;
+        uint8_t PollBuf[SD_SPI_POLL_CHUNK];
+} SpiCard;
+
+static SD_Error SpiInit (SD_BlockDev *dev);
+static SD_Error SpiGetInfo (SD_BlockDev *dev, SD_BlockDevInfo *info);
+static SD_Error SpiReadAsync (SD_BlockDev *dev, uint8_t *buffer, uint32_t block, uint32_t count, SD_TransferCallback callback, void *context);
+static SD_Error SpiWriteAsync (SD_BlockDev *dev, const uint8_t *buffer, uint32_t block, uint32_t count, SD_TransferCallback callback, void *context);
+static SD_Error SpiWaitReady (SD_BlockDev *dev);
+static SD_Error SpiErase (SD_BlockDev *dev, uint32_t block, uint32_t count);
+
+static void LowLevelInit (void);
+static void SetPrescaler (uint16_t prescaler);
+static void Select (void);
+static void Deselect (void);
+static uint8_t Xchg (uint8_t byte);
+static uint8_t WaitNotBusy (uint32_t us);
+static uint8_t Command (uint8_t cmd, uint32_t arg);
+static uint8_t AppCommand (uint8_t cmd, uint32_t arg);
+static SD_Error ReadRegister (uint8_t *buffer, uint32_t length);
+static void DmaStart (const uint8_t *tx, uint8_t *rx, uint32_t length);
+static void PollStart (uint32_t us);
+static void SendBlock (void);
+static void Finish (SD_Error status);
+static uint8_t Crc7 (const uint8_t *data, uint32_t length);
+
+static const SD_BlockDevOps SpiOps = {
+        SpiInit,
+        SpiGetInfo,
+        SpiReadAsync,
+        SpiWriteAsync,
+        SpiWaitReady,
+        SpiErase
+};
+
+static SpiCard Card;
+static uint8_t Dummy = 0xFF; /*!< Sent while receiving */
+static uint8_t Sink; /*!< Received while sending */
+
+SD_BlockDev SD_SpiDev = { &SpiOps, &Card, "spi" };
+
+/**
+ * @brief  DMA RX transfer complete, runs the transfer state machine. Called from
+ *         SD_SPI_DMA_IRQHANDLER.
+ * @param  None
+ * @retval None
+ */
+void SD_SpiProcessDMAIRQ (void)
+{
+        uint32_t i, copied;
+        uint16_t crc;
+        uint8_t response;
+
+        if (DMA_GetFlagStatus (SD_SPI_DMA_RX_STREAM, SD_SPI_DMA_RX_FLAG_TCIF) == RESET) {
+                return;
+        }
+
+        DMA_ClearFlag (SD_SPI_DMA_RX_STREAM, SD_SPI_DMA_RX_FLAGS);
+        DMA_ClearFlag (SD_SPI_DMA_TX_STREAM, SD_SPI_DMA_TX_FLAGS);
+
+        switch (Card.State) {
+                case SPI_STATE_RX_TOKEN:
+                {
+                        for (i = 0; (i < SD_SPI_POLL_CHUNK) && (Card.PollBuf[i] == 0xFF); i++)
+                                ;
+
+                        if (i == SD_SPI_POLL_CHUNK) {
+                                if (SD_DeadlineExpired (&Card.Deadline)) {
+                                        Finish (SD_DATA_TIMEOUT);
+                                }
+                                else {
+                                        DmaStart (&Dummy, Card.PollBuf, SD_SPI_POLL_CHUNK);
+                                }
+
+                                break;
+                        }
+
+                        /*!< Anything else than the start token is a data error token */
+                        if (Card.PollBuf[i] != SPI_TOKEN_START_BLOCK) {
+                                Finish (SD_ERROR);
+                                break;
+                        }
+
+                        /*!< The first bytes of the block came in with the token */
+                        copied = SD_SPI_POLL_CHUNK - i - 1;
+                        memcpy (Card.Buffer, &Card.PollBuf[i + 1], copied);
+                        Card.State = SPI_STATE_RX_DATA;
+                        DmaStart (&Dummy, Card.Buffer + copied, SPI_BLOCK_SIZE - copied);
+                        break;
+                }
+
+                case SPI_STATE_RX_DATA:
+                {
+                        crc = (uint16_t) (Xchg (0xFF) << 8);
+                        crc |= Xchg (0xFF);
+
+                        if (SD_SPI_CRC && (crc != SD_Crc16 (Card.Buffer, SPI_BLOCK_SIZE))) {
+                                Finish (SD_DATA_CRC_FAIL);
+                                break;
+                        }
+
+                        Card.Buffer += SPI_BLOCK_SIZE;
+
+                        if (--Card.Left == 0) {
+                                Finish (SD_OK);
+                                break;
+                        }
+
+                        Card.State = SPI_STATE_RX_TOKEN;
+                        PollStart (SD_SPI_READ_TIMEOUT_US);
+                        break;
+                }
+
+                case SPI_STATE_TX_DATA:
+                {
+                        crc = (SD_SPI_CRC) ? SD_Crc16 (Card.Buffer, SPI_BLOCK_SIZE) : 0xFFFF;
+                        Xchg ((uint8_t) (crc >> 8));
+                        Xchg ((uint8_t) crc);
+
+                        for (i = 0, response = 0xFF; (i < 8) && (response == 0xFF); i++) {
+                                response = Xchg (0xFF);
+                        }
+
+                        if ((response & SPI_DATA_RESPONSE_MASK) != SPI_DATA_ACCEPTED) {
+                                Finish (((response & SPI_DATA_RESPONSE_MASK) == SPI_DATA_CRC_REJECTED) ? SD_DATA_CRC_FAIL : SD_ERROR);
+                                break;
+                        }
+
+                        Card.Buffer += SPI_BLOCK_SIZE;
+                        Card.Left--;
+                        Card.State = SPI_STATE_TX_BUSY;
+                        PollStart (SD_SPI_WRITE_TIMEOUT_US);
+                        break;
+                }
+
+                case SPI_STATE_TX_BUSY:
+                case SPI_STATE_STOP_BUSY:
+                {
+                        /*!< The card holds DO low while programming */
+                        if (Card.PollBuf[SD_SPI_POLL_CHUNK - 1] != 0xFF) {
+                                if (SD_DeadlineExpired (&Card.Deadline)) {
+                                        Finish (SD_DATA_TIMEOUT);
+                                }
+                                else {
+                                        DmaStart (&Dummy, Card.PollBuf, SD_SPI_POLL_CHUNK);
+                                }
+
+                                break;
+                        }
+
+                        if ((Card.State == SPI_STATE_TX_BUSY) && Card.Left) {
+                                SendBlock ();
+                        }
+                        else if ((Card.State == SPI_STATE_TX_BUSY) && Card.Multi) {
+                                Xchg (SPI_TOKEN_STOP_TRAN);
+                                Xchg (0xFF);
+                                Card.State = SPI_STATE_STOP_BUSY;
+                                PollStart (SD_SPI_WRITE_TIMEOUT_US);
+                        }
+                        else {
+                                Finish (SD_OK);
+                        }
+
+                        break;
+                }
+
+                default:
+                        break;
+        }
+}
+
+/**
+ * @brief  Identification in SPI mode : CMD0, CMD8, ACMD41, CMD58, then CRC on, the
+ *         block length, the CSD (capacity) and the SD status (AU size).
+ */
+static SD_Error SpiInit (SD_BlockDev *dev)
+{
+        SD_Deadline deadline;
+        uint8_t r1, i, version2 = 0;
+        uint8_t buffer[64];
+        uint32_t size;
+
+        LowLevelInit ();
+        Card.State = SPI_STATE_IDLE;
+        Card.HighCapacity = 0;
+        SetPrescaler (SD_SPI_INIT_PRESCALER);
+
+        /*!< At least 74 clocks with CS high */
+        Deselect ();
+
+        for (i = 0; i < 10; i++) {
+                Xchg (0xFF);
+        }
+
+        for (i = 0, r1 = 0xFF; (i < 10) && (r1 != SPI_R1_IDLE); i++) {
+                Select ();
+                r1 = Command (SPI_CMD_GO_IDLE_STATE, 0);
+                Deselect ();
+        }
+
+        if (r1 != SPI_R1_IDLE) {
+                return (SD_CMD_RSP_TIMEOUT);
+        }
+
+        /*!< CMD8 : 2.7-3.6V, check pattern 0xAA. Illegal on version 1 cards */
+        Select ();
+        r1 = Command (SPI_CMD_SEND_IF_COND, 0x1AA);
+
+        if (r1 == SPI_R1_IDLE) {
+                for (i = 0; i < 4; i++) {
+                        buffer[i] = Xchg (0xFF);
+                }
+
+                if ((buffer[2] & 0x0F) != 0x01 || buffer[3] != 0xAA) {
+                        Deselect ();
+                        return (SD_INVALID_VOLTRANGE);
+                }
+
+                version2 = 1;
+        }
+        else if (!(r1 & SPI_R1_ILLEGAL_CMD)) {
+                Deselect ();
+                return (SD_ERROR);
+        }
+
+        Deselect ();
+
+        /*!< ACMD41 until out of idle, with HCS for version 2 cards */
+        SD_DeadlineStart (&deadline, SPI_INIT_TIMEOUT_US);
+
+        do {
+                Select ();
+                r1 = AppCommand (SPI_ACMD_SD_SEND_OP_COND, (version2) ? 0x40000000 : 0);
+                Deselect ();
+        } while ((r1 == SPI_R1_IDLE) && !SD_DeadlineExpired (&deadline));
+
+        if (r1 != 0) {
+                return ((r1 == SPI_R1_IDLE) ? SD_CMD_RSP_TIMEOUT : SD_ERROR);
+        }
+
+        if (version2) {
+                Select ();
+                r1 = Command (SPI_CMD_READ_OCR, 0);
+
+                for (i = 0; i < 4; i++) {
+                        buffer[i] = Xchg (0xFF);
+                }
+
+                Deselect ();
+
+                if (r1 != 0) {
+                        return (SD_ERROR);
+                }
+
+                /*!< CCS */
+                Card.HighCapacity = (buffer[0] & 0x40) ? 1 : 0;
+        }
+
+        Select ();
+        r1 = Command (SPI_CMD_CRC_ON_OFF, SD_SPI_CRC);
+
+        if ((r1 == 0) && !Card.HighCapacity) {
+                r1 = Command (SPI_CMD_SET_BLOCKLEN, SPI_BLOCK_SIZE);
+        }
+
+        Deselect ();
+
+        if (r1 != 0) {
+                return (SD_ERROR);
+        }
+
+        SetPrescaler (SD_SPI_FAST_PRESCALER);
+
+        /*!< CSD : capacity */
+        Select ();
+
+        if (Command (SPI_CMD_SEND_CSD, 0) != 0) {
+                Deselect ();
+                return (SD_ERROR);
+        }
+
+        if (ReadRegister (buffer, 16) != SD_OK) {
+                Deselect ();
+                return (SD_ERROR);
+        }
+
+        Deselect ();
+
+        if ((buffer[0] >> 6) == 1) {
+                /*!< CSD version 2 : (C_SIZE + 1) * 512 KB */
+                size = ((uint32_t) (buffer[7] & 0x3F) << 16) | ((uint32_t) buffer[8] << 8) | buffer[9];
+                Card.Blocks = (size + 1) * 1024;
+        }
+        else {
+                /*!< CSD version 1 : (C_SIZE + 1) << (C_SIZE_MULT + 2 + READ_BL_LEN) bytes */
+                size = ((uint32_t) (buffer[6] & 0x03) << 10) | ((uint32_t) buffer[7] << 2) | (buffer[8] >> 6);
+                i = (uint8_t) (((buffer[9] & 0x03) << 1) | (buffer[10] >> 7));
+                Card.Blocks = ((size + 1) << (i + 2 + (buffer[5] & 0x0F))) / SPI_BLOCK_SIZE;
+        }
+
+        /*!< SD status : AU_SIZE, bits 431:428. R2 is R1 and one more byte */
+        Card.AuSize = 0;
+        Select ();
+
+        if (AppCommand (SPI_ACMD_SD_STATUS, 0) == 0) {
+                Xchg (0xFF);
+
+                if (ReadRegister (buffer, 64) == SD_OK) {
+                        Card.AuSize = buffer[10] >> 4;
+                }
+        }
+
+        Deselect ();
+        return (SD_OK);
+}
+
+static SD_Error SpiGetInfo (SD_BlockDev *dev, SD_BlockDevInfo *info)
+{
+        info->Blocks = Card.Blocks;
+        info->AuBlocks = SD_AuBlocks (Card.AuSize);
+        return (SD_OK);
+}
+
+/**
+ * @brief  Sends CMD17 / CMD18 and starts polling for the first token.
+ */
+static SD_Error SpiReadAsync (SD_BlockDev *dev, uint8_t *buffer, uint32_t block, uint32_t count, SD_TransferCallback callback, void *context)
+{
+        uint32_t address = (Card.HighCapacity) ? block : block * SPI_BLOCK_SIZE;
+
+        if (Card.State != SPI_STATE_IDLE) {
+                return (SD_REQUEST_PENDING);
+        }
+
+        if (count == 0) {
+                return (SD_INVALID_PARAMETER);
+        }
+
+        Select ();
+
+        if (Command ((count > 1) ? SPI_CMD_READ_MULT_BLOCK : SPI_CMD_READ_SINGLE_BLOCK, address) != 0) {
+                Deselect ();
+                return (SD_ERROR);
+        }
+
+        Card.Multi = (count > 1);
+        Card.Buffer = buffer;
+        Card.Left = count;
+        Card.Callback = callback;
+        Card.Context = context;
+        Card.State = SPI_STATE_RX_TOKEN;
+        PollStart (SD_SPI_READ_TIMEOUT_US);
+        return (SD_OK);
+}
+
+/**
+ * @brief  Sends CMD24 / CMD25 and starts the DMA of the first block. The transfer
+ *         completes once the card is done programming.
+ */
+static SD_Error SpiWriteAsync (SD_BlockDev *dev, const uint8_t *buffer, uint32_t block, uint32_t count, SD_TransferCallback callback, void *context)
+{
+        uint32_t address = (Card.HighCapacity) ? block : block * SPI_BLOCK_SIZE;
+
+        if (Card.State != SPI_STATE_IDLE) {
+                return (SD_REQUEST_PENDING);
+        }
+
+        if (count == 0) {
+                return (SD_INVALID_PARAMETER);
+        }
+
+        Select ();
+
+        if (Command ((count > 1) ? SPI_CMD_WRITE_MULT_BLOCK : SPI_CMD_WRITE_SINGLE_BLOCK, address) != 0) {
+                Deselect ();
+                return (SD_ERROR);
+        }
+
+        Xchg (0xFF);
+        Card.Multi = (count > 1);
+        Card.Buffer = (uint8_t *) buffer;
+        Card.Left = count;
+        Card.Callback = callback;
+        Card.Context = context;
+        SendBlock ();
+        return (SD_OK);
+}
+
+/**
+ * @brief  Writes complete after the busy time, this only waits for the transfer.
+ */
+static SD_Error SpiWaitReady (SD_BlockDev *dev)
+{
+        __disable_irq ();
+
+        while (Card.State != SPI_STATE_IDLE) {
+                SD_Sleep ();
+                __enable_irq ();
+                __disable_irq ();
+        }
+
+        __enable_irq ();
+        return (SD_OK);
+}
+
+/**
+ * @brief  CMD32, CMD33, CMD38, then polls for the end of busy.
+ */
+static SD_Error SpiErase (SD_BlockDev *dev, uint32_t block, uint32_t count)
+{
+        uint32_t unit = (Card.HighCapacity) ? 1 : SPI_BLOCK_SIZE;
+        SD_Error errorstatus = SD_OK;
+
+        if (count == 0) {
+                return (SD_OK);
+        }
+
+        SpiWaitReady (dev);
+        Select ();
+
+        if ((Command (SPI_CMD_ERASE_WR_BLK_START, block * unit) != 0) || (Command (SPI_CMD_ERASE_WR_BLK_END, (block + count - 1) * unit) != 0)
+                        || (Command (SPI_CMD_ERASE, 0) != 0)) {
+                errorstatus = SD_ERROR;
+        }
+        /*!< No ERASE_TIMEOUT from the SD status here, so allow a write time per block */
+        else if (!WaitNotBusy (SD_SPI_WRITE_TIMEOUT_US + count * 250)) {
+                errorstatus = SD_DATA_TIMEOUT;
+        }
+
+        Deselect ();
+        return (errorstatus);
+}
+
+/**
+ * @brief  SPI2 master mode 0, 8 bit, the pins, the two DMA streams and their
+ *         interrupt.
+ */
+static void LowLevelInit (void)
+{
+        GPIO_InitTypeDef GPIO_InitStructure;
+        SPI_InitTypeDef SPI_InitStructure;
+        DMA_InitTypeDef DMA_InitStructure;
+        NVIC_InitTypeDef NVIC_InitStructure;
+
+        RCC_AHB1PeriphClockCmd (SD_SPI_GPIO_CLK | SD_SPI_DMA_CLK, ENABLE);
+        RCC_APB1PeriphClockCmd (SD_SPI_CLK, ENABLE);
+
+        GPIO_PinAFConfig (SD_SPI_GPIO_PORT, SD_SPI_SCK_SOURCE, SD_SPI_AF);
+        GPIO_PinAFConfig (SD_SPI_GPIO_PORT, SD_SPI_MISO_SOURCE, SD_SPI_AF);
+        GPIO_PinAFConfig (SD_SPI_GPIO_PORT, SD_SPI_MOSI_SOURCE, SD_SPI_AF);
+
+        GPIO_InitStructure.GPIO_Pin = SD_SPI_SCK_PIN | SD_SPI_MISO_PIN | SD_SPI_MOSI_PIN;
+        GPIO_InitStructure.GPIO_Mode = GPIO_Mode_AF;
+        GPIO_InitStructure.GPIO_Speed = GPIO_Speed_50MHz;
+        GPIO_InitStructure.GPIO_OType = GPIO_OType_PP;
+        GPIO_InitStructure.GPIO_PuPd = GPIO_PuPd_UP;
+        GPIO_Init (SD_SPI_GPIO_PORT, &GPIO_InitStructure);
+
+        /*!< CS high only : SPI2 is not enabled yet, Deselect would hang on its dummy byte */
+        GPIO_SetBits (SD_SPI_GPIO_PORT, SD_SPI_CS_PIN);
+        GPIO_InitStructure.GPIO_Pin = SD_SPI_CS_PIN;
+        GPIO_InitStructure.GPIO_Mode = GPIO_Mode_OUT;
+        GPIO_Init (SD_SPI_GPIO_PORT, &GPIO_InitStructure);
+
+        SPI_I2S_DeInit (SD_SPI);
+        SPI_InitStructure.SPI_Direction = SPI_Direction_2Lines_FullDuplex;
+        SPI_InitStructure.SPI_Mode = SPI_Mode_Master;
+        SPI_InitStructure.SPI_DataSize = SPI_DataSize_8b;
+        SPI_InitStructure.SPI_CPOL = SPI_CPOL_Low;
+        SPI_InitStructure.SPI_CPHA = SPI_CPHA_1Edge;
+        SPI_InitStructure.SPI_NSS = SPI_NSS_Soft;
+        SPI_InitStructure.SPI_BaudRatePrescaler = SD_SPI_INIT_PRESCALER;
+        SPI_InitStructure.SPI_FirstBit = SPI_FirstBit_MSB;
+        SPI_InitStructure.SPI_CRCPolynomial = 7;
+        SPI_Init (SD_SPI, &SPI_InitStructure);
+
+        DMA_DeInit (SD_SPI_DMA_RX_STREAM);
+        DMA_DeInit (SD_SPI_DMA_TX_STREAM);
+        DMA_InitStructure.DMA_Channel = SD_SPI_DMA_CHANNEL;
+        DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t) &SD_SPI->DR;
+        DMA_InitStructure.DMA_Memory0BaseAddr = (uint32_t) &Sink;
+        DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralToMemory;
+        DMA_InitStructure.DMA_BufferSize = 1;
+        DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+        DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
+        DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+        DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+        DMA_InitStructure.DMA_Mode = DMA_Mode_Normal;
+        DMA_InitStructure.DMA_Priority = DMA_Priority_High;
+        DMA_InitStructure.DMA_FIFOMode = DMA_FIFOMode_Disable;
+        DMA_InitStructure.DMA_FIFOThreshold = DMA_FIFOThreshold_Full;
+        DMA_InitStructure.DMA_MemoryBurst = DMA_MemoryBurst_Single;
+        DMA_InitStructure.DMA_PeripheralBurst = DMA_PeripheralBurst_Single;
+        DMA_Init (SD_SPI_DMA_RX_STREAM, &DMA_InitStructure);
+
+        DMA_InitStructure.DMA_DIR = DMA_DIR_MemoryToPeripheral;
+        DMA_InitStructure.DMA_Priority = DMA_Priority_Medium;
+        DMA_Init (SD_SPI_DMA_TX_STREAM, &DMA_InitStructure);
+
+        /*!< Only the RX end matters : it comes after the last byte sent */
+        DMA_ITConfig (SD_SPI_DMA_RX_STREAM, DMA_IT_TC, ENABLE);
+
+        NVIC_InitStructure.NVIC_IRQChannel = SD_SPI_DMA_IRQn;
+        NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 1;
+        NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+        NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+        NVIC_Init (&NVIC_InitStructure);
+
+        SPI_I2S_DMACmd (SD_SPI, SPI_I2S_DMAReq_Rx | SPI_I2S_DMAReq_Tx, ENABLE);
+        SPI_Cmd (SD_SPI, ENABLE);
+}
+
+/**
+ * @brief  Changes the SPI clock, the bus being idle.
+ */
+static void SetPrescaler (uint16_t prescaler)
+{
+        SPI_Cmd (SD_SPI, DISABLE);
+        SD_SPI->CR1 = (SD_SPI->CR1 & ~SPI_CR1_BR) | prescaler;
+        SPI_Cmd (SD_SPI, ENABLE);
+}
+
+static void Select (void)
+{
+        GPIO_ResetBits (SD_SPI_GPIO_PORT, SD_SPI_CS_PIN);
+}
+
+/**
+ * @brief  CS high, and one more byte for the card to release DO.
+ */
+static void Deselect (void)
+{
+        GPIO_SetBits (SD_SPI_GPIO_PORT, SD_SPI_CS_PIN);
+        Xchg (0xFF);
+}
+
+/**
+ * @brief  Polled exchange of one byte, the DMA being idle.
+ */
+static uint8_t Xchg (uint8_t byte)
+{
+        while (SPI_I2S_GetFlagStatus (SD_SPI, SPI_I2S_FLAG_TXE) == RESET) {
+        }
+
+        SPI_I2S_SendData (SD_SPI, byte);
+
+        while (SPI_I2S_GetFlagStatus (SD_SPI, SPI_I2S_FLAG_RXNE) == RESET) {
+        }
+
+        return ((uint8_t) SPI_I2S_ReceiveData (SD_SPI));
+}
+
+/**
+ * @brief  Polls until DO is released (0xFF).
+ * @retval 1 if ready, 0 on timeout.
+ */
+static uint8_t WaitNotBusy (uint32_t us)
+{
+        SD_Deadline deadline;
+
+        SD_DeadlineStart (&deadline, us);
+
+        while (Xchg (0xFF) != 0xFF) {
+                if (SD_DeadlineExpired (&deadline)) {
+                        return (0);
+                }
+        }
+
+        return (1);
+}
+
+/**
+ * @brief  Sends a command frame (CS already low) and returns R1, 0xFF if the card
+ *         did not answer. Other response bytes (R3, R7) are left to the caller.
+ */
+static uint8_t Command (uint8_t cmd, uint32_t arg)
+{
+        uint8_t frame[6];
+        uint8_t r1 = 0xFF;
+        uint32_t i;
+
+        /*!< CMD12 interrupts a read, DO carries data and not busy */
+        if ((cmd != SPI_CMD_GO_IDLE_STATE) && (cmd != SPI_CMD_STOP_TRANSMISSION) && !WaitNotBusy (SD_SPI_WRITE_TIMEOUT_US)) {
+                return (0xFF);
+        }
+
+        frame[0] = 0x40 | cmd;
+        frame[1] = (uint8_t) (arg >> 24);
+        frame[2] = (uint8_t) (arg >> 16);
+        frame[3] = (uint8_t) (arg >> 8);
+        frame[4] = (uint8_t) arg;
+        frame[5] = (uint8_t) ((Crc7 (frame, 5) << 1) | 0x01);
+
+        for (i = 0; i < 6; i++) {
+                Xchg (frame[i]);
+        }
+
+        /*!< CMD12 : skip the stuff byte */
+        if (cmd == SPI_CMD_STOP_TRANSMISSION) {
+                Xchg (0xFF);
+        }
+
+        /*!< NCR : 0 to 8 bytes */
+        for (i = 0; (i < 10) && (r1 & 0x80); i++) {
+                r1 = Xchg (0xFF);
+        }
+
+        return (r1);
+}
+
+static uint8_t AppCommand (uint8_t cmd, uint32_t arg)
+{
+        uint8_t r1 = Command (SPI_CMD_APP_CMD, 0);
+
+        if (r1 > SPI_R1_IDLE) {
+                return (r1);
+        }
+
+        return (Command (cmd, arg));
+}
+
+/**
+ * @brief  Polled read of a short data block (CSD, SD status) : token, data, CRC.
+ */
+static SD_Error ReadRegister (uint8_t *buffer, uint32_t length)
+{
+        SD_Deadline deadline;
+        uint8_t token;
+        uint16_t crc;
+        uint32_t i;
+
+        SD_DeadlineStart (&deadline, SD_SPI_READ_TIMEOUT_US);
+
+        while ((token = Xchg (0xFF)) == 0xFF) {
+                if (SD_DeadlineExpired (&deadline)) {
+                        return (SD_DATA_TIMEOUT);
+                }
+        }
+
+        if (token != SPI_TOKEN_START_BLOCK) {
+                return (SD_ERROR);
+        }
+
+        for (i = 0; i < length; i++) {
+                buffer[i] = Xchg (0xFF);
+        }
+
+        crc = (uint16_t) (Xchg (0xFF) << 8);
+        crc |= Xchg (0xFF);
+
+        if (SD_SPI_CRC && (crc != SD_Crc16 (buffer, length))) {
+                return (SD_DATA_CRC_FAIL);
+        }
+
+        return (SD_OK);
+}
+
+/**
+ * @brief  Full duplex DMA of length bytes. tx == &Dummy sends 0xFF, rx == &Sink
+ *         discards, both without memory increment.
+ */
+static void DmaStart (const uint8_t *tx, uint8_t *rx, uint32_t length)
+{
+        DMA_Cmd (SD_SPI_DMA_RX_STREAM, DISABLE);
+        DMA_Cmd (SD_SPI_DMA_TX_STREAM, DISABLE);
+
+        while ((SD_SPI_DMA_RX_STREAM->CR & DMA_SxCR_EN) || (SD_SPI_DMA_TX_STREAM->CR & DMA_SxCR_EN)) {
+        }
+
+        DMA_ClearFlag (SD_SPI_DMA_RX_STREAM, SD_SPI_DMA_RX_FLAGS);
+        DMA_ClearFlag (SD_SPI_DMA_TX_STREAM, SD_SPI_DMA_TX_FLAGS);
+
+        SD_SPI_DMA_RX_STREAM->M0AR = (uint32_t) rx;
+        SD_SPI_DMA_RX_STREAM->NDTR = length;
+        SD_SPI_DMA_TX_STREAM->M0AR = (uint32_t) tx;
+        SD_SPI_DMA_TX_STREAM->NDTR = length;
+
+        if (rx == &Sink) {
+                SD_SPI_DMA_RX_STREAM->CR &= ~DMA_SxCR_MINC;
+        }
+        else {
+                SD_SPI_DMA_RX_STREAM->CR |= DMA_SxCR_MINC;
+        }
+
+        if (tx == &Dummy) {
+                SD_SPI_DMA_TX_STREAM->CR &= ~DMA_SxCR_MINC;
+        }
+        else {
+                SD_SPI_DMA_TX_STREAM->CR |= DMA_SxCR_MINC;
+        }
+
+        /*!< RX first, so that no received byte is missed */
+        DMA_Cmd (SD_SPI_DMA_RX_STREAM, ENABLE);
+        DMA_Cmd (SD_SPI_DMA_TX_STREAM, ENABLE);
+}
+
+/**
+ * @brief  Arms the deadline and the first DMA read of the poll buffer.
+ */
+static void PollStart (uint32_t us)
+{
+        SD_DeadlineStart (&Card.Deadline, us);
+        DmaStart (&Dummy, Card.PollBuf, SD_SPI_POLL_CHUNK);
+}
+
+/**
+ * @brief  Start token, then the DMA of the current block.
+ */
+static void SendBlock (void)
+{
+        Xchg ((Card.Multi) ? SPI_TOKEN_START_MULT_WRITE : SPI_TOKEN_START_BLOCK);
+        Card.State = SPI_STATE_TX_DATA;
+        DmaStart (Card.Buffer, &Sink, SPI_BLOCK_SIZE);
+}
+
+/**
+ * @brief  Ends the transfer : CMD12 after a multiple block read, the stop token
+ *         after a failed multiple block write, then the callback.
+ */
+static void Finish (SD_Error status)
+{
+        SpiState state = Card.State;
+
+        if (Card.Multi && ((state == SPI_STATE_RX_TOKEN) || (state == SPI_STATE_RX_DATA))) {
+                if ((Command (SPI_CMD_STOP_TRANSMISSION, 0) != 0) && (status == SD_OK)) {
+                        status = SD_ERROR;
+                }
+
+                WaitNotBusy (SD_SPI_WRITE_TIMEOUT_US);
+        }
+        else if (Card.Multi && (status != SD_OK) && ((state == SPI_STATE_TX_DATA) || (state == SPI_STATE_TX_BUSY))) {
+                WaitNotBusy (SD_SPI_WRITE_TIMEOUT_US);
+                Xchg (SPI_TOKEN_STOP_TRAN);
+                Xchg (0xFF);
+                WaitNotBusy (SD_SPI_WRITE_TIMEOUT_US);
+        }
+
+        Deselect ();
+        Card.State = SPI_STATE_IDLE;
+
+        if (Card.Callback) {
+                Card.Callback (status, Card.Context);
+        }
+}
+
+/**
+ * @brief  Command CRC : x^7 + x^3 + 1.
+ */
+static uint8_t Crc7 (const uint8_t *data, uint32_t length)
+{
+        uint8_t crc = 0, byte;
+        uint32_t i, j;
+
+        for (i = 0; i < length; i++) {
+                byte = data[i];
+
+                for (j = 0; j < 8; j++) {
+                        crc <<= 1;
+
+                        if ((byte ^ crc) & 0x80) {
+                                crc ^= 0x09;
+                        }
+
+                        byte <<= 1;
+                }
+        }
+
+        return (crc & 0x7F);
+}
+
+#endif /* USE_SD_SPI */
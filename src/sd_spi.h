@@ -0,0 +1,89 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef SD_SPI_H_
+#define SD_SPI_H_
+
+#include <stm32f4xx.h>
+#include "sd_blockdev.h"
+
+/*
+ * SD card in SPI mode, as a SD_BlockDev transport (SD_SpiDev). Built with
+ * -DWITH_SD_SPI=ON, see build/CMakeLists.txt.
+ *
+ * SPI2 : SCK PB13, MISO PB14, MOSI PB15, CS PB12 (GPIO). Both directions use DMA1
+ * (RX Stream3, TX Stream4, channel 0), independent of the SDIO DMA2 stream.
+ *
+ * Commands and short responses are polled. Data blocks go through the DMA ; the
+ * data token and the busy time after a written block are polled by DMA reads of
+ * SD_SPI_POLL_CHUNK bytes, so a transfer runs from the DMA interrupt from start to
+ * end without blocking the core.
+ */
+
+/**
+ * @brief  1 : CRC on (CMD59), CRC16 of the data blocks computed and checked.
+ *         0 : the card ignores the CRCs, only CMD0 / CMD8 need one.
+ */
+#ifndef SD_SPI_CRC
+#define SD_SPI_CRC                    1
+#endif
+
+/**
+ * @brief  Bytes read per DMA while waiting for a data token or for the end of busy.
+ *         A power of 2, below 512.
+ */
+#ifndef SD_SPI_POLL_CHUNK
+#define SD_SPI_POLL_CHUNK             32
+#endif
+
+#ifndef SD_SPI_READ_TIMEOUT_US
+#define SD_SPI_READ_TIMEOUT_US        100000
+#endif
+
+#ifndef SD_SPI_WRITE_TIMEOUT_US
+#define SD_SPI_WRITE_TIMEOUT_US       500000
+#endif
+
+/**
+ * @brief  SPI2 is on APB1 (42 MHz) : / 128 = 328 kHz for the identification, / 2 =
+ *         21 MHz afterwards.
+ */
+#define SD_SPI_INIT_PRESCALER         SPI_BaudRatePrescaler_128
+#define SD_SPI_FAST_PRESCALER         SPI_BaudRatePrescaler_2
+
+#define SD_SPI                        SPI2
+#define SD_SPI_CLK                    RCC_APB1Periph_SPI2
+#define SD_SPI_GPIO_PORT              GPIOB
+#define SD_SPI_GPIO_CLK               RCC_AHB1Periph_GPIOB
+#define SD_SPI_SCK_PIN                GPIO_Pin_13
+#define SD_SPI_SCK_SOURCE             GPIO_PinSource13
+#define SD_SPI_MISO_PIN               GPIO_Pin_14
+#define SD_SPI_MISO_SOURCE            GPIO_PinSource14
+#define SD_SPI_MOSI_PIN               GPIO_Pin_15
+#define SD_SPI_MOSI_SOURCE            GPIO_PinSource15
+#define SD_SPI_CS_PIN                 GPIO_Pin_12
+#define SD_SPI_AF                     GPIO_AF_SPI2
+
+#define SD_SPI_DMA_CLK                RCC_AHB1Periph_DMA1
+#define SD_SPI_DMA_CHANNEL            DMA_Channel_0
+#define SD_SPI_DMA_RX_STREAM          DMA1_Stream3
+#define SD_SPI_DMA_TX_STREAM          DMA1_Stream4
+#define SD_SPI_DMA_RX_FLAG_TCIF       DMA_FLAG_TCIF3
+#define SD_SPI_DMA_RX_FLAGS           (DMA_FLAG_TCIF3 | DMA_FLAG_HTIF3 | DMA_FLAG_TEIF3 | DMA_FLAG_DMEIF3 | DMA_FLAG_FEIF3)
+#define SD_SPI_DMA_TX_FLAGS           (DMA_FLAG_TCIF4 | DMA_FLAG_HTIF4 | DMA_FLAG_TEIF4 | DMA_FLAG_DMEIF4 | DMA_FLAG_FEIF4)
+#define SD_SPI_DMA_IRQn               DMA1_Stream3_IRQn
+#define SD_SPI_DMA_IRQHANDLER         DMA1_Stream3_IRQHandler
+
+/**
+ * @brief  The card on SPI2.
+ */
+extern SD_BlockDev SD_SpiDev;
+
+void SD_SpiProcessDMAIRQ (void);
+
+#endif /* SD_SPI_H_ */
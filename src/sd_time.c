@@ -0,0 +1,142 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <stm32f4xx.h>
+#include "sd_time.h"
+
+/*
+ * Cycles spent asleep in SD_Sleep, and in total, since SD_IdleReset. The total is
+ * accumulated from IdleLast on each sleep and each SD_IdlePercent, in 64 bits, so
+ * the window is not limited to one wrap of the 32 bit counter.
+ */
+static uint64_t IdleCycles = 0;
+static uint64_t TotalCycles = 0;
+static uint32_t IdleLast = 0;
+
+static void IdleUpdate (void);
+
+/**
+ * @brief  Starts the DWT cycle counter, and SysTick as the periodic wake up of the
+ *         sleeping waits. Safe to call more than once.
+ * @param  None
+ * @retval None
+ */
+void SD_TimeInit (void)
+{
+        if (!(DWT->CTRL & DWT_CTRL_CYCCNTENA_Msk)) {
+                CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+                DWT->CYCCNT = 0;
+                DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+        }
+
+        if (!(SysTick->CTRL & SysTick_CTRL_ENABLE_Msk)) {
+                SysTick_Config (SD_TIME_HZ / SD_TIME_WAKE_HZ);
+        }
+}
+
+/**
+ * @brief  Arms a deadline us microseconds from now.
+ * @param  deadline: deadline to arm.
+ * @param  us: time from now, in microseconds.
+ * @retval None
+ */
+void SD_DeadlineStart (SD_Deadline *deadline, uint32_t us)
+{
+        deadline->last = SD_TIME_NOW ();
+        deadline->remaining = (uint64_t) us * (SD_TIME_HZ / 1000000);
+}
+
+/**
+ * @brief  Checks a deadline.
+ * @param  deadline: armed deadline.
+ * @retval 1 once the time is over, 0 before.
+ */
+uint8_t SD_DeadlineExpired (SD_Deadline *deadline)
+{
+        uint32_t now = SD_TIME_NOW ();
+        uint32_t elapsed = now - deadline->last;
+
+        deadline->last = now;
+
+        if (elapsed >= deadline->remaining) {
+                deadline->remaining = 0;
+                return (1);
+        }
+
+        deadline->remaining -= elapsed;
+        return (0);
+}
+
+/**
+ * @brief  Time since a SD_TIME_NOW () sample. Valid for one counter wrap.
+ * @param  since: earlier SD_TIME_NOW () value.
+ * @retval Microseconds.
+ */
+uint32_t SD_TimeElapsedUs (uint32_t since)
+{
+        return ((SD_TIME_NOW () - since) / (SD_TIME_HZ / 1000000));
+}
+
+/**
+ * @brief  Sleeps until the next interrupt and accounts the time as idle. Call it
+ *         with interrupts disabled after checking the wait condition : a pending
+ *         interrupt still wakes the core, and none can slip in between the check
+ *         and the WFI. Enable interrupts afterwards to let the handler run.
+ * @param  None
+ * @retval None
+ */
+void SD_Sleep (void)
+{
+        uint32_t start;
+
+        IdleUpdate ();
+        start = SD_TIME_NOW ();
+        SD_TIME_SLEEP ();
+        IdleCycles += SD_TIME_NOW () - start;
+}
+
+/**
+ * @brief  Starts a new idle measurement window.
+ * @param  None
+ * @retval None
+ */
+void SD_IdleReset (void)
+{
+        IdleCycles = 0;
+        TotalCycles = 0;
+        IdleLast = SD_TIME_NOW ();
+}
+
+/**
+ * @brief  Share of the time spent asleep in the driver waits since SD_IdleReset.
+ *         The window may be longer than one counter wrap (25s at 168MHz) as long
+ *         as no stretch without a sleep or a call to this function is.
+ * @param  None
+ * @retval Percent, 0 - 100.
+ */
+uint32_t SD_IdlePercent (void)
+{
+        IdleUpdate ();
+
+        if (TotalCycles == 0) {
+                return (0);
+        }
+
+        return ((uint32_t) (IdleCycles * 100 / TotalCycles));
+}
+
+/**
+ * @brief  Adds the time since the last update to the window.
+ */
+static void IdleUpdate (void)
+{
+        uint32_t now = SD_TIME_NOW ();
+
+        TotalCycles += now - IdleLast;
+        IdleLast = now;
+}
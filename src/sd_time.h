@@ -0,0 +1,61 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef SD_TIME_H_
+#define SD_TIME_H_
+
+#include <stm32f4xx.h>
+
+/**
+ * @brief  Tick source of the deadlines : a free running 32 bit counter and its
+ *         frequency. DWT->CYCCNT by default, both can be redefined (for example
+ *         with a fake clock).
+ */
+#ifndef SD_TIME_NOW
+#define SD_TIME_NOW()                 (DWT->CYCCNT)
+#endif
+
+#ifndef SD_TIME_HZ
+#define SD_TIME_HZ                    (SystemCoreClock)
+#endif
+
+/**
+ * @brief  How a wait puts the core to sleep until the next interrupt. Redefine to
+ *         inject wake events (or to spin).
+ */
+#ifndef SD_TIME_SLEEP
+#define SD_TIME_SLEEP()               __WFI ()
+#endif
+
+/**
+ * @brief  SysTick rate started by SD_TimeInit, if nobody started it before. Bounds
+ *         the time a wait sleeps without checking its deadline.
+ */
+#ifndef SD_TIME_WAKE_HZ
+#define SD_TIME_WAKE_HZ               1000
+#endif
+
+/**
+ * @brief  Point in time to wait for. Time is accumulated on each check, so the
+ *         deadline may be longer than one wrap of the counter (25s at 168MHz) as
+ *         long as it is checked more often than that.
+ */
+typedef struct {
+        uint32_t last;
+        uint64_t remaining;
+} SD_Deadline;
+
+void SD_TimeInit (void);
+void SD_DeadlineStart (SD_Deadline *deadline, uint32_t us);
+uint8_t SD_DeadlineExpired (SD_Deadline *deadline);
+uint32_t SD_TimeElapsedUs (uint32_t since);
+void SD_Sleep (void);
+void SD_IdleReset (void);
+uint32_t SD_IdlePercent (void);
+
+#endif /* SD_TIME_H_ */
@@ -0,0 +1,244 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifdef SD_TRACE_ENABLE
+
+#include <stdio.h>
+#include <string.h>
+#include <stm32f4xx.h>
+#include "sd_trace.h"
+
+#if (SD_TRACE_DEPTH & (SD_TRACE_DEPTH - 1)) != 0
+#error "SD_TRACE_DEPTH must be a power of 2"
+#endif
+
+/*
+ * Head counts every event ever pushed, the slot is Head % SD_TRACE_DEPTH. Writers
+ * (thread and IRQs) claim slots with LDREX/STREX, no interrupt masking. The
+ * counters are updated from both too : with interrupts disabled (PRIMASK saved
+ * and restored), a read-modify-write (two for the 64 bit SpinCycles) is not
+ * atomic.
+ */
+static SD_TraceEvent Ring[SD_TRACE_DEPTH];
+static __IO uint32_t Head = 0;
+static SD_TraceCounters Counters;
+
+static void Push (SD_TraceEventType type, uint16_t code, uint32_t arg);
+
+/**
+ * @brief  Clears the counters and the ring.
+ * @param  None
+ * @retval None
+ */
+void SD_TraceReset (void)
+{
+        uint32_t primask = __get_PRIMASK ();
+
+        __disable_irq ();
+        memset (&Counters, 0, sizeof (Counters));
+        Head = 0;
+        __set_PRIMASK (primask);
+}
+
+/**
+ * @brief  Copies the counters.
+ * @param  counters: destination.
+ * @retval None
+ */
+void SD_TraceGetCounters (SD_TraceCounters *counters)
+{
+        uint32_t primask = __get_PRIMASK ();
+
+        __disable_irq ();
+        *counters = Counters;
+        counters->Events = Head;
+        __set_PRIMASK (primask);
+}
+
+/**
+ * @brief  Copies the newest events, oldest first. Call while the driver is idle,
+ *         events pushed meanwhile may overwrite the ones being copied.
+ * @param  events: destination.
+ * @param  max: its size.
+ * @retval Number of events copied.
+ */
+uint32_t SD_TraceRead (SD_TraceEvent *events, uint32_t max)
+{
+        uint32_t head = Head;
+        uint32_t n = (head < SD_TRACE_DEPTH) ? head : SD_TRACE_DEPTH;
+        uint32_t i;
+
+        if (n > max) {
+                n = max;
+        }
+
+        for (i = 0; i < n; i++) {
+                events[i] = Ring[(head - n + i) & (SD_TRACE_DEPTH - 1)];
+        }
+
+        return (n);
+}
+
+/**
+ * @brief  Prints the counters and the ring, one record per line.
+ * @param  None
+ * @retval None
+ */
+void SD_TraceDump (void)
+{
+        SD_TraceCounters counters;
+        SD_TraceEvent event;
+        uint32_t head, n, i;
+
+        SD_TraceGetCounters (&counters);
+
+        for (i = 0; i < 64; i++) {
+                if (counters.Cmd[i]) {
+                        printf ("TRACE cmd=%u count=%u\r\n", (unsigned int) i, (unsigned int) counters.Cmd[i]);
+                }
+        }
+
+        printf ("TRACE cmd_errors=%u spin_us=%u\r\n", (unsigned int) counters.CmdErrors, (unsigned int) (counters.SpinCycles / (SD_TIME_HZ / 1000000)));
+
+        for (i = 0; i < SD_TRACE_SDIO_FLAGS; i++) {
+                if (counters.Irq[i]) {
+                        printf ("TRACE irq_flag=%u count=%u\r\n", (unsigned int) i, (unsigned int) counters.Irq[i]);
+                }
+        }
+
+        printf ("TRACE dma_tc=%u dma_fifo_errors=%u events=%u\r\n", (unsigned int) counters.DmaTc, (unsigned int) counters.DmaFifoErrors,
+                        (unsigned int) counters.Events);
+
+        head = Head;
+        n = (head < SD_TRACE_DEPTH) ? head : SD_TRACE_DEPTH;
+
+        for (i = 0; i < n; i++) {
+                event = Ring[(head - n + i) & (SD_TRACE_DEPTH - 1)];
+                printf ("EVENT time=%u type=%u code=%u arg=%08x\r\n", (unsigned int) event.time, (unsigned int) event.type, (unsigned int) event.code,
+                                (unsigned int) event.arg);
+        }
+}
+
+/**
+ * @brief  A command response was waited for (CmdResp1Error, IsCardProgramming).
+ * @param  cmd: command index.
+ * @param  cycles: time spent waiting.
+ * @param  status: SDIO STA at the end of the wait.
+ * @retval None
+ */
+void SD_TraceCmd (uint8_t cmd, uint32_t cycles, uint32_t status)
+{
+        uint32_t primask = __get_PRIMASK ();
+
+        __disable_irq ();
+        Counters.Cmd[cmd & 0x3F]++;
+        Counters.SpinCycles += cycles;
+
+        if (status & (SDIO_FLAG_CTIMEOUT | SDIO_FLAG_CCRCFAIL)) {
+                Counters.CmdErrors++;
+        }
+
+        __set_PRIMASK (primask);
+
+        if (status & (SDIO_FLAG_CTIMEOUT | SDIO_FLAG_CCRCFAIL)) {
+                Push (SD_TRACE_EV_CMD_ERROR, cmd, status);
+        }
+        else {
+                Push (SD_TRACE_EV_CMD, cmd, cycles);
+        }
+}
+
+/**
+ * @brief  SDIO interrupt entry.
+ * @param  sta: SDIO STA.
+ * @retval None
+ */
+void SD_TraceIrq (uint32_t sta)
+{
+        uint32_t primask = __get_PRIMASK ();
+        uint32_t i;
+
+        __disable_irq ();
+
+        for (i = 0; i < SD_TRACE_SDIO_FLAGS; i++) {
+                if (sta & (1U << i)) {
+                        Counters.Irq[i]++;
+                }
+        }
+
+        __set_PRIMASK (primask);
+
+        Push (SD_TRACE_EV_IRQ, 0, sta);
+}
+
+/**
+ * @brief  DMA interrupt entry.
+ * @param  tc: transfer complete flag set.
+ * @param  fe: FIFO error flag set.
+ * @retval None
+ */
+void SD_TraceDma (uint8_t tc, uint8_t fe)
+{
+        uint32_t primask = __get_PRIMASK ();
+
+        __disable_irq ();
+        Counters.DmaTc += (tc != 0);
+        Counters.DmaFifoErrors += (fe != 0);
+        __set_PRIMASK (primask);
+
+        if (tc) {
+                Push (SD_TRACE_EV_DMA_TC, 0, 0);
+        }
+
+        if (fe) {
+                Push (SD_TRACE_EV_DMA_FE, 0, 0);
+        }
+}
+
+/**
+ * @brief  Claims the next slot of the ring and fills it.
+ */
+static void Push (SD_TraceEventType type, uint16_t code, uint32_t arg)
+{
+        SD_TraceEvent *event;
+        uint32_t index;
+
+        do {
+                index = __LDREXW ((uint32_t *) &Head);
+        } while (__STREXW (index + 1, (uint32_t *) &Head));
+
+        event = &Ring[index & (SD_TRACE_DEPTH - 1)];
+        event->time = SD_TIME_NOW ();
+        event->type = type;
+        event->code = code;
+        event->arg = arg;
+}
+
+#else
+
+#include "sd_trace.h"
+
+void SD_TraceReset (void)
+{
+}
+
+void SD_TraceGetCounters (SD_TraceCounters *counters)
+{
+        *counters = (SD_TraceCounters) { { 0 } };
+}
+
+uint32_t SD_TraceRead (SD_TraceEvent *events, uint32_t max)
+{
+        return (0);
+}
+
+void SD_TraceDump (void)
+{
+}
+
+#endif /* SD_TRACE_ENABLE */
@@ -0,0 +1,82 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef SD_TRACE_H_
+#define SD_TRACE_H_
+
+#include <stm32f4xx.h>
+
+/*
+ * Driver instrumentation : per command counters, time spent waiting for command
+ * responses, IRQ counts per SDIO flag, DMA counts, and a ring of timestamped
+ * events. Built in with -DSD_TRACE_ENABLE (cmake -DWITH_SD_TRACE=ON), otherwise
+ * the SD_TRACE_xxx hooks expand to nothing and the functions below are stubs :
+ * the counters read as zero and the ring as empty.
+ */
+
+/**
+ * @brief  Events kept in the ring, a power of 2.
+ */
+#ifndef SD_TRACE_DEPTH
+#define SD_TRACE_DEPTH                128
+#endif
+
+#define SD_TRACE_SDIO_FLAGS           24
+
+typedef enum {
+        SD_TRACE_EV_CMD = 0, /*!< code : command index, arg : response wait in cycles */
+        SD_TRACE_EV_CMD_ERROR = 1, /*!< code : command index, arg : SDIO STA */
+        SD_TRACE_EV_IRQ = 2, /*!< arg : SDIO STA */
+        SD_TRACE_EV_DMA_TC = 3,
+        SD_TRACE_EV_DMA_FE = 4
+} SD_TraceEventType;
+
+/**
+ * @brief  One event. time is SD_TIME_NOW () (DWT cycles).
+ */
+typedef struct {
+        uint32_t time;
+        uint16_t type;
+        uint16_t code;
+        uint32_t arg;
+} SD_TraceEvent;
+
+typedef struct {
+        uint32_t Cmd[64]; /*!< Responses waited for, per command index */
+        uint32_t CmdErrors; /*!< Response timeouts and CRC failures */
+        uint64_t SpinCycles; /*!< Cycles spent waiting for the responses */
+        uint32_t Irq[SD_TRACE_SDIO_FLAGS]; /*!< SDIO interrupts, per STA flag set */
+        uint32_t DmaTc;
+        uint32_t DmaFifoErrors;
+        uint32_t Events; /*!< Events pushed to the ring since the reset */
+} SD_TraceCounters;
+
+#ifdef SD_TRACE_ENABLE
+#include "sd_time.h"
+
+#define SD_TRACE_TIMER(t)             uint32_t t = SD_TIME_NOW ()
+#define SD_TRACE_CMD(cmd, t, status)  SD_TraceCmd ((cmd), SD_TIME_NOW () - (t), (status))
+#define SD_TRACE_IRQ(sta)             SD_TraceIrq (sta)
+#define SD_TRACE_DMA(tc, fe)          SD_TraceDma ((tc), (fe))
+
+void SD_TraceCmd (uint8_t cmd, uint32_t cycles, uint32_t status);
+void SD_TraceIrq (uint32_t sta);
+void SD_TraceDma (uint8_t tc, uint8_t fe);
+#else
+#define SD_TRACE_TIMER(t)
+#define SD_TRACE_CMD(cmd, t, status)
+#define SD_TRACE_IRQ(sta)
+#define SD_TRACE_DMA(tc, fe)
+#endif
+
+void SD_TraceReset (void);
+void SD_TraceGetCounters (SD_TraceCounters *counters);
+uint32_t SD_TraceRead (SD_TraceEvent *events, uint32_t max);
+void SD_TraceDump (void);
+
+#endif /* SD_TRACE_H_ */
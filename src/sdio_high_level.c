@@ -67,6 +67,12 @@
  *
  *              5 -  Configure the SD Card in wide bus mode: 4-bits data.
  *
+ *              6 -  Switch the card to High-speed (CMD6) if it supports it and
+ *                   use the bypass mode (48MHz), then check with a read of
+ *                   block 0, going down 24/16/8MHz/400KHz on CRC errors. The
+ *                   resulting clock is SD_CardInfo.BusClock, SD_SetBusSpeed()
+ *                   changes it later on.
+ *
  *          B - SD Card Read operation
  *          ==========================
  *           - You can read SD card by using two functions : SD_ReadBlock() and
@@ -183,6 +189,69 @@
  *            // Read operation as described in Section B
  *            Status = SD_ReadBlock(buffer, address, 512);
  *
+ *          G - Programming Model (Asynchronous DMA transfers)
+ *          ==================================================
+ *             Status = SD_WriteMultiBlocksAsync(buffer, address, 512, NUMBEROFBLOCKS,
+ *                                               onDone, context);
+ *             // ... keep working, completion is reported from PendSV:
+ *             // onDone(status, context) is called or SD_GetAsyncState() stops
+ *             // returning SD_TRANSFER_BUSY.
+ *
+ *             - The IRQ handlers only note the end of the data phase, CMD12 and
+ *               the callback run in SD_ProcessAsync() and the deadline of the
+ *               transfer is checked by SD_ProcessTick():
+ *                 void PendSV_Handler(void)
+ *                 {
+ *                   SD_ProcessAsync();
+ *                 }
+ *                 void SysTick_Handler(void)
+ *                 {
+ *                   SD_ProcessTick();
+ *                 }
+ *             - Loops waiting for a callback from inside an interrupt handler
+ *               sleep with SD_AsyncSleep() instead of SD_Sleep().
+ *
+ *          H - Programming Model (Streaming write)
+ *          =======================================
+ *             Status = SD_StreamOpen(address, EXPECTEDBLOCKS);   // ACMD23 + CMD25
+ *             while (logging) {
+ *               Status = SD_StreamWrite(buffer, NUMBEROFBLOCKS);  // data only
+ *               Status = SD_WaitWriteOperation();
+ *             }
+ *             Status = SD_StreamClose();                          // CMD12
+ *             Status = SD_WaitReady();
+ *
+ *          I - Programming Model (Double buffered DMA)
+ *          ===========================================
+ *             // Fill buf0 and buf1, refill each one in onBufferDone(buf, context)
+ *             Status = SD_WriteMultiBlocksDoubleBuffer(buf0, buf1, BUFFERBLOCKS,
+ *                                                      address, NUMBEROFBLOCKS,
+ *                                                      onBufferDone, context);
+ *             Status = SD_WaitWriteOperation();
+ *             while(SD_GetStatus() != SD_TRANSFER_OK);
+ *
+ *          J - Programming Model (Scatter-gather)
+ *          ======================================
+ *             SD_IoVec vec[] = { { header, 1 }, { payload, 8 } };
+ *             Status = SD_WriteMultiBlocksVec(vec, 2, address);   // one CMD25
+ *             Status = SD_WaitWriteOperation();
+ *             while(SD_GetStatus() != SD_TRANSFER_OK);
+ *
+ *          K - Card busy
+ *          =============
+ *            - After a write or an erase the card holds D0 low until it is done
+ *              programming. Instead of polling it with CMD13 (which keeps the CMD
+ *              line and the CPU busy), the end of busy is taken from the D0 rising
+ *              edge through EXTI (SD_BUSY_xxx in sdio_low_level.h).
+ *            - SD_WaitReady() sleeps until D0 goes high and checks the state with a
+ *              single CMD13. SD_NotifyWhenReady() calls back instead, from
+ *              PendSV (SD_ProcessAsync()) once the EXTI interrupt saw the edge.
+ *              SD_IsBusy() just samples the pin.
+ *            - SD_GetStatus() reports SD_TRANSFER_BUSY from D0 without a command.
+ *
+ *             Status = SD_WaitWriteOperation();
+ *             Status = SD_WaitReady();                            // D0, one CMD13
+ *
  *          STM32 SDIO Pin assignment
  *          =========================
  *          +-----------------------------------------------------------+
@@ -224,6 +293,9 @@
 
 /* Includes ------------------------------------------------------------------*/
 #include "sdio_high_level.h"
+#include "sd_time.h"
+#include "sd_trace.h"
+#include "dlog.h"
 //#include "stm324x9i_eval_ioe16.h"
 #include <stm32f4xx.h>
 #include "logf.h"
@@ -260,7 +332,15 @@
  * @brief  SDIO Static flags, TimeOut, FIFO Address
  */
 #define SDIO_STATIC_FLAGS               ((uint32_t)0x000005FF)
-#define SDIO_CMD0TIMEOUT                ((uint32_t)0x00010000)
+
+/**
+ * @brief  Deadlines in microseconds. Read and write are the SDHC limits of the
+ *         spec, and the upper bounds of the values computed from the CSD for SDSC.
+ */
+#define SD_CMD_TIMEOUT_US               ((uint32_t)10000)
+#define SD_INIT_TIMEOUT_US              ((uint32_t)1000000)
+#define SD_READ_TIMEOUT_US              ((uint32_t)100000)
+#define SD_WRITE_TIMEOUT_US             ((uint32_t)250000)
 
 /** 
  * @brief  Mask for errors Card Status R1 (OCR Register)
@@ -298,7 +378,6 @@
 #define SD_STD_CAPACITY                 ((uint32_t)0x00000000)
 #define SD_CHECK_PATTERN                ((uint32_t)0x000001AA)
 
-#define SD_MAX_VOLT_TRIAL               ((uint32_t)0x0000FFFF)
 #define SD_ALLZERO                      ((uint32_t)0x00000000)
 
 #define SD_WIDE_BUS_SUPPORT             ((uint32_t)0x00040000)
@@ -306,7 +385,6 @@
 #define SD_CARD_LOCKED                  ((uint32_t)0x02000000)
 
 #define SD_DATATIMEOUT                  ((uint32_t)0xFFFFFFFF)
-//#define SD_DATATIMEOUT                  ((uint32_t)1000000)
 #define SD_0TO7BITS                     ((uint32_t)0x000000FF)
 #define SD_8TO15BITS                    ((uint32_t)0x0000FF00)
 #define SD_16TO23BITS                   ((uint32_t)0x00FF0000)
@@ -316,6 +394,17 @@
 #define SD_HALFFIFO                     ((uint32_t)0x00000008)
 #define SD_HALFFIFOBYTES                ((uint32_t)0x00000020)
 
+/**
+ * @brief  How far the SDIO may be ahead of the DMA in memory : its 32 word FIFO
+ *         plus the 4 word FIFO of the stream.
+ */
+#define SD_DMA_LAG_BYTES                ((uint32_t)((32 + 4) * 4))
+
+/**
+ * @brief  Largest double buffer, in blocks : NDTR counts words on 16 bits.
+ */
+#define SD_DBM_MAX_BLOCKS               ((uint32_t)(0xFFFF / (512 / 4)))
+
 /** 
  * @brief  Command Class Supported
  */
@@ -344,17 +433,116 @@
  * @{
  */
 
-static uint32_t CardType = SDIO_STD_CAPACITY_SD_CARD_V1_1;
-static uint32_t CSD_Tab[4], CID_Tab[4], RCA = 0;
-static uint8_t SDSTATUS_Tab[16];
-__IO uint32_t StopCondition = 0;
-__IO SD_Error TransferError = SD_OK;
-__IO uint32_t TransferEnd = 0, DMAEndOfTransfer = 0;
-SD_CardInfo SDCardInfo;
+/*
+ * Asynchronous transfer states (see SD_ReadMultiBlocksAsync). The IRQ handlers only
+ * take a transfer from RUNNING to DONE, SD_ProcessAsync (PendSV) finishes it.
+ */
+#define ASYNC_IDLE                    0
+#define ASYNC_RUNNING                 1 /*!< Data phase in flight */
+#define ASYNC_DONE                    2 /*!< Data phase over or failed, waits for SD_ProcessAsync */
+#define ASYNC_FINISHING               3 /*!< In SD_ProcessAsync : CMD12, then the callback */
+
+/*
+ * Everything the driver knows about the card on the SDIO slot : its identity, the
+ * bus settings, the timeouts and the state of the transfer in flight. The SDIO
+ * transport of the block device layer (sd_blockdev.h) drives this one instance,
+ * other transports keep their own context.
+ */
+typedef struct {
+        /* Identity */
+        uint32_t Type;
+        uint32_t CSD[4];
+        uint32_t CID[4];
+        uint32_t RCA;
+        uint8_t SdStatus[16];
+        uint32_t BlockLen; /*!< Last length set by CMD16, 0 when unknown */
+        SD_CardInfo Info;
+
+        /* Bus */
+        SD_BusSpeed BusSpeed;
+        uint32_t BusWide;
+        uint32_t HighSpeedMode; /*!< Card switched to high speed by CMD6 */
+
+        /*
+         * Per block access timeouts (from the CSD, see ComputeTimeouts) and the
+         * deadline of the transfer in flight, used by SD_WaitReadOperation /
+         * SD_WaitWriteOperation.
+         */
+        uint32_t ReadTimeoutUs;
+        uint32_t WriteTimeoutUs;
+        uint32_t WaitTimeoutUs;
+
+        /* Transfer in flight, set by the IRQ handlers */
+        __IO uint32_t StopCondition;
+        __IO SD_Error TransferError;
+        __IO uint32_t TransferEnd;
+        __IO uint32_t DMAEndOfTransfer;
+
+        /*
+         * End of busy notification (SD_NotifyWhenReady). The D0 EXTI sets
+         * ReadyFired, the callback runs from SD_ProcessAsync.
+         */
+        SD_TransferCallback ReadyCallback;
+        void *ReadyContext;
+        __IO uint8_t ReadyFired;
+
+        /* Asynchronous transfer, one of the ASYNC_ states */
+        __IO uint32_t AsyncState;
+        __IO SD_Error AsyncStatus;
+        SD_TransferCallback AsyncCallback;
+        void *AsyncContext;
+        SD_Deadline AsyncDeadline;
+        __IO uint8_t AsyncExpired;
+
+        /* Streaming write session (CMD25 left open between SD_StreamWrite calls) */
+        uint32_t StreamOpen;
+        uint32_t StreamBlocks;
+
+        /*
+         * Double buffered DMA transfer. BufferDone counts blocks, and is compared
+         * to BufferTotal to find the last TC, after which the circular DMA is stopped.
+         */
+        __IO uint32_t DoubleBufferActive;
+        uint32_t BufferBlocksEach, BufferTotal;
+        __IO uint32_t BufferDone;
+        SD_BufferCallback BufferCallback;
+        void *BufferContext;
+
+        /*
+         * Scatter-gather cursor : next chunk to be loaded into the idle DMA memory
+         * register. VecBlock is the offset in VecCurrent, VecChunk the size of all
+         * the chunks.
+         */
+        const SD_IoVec *VecCurrent, *VecEnd;
+        uint32_t VecBlock;
+        uint32_t VecChunk;
+} SD_Device;
+
+static SD_Device Card = {
+        .Type = SDIO_STD_CAPACITY_SD_CARD_V1_1,
+        .BusSpeed = SD_BUS_SPEED_DEFAULT,
+        .BusWide = SDIO_BusWide_1b,
+        .ReadTimeoutUs = SD_READ_TIMEOUT_US,
+        .WriteTimeoutUs = SD_WRITE_TIMEOUT_US,
+        .WaitTimeoutUs = SD_WRITE_TIMEOUT_US,
+        .TransferError = SD_OK,
+        .AsyncState = ASYNC_IDLE,
+        .AsyncStatus = SD_OK,
+        .VecChunk = 1
+};
+
+/*
+ * SDIO_CK = SDIOCLK / (div + 2), SDIOCLK being 48MHz. Indexed by SD_BusSpeed, the
+ * first entry bypasses the divider.
+ */
+static const uint8_t BusClockDiv[] = { 0, SDIO_TRANSFER_CLK_DIV, 1, 4, SDIO_INIT_CLK_DIV };
+static const uint32_t BusClockHz[] = { 48000000, 24000000, 16000000, 8000000, 400000 };
+
+/* Scratch register images, only used while building a command or a transfer. */
+static SDIO_InitTypeDef SDIO_InitStructure;
+static SDIO_CmdInitTypeDef SDIO_CmdInitStructure;
+static SDIO_DataInitTypeDef SDIO_DataInitStructure;
 
-SDIO_InitTypeDef SDIO_InitStructure;
-SDIO_CmdInitTypeDef SDIO_CmdInitStructure;
-SDIO_DataInitTypeDef SDIO_DataInitStructure;
 /**
  * @}
  */
@@ -371,6 +559,30 @@ static SD_Error CmdResp6Error (uint8_t cmd, uint16_t *prca);
 static SD_Error SDEnWideBus (FunctionalState NewState);
 static SD_Error IsCardProgramming (uint8_t *pstatus);
 static SD_Error FindSCR (uint16_t rca, uint32_t *pscr);
+static SD_Error SetBlockLen (uint32_t BlockLen);
+static SD_Error SendWriteMultiBlockCmd (uint64_t WriteAddr, uint16_t BlockSize, uint32_t PreEraseBlocks);
+static uint8_t StartAsync (SD_TransferCallback callback, void *context);
+static SD_Error ArmAsync (SD_Error errorstatus);
+static void CheckAsyncDeadline (void);
+static void CompleteAsyncTransfer (void);
+static void FinishAsyncTransfer (void);
+static void ConfigureSDIO (uint32_t Wide);
+static uint32_t WaitCmdResponse (void);
+static void SetDataTimeout (uint32_t NumberOfBlocks, uint8_t write);
+static void ComputeTimeouts (SD_CSD *csd);
+static uint8_t WaitDataEnd (SD_Deadline *deadline);
+static uint8_t WaitNotBusy (SD_Deadline *deadline);
+static void CompleteReady (void);
+static SD_Error NegotiateBusSpeed (void);
+static SD_Error CheckDoubleBuffer (uint8_t *buffer0, uint8_t *buffer1, uint32_t BufferBlocks, uint32_t NumberOfBlocks);
+static void StartDoubleBuffer (uint32_t BufferBlocks, uint32_t NumberOfBlocks, SD_BufferCallback callback, void *context);
+static SD_Error StartVec (const SD_IoVec *vec, uint32_t count, uint8_t **first, uint8_t **second, uint32_t *NumberOfBlocks);
+static uint8_t *NextVecBlock (void);
+static uint32_t Gcd (uint32_t a, uint32_t b);
+static void VecBufferDone (uint8_t *buffer, void *context);
+static void StopDoubleBuffer (void);
+static uint8_t MissedSwap (void);
+static void FailDma (SD_Error error);
 uint8_t convert_from_bytes_to_power_of_two (uint16_t NumberOfBytes);
 
 /**
@@ -401,7 +613,11 @@ SD_Error SD_Init (void)
 {
         __IO SD_Error errorstatus = SD_OK;
 
+        /* Asynchronous transfers are finished from PendSV, below every interrupt */
+        NVIC_SetPriority (PendSV_IRQn, (1 << __NVIC_PRIO_BITS) - 1);
+
         /* SDIO Peripheral Low Level Init */
+        SD_TimeInit ();
         SD_LowLevel_Init ();
         SDIO_DeInit ();
         errorstatus = SD_PowerON ();
@@ -425,23 +641,19 @@ SD_Error SD_Init (void)
         logf ("SD_InitializeCards OK\r\n");
 
         /*!< Configure the SDIO peripheral */
-        /*!< SDIO_CK = SDIOCLK / (SDIO_TRANSFER_CLK_DIV + 2) */
-        /*!< on STM32F4xx devices, SDIOCLK is fixed to 48MHz */
-        SDIO_InitStructure.SDIO_ClockDiv = SDIO_TRANSFER_CLK_DIV;
-        SDIO_InitStructure.SDIO_ClockEdge = SDIO_ClockEdge_Rising;
-        SDIO_InitStructure.SDIO_ClockBypass = SDIO_ClockBypass_Disable;
-        SDIO_InitStructure.SDIO_ClockPowerSave = SDIO_ClockPowerSave_Disable;
-        SDIO_InitStructure.SDIO_BusWide = SDIO_BusWide_1b;
-        SDIO_InitStructure.SDIO_HardwareFlowControl = SDIO_HardwareFlowControl_Disable;
-        SDIO_Init (&SDIO_InitStructure);
+        /*!< Still at the identification clock : a CRC error in CMD7, ACMD51 or ACMD6 */
+        /*!< would fail SD_Init, NegotiateBusSpeed speeds the bus up afterwards */
+        Card.BusSpeed = SD_BUS_SPEED_INIT;
+        ConfigureSDIO (SDIO_BusWide_1b);
 
         /*----------------- Read CSD/CID MSD registers ------------------*/
-        errorstatus = SD_GetCardInfo (&SDCardInfo);
+        errorstatus = SD_GetCardInfo (&Card.Info);
 
         if (errorstatus == SD_OK) {
                 /*----------------- Select Card --------------------------------*/
                 logf ("SD_GetCardInfo OK\r\n");
-                errorstatus = SD_SelectDeselect ((uint32_t) (SDCardInfo.RCA << 16));
+                ComputeTimeouts (&Card.Info.SD_csd);
+                errorstatus = SD_SelectDeselect ((uint32_t) (Card.Info.RCA << 16));
         }
         else {
                 logf ("SD_SelectDeselect failed\r\n");
@@ -457,6 +669,11 @@ SD_Error SD_Init (void)
 
         if (errorstatus == SD_OK) {
                 logf ("SD_EnableWideBusOperation OK\r\n");
+                errorstatus = NegotiateBusSpeed ();
+        }
+
+        if (errorstatus == SD_OK) {
+                logf ("SD bus clock %u Hz\r\n", (unsigned int) Card.Info.BusClock);
         }
 
         return (errorstatus);
@@ -474,6 +691,11 @@ SDTransferState SD_GetStatus (void)
 {
         SDCardState cardstate = SD_CARD_TRANSFER;
 
+        /*!< D0 low : still programming, no need to ask with CMD13 */
+        if (SD_LowLevel_IsBusy ()) {
+                return (SD_TRANSFER_BUSY);
+        }
+
         cardstate = SD_GetState ();
 
         if (cardstate == SD_CARD_TRANSFER) {
@@ -536,8 +758,9 @@ uint8_t SD_Detect (void)
 SD_Error SD_PowerON (void)
 {
         __IO SD_Error errorstatus = SD_OK;
-        uint32_t response = 0, count = 0, validvoltage = 0;
+        uint32_t response = 0, validvoltage = 0;
         uint32_t SDType = SD_STD_CAPACITY;
+        SD_Deadline deadline;
 
         /*!< Power ON Sequence -----------------------------------------------------*/
         /*!< Configure the SDIO peripheral */
@@ -560,6 +783,8 @@ SD_Error SD_PowerON (void)
 
         /*!< CMD0: GO_IDLE_STATE ---------------------------------------------------*/
         /*!< No CMD response required */
+        Card.BlockLen = 0;
+        Card.HighSpeedMode = 0;
         SDIO_CmdInitStructure.SDIO_Argument = 0x0;
         SDIO_CmdInitStructure.SDIO_CmdIndex = SD_CMD_GO_IDLE_STATE;
         SDIO_CmdInitStructure.SDIO_Response = SDIO_Response_No;
@@ -590,7 +815,7 @@ SD_Error SD_PowerON (void)
         errorstatus = CmdResp7Error ();
 
         if (errorstatus == SD_OK) {
-                CardType = SDIO_STD_CAPACITY_SD_CARD_V2_0; /*!< SD Card 2.0 */
+                Card.Type = SDIO_STD_CAPACITY_SD_CARD_V2_0; /*!< SD Card 2.0 */
                 SDType = SD_HIGH_CAPACITY;
         }
         else {
@@ -618,7 +843,9 @@ SD_Error SD_PowerON (void)
         if (errorstatus == SD_OK) {
                 /*!< SD CARD */
                 /*!< Send ACMD41 SD_APP_OP_COND with Argument 0x80100000 */
-                while ((!validvoltage) && (count < SD_MAX_VOLT_TRIAL )) {
+                SD_DeadlineStart (&deadline, SD_INIT_TIMEOUT_US);
+
+                while ((!validvoltage) && !SD_DeadlineExpired (&deadline)) {
 
                         /*!< SEND CMD55 APP_CMD with RCA as 0 */
                         SDIO_CmdInitStructure.SDIO_Argument = 0x00;
@@ -647,15 +874,14 @@ SD_Error SD_PowerON (void)
 
                         response = SDIO_GetResponse (SDIO_RESP1);
                         validvoltage = (((response >> 31) == 1) ? 1 : 0);
-                        count++;
                 }
-                if (count >= SD_MAX_VOLT_TRIAL ) {
+                if (!validvoltage) {
                         errorstatus = SD_INVALID_VOLTRANGE;
                         return (errorstatus);
                 }
 
                 if (response &= SD_HIGH_CAPACITY ) {
-                        CardType = SDIO_HIGH_CAPACITY_SD_CARD;
+                        Card.Type = SDIO_HIGH_CAPACITY_SD_CARD;
                 }
 
         }/*!< else MMC Card */
@@ -694,7 +920,7 @@ SD_Error SD_InitializeCards (void)
                 return (errorstatus);
         }
 
-        if (SDIO_SECURE_DIGITAL_IO_CARD != CardType) {
+        if (SDIO_SECURE_DIGITAL_IO_CARD != Card.Type) {
                 /*!< Send CMD2 ALL_SEND_CID */
                 SDIO_CmdInitStructure.SDIO_Argument = 0x0;
                 SDIO_CmdInitStructure.SDIO_CmdIndex = SD_CMD_ALL_SEND_CID;
@@ -709,13 +935,13 @@ SD_Error SD_InitializeCards (void)
                         return (errorstatus);
                 }
 
-                CID_Tab[0] = SDIO_GetResponse (SDIO_RESP1);
-                CID_Tab[1] = SDIO_GetResponse (SDIO_RESP2);
-                CID_Tab[2] = SDIO_GetResponse (SDIO_RESP3);
-                CID_Tab[3] = SDIO_GetResponse (SDIO_RESP4);
+                Card.CID[0] = SDIO_GetResponse (SDIO_RESP1);
+                Card.CID[1] = SDIO_GetResponse (SDIO_RESP2);
+                Card.CID[2] = SDIO_GetResponse (SDIO_RESP3);
+                Card.CID[3] = SDIO_GetResponse (SDIO_RESP4);
         }
-        if ((SDIO_STD_CAPACITY_SD_CARD_V1_1 == CardType) || (SDIO_STD_CAPACITY_SD_CARD_V2_0 == CardType) || (SDIO_SECURE_DIGITAL_IO_COMBO_CARD == CardType)
-                        || (SDIO_HIGH_CAPACITY_SD_CARD == CardType)) {
+        if ((SDIO_STD_CAPACITY_SD_CARD_V1_1 == Card.Type) || (SDIO_STD_CAPACITY_SD_CARD_V2_0 == Card.Type) || (SDIO_SECURE_DIGITAL_IO_COMBO_CARD == Card.Type)
+                        || (SDIO_HIGH_CAPACITY_SD_CARD == Card.Type)) {
                 /*!< Send CMD3 SET_REL_ADDR with argument 0 */
                 /*!< SD Card publishes its RCA. */
                 SDIO_CmdInitStructure.SDIO_Argument = 0x00;
@@ -732,8 +958,8 @@ SD_Error SD_InitializeCards (void)
                 }
         }
 
-        if (SDIO_SECURE_DIGITAL_IO_CARD != CardType) {
-                RCA = rca;
+        if (SDIO_SECURE_DIGITAL_IO_CARD != Card.Type) {
+                Card.RCA = rca;
 
                 /*!< Send CMD9 SEND_CSD with argument as card's RCA */
                 SDIO_CmdInitStructure.SDIO_Argument = (uint32_t) (rca << 16);
@@ -749,10 +975,10 @@ SD_Error SD_InitializeCards (void)
                         return (errorstatus);
                 }
 
-                CSD_Tab[0] = SDIO_GetResponse (SDIO_RESP1);
-                CSD_Tab[1] = SDIO_GetResponse (SDIO_RESP2);
-                CSD_Tab[2] = SDIO_GetResponse (SDIO_RESP3);
-                CSD_Tab[3] = SDIO_GetResponse (SDIO_RESP4);
+                Card.CSD[0] = SDIO_GetResponse (SDIO_RESP1);
+                Card.CSD[1] = SDIO_GetResponse (SDIO_RESP2);
+                Card.CSD[2] = SDIO_GetResponse (SDIO_RESP3);
+                Card.CSD[3] = SDIO_GetResponse (SDIO_RESP4);
         }
 
         errorstatus = SD_OK; /*!< All cards get intialized */
@@ -771,65 +997,66 @@ SD_Error SD_GetCardInfo (SD_CardInfo *cardinfo)
         SD_Error errorstatus = SD_OK;
         uint8_t tmp = 0;
 
-        cardinfo->CardType = (uint8_t) CardType;
-        cardinfo->RCA = (uint16_t) RCA;
+        cardinfo->CardType = (uint8_t) Card.Type;
+        cardinfo->RCA = (uint16_t) Card.RCA;
+        cardinfo->BusClock = BusClockHz[Card.BusSpeed];
 
         /*!< Byte 0 */
-        tmp = (uint8_t) ((CSD_Tab[0] & 0xFF000000) >> 24);
+        tmp = (uint8_t) ((Card.CSD[0] & 0xFF000000) >> 24);
         cardinfo->SD_csd.CSDStruct = (tmp & 0xC0) >> 6;
         cardinfo->SD_csd.SysSpecVersion = (tmp & 0x3C) >> 2;
         cardinfo->SD_csd.Reserved1 = tmp & 0x03;
 
         /*!< Byte 1 */
-        tmp = (uint8_t) ((CSD_Tab[0] & 0x00FF0000) >> 16);
+        tmp = (uint8_t) ((Card.CSD[0] & 0x00FF0000) >> 16);
         cardinfo->SD_csd.TAAC = tmp;
 
         /*!< Byte 2 */
-        tmp = (uint8_t) ((CSD_Tab[0] & 0x0000FF00) >> 8);
+        tmp = (uint8_t) ((Card.CSD[0] & 0x0000FF00) >> 8);
         cardinfo->SD_csd.NSAC = tmp;
 
         /*!< Byte 3 */
-        tmp = (uint8_t) (CSD_Tab[0] & 0x000000FF);
+        tmp = (uint8_t) (Card.CSD[0] & 0x000000FF);
         cardinfo->SD_csd.MaxBusClkFrec = tmp;
 
         /*!< Byte 4 */
-        tmp = (uint8_t) ((CSD_Tab[1] & 0xFF000000) >> 24);
+        tmp = (uint8_t) ((Card.CSD[1] & 0xFF000000) >> 24);
         cardinfo->SD_csd.CardComdClasses = tmp << 4;
 
         /*!< Byte 5 */
-        tmp = (uint8_t) ((CSD_Tab[1] & 0x00FF0000) >> 16);
+        tmp = (uint8_t) ((Card.CSD[1] & 0x00FF0000) >> 16);
         cardinfo->SD_csd.CardComdClasses |= (tmp & 0xF0) >> 4;
         cardinfo->SD_csd.RdBlockLen = tmp & 0x0F;
 
         /*!< Byte 6 */
-        tmp = (uint8_t) ((CSD_Tab[1] & 0x0000FF00) >> 8);
+        tmp = (uint8_t) ((Card.CSD[1] & 0x0000FF00) >> 8);
         cardinfo->SD_csd.PartBlockRead = (tmp & 0x80) >> 7;
         cardinfo->SD_csd.WrBlockMisalign = (tmp & 0x40) >> 6;
         cardinfo->SD_csd.RdBlockMisalign = (tmp & 0x20) >> 5;
         cardinfo->SD_csd.DSRImpl = (tmp & 0x10) >> 4;
         cardinfo->SD_csd.Reserved2 = 0; /*!< Reserved */
 
-        if ((CardType == SDIO_STD_CAPACITY_SD_CARD_V1_1 )|| (CardType == SDIO_STD_CAPACITY_SD_CARD_V2_0)){
+        if ((Card.Type == SDIO_STD_CAPACITY_SD_CARD_V1_1 )|| (Card.Type == SDIO_STD_CAPACITY_SD_CARD_V2_0)){
         cardinfo->SD_csd.DeviceSize = (tmp & 0x03) << 10;
 
         /*!< Byte 7 */
-        tmp = (uint8_t)(CSD_Tab[1] & 0x000000FF);
+        tmp = (uint8_t)(Card.CSD[1] & 0x000000FF);
         cardinfo->SD_csd.DeviceSize |= (tmp) << 2;
 
         /*!< Byte 8 */
-        tmp = (uint8_t)((CSD_Tab[2] & 0xFF000000) >> 24);
+        tmp = (uint8_t)((Card.CSD[2] & 0xFF000000) >> 24);
         cardinfo->SD_csd.DeviceSize |= (tmp & 0xC0) >> 6;
 
         cardinfo->SD_csd.MaxRdCurrentVDDMin = (tmp & 0x38) >> 3;
         cardinfo->SD_csd.MaxRdCurrentVDDMax = (tmp & 0x07);
 
         /*!< Byte 9 */
-        tmp = (uint8_t)((CSD_Tab[2] & 0x00FF0000) >> 16);
+        tmp = (uint8_t)((Card.CSD[2] & 0x00FF0000) >> 16);
         cardinfo->SD_csd.MaxWrCurrentVDDMin = (tmp & 0xE0) >> 5;
         cardinfo->SD_csd.MaxWrCurrentVDDMax = (tmp & 0x1C) >> 2;
         cardinfo->SD_csd.DeviceSizeMul = (tmp & 0x03) << 1;
         /*!< Byte 10 */
-        tmp = (uint8_t)((CSD_Tab[2] & 0x0000FF00) >> 8);
+        tmp = (uint8_t)((Card.CSD[2] & 0x0000FF00) >> 8);
         cardinfo->SD_csd.DeviceSizeMul |= (tmp & 0x80) >> 7;
 
         cardinfo->CardCapacity = (cardinfo->SD_csd.DeviceSize + 1);
@@ -837,24 +1064,24 @@ SD_Error SD_GetCardInfo (SD_CardInfo *cardinfo)
         cardinfo->CardBlockSize = 1 << (cardinfo->SD_csd.RdBlockLen);
         cardinfo->CardCapacity *= cardinfo->CardBlockSize;
 }
-else if (CardType == SDIO_HIGH_CAPACITY_SD_CARD)
+else if (Card.Type == SDIO_HIGH_CAPACITY_SD_CARD)
 {
         /*!< Byte 7 */
-        tmp = (uint8_t)(CSD_Tab[1] & 0x000000FF);
+        tmp = (uint8_t)(Card.CSD[1] & 0x000000FF);
         cardinfo->SD_csd.DeviceSize = (tmp & 0x3F) << 16;
 
         /*!< Byte 8 */
-        tmp = (uint8_t)((CSD_Tab[2] & 0xFF000000) >> 24);
+        tmp = (uint8_t)((Card.CSD[2] & 0xFF000000) >> 24);
 
         cardinfo->SD_csd.DeviceSize |= (tmp << 8);
 
         /*!< Byte 9 */
-        tmp = (uint8_t)((CSD_Tab[2] & 0x00FF0000) >> 16);
+        tmp = (uint8_t)((Card.CSD[2] & 0x00FF0000) >> 16);
 
         cardinfo->SD_csd.DeviceSize |= (tmp);
 
         /*!< Byte 10 */
-        tmp = (uint8_t)((CSD_Tab[2] & 0x0000FF00) >> 8);
+        tmp = (uint8_t)((Card.CSD[2] & 0x0000FF00) >> 8);
 
         cardinfo->CardCapacity = ((uint64_t)cardinfo->SD_csd.DeviceSize + 1) * 512 * 1024;
         cardinfo->CardBlockSize = 512;
@@ -864,26 +1091,26 @@ else if (CardType == SDIO_HIGH_CAPACITY_SD_CARD)
         cardinfo->SD_csd.EraseGrMul = (tmp & 0x3F) << 1;
 
         /*!< Byte 11 */
-        tmp = (uint8_t) (CSD_Tab[2] & 0x000000FF);
+        tmp = (uint8_t) (Card.CSD[2] & 0x000000FF);
         cardinfo->SD_csd.EraseGrMul |= (tmp & 0x80) >> 7;
         cardinfo->SD_csd.WrProtectGrSize = (tmp & 0x7F);
 
         /*!< Byte 12 */
-        tmp = (uint8_t) ((CSD_Tab[3] & 0xFF000000) >> 24);
+        tmp = (uint8_t) ((Card.CSD[3] & 0xFF000000) >> 24);
         cardinfo->SD_csd.WrProtectGrEnable = (tmp & 0x80) >> 7;
         cardinfo->SD_csd.ManDeflECC = (tmp & 0x60) >> 5;
         cardinfo->SD_csd.WrSpeedFact = (tmp & 0x1C) >> 2;
         cardinfo->SD_csd.MaxWrBlockLen = (tmp & 0x03) << 2;
 
         /*!< Byte 13 */
-        tmp = (uint8_t) ((CSD_Tab[3] & 0x00FF0000) >> 16);
+        tmp = (uint8_t) ((Card.CSD[3] & 0x00FF0000) >> 16);
         cardinfo->SD_csd.MaxWrBlockLen |= (tmp & 0xC0) >> 6;
         cardinfo->SD_csd.WriteBlockPaPartial = (tmp & 0x20) >> 5;
         cardinfo->SD_csd.Reserved3 = 0;
         cardinfo->SD_csd.ContentProtectAppli = (tmp & 0x01);
 
         /*!< Byte 14 */
-        tmp = (uint8_t) ((CSD_Tab[3] & 0x0000FF00) >> 8);
+        tmp = (uint8_t) ((Card.CSD[3] & 0x0000FF00) >> 8);
         cardinfo->SD_csd.FileFormatGrouop = (tmp & 0x80) >> 7;
         cardinfo->SD_csd.CopyFlag = (tmp & 0x40) >> 6;
         cardinfo->SD_csd.PermWrProtect = (tmp & 0x20) >> 5;
@@ -892,73 +1119,73 @@ else if (CardType == SDIO_HIGH_CAPACITY_SD_CARD)
         cardinfo->SD_csd.ECC = (tmp & 0x03);
 
         /*!< Byte 15 */
-        tmp = (uint8_t) (CSD_Tab[3] & 0x000000FF);
+        tmp = (uint8_t) (Card.CSD[3] & 0x000000FF);
         cardinfo->SD_csd.CSD_CRC = (tmp & 0xFE) >> 1;
         cardinfo->SD_csd.Reserved4 = 1;
 
         /*!< Byte 0 */
-        tmp = (uint8_t) ((CID_Tab[0] & 0xFF000000) >> 24);
+        tmp = (uint8_t) ((Card.CID[0] & 0xFF000000) >> 24);
         cardinfo->SD_cid.ManufacturerID = tmp;
 
         /*!< Byte 1 */
-        tmp = (uint8_t) ((CID_Tab[0] & 0x00FF0000) >> 16);
+        tmp = (uint8_t) ((Card.CID[0] & 0x00FF0000) >> 16);
         cardinfo->SD_cid.OEM_AppliID = tmp << 8;
 
         /*!< Byte 2 */
-        tmp = (uint8_t) ((CID_Tab[0] & 0x000000FF00) >> 8);
+        tmp = (uint8_t) ((Card.CID[0] & 0x000000FF00) >> 8);
         cardinfo->SD_cid.OEM_AppliID |= tmp;
 
         /*!< Byte 3 */
-        tmp = (uint8_t) (CID_Tab[0] & 0x000000FF);
+        tmp = (uint8_t) (Card.CID[0] & 0x000000FF);
         cardinfo->SD_cid.ProdName1 = tmp << 24;
 
         /*!< Byte 4 */
-        tmp = (uint8_t) ((CID_Tab[1] & 0xFF000000) >> 24);
+        tmp = (uint8_t) ((Card.CID[1] & 0xFF000000) >> 24);
         cardinfo->SD_cid.ProdName1 |= tmp << 16;
 
         /*!< Byte 5 */
-        tmp = (uint8_t) ((CID_Tab[1] & 0x00FF0000) >> 16);
+        tmp = (uint8_t) ((Card.CID[1] & 0x00FF0000) >> 16);
         cardinfo->SD_cid.ProdName1 |= tmp << 8;
 
         /*!< Byte 6 */
-        tmp = (uint8_t) ((CID_Tab[1] & 0x0000FF00) >> 8);
+        tmp = (uint8_t) ((Card.CID[1] & 0x0000FF00) >> 8);
         cardinfo->SD_cid.ProdName1 |= tmp;
 
         /*!< Byte 7 */
-        tmp = (uint8_t) (CID_Tab[1] & 0x000000FF);
+        tmp = (uint8_t) (Card.CID[1] & 0x000000FF);
         cardinfo->SD_cid.ProdName2 = tmp;
 
         /*!< Byte 8 */
-        tmp = (uint8_t) ((CID_Tab[2] & 0xFF000000) >> 24);
+        tmp = (uint8_t) ((Card.CID[2] & 0xFF000000) >> 24);
         cardinfo->SD_cid.ProdRev = tmp;
 
         /*!< Byte 9 */
-        tmp = (uint8_t) ((CID_Tab[2] & 0x00FF0000) >> 16);
+        tmp = (uint8_t) ((Card.CID[2] & 0x00FF0000) >> 16);
         cardinfo->SD_cid.ProdSN = tmp << 24;
 
         /*!< Byte 10 */
-        tmp = (uint8_t) ((CID_Tab[2] & 0x0000FF00) >> 8);
+        tmp = (uint8_t) ((Card.CID[2] & 0x0000FF00) >> 8);
         cardinfo->SD_cid.ProdSN |= tmp << 16;
 
         /*!< Byte 11 */
-        tmp = (uint8_t) (CID_Tab[2] & 0x000000FF);
+        tmp = (uint8_t) (Card.CID[2] & 0x000000FF);
         cardinfo->SD_cid.ProdSN |= tmp << 8;
 
         /*!< Byte 12 */
-        tmp = (uint8_t) ((CID_Tab[3] & 0xFF000000) >> 24);
+        tmp = (uint8_t) ((Card.CID[3] & 0xFF000000) >> 24);
         cardinfo->SD_cid.ProdSN |= tmp;
 
         /*!< Byte 13 */
-        tmp = (uint8_t) ((CID_Tab[3] & 0x00FF0000) >> 16);
+        tmp = (uint8_t) ((Card.CID[3] & 0x00FF0000) >> 16);
         cardinfo->SD_cid.Reserved1 |= (tmp & 0xF0) >> 4;
         cardinfo->SD_cid.ManufactDate = (tmp & 0x0F) << 8;
 
         /*!< Byte 14 */
-        tmp = (uint8_t) ((CID_Tab[3] & 0x0000FF00) >> 8);
+        tmp = (uint8_t) ((Card.CID[3] & 0x0000FF00) >> 8);
         cardinfo->SD_cid.ManufactDate |= tmp;
 
         /*!< Byte 15 */
-        tmp = (uint8_t) (CID_Tab[3] & 0x000000FF);
+        tmp = (uint8_t) (Card.CID[3] & 0x000000FF);
         cardinfo->SD_cid.CID_CRC = (tmp & 0xFE) >> 1;
         cardinfo->SD_cid.Reserved2 = 1;
 
@@ -980,70 +1207,70 @@ SD_Error SD_GetCardStatus (SD_CardStatus *cardstatus)
         SD_Error errorstatus = SD_OK;
         uint8_t tmp = 0;
 
-        errorstatus = SD_SendSDStatus ((uint32_t *) SDSTATUS_Tab);
+        errorstatus = SD_SendSDStatus ((uint32_t *) Card.SdStatus);
 
         if (errorstatus != SD_OK) {
                 return (errorstatus);
         }
 
         /*!< Byte 0 */
-        tmp = (uint8_t) ((SDSTATUS_Tab[0] & 0xC0) >> 6);
+        tmp = (uint8_t) ((Card.SdStatus[0] & 0xC0) >> 6);
         cardstatus->DAT_BUS_WIDTH = tmp;
 
         /*!< Byte 0 */
-        tmp = (uint8_t) ((SDSTATUS_Tab[0] & 0x20) >> 5);
+        tmp = (uint8_t) ((Card.SdStatus[0] & 0x20) >> 5);
         cardstatus->SECURED_MODE = tmp;
 
         /*!< Byte 2 */
-        tmp = (uint8_t) ((SDSTATUS_Tab[2] & 0xFF));
+        tmp = (uint8_t) ((Card.SdStatus[2] & 0xFF));
         cardstatus->SD_CARD_TYPE = tmp << 8;
 
         /*!< Byte 3 */
-        tmp = (uint8_t) ((SDSTATUS_Tab[3] & 0xFF));
+        tmp = (uint8_t) ((Card.SdStatus[3] & 0xFF));
         cardstatus->SD_CARD_TYPE |= tmp;
 
         /*!< Byte 4 */
-        tmp = (uint8_t) (SDSTATUS_Tab[4] & 0xFF);
+        tmp = (uint8_t) (Card.SdStatus[4] & 0xFF);
         cardstatus->SIZE_OF_PROTECTED_AREA = tmp << 24;
 
         /*!< Byte 5 */
-        tmp = (uint8_t) (SDSTATUS_Tab[5] & 0xFF);
+        tmp = (uint8_t) (Card.SdStatus[5] & 0xFF);
         cardstatus->SIZE_OF_PROTECTED_AREA |= tmp << 16;
 
         /*!< Byte 6 */
-        tmp = (uint8_t) (SDSTATUS_Tab[6] & 0xFF);
+        tmp = (uint8_t) (Card.SdStatus[6] & 0xFF);
         cardstatus->SIZE_OF_PROTECTED_AREA |= tmp << 8;
 
         /*!< Byte 7 */
-        tmp = (uint8_t) (SDSTATUS_Tab[7] & 0xFF);
+        tmp = (uint8_t) (Card.SdStatus[7] & 0xFF);
         cardstatus->SIZE_OF_PROTECTED_AREA |= tmp;
 
         /*!< Byte 8 */
-        tmp = (uint8_t) ((SDSTATUS_Tab[8] & 0xFF));
+        tmp = (uint8_t) ((Card.SdStatus[8] & 0xFF));
         cardstatus->SPEED_CLASS = tmp;
 
         /*!< Byte 9 */
-        tmp = (uint8_t) ((SDSTATUS_Tab[9] & 0xFF));
+        tmp = (uint8_t) ((Card.SdStatus[9] & 0xFF));
         cardstatus->PERFORMANCE_MOVE = tmp;
 
         /*!< Byte 10 */
-        tmp = (uint8_t) ((SDSTATUS_Tab[10] & 0xF0) >> 4);
+        tmp = (uint8_t) ((Card.SdStatus[10] & 0xF0) >> 4);
         cardstatus->AU_SIZE = tmp;
 
         /*!< Byte 11 */
-        tmp = (uint8_t) (SDSTATUS_Tab[11] & 0xFF);
+        tmp = (uint8_t) (Card.SdStatus[11] & 0xFF);
         cardstatus->ERASE_SIZE = tmp << 8;
 
         /*!< Byte 12 */
-        tmp = (uint8_t) (SDSTATUS_Tab[12] & 0xFF);
+        tmp = (uint8_t) (Card.SdStatus[12] & 0xFF);
         cardstatus->ERASE_SIZE |= tmp;
 
         /*!< Byte 13 */
-        tmp = (uint8_t) ((SDSTATUS_Tab[13] & 0xFC) >> 2);
+        tmp = (uint8_t) ((Card.SdStatus[13] & 0xFC) >> 2);
         cardstatus->ERASE_TIMEOUT = tmp;
 
         /*!< Byte 13 */
-        tmp = (uint8_t) ((SDSTATUS_Tab[13] & 0x3));
+        tmp = (uint8_t) ((Card.SdStatus[13] & 0x3));
         cardstatus->ERASE_OFFSET = tmp;
 
         return (errorstatus);
@@ -1064,11 +1291,11 @@ SD_Error SD_EnableWideBusOperation (uint32_t WideMode)
         SD_Error errorstatus = SD_OK;
 
         /*!< MMC Card doesn't support this feature */
-        if (SDIO_MULTIMEDIA_CARD == CardType) {
+        if (SDIO_MULTIMEDIA_CARD == Card.Type) {
                 errorstatus = SD_UNSUPPORTED_FEATURE;
                 return (errorstatus);
         }
-        else if ((SDIO_STD_CAPACITY_SD_CARD_V1_1 == CardType) || (SDIO_STD_CAPACITY_SD_CARD_V2_0 == CardType) || (SDIO_HIGH_CAPACITY_SD_CARD == CardType)) {
+        else if ((SDIO_STD_CAPACITY_SD_CARD_V1_1 == Card.Type) || (SDIO_STD_CAPACITY_SD_CARD_V2_0 == Card.Type) || (SDIO_HIGH_CAPACITY_SD_CARD == Card.Type)) {
                 if (SDIO_BusWide_8b == WideMode) {
                         errorstatus = SD_UNSUPPORTED_FEATURE;
                         return (errorstatus);
@@ -1078,13 +1305,7 @@ SD_Error SD_EnableWideBusOperation (uint32_t WideMode)
 
                         if (SD_OK == errorstatus) {
                                 /*!< Configure the SDIO peripheral */
-                                SDIO_InitStructure.SDIO_ClockDiv = SDIO_TRANSFER_CLK_DIV;
-                                SDIO_InitStructure.SDIO_ClockEdge = SDIO_ClockEdge_Rising;
-                                SDIO_InitStructure.SDIO_ClockBypass = SDIO_ClockBypass_Disable;
-                                SDIO_InitStructure.SDIO_ClockPowerSave = SDIO_ClockPowerSave_Disable;
-                                SDIO_InitStructure.SDIO_BusWide = SDIO_BusWide_4b;
-                                SDIO_InitStructure.SDIO_HardwareFlowControl = SDIO_HardwareFlowControl_Disable;
-                                SDIO_Init (&SDIO_InitStructure);
+                                ConfigureSDIO (SDIO_BusWide_4b);
                         }
                 }
                 else {
@@ -1092,13 +1313,7 @@ SD_Error SD_EnableWideBusOperation (uint32_t WideMode)
 
                         if (SD_OK == errorstatus) {
                                 /*!< Configure the SDIO peripheral */
-                                SDIO_InitStructure.SDIO_ClockDiv = SDIO_TRANSFER_CLK_DIV;
-                                SDIO_InitStructure.SDIO_ClockEdge = SDIO_ClockEdge_Rising;
-                                SDIO_InitStructure.SDIO_ClockBypass = SDIO_ClockBypass_Disable;
-                                SDIO_InitStructure.SDIO_ClockPowerSave = SDIO_ClockPowerSave_Disable;
-                                SDIO_InitStructure.SDIO_BusWide = SDIO_BusWide_1b;
-                                SDIO_InitStructure.SDIO_HardwareFlowControl = SDIO_HardwareFlowControl_Disable;
-                                SDIO_Init (&SDIO_InitStructure);
+                                ConfigureSDIO (SDIO_BusWide_1b);
                         }
                 }
         }
@@ -1149,9 +1364,10 @@ SD_Error SD_ReadBlock (uint8_t *readbuff, uint64_t ReadAddr, uint16_t BlockSize)
         uint32_t count = 0, *tempbuff = (uint32_t *)readbuff;
 #endif
 
-        TransferError = SD_OK;
-        TransferEnd = 0;
-        StopCondition = 0;
+        Card.TransferError = SD_OK;
+        Card.TransferEnd = 0;
+        Card.StopCondition = 0;
+        Card.DMAEndOfTransfer = 0x00;
 
         SDIO ->DCTRL = 0x0;
 
@@ -1161,26 +1377,19 @@ SD_Error SD_ReadBlock (uint8_t *readbuff, uint64_t ReadAddr, uint16_t BlockSize)
         SD_LowLevel_DMA_RxConfig ((uint32_t *) readbuff, BlockSize);
 #endif
 
-        if (CardType == SDIO_HIGH_CAPACITY_SD_CARD ) {
+        if (Card.Type == SDIO_HIGH_CAPACITY_SD_CARD ) {
                 BlockSize = 512;
                 ReadAddr /= 512;
         }
 
         /* Set Block Size for Card */
-        SDIO_CmdInitStructure.SDIO_Argument = (uint32_t) BlockSize;
-        SDIO_CmdInitStructure.SDIO_CmdIndex = SD_CMD_SET_BLOCKLEN;
-        SDIO_CmdInitStructure.SDIO_Response = SDIO_Response_Short;
-        SDIO_CmdInitStructure.SDIO_Wait = SDIO_Wait_No;
-        SDIO_CmdInitStructure.SDIO_CPSM = SDIO_CPSM_Enable;
-        SDIO_SendCommand (&SDIO_CmdInitStructure);
-
-        errorstatus = CmdResp1Error (SD_CMD_SET_BLOCKLEN );
+        errorstatus = SetBlockLen (BlockSize);
 
         if (SD_OK != errorstatus) {
                 return (errorstatus);
         }
 
-        SDIO_DataInitStructure.SDIO_DataTimeOut = SD_DATATIMEOUT;
+        SetDataTimeout (1, 0);
         SDIO_DataInitStructure.SDIO_DataLength = BlockSize;
         SDIO_DataInitStructure.SDIO_DataBlockSize = (uint32_t) 9 << 4;
         SDIO_DataInitStructure.SDIO_TransferDir = SDIO_TransferDir_ToSDIO;
@@ -1275,9 +1484,10 @@ SD_Error SD_ReadBlock (uint8_t *readbuff, uint64_t ReadAddr, uint16_t BlockSize)
 SD_Error SD_ReadMultiBlocks (uint8_t *readbuff, uint64_t ReadAddr, uint16_t BlockSize, uint32_t NumberOfBlocks)
 {
         SD_Error errorstatus = SD_OK;
-        TransferError = SD_OK;
-        TransferEnd = 0;
-        StopCondition = 1;
+        Card.TransferError = SD_OK;
+        Card.TransferEnd = 0;
+        Card.StopCondition = 1;
+        Card.DMAEndOfTransfer = 0x00;
 
         SDIO ->DCTRL = 0x0;
 
@@ -1287,26 +1497,19 @@ SD_Error SD_ReadMultiBlocks (uint8_t *readbuff, uint64_t ReadAddr, uint16_t Bloc
         SDIO_DMACmd (ENABLE);
 #endif
 
-        if (CardType == SDIO_HIGH_CAPACITY_SD_CARD ) {
+        if (Card.Type == SDIO_HIGH_CAPACITY_SD_CARD ) {
                 BlockSize = 512;
                 ReadAddr /= 512;
         }
 
         /*!< Set Block Size for Card */
-        SDIO_CmdInitStructure.SDIO_Argument = (uint32_t) BlockSize;
-        SDIO_CmdInitStructure.SDIO_CmdIndex = SD_CMD_SET_BLOCKLEN;
-        SDIO_CmdInitStructure.SDIO_Response = SDIO_Response_Short;
-        SDIO_CmdInitStructure.SDIO_Wait = SDIO_Wait_No;
-        SDIO_CmdInitStructure.SDIO_CPSM = SDIO_CPSM_Enable;
-        SDIO_SendCommand (&SDIO_CmdInitStructure);
-
-        errorstatus = CmdResp1Error (SD_CMD_SET_BLOCKLEN );
+        errorstatus = SetBlockLen (BlockSize);
 
         if (SD_OK != errorstatus) {
                 return (errorstatus);
         }
 
-        SDIO_DataInitStructure.SDIO_DataTimeOut = SD_DATATIMEOUT;
+        SetDataTimeout (NumberOfBlocks, 0);
         SDIO_DataInitStructure.SDIO_DataLength = NumberOfBlocks * BlockSize;
         SDIO_DataInitStructure.SDIO_DataBlockSize = (uint32_t) 9 << 4;
         SDIO_DataInitStructure.SDIO_TransferDir = SDIO_TransferDir_ToSDIO;
@@ -1342,45 +1545,32 @@ SD_Error SD_ReadMultiBlocks (uint8_t *readbuff, uint64_t ReadAddr, uint16_t Bloc
 SD_Error SD_WaitReadOperation (void)
 {
         SD_Error errorstatus = SD_OK;
-        volatile uint32_t timeout;
-
-        timeout = SD_DATATIMEOUT;
+        SD_Deadline deadline;
+        uint8_t expired = 0;
 
-        logf ("1\r\n");
+        SD_DeadlineStart (&deadline, Card.WaitTimeoutUs);
 
-        while ((DMAEndOfTransfer == 0x00) && (TransferEnd == 0) && (TransferError == SD_OK) && (timeout > 0)) {
-                timeout--;
-        }
-
-        logf ("1.5\r\n");
-        logf ("2 DMAEndOfTransfer = %d, TransferEnd = %d, TransferError = %d, timeout = %d\r\n", DMAEndOfTransfer, TransferEnd, TransferError, timeout);
+        expired = WaitDataEnd (&deadline);
 
-        DMAEndOfTransfer = 0x00;
+        Card.DMAEndOfTransfer = 0x00;
 
-        timeout = SD_DATATIMEOUT;
-
-        while (((SDIO ->STA & SDIO_FLAG_RXACT)) && (timeout > 0)) {
-                timeout--;
+        while (((SDIO ->STA & SDIO_FLAG_RXACT)) && !(expired = SD_DeadlineExpired (&deadline))) {
         }
 
-        logf ("3\r\n");
-
-        if (StopCondition == 1) {
+        if (Card.StopCondition == 1) {
                 errorstatus = SD_StopTransfer ();
-                StopCondition = 0;
+                Card.StopCondition = 0;
         }
 
-        if ((timeout == 0) && (errorstatus == SD_OK)) {
+        if (expired && (errorstatus == SD_OK)) {
                 errorstatus = SD_DATA_TIMEOUT;
         }
 
         /*!< Clear all the static flags */
         SDIO_ClearFlag (SDIO_STATIC_FLAGS );
 
-        logf ("4\r\n");
-
-        if (TransferError != SD_OK) {
-                return (TransferError);
+        if (Card.TransferError != SD_OK) {
+                return (Card.TransferError);
         }
         else {
                 return (errorstatus);
@@ -1410,9 +1600,10 @@ SD_Error SD_WriteBlock (uint8_t *writebuff, uint64_t WriteAddr, uint16_t BlockSi
         uint32_t *tempbuff = (uint32_t *)writebuff;
 #endif
 
-        TransferError = SD_OK;
-        TransferEnd = 0;
-        StopCondition = 0;
+        Card.TransferError = SD_OK;
+        Card.TransferEnd = 0;
+        Card.StopCondition = 0;
+        Card.DMAEndOfTransfer = 0x00;
 
         SDIO ->DCTRL = 0x0;
 
@@ -1422,20 +1613,13 @@ SD_Error SD_WriteBlock (uint8_t *writebuff, uint64_t WriteAddr, uint16_t BlockSi
         SDIO_DMACmd (ENABLE);
 #endif
 
-        if (CardType == SDIO_HIGH_CAPACITY_SD_CARD ) {
+        if (Card.Type == SDIO_HIGH_CAPACITY_SD_CARD ) {
                 BlockSize = 512;
                 WriteAddr /= 512;
         }
 
         /* Set Block Size for Card */
-        SDIO_CmdInitStructure.SDIO_Argument = (uint32_t) BlockSize;
-        SDIO_CmdInitStructure.SDIO_CmdIndex = SD_CMD_SET_BLOCKLEN;
-        SDIO_CmdInitStructure.SDIO_Response = SDIO_Response_Short;
-        SDIO_CmdInitStructure.SDIO_Wait = SDIO_Wait_No;
-        SDIO_CmdInitStructure.SDIO_CPSM = SDIO_CPSM_Enable;
-        SDIO_SendCommand (&SDIO_CmdInitStructure);
-
-        errorstatus = CmdResp1Error (SD_CMD_SET_BLOCKLEN );
+        errorstatus = SetBlockLen (BlockSize);
 
         if (SD_OK != errorstatus) {
                 return (errorstatus);
@@ -1455,7 +1639,7 @@ SD_Error SD_WriteBlock (uint8_t *writebuff, uint64_t WriteAddr, uint16_t BlockSi
                 return (errorstatus);
         }
 
-        SDIO_DataInitStructure.SDIO_DataTimeOut = SD_DATATIMEOUT;
+        SetDataTimeout (1, 1);
         SDIO_DataInitStructure.SDIO_DataLength = BlockSize;
         SDIO_DataInitStructure.SDIO_DataBlockSize = (uint32_t) 9 << 4;
         SDIO_DataInitStructure.SDIO_TransferDir = SDIO_TransferDir_ToCard;
@@ -1537,9 +1721,10 @@ SD_Error SD_WriteMultiBlocks (uint8_t *writebuff, uint64_t WriteAddr, uint16_t B
 {
         SD_Error errorstatus = SD_OK;
 
-        TransferError = SD_OK;
-        TransferEnd = 0;
-        StopCondition = 1;
+        Card.TransferError = SD_OK;
+        Card.TransferEnd = 0;
+        Card.StopCondition = 1;
+        Card.DMAEndOfTransfer = 0x00;
         SDIO ->DCTRL = 0x0;
 
 #if defined (SD_DMA_MODE)
@@ -1548,67 +1733,18 @@ SD_Error SD_WriteMultiBlocks (uint8_t *writebuff, uint64_t WriteAddr, uint16_t B
         SDIO_DMACmd (ENABLE);
 #endif
 
-        if (CardType == SDIO_HIGH_CAPACITY_SD_CARD ) {
+        if (Card.Type == SDIO_HIGH_CAPACITY_SD_CARD ) {
                 BlockSize = 512;
                 WriteAddr /= 512;
         }
 
-        /* Set Block Size for Card */
-        SDIO_CmdInitStructure.SDIO_Argument = (uint32_t) BlockSize;
-        SDIO_CmdInitStructure.SDIO_CmdIndex = SD_CMD_SET_BLOCKLEN;
-        SDIO_CmdInitStructure.SDIO_Response = SDIO_Response_Short;
-        SDIO_CmdInitStructure.SDIO_Wait = SDIO_Wait_No;
-        SDIO_CmdInitStructure.SDIO_CPSM = SDIO_CPSM_Enable;
-        SDIO_SendCommand (&SDIO_CmdInitStructure);
-
-        errorstatus = CmdResp1Error (SD_CMD_SET_BLOCKLEN );
-
-        if (SD_OK != errorstatus) {
-                return (errorstatus);
-        }
-
-        /*!< To improve performance */
-        SDIO_CmdInitStructure.SDIO_Argument = (uint32_t) (RCA << 16);
-        SDIO_CmdInitStructure.SDIO_CmdIndex = SD_CMD_APP_CMD;
-        SDIO_CmdInitStructure.SDIO_Response = SDIO_Response_Short;
-        SDIO_CmdInitStructure.SDIO_Wait = SDIO_Wait_No;
-        SDIO_CmdInitStructure.SDIO_CPSM = SDIO_CPSM_Enable;
-        SDIO_SendCommand (&SDIO_CmdInitStructure);
-
-        errorstatus = CmdResp1Error (SD_CMD_APP_CMD );
-
-        if (errorstatus != SD_OK) {
-                return (errorstatus);
-        }
-        /*!< To improve performance */
-        SDIO_CmdInitStructure.SDIO_Argument = (uint32_t) NumberOfBlocks;
-        SDIO_CmdInitStructure.SDIO_CmdIndex = SD_CMD_SET_BLOCK_COUNT;
-        SDIO_CmdInitStructure.SDIO_Response = SDIO_Response_Short;
-        SDIO_CmdInitStructure.SDIO_Wait = SDIO_Wait_No;
-        SDIO_CmdInitStructure.SDIO_CPSM = SDIO_CPSM_Enable;
-        SDIO_SendCommand (&SDIO_CmdInitStructure);
-
-        errorstatus = CmdResp1Error (SD_CMD_SET_BLOCK_COUNT );
-
-        if (errorstatus != SD_OK) {
-                return (errorstatus);
-        }
-
-        /*!< Send CMD25 WRITE_MULT_BLOCK with argument data address */
-        SDIO_CmdInitStructure.SDIO_Argument = (uint32_t) WriteAddr;
-        SDIO_CmdInitStructure.SDIO_CmdIndex = SD_CMD_WRITE_MULT_BLOCK;
-        SDIO_CmdInitStructure.SDIO_Response = SDIO_Response_Short;
-        SDIO_CmdInitStructure.SDIO_Wait = SDIO_Wait_No;
-        SDIO_CmdInitStructure.SDIO_CPSM = SDIO_CPSM_Enable;
-        SDIO_SendCommand (&SDIO_CmdInitStructure);
-
-        errorstatus = CmdResp1Error (SD_CMD_WRITE_MULT_BLOCK );
+        errorstatus = SendWriteMultiBlockCmd (WriteAddr, BlockSize, NumberOfBlocks);
 
         if (SD_OK != errorstatus) {
                 return (errorstatus);
         }
 
-        SDIO_DataInitStructure.SDIO_DataTimeOut = SD_DATATIMEOUT;
+        SetDataTimeout (NumberOfBlocks, 1);
         SDIO_DataInitStructure.SDIO_DataLength = NumberOfBlocks * BlockSize;
         SDIO_DataInitStructure.SDIO_DataBlockSize = (uint32_t) 9 << 4;
         SDIO_DataInitStructure.SDIO_TransferDir = SDIO_TransferDir_ToCard;
@@ -1630,36 +1766,32 @@ SD_Error SD_WriteMultiBlocks (uint8_t *writebuff, uint64_t WriteAddr, uint16_t B
 SD_Error SD_WaitWriteOperation (void)
 {
         SD_Error errorstatus = SD_OK;
-        uint32_t timeout;
-
-        timeout = SD_DATATIMEOUT;
+        SD_Deadline deadline;
+        uint8_t expired = 0;
 
-        while ((DMAEndOfTransfer == 0x00) && (TransferEnd == 0) && (TransferError == SD_OK) && (timeout > 0)) {
-                timeout--;
-        }
+        SD_DeadlineStart (&deadline, Card.WaitTimeoutUs);
 
-        DMAEndOfTransfer = 0x00;
+        expired = WaitDataEnd (&deadline);
 
-        timeout = SD_DATATIMEOUT;
+        Card.DMAEndOfTransfer = 0x00;
 
-        while (((SDIO ->STA & SDIO_FLAG_TXACT)) && (timeout > 0)) {
-                timeout--;
+        while (((SDIO ->STA & SDIO_FLAG_TXACT)) && !(expired = SD_DeadlineExpired (&deadline))) {
         }
 
-        if (StopCondition == 1) {
+        if (Card.StopCondition == 1) {
                 errorstatus = SD_StopTransfer ();
-                StopCondition = 0;
+                Card.StopCondition = 0;
         }
 
-        if ((timeout == 0) && (errorstatus == SD_OK)) {
+        if (expired && (errorstatus == SD_OK)) {
                 errorstatus = SD_DATA_TIMEOUT;
         }
 
         /*!< Clear all the static flags */
         SDIO_ClearFlag (SDIO_STATIC_FLAGS );
 
-        if (TransferError != SD_OK) {
-                return (TransferError);
+        if (Card.TransferError != SD_OK) {
+                return (Card.TransferError);
         }
         else {
                 return (errorstatus);
@@ -1715,30 +1847,32 @@ SD_Error SD_StopTransfer (void)
 SD_Error SD_Erase (uint64_t startaddr, uint64_t endaddr)
 {
         SD_Error errorstatus = SD_OK;
-        uint32_t delay = 0;
-        __IO uint32_t maxdelay = 0;
+        SD_Deadline deadline;
+        uint64_t blocks;
         uint8_t cardstate = 0;
 
         /*!< Check if the card coomnd class supports erase command */
-        if (((CSD_Tab[1] >> 20) & SD_CCCC_ERASE )== 0){
+        if (((Card.CSD[1] >> 20) & SD_CCCC_ERASE )== 0){
                 errorstatus = SD_REQUEST_NOT_APPLICABLE;
                 return (errorstatus);
         }
 
-        maxdelay = 120000 / ((SDIO ->CLKCR & 0xFF) + 2);
+        /*!< No ERASE_TIMEOUT from the SD status here, so allow a write time per block */
+        blocks = (endaddr - startaddr) / 512 + 1;
+        blocks *= Card.WriteTimeoutUs;
 
         if (SDIO_GetResponse (SDIO_RESP1) & SD_CARD_LOCKED ) {
                 errorstatus = SD_LOCK_UNLOCK_FAILED;
                 return (errorstatus);
         }
 
-        if (CardType == SDIO_HIGH_CAPACITY_SD_CARD ) {
+        if (Card.Type == SDIO_HIGH_CAPACITY_SD_CARD ) {
                 startaddr /= 512;
                 endaddr /= 512;
         }
 
         /*!< According to sd-card spec 1.0 ERASE_GROUP_START (CMD32) and erase_group_end(CMD33) */
-        if ((SDIO_STD_CAPACITY_SD_CARD_V1_1 == CardType) || (SDIO_STD_CAPACITY_SD_CARD_V2_0 == CardType) || (SDIO_HIGH_CAPACITY_SD_CARD == CardType)) {
+        if ((SDIO_STD_CAPACITY_SD_CARD_V1_1 == Card.Type) || (SDIO_STD_CAPACITY_SD_CARD_V2_0 == Card.Type) || (SDIO_HIGH_CAPACITY_SD_CARD == Card.Type)) {
                 /*!< Send CMD32 SD_ERASE_GRP_START with argument as addr  */
                 SDIO_CmdInitStructure.SDIO_Argument = (uint32_t) startaddr;
                 SDIO_CmdInitStructure.SDIO_CmdIndex = SD_CMD_SD_ERASE_GRP_START;
@@ -1780,15 +1914,18 @@ SD_Error SD_Erase (uint64_t startaddr, uint64_t endaddr)
                 return (errorstatus);
         }
 
-        for (delay = 0; delay < maxdelay; delay++) {
-        }
-
         /*!< Wait till the card is in programming state */
+        SD_DeadlineStart (&deadline, (blocks > 0xFFFFFFFF) ? 0xFFFFFFFF : (uint32_t) blocks);
+        WaitNotBusy (&deadline);
         errorstatus = IsCardProgramming (&cardstate);
-        delay = SD_DATATIMEOUT;
-        while ((delay > 0) && (errorstatus == SD_OK) && ((SD_CARD_PROGRAMMING == cardstate) || (SD_CARD_RECEIVING == cardstate))) {
+
+        while ((errorstatus == SD_OK) && ((SD_CARD_PROGRAMMING == cardstate) || (SD_CARD_RECEIVING == cardstate))) {
+                if (SD_DeadlineExpired (&deadline)) {
+                        errorstatus = SD_DATA_TIMEOUT;
+                        break;
+                }
+
                 errorstatus = IsCardProgramming (&cardstate);
-                delay--;
         }
 
         return (errorstatus);
@@ -1809,7 +1946,7 @@ SD_Error SD_SendStatus (uint32_t *pcardstatus)
                 return (errorstatus);
         }
 
-        SDIO_CmdInitStructure.SDIO_Argument = (uint32_t) RCA << 16;
+        SDIO_CmdInitStructure.SDIO_Argument = (uint32_t) Card.RCA << 16;
         SDIO_CmdInitStructure.SDIO_CmdIndex = SD_CMD_SEND_STATUS;
         SDIO_CmdInitStructure.SDIO_Response = SDIO_Response_Short;
         SDIO_CmdInitStructure.SDIO_Wait = SDIO_Wait_No;
@@ -1844,21 +1981,14 @@ SD_Error SD_SendSDStatus (uint32_t *psdstatus)
         }
 
         /*!< Set block size for card if it is not equal to current block size for card. */
-        SDIO_CmdInitStructure.SDIO_Argument = 64;
-        SDIO_CmdInitStructure.SDIO_CmdIndex = SD_CMD_SET_BLOCKLEN;
-        SDIO_CmdInitStructure.SDIO_Response = SDIO_Response_Short;
-        SDIO_CmdInitStructure.SDIO_Wait = SDIO_Wait_No;
-        SDIO_CmdInitStructure.SDIO_CPSM = SDIO_CPSM_Enable;
-        SDIO_SendCommand (&SDIO_CmdInitStructure);
-
-        errorstatus = CmdResp1Error (SD_CMD_SET_BLOCKLEN );
+        errorstatus = SetBlockLen (64);
 
         if (errorstatus != SD_OK) {
                 return (errorstatus);
         }
 
         /*!< CMD55 */
-        SDIO_CmdInitStructure.SDIO_Argument = (uint32_t) RCA << 16;
+        SDIO_CmdInitStructure.SDIO_Argument = (uint32_t) Card.RCA << 16;
         SDIO_CmdInitStructure.SDIO_CmdIndex = SD_CMD_APP_CMD;
         SDIO_CmdInitStructure.SDIO_Response = SDIO_Response_Short;
         SDIO_CmdInitStructure.SDIO_Wait = SDIO_Wait_No;
@@ -1870,7 +2000,7 @@ SD_Error SD_SendSDStatus (uint32_t *psdstatus)
                 return (errorstatus);
         }
 
-        SDIO_DataInitStructure.SDIO_DataTimeOut = SD_DATATIMEOUT;
+        SetDataTimeout (1, 0);
         SDIO_DataInitStructure.SDIO_DataLength = 64;
         SDIO_DataInitStructure.SDIO_DataBlockSize = SDIO_DataBlockSize_64b;
         SDIO_DataInitStructure.SDIO_TransferDir = SDIO_TransferDir_ToSDIO;
@@ -1934,46 +2064,66 @@ SD_Error SD_SendSDStatus (uint32_t *psdstatus)
 }
 
 /**
- * @brief  Allows to process all the interrupts that are high.
+ * @brief  Allows to process all the interrupts that are high. Nothing is done on
+ *         a spurious call (no data flag set) : the interrupts stay armed for the
+ *         real end of the transfer.
  * @param  None
  * @retval SD_Error: SD Card Error code.
  */
 SD_Error SD_ProcessIRQSrc (void)
 {
+        uint32_t sta = SDIO->STA;
+
+        SD_TRACE_IRQ (sta);
+
+        if ((sta & (SDIO_IT_DATAEND | SDIO_IT_DCRCFAIL | SDIO_IT_DTIMEOUT | SDIO_IT_RXOVERR | SDIO_IT_TXUNDERR | SDIO_IT_STBITERR)) == 0) {
+                return (Card.TransferError);
+        }
+
         if (SDIO_GetITStatus (SDIO_IT_DATAEND) != RESET) {
-                TransferError = SD_OK;
+                Card.TransferError = SD_OK;
                 SDIO_ClearITPendingBit (SDIO_IT_DATAEND);
-                TransferEnd = 1;
-                logf ("SDIO IRQ : TransferEnd = 1, OK\r\n");
+                Card.TransferEnd = 1;
+                dlogf ("SDIO IRQ : TransferEnd = 1, OK\r\n");
         }
         else if (SDIO_GetITStatus (SDIO_IT_DCRCFAIL) != RESET) {
                 SDIO_ClearITPendingBit (SDIO_IT_DCRCFAIL);
-                TransferError = SD_DATA_CRC_FAIL;
-                logf ("SDIO IRQ : SD_DATA_CRC_FAIL\r\n");
+                Card.TransferError = SD_DATA_CRC_FAIL;
+                dlogf ("SDIO IRQ : SD_DATA_CRC_FAIL\r\n");
         }
         else if (SDIO_GetITStatus (SDIO_IT_DTIMEOUT) != RESET) {
                 SDIO_ClearITPendingBit (SDIO_IT_DTIMEOUT);
-                TransferError = SD_DATA_TIMEOUT;
-                logf ("SDIO IRQ : SD_DATA_TIMEOUT\r\n");
+                Card.TransferError = SD_DATA_TIMEOUT;
+                dlogf ("SDIO IRQ : SD_DATA_TIMEOUT\r\n");
         }
         else if (SDIO_GetITStatus (SDIO_IT_RXOVERR) != RESET) {
                 SDIO_ClearITPendingBit (SDIO_IT_RXOVERR);
-                TransferError = SD_RX_OVERRUN;
-                logf ("SDIO IRQ : SD_RX_OVERRUN\r\n");
+                Card.TransferError = SD_RX_OVERRUN;
+                dlogf ("SDIO IRQ : SD_RX_OVERRUN\r\n");
         }
         else if (SDIO_GetITStatus (SDIO_IT_TXUNDERR) != RESET) {
                 SDIO_ClearITPendingBit (SDIO_IT_TXUNDERR);
-                TransferError = SD_TX_UNDERRUN;
-                logf ("SDIO IRQ : SD_TX_UNDERRUN\r\n");
+                Card.TransferError = SD_TX_UNDERRUN;
+                dlogf ("SDIO IRQ : SD_TX_UNDERRUN\r\n");
         }
         else if (SDIO_GetITStatus (SDIO_IT_STBITERR) != RESET) {
                 SDIO_ClearITPendingBit (SDIO_IT_STBITERR);
-                TransferError = SD_START_BIT_ERR;
-                logf ("SDIO IRQ : SD_START_BIT_ERR\r\n");
+                Card.TransferError = SD_START_BIT_ERR;
+                dlogf ("SDIO IRQ : SD_START_BIT_ERR\r\n");
         }
 
         SDIO_ITConfig (SDIO_IT_DCRCFAIL | SDIO_IT_DTIMEOUT | SDIO_IT_DATAEND | SDIO_IT_TXFIFOHE | SDIO_IT_RXFIFOHF | SDIO_IT_TXUNDERR | SDIO_IT_RXOVERR | SDIO_IT_STBITERR, DISABLE);
-        return (TransferError);
+
+        /*!< A circular DMA would never stop by itself */
+        if (Card.DoubleBufferActive && (Card.TransferError != SD_OK)) {
+                StopDoubleBuffer ();
+        }
+
+        if (Card.AsyncState == ASYNC_RUNNING) {
+                CompleteAsyncTransfer ();
+        }
+
+        return (Card.TransferError);
 }
 
 /**
@@ -1983,112 +2133,1003 @@ SD_Error SD_ProcessIRQSrc (void)
  */
 void SD_ProcessDMAIRQ (void)
 {
+        uint8_t *done;
+
+        SD_TRACE_DMA (DMA_GetFlagStatus (SD_SDIO_DMA_STREAM, SD_SDIO_DMA_FLAG_TCIF) != RESET, DMA_GetFlagStatus (SD_SDIO_DMA_STREAM, SD_SDIO_DMA_FLAG_FEIF) != RESET);
+
+        /*!< Bus error or a write to the registers of an enabled stream : the stream is off, the data incomplete */
+        if ((DMA_GetFlagStatus (SD_SDIO_DMA_STREAM, SD_SDIO_DMA_FLAG_TEIF) != RESET) || (DMA_GetFlagStatus (SD_SDIO_DMA_STREAM, SD_SDIO_DMA_FLAG_DMEIF) != RESET)) {
+                DMA_ClearFlag (SD_SDIO_DMA_STREAM, SD_SDIO_DMA_FLAG_TEIF | SD_SDIO_DMA_FLAG_DMEIF);
+                FailDma (SD_DMA_ERROR);
+                dlogf ("DMA IRQ : SD_DMA_ERROR\r\n");
+        }
+
+        /*!< FIFO error : the stream goes on, a word really lost shows as RXOVERR / TXUNDERR on the SDIO side */
+        if (DMA_GetFlagStatus (SD_SDIO_DMA_STREAM, SD_SDIO_DMA_FLAG_FEIF) != RESET) {
+                DMA_ClearFlag (SD_SDIO_DMA_STREAM, SD_SDIO_DMA_FLAG_FEIF);
+        }
+
         if (DMA2 ->LISR & SD_SDIO_DMA_FLAG_TCIF) {
-                DMAEndOfTransfer = 0x01;
                 DMA_ClearFlag (SD_SDIO_DMA_STREAM, SD_SDIO_DMA_FLAG_TCIF | SD_SDIO_DMA_FLAG_FEIF);
+
+                if (Card.DoubleBufferActive) {
+                        /*!< CT already points to the buffer in use, the other one is done */
+                        done = (uint8_t *) ((DMA_GetCurrentMemoryTarget (SD_SDIO_DMA_STREAM) == 0) ? SD_SDIO_DMA_STREAM ->M1AR : SD_SDIO_DMA_STREAM ->M0AR);
+                        Card.BufferDone += Card.BufferBlocksEach;
+
+                        if (Card.BufferDone >= Card.BufferTotal) {
+                                StopDoubleBuffer ();
+                                Card.DMAEndOfTransfer = 0x01;
+                        }
+                        else if (MissedSwap ()) {
+                                /*!< The DMA already went through a buffer nobody reloaded */
+                                FailDma (SD_DMA_LATE);
+                                dlogf ("DMA IRQ : SD_DMA_LATE\r\n");
+                        }
+
+                        if (Card.BufferCallback && (Card.TransferError == SD_OK)) {
+                                Card.BufferCallback (done, Card.BufferContext);
+                        }
+                }
+                else {
+                        Card.DMAEndOfTransfer = 0x01;
+                }
+        }
+
+        if (Card.AsyncState == ASYNC_RUNNING) {
+                CompleteAsyncTransfer ();
         }
-        logf ("DMA...\r\n");
 }
 
 /**
- * @brief  Checks for error conditions for CMD0.
- * @param  None
- * @retval SD_Error: SD Card Error code.
+ * @brief  Starts reading blocks without waiting for the data. Once both the SDIO
+ *         DATAEND and the DMA TC are in (or either reported an error, or the
+ *         deadline from SetDataTimeout passed), the IRQ handler pends PendSV, and
+ *         SD_ProcessAsync sends CMD12 and calls callback from there.
+ * @note   Only one transfer may be in flight. No other SD command may be issued
+ *         until it completes (use SD_GetAsyncState for polling, not SD_GetStatus).
+ * @param  readbuff: pointer to the buffer that will contain the received data.
+ * @param  ReadAddr: Address from where data are to be read.
+ * @param  BlockSize: the SD card Data block size. The Block size should be 512.
+ * @param  NumberOfBlocks: number of blocks to be read.
+ * @param  callback: called from SD_ProcessAsync on completion. May be NULL.
+ * @param  context: passed to the callback.
+ * @retval SD_Error: SD_REQUEST_PENDING if a transfer is in flight, otherwise the
+ *         status of the command phase.
  */
-static SD_Error CmdError (void)
+SD_Error SD_ReadMultiBlocksAsync (uint8_t *readbuff, uint64_t ReadAddr, uint16_t BlockSize, uint32_t NumberOfBlocks, SD_TransferCallback callback, void *context)
 {
         SD_Error errorstatus = SD_OK;
-        uint32_t timeout;
 
-        timeout = SDIO_CMD0TIMEOUT; /*!< 10000 */
-
-        while ((timeout > 0) && (SDIO_GetFlagStatus (SDIO_FLAG_CMDSENT) == RESET)) {
-                timeout--;
+        if (!StartAsync (callback, context)) {
+                return (SD_REQUEST_PENDING);
         }
 
-        if (timeout == 0) {
-                errorstatus = SD_CMD_RSP_TIMEOUT;
-                return (errorstatus);
+        errorstatus = SD_ReadMultiBlocks (readbuff, ReadAddr, BlockSize, NumberOfBlocks);
+        return (ArmAsync (errorstatus));
+}
+
+/**
+ * @brief  Starts writing blocks without waiting for the data. See
+ *         SD_ReadMultiBlocksAsync for the completion rules.
+ * @note   Completion means the data phase is over and CMD12 was sent. The card
+ *         may still be programming, so check SD_GetStatus before the next command.
+ * @param  writebuff: pointer to the buffer that contain the data to be transferred.
+ * @param  WriteAddr: Address where data are to be written.
+ * @param  BlockSize: the SD card Data block size. The Block size should be 512.
+ * @param  NumberOfBlocks: number of blocks to be written.
+ * @param  callback: called from SD_ProcessAsync on completion. May be NULL.
+ * @param  context: passed to the callback.
+ * @retval SD_Error: SD_REQUEST_PENDING if a transfer is in flight, otherwise the
+ *         status of the command phase.
+ */
+SD_Error SD_WriteMultiBlocksAsync (uint8_t *writebuff, uint64_t WriteAddr, uint16_t BlockSize, uint32_t NumberOfBlocks, SD_TransferCallback callback, void *context)
+{
+        SD_Error errorstatus = SD_OK;
+
+        if (!StartAsync (callback, context)) {
+                return (SD_REQUEST_PENDING);
         }
 
-        /*!< Clear all the static flags */
-        SDIO_ClearFlag (SDIO_STATIC_FLAGS );
+        errorstatus = SD_WriteMultiBlocks (writebuff, WriteAddr, BlockSize, NumberOfBlocks);
+        return (ArmAsync (errorstatus));
+}
 
-        return (errorstatus);
+/**
+ * @brief  Non blocking check of the asynchronous transfer.
+ * @param  None
+ * @retval SDTransferState: SD_TRANSFER_BUSY while in flight, SD_TRANSFER_OK or
+ *         SD_TRANSFER_ERROR (see SD_GetAsyncError) once finished.
+ */
+SDTransferState SD_GetAsyncState (void)
+{
+        if (Card.AsyncState != ASYNC_IDLE) {
+                return (SD_TRANSFER_BUSY);
+        }
+
+        return ((Card.AsyncStatus == SD_OK) ? SD_TRANSFER_OK : SD_TRANSFER_ERROR);
 }
 
 /**
- * @brief  Checks for error conditions for R7 response.
+ * @brief  Returns the result of the last asynchronous transfer.
  * @param  None
  * @retval SD_Error: SD Card Error code.
  */
-static SD_Error CmdResp7Error (void)
+SD_Error SD_GetAsyncError (void)
 {
-        SD_Error errorstatus = SD_OK;
-        uint32_t status;
-        uint32_t timeout = SDIO_CMD0TIMEOUT;
+        return (Card.AsyncStatus);
+}
 
-        status = SDIO ->STA;
+/**
+ * @brief  Does what the IRQ handlers leave for later : finishes the asynchronous
+ *         transfer they (or the deadline) ended, sends CMD12 if needed and calls
+ *         its callback, and calls the SD_NotifyWhenReady callback once D0 went
+ *         high. Call it from PendSV_Handler, which SD_Init sets to the lowest
+ *         priority. It does nothing if there is nothing to do, so it may be
+ *         called from anywhere else too (see SD_AsyncSleep).
+ * @param  None
+ * @retval None
+ */
+void SD_ProcessAsync (void)
+{
+        uint8_t ready;
 
-        while (!(status & (SDIO_FLAG_CCRCFAIL | SDIO_FLAG_CMDREND | SDIO_FLAG_CTIMEOUT)) && (timeout > 0)) {
-                timeout--;
-                status = SDIO ->STA;
-        }
+        __disable_irq ();
+        ready = Card.ReadyFired;
+        Card.ReadyFired = 0;
+        __enable_irq ();
 
-        if ((timeout == 0) || (status & SDIO_FLAG_CTIMEOUT)) {
-                /*!< Card is not V2.0 complient or card does not support the set voltage range */
-                errorstatus = SD_CMD_RSP_TIMEOUT;
-                SDIO_ClearFlag (SDIO_FLAG_CTIMEOUT);
-                return (errorstatus);
+        if (ready) {
+                CompleteReady ();
         }
 
-        if (status & SDIO_FLAG_CMDREND) {
-                /*!< Card is SD V2.0 compliant */
-                errorstatus = SD_OK;
-                SDIO_ClearFlag (SDIO_FLAG_CMDREND);
-                return (errorstatus);
+        FinishAsyncTransfer ();
+}
+
+/**
+ * @brief  Checks the deadline of the asynchronous transfer. Call it from
+ *         SysTick_Handler.
+ * @param  None
+ * @retval None
+ */
+void SD_ProcessTick (void)
+{
+        __disable_irq ();
+        CheckAsyncDeadline ();
+        __enable_irq ();
+}
+
+/**
+ * @brief  SD_Sleep for the loops waiting on an asynchronous transfer. PendSV can
+ *         not preempt a waiter running in an interrupt handler (the USB mass
+ *         storage in the OTG IRQ) and neither can SysTick, so this runs
+ *         SD_ProcessAsync and checks the deadline itself instead of sleeping when
+ *         that is what is left to do. Called, and returns, with the interrupts
+ *         disabled, like SD_Sleep.
+ * @param  None
+ * @retval None
+ */
+void SD_AsyncSleep (void)
+{
+        CheckAsyncDeadline ();
+
+        if ((Card.AsyncState == ASYNC_DONE) || Card.ReadyFired) {
+                __enable_irq ();
+                SD_ProcessAsync ();
+                __disable_irq ();
+        }
+        else {
+                SD_Sleep ();
         }
-        return (errorstatus);
 }
 
 /**
- * @brief  Checks for error conditions for R1 response.
- * @param  cmd: The sent command index.
+ * @brief  Opens a streaming write session : sends ACMD23 and CMD25 and leaves the
+ *         card in the receive-data state. Blocks are then pushed with SD_StreamWrite
+ *         (or SD_StreamWriteAsync) for as long as needed, and the card programs
+ *         them as they come instead of once per SD_WriteMultiBlocks call. The
+ *         session must be ended with SD_StreamClose.
+ * @note   No other command may be sent to the card while the stream is open.
+ * @param  WriteAddr: Address of the first block, in bytes.
+ * @param  PreEraseBlocks: expected length of the stream, in blocks. Passed to
+ *         ACMD23 so the card can pre-erase. 0 if unknown. Writing more (or less)
+ *         than that is allowed.
  * @retval SD_Error: SD Card Error code.
  */
-static SD_Error CmdResp1Error (uint8_t cmd)
+SD_Error SD_StreamOpen (uint64_t WriteAddr, uint32_t PreEraseBlocks)
 {
         SD_Error errorstatus = SD_OK;
-        uint32_t status;
-        uint32_t response_r1;
-
-        status = SDIO ->STA;
+        uint16_t BlockSize = 512;
 
-        while (!(status & (SDIO_FLAG_CCRCFAIL | SDIO_FLAG_CMDREND | SDIO_FLAG_CTIMEOUT))) {
-                status = SDIO ->STA;
+        if (Card.StreamOpen) {
+                return (SD_REQUEST_PENDING);
         }
 
-        if (status & SDIO_FLAG_CTIMEOUT) {
-                errorstatus = SD_CMD_RSP_TIMEOUT;
-                SDIO_ClearFlag (SDIO_FLAG_CTIMEOUT);
-                return (errorstatus);
-        }
-        else if (status & SDIO_FLAG_CCRCFAIL) {
-                errorstatus = SD_CMD_CRC_FAIL;
-                SDIO_ClearFlag (SDIO_FLAG_CCRCFAIL);
-                return (errorstatus);
+        /*!< ACMD23 argument is 23 bits wide */
+        if (PreEraseBlocks > 0x007FFFFF) {
+                PreEraseBlocks = 0x007FFFFF;
         }
 
-        /*!< Check response received is of desired command */
-        if (SDIO_GetCommandResponse () != cmd) {
-                errorstatus = SD_ILLEGAL_CMD;
-                return (errorstatus);
+        Card.TransferError = SD_OK;
+        Card.TransferEnd = 0;
+        Card.StopCondition = 0;
+        SDIO ->DCTRL = 0x0;
+
+        if (Card.Type == SDIO_HIGH_CAPACITY_SD_CARD ) {
+                WriteAddr /= 512;
         }
 
-        /*!< Clear all the static flags */
-        SDIO_ClearFlag (SDIO_STATIC_FLAGS );
+        errorstatus = SendWriteMultiBlockCmd (WriteAddr, BlockSize, PreEraseBlocks);
 
-        /*!< We have received response, retrieve it for analysis  */
+        if (errorstatus == SD_OK) {
+                Card.StreamOpen = 1;
+                Card.StreamBlocks = 0;
+        }
+
+        return (errorstatus);
+}
+
+/**
+ * @brief  Starts the data phase for the next chunk of an open stream. Only the DMA
+ *         and the DPSM are set up, no command is sent. Wait for it with
+ *         SD_WaitWriteOperation like after SD_WriteMultiBlocks, which does not send
+ *         CMD12 here. The DPSM does not start a block while the card signals busy,
+ *         so chunks can follow each other without polling the card.
+ * @param  writebuff: pointer to the buffer that contain the data to be transferred.
+ * @param  NumberOfBlocks: number of 512 byte blocks to send.
+ * @retval SD_Error: SD_ERROR if no stream is open.
+ */
+SD_Error SD_StreamWrite (uint8_t *writebuff, uint32_t NumberOfBlocks)
+{
+        if (!Card.StreamOpen) {
+                return (SD_ERROR);
+        }
+
+        if ((NumberOfBlocks == 0) || (NumberOfBlocks > 0x01FFFFFF / 512)) {
+                return (SD_INVALID_PARAMETER);
+        }
+
+        Card.TransferError = SD_OK;
+        Card.TransferEnd = 0;
+        Card.StopCondition = 0;
+        Card.DMAEndOfTransfer = 0x00;
+        SDIO ->DCTRL = 0x0;
+
+#if defined (SD_DMA_MODE)
+        SDIO_ITConfig (SDIO_IT_DCRCFAIL | SDIO_IT_DTIMEOUT | SDIO_IT_DATAEND | SDIO_IT_TXUNDERR | SDIO_IT_STBITERR, ENABLE);
+        SD_LowLevel_DMA_TxConfig ((uint32_t *) writebuff, (NumberOfBlocks * 512));
+        SDIO_DMACmd (ENABLE);
+#endif
+
+        SetDataTimeout (NumberOfBlocks, 1);
+        SDIO_DataInitStructure.SDIO_DataLength = NumberOfBlocks * 512;
+        SDIO_DataInitStructure.SDIO_DataBlockSize = (uint32_t) 9 << 4;
+        SDIO_DataInitStructure.SDIO_TransferDir = SDIO_TransferDir_ToCard;
+        SDIO_DataInitStructure.SDIO_TransferMode = SDIO_TransferMode_Block;
+        SDIO_DataInitStructure.SDIO_DPSM = SDIO_DPSM_Enable;
+        SDIO_DataConfig (&SDIO_DataInitStructure);
+
+        Card.StreamBlocks += NumberOfBlocks;
+        return (SD_OK);
+}
+
+/**
+ * @brief  Asynchronous version of SD_StreamWrite. Completion is reported the same
+ *         way as for SD_WriteMultiBlocksAsync, except that CMD12 is not sent.
+ * @param  writebuff: pointer to the buffer that contain the data to be transferred.
+ * @param  NumberOfBlocks: number of 512 byte blocks to send.
+ * @param  callback: called from SD_ProcessAsync on completion. May be NULL.
+ * @param  context: passed to the callback.
+ * @retval SD_Error: SD_REQUEST_PENDING if a transfer is in flight.
+ */
+SD_Error SD_StreamWriteAsync (uint8_t *writebuff, uint32_t NumberOfBlocks, SD_TransferCallback callback, void *context)
+{
+        SD_Error errorstatus = SD_OK;
+
+        if (!StartAsync (callback, context)) {
+                return (SD_REQUEST_PENDING);
+        }
+
+        errorstatus = SD_StreamWrite (writebuff, NumberOfBlocks);
+        return (ArmAsync (errorstatus));
+}
+
+/**
+ * @brief  Ends the streaming write with CMD12. The last chunk must be finished
+ *         first. Must be called after a failed chunk too, to get the card back to
+ *         the transfer state. Like after SD_WriteMultiBlocks the card may still be
+ *         programming when this returns.
+ * @param  None
+ * @retval SD_Error: SD Card Error code.
+ */
+SD_Error SD_StreamClose (void)
+{
+        if (!Card.StreamOpen) {
+                return (SD_ERROR);
+        }
+
+        Card.StreamOpen = 0;
+        SDIO_ClearFlag (SDIO_STATIC_FLAGS );
+        return (SD_StopTransfer ());
+}
+
+/**
+ * @brief  Number of blocks pushed into the current (or the last) stream.
+ * @param  None
+ * @retval Block count.
+ */
+uint32_t SD_StreamGetBlocks (void)
+{
+        return (Card.StreamBlocks);
+}
+
+/**
+ * @brief  Reads NumberOfBlocks blocks through two small buffers used in turns by
+ *         the DMA (double buffer mode). callback is called each time a buffer is
+ *         full. Wait for the end with SD_WaitReadOperation. The last buffer is
+ *         reported by the DMA IRQ, which may come slightly after DATAEND.
+ * @param  buffer0: first buffer, filled first.
+ * @param  buffer1: second buffer.
+ * @param  BufferBlocks: size of each buffer in 512 byte blocks.
+ * @param  ReadAddr: Address from where data are to be read, in bytes.
+ * @param  NumberOfBlocks: number of blocks to read, a multiple of BufferBlocks.
+ * @param  callback: called in interrupt context for each full buffer.
+ * @param  context: passed to the callback.
+ * @retval SD_Error: SD Card Error code.
+ */
+SD_Error SD_ReadMultiBlocksDoubleBuffer (uint8_t *buffer0, uint8_t *buffer1, uint32_t BufferBlocks, uint64_t ReadAddr, uint32_t NumberOfBlocks, SD_BufferCallback callback,
+                void *context)
+{
+        SD_Error errorstatus = SD_OK;
+        uint16_t BlockSize = 512;
+
+        errorstatus = CheckDoubleBuffer (buffer0, buffer1, BufferBlocks, NumberOfBlocks);
+
+        if (errorstatus != SD_OK) {
+                return (errorstatus);
+        }
+
+        Card.TransferError = SD_OK;
+        Card.TransferEnd = 0;
+        Card.StopCondition = 1;
+        Card.DMAEndOfTransfer = 0x00;
+        SDIO ->DCTRL = 0x0;
+
+        SDIO_ITConfig (SDIO_IT_DCRCFAIL | SDIO_IT_DTIMEOUT | SDIO_IT_DATAEND | SDIO_IT_RXOVERR | SDIO_IT_STBITERR, ENABLE);
+        StartDoubleBuffer (BufferBlocks, NumberOfBlocks, callback, context);
+        SD_LowLevel_DMA_RxConfigDoubleBuffer ((uint32_t *) buffer0, (uint32_t *) buffer1, BufferBlocks * BlockSize);
+        SDIO_DMACmd (ENABLE);
+
+        if (Card.Type == SDIO_HIGH_CAPACITY_SD_CARD ) {
+                ReadAddr /= 512;
+        }
+
+        /*!< Set Block Size for Card */
+        errorstatus = SetBlockLen (BlockSize);
+
+        if (SD_OK != errorstatus) {
+                StopDoubleBuffer ();
+                return (errorstatus);
+        }
+
+        SetDataTimeout (NumberOfBlocks, 0);
+        SDIO_DataInitStructure.SDIO_DataLength = NumberOfBlocks * BlockSize;
+        SDIO_DataInitStructure.SDIO_DataBlockSize = (uint32_t) 9 << 4;
+        SDIO_DataInitStructure.SDIO_TransferDir = SDIO_TransferDir_ToSDIO;
+        SDIO_DataInitStructure.SDIO_TransferMode = SDIO_TransferMode_Block;
+        SDIO_DataInitStructure.SDIO_DPSM = SDIO_DPSM_Enable;
+        SDIO_DataConfig (&SDIO_DataInitStructure);
+
+        /*!< Send CMD18 READ_MULT_BLOCK with argument data address */
+        SDIO_CmdInitStructure.SDIO_Argument = (uint32_t) ReadAddr;
+        SDIO_CmdInitStructure.SDIO_CmdIndex = SD_CMD_READ_MULT_BLOCK;
+        SDIO_CmdInitStructure.SDIO_Response = SDIO_Response_Short;
+        SDIO_CmdInitStructure.SDIO_Wait = SDIO_Wait_No;
+        SDIO_CmdInitStructure.SDIO_CPSM = SDIO_CPSM_Enable;
+        SDIO_SendCommand (&SDIO_CmdInitStructure);
+
+        errorstatus = CmdResp1Error (SD_CMD_READ_MULT_BLOCK );
+
+        if (errorstatus != SD_OK) {
+                StopDoubleBuffer ();
+        }
+
+        return (errorstatus);
+}
+
+/**
+ * @brief  Writes NumberOfBlocks blocks from two small buffers used in turns by the
+ *         DMA (double buffer mode). Both buffers must be filled before the call,
+ *         callback is called each time one of them has been sent and can be
+ *         refilled. Wait for the end with SD_WaitWriteOperation.
+ * @param  buffer0: first buffer, sent first.
+ * @param  buffer1: second buffer.
+ * @param  BufferBlocks: size of each buffer in 512 byte blocks.
+ * @param  WriteAddr: Address where data are to be written, in bytes.
+ * @param  NumberOfBlocks: number of blocks to write, a multiple of BufferBlocks.
+ * @param  callback: called in interrupt context for each buffer sent.
+ * @param  context: passed to the callback.
+ * @retval SD_Error: SD Card Error code.
+ */
+SD_Error SD_WriteMultiBlocksDoubleBuffer (uint8_t *buffer0, uint8_t *buffer1, uint32_t BufferBlocks, uint64_t WriteAddr, uint32_t NumberOfBlocks, SD_BufferCallback callback,
+                void *context)
+{
+        SD_Error errorstatus = SD_OK;
+        uint16_t BlockSize = 512;
+
+        errorstatus = CheckDoubleBuffer (buffer0, buffer1, BufferBlocks, NumberOfBlocks);
+
+        if (errorstatus != SD_OK) {
+                return (errorstatus);
+        }
+
+        Card.TransferError = SD_OK;
+        Card.TransferEnd = 0;
+        Card.StopCondition = 1;
+        Card.DMAEndOfTransfer = 0x00;
+        SDIO ->DCTRL = 0x0;
+
+        SDIO_ITConfig (SDIO_IT_DCRCFAIL | SDIO_IT_DTIMEOUT | SDIO_IT_DATAEND | SDIO_IT_TXUNDERR | SDIO_IT_STBITERR, ENABLE);
+        StartDoubleBuffer (BufferBlocks, NumberOfBlocks, callback, context);
+        SD_LowLevel_DMA_TxConfigDoubleBuffer ((uint32_t *) buffer0, (uint32_t *) buffer1, BufferBlocks * BlockSize);
+        SDIO_DMACmd (ENABLE);
+
+        if (Card.Type == SDIO_HIGH_CAPACITY_SD_CARD ) {
+                WriteAddr /= 512;
+        }
+
+        errorstatus = SendWriteMultiBlockCmd (WriteAddr, BlockSize, NumberOfBlocks);
+
+        if (SD_OK != errorstatus) {
+                StopDoubleBuffer ();
+                return (errorstatus);
+        }
+
+        SetDataTimeout (NumberOfBlocks, 1);
+        SDIO_DataInitStructure.SDIO_DataLength = NumberOfBlocks * BlockSize;
+        SDIO_DataInitStructure.SDIO_DataBlockSize = (uint32_t) 9 << 4;
+        SDIO_DataInitStructure.SDIO_TransferDir = SDIO_TransferDir_ToCard;
+        SDIO_DataInitStructure.SDIO_TransferMode = SDIO_TransferMode_Block;
+        SDIO_DataInitStructure.SDIO_DPSM = SDIO_DPSM_Enable;
+        SDIO_DataConfig (&SDIO_DataInitStructure);
+
+        return (errorstatus);
+}
+
+/**
+ * @brief  Double buffered version of SD_StreamWrite : pushes NumberOfBlocks into
+ *         the open stream from two buffers refilled in the callback. Together with
+ *         SD_StreamOpen this writes a log of any length from two small buffers.
+ * @param  buffer0: first buffer, sent first.
+ * @param  buffer1: second buffer.
+ * @param  BufferBlocks: size of each buffer in 512 byte blocks.
+ * @param  NumberOfBlocks: number of blocks to send, a multiple of BufferBlocks.
+ * @param  callback: called in interrupt context for each buffer sent.
+ * @param  context: passed to the callback.
+ * @retval SD_Error: SD_ERROR if no stream is open.
+ */
+SD_Error SD_StreamWriteDoubleBuffer (uint8_t *buffer0, uint8_t *buffer1, uint32_t BufferBlocks, uint32_t NumberOfBlocks, SD_BufferCallback callback, void *context)
+{
+        SD_Error errorstatus = SD_OK;
+
+        if (!Card.StreamOpen) {
+                return (SD_ERROR);
+        }
+
+        errorstatus = CheckDoubleBuffer (buffer0, buffer1, BufferBlocks, NumberOfBlocks);
+
+        if (errorstatus != SD_OK) {
+                return (errorstatus);
+        }
+
+        Card.TransferError = SD_OK;
+        Card.TransferEnd = 0;
+        Card.StopCondition = 0;
+        Card.DMAEndOfTransfer = 0x00;
+        SDIO ->DCTRL = 0x0;
+
+        SDIO_ITConfig (SDIO_IT_DCRCFAIL | SDIO_IT_DTIMEOUT | SDIO_IT_DATAEND | SDIO_IT_TXUNDERR | SDIO_IT_STBITERR, ENABLE);
+        StartDoubleBuffer (BufferBlocks, NumberOfBlocks, callback, context);
+        SD_LowLevel_DMA_TxConfigDoubleBuffer ((uint32_t *) buffer0, (uint32_t *) buffer1, BufferBlocks * 512);
+        SDIO_DMACmd (ENABLE);
+
+        SetDataTimeout (NumberOfBlocks, 1);
+        SDIO_DataInitStructure.SDIO_DataLength = NumberOfBlocks * 512;
+        SDIO_DataInitStructure.SDIO_DataBlockSize = (uint32_t) 9 << 4;
+        SDIO_DataInitStructure.SDIO_TransferDir = SDIO_TransferDir_ToCard;
+        SDIO_DataInitStructure.SDIO_TransferMode = SDIO_TransferMode_Block;
+        SDIO_DataInitStructure.SDIO_DPSM = SDIO_DPSM_Enable;
+        SDIO_DataConfig (&SDIO_DataInitStructure);
+
+        Card.StreamBlocks += NumberOfBlocks;
+        return (errorstatus);
+}
+
+/**
+ * @brief  Vectored read : one CMD18 scattered over several buffers, without an
+ *         intermediate copy. Runs on the double buffer mode : each DMA TC loads
+ *         the address of the chunk after next into the memory register that has
+ *         just been freed. Entries contiguous in memory are taken as one, and the
+ *         chunk is the largest size all of them are a multiple of (one block at
+ *         worst). Wait for the end with SD_WaitReadOperation.
+ * @note   The DMA IRQ must be served within one chunk time, otherwise the
+ *         transfer fails with SD_DMA_LATE.
+ * @param  vec: array of {buffer, NumberOfBlocks}, buffers word aligned. Must stay
+ *         valid until the transfer is over.
+ * @param  count: number of vec entries.
+ * @param  ReadAddr: Address from where data are to be read, in bytes.
+ * @retval SD_Error: SD Card Error code.
+ */
+SD_Error SD_ReadMultiBlocksVec (const SD_IoVec *vec, uint32_t count, uint64_t ReadAddr)
+{
+        SD_Error errorstatus = SD_OK;
+        uint8_t *first, *second;
+        uint32_t NumberOfBlocks;
+
+        errorstatus = StartVec (vec, count, &first, &second, &NumberOfBlocks);
+
+        if (errorstatus != SD_OK) {
+                return (errorstatus);
+        }
+
+        return (SD_ReadMultiBlocksDoubleBuffer (first, second, Card.VecChunk, ReadAddr, NumberOfBlocks, VecBufferDone, NULL));
+}
+
+/**
+ * @brief  Vectored write : one ACMD23/CMD25 gathered from several buffers. See
+ *         SD_ReadMultiBlocksVec. Wait for the end with SD_WaitWriteOperation.
+ * @param  vec: array of {buffer, NumberOfBlocks}, buffers word aligned. Must stay
+ *         valid until the transfer is over.
+ * @param  count: number of vec entries.
+ * @param  WriteAddr: Address where data are to be written, in bytes.
+ * @retval SD_Error: SD Card Error code.
+ */
+SD_Error SD_WriteMultiBlocksVec (const SD_IoVec *vec, uint32_t count, uint64_t WriteAddr)
+{
+        SD_Error errorstatus = SD_OK;
+        uint8_t *first, *second;
+        uint32_t NumberOfBlocks;
+
+        errorstatus = StartVec (vec, count, &first, &second, &NumberOfBlocks);
+
+        if (errorstatus != SD_OK) {
+                return (errorstatus);
+        }
+
+        return (SD_WriteMultiBlocksDoubleBuffer (first, second, Card.VecChunk, WriteAddr, NumberOfBlocks, VecBufferDone, NULL));
+}
+
+/**
+ * @brief  Validates a vector, counts its blocks, picks the chunk size and returns
+ *         the first two chunk addresses, which go to Memory0 and Memory1.
+ * @retval SD_Error: SD_INVALID_PARAMETER or SD_OK.
+ */
+static SD_Error StartVec (const SD_IoVec *vec, uint32_t count, uint8_t **first, uint8_t **second, uint32_t *NumberOfBlocks)
+{
+        uint32_t i, total = 0, run = 0, chunk = 0;
+
+        if ((vec == NULL) || (count == 0)) {
+                return (SD_INVALID_PARAMETER);
+        }
+
+        for (i = 0; i < count; i++) {
+                if ((vec[i].NumberOfBlocks == 0) || ((uint32_t) vec[i].buffer & 0x03)) {
+                        return (SD_INVALID_PARAMETER);
+                }
+
+                total += vec[i].NumberOfBlocks;
+
+                /*!< Runs of entries contiguous in memory, chunk divides all of them */
+                if ((i > 0) && (vec[i].buffer == vec[i - 1].buffer + vec[i - 1].NumberOfBlocks * 512)) {
+                        run += vec[i].NumberOfBlocks;
+                }
+                else {
+                        chunk = Gcd (chunk, run);
+                        run = vec[i].NumberOfBlocks;
+                }
+        }
+
+        chunk = Gcd (chunk, run);
+
+        while (chunk > SD_DBM_MAX_BLOCKS) {
+                for (i = SD_DBM_MAX_BLOCKS; chunk % i; i--) {
+                }
+
+                chunk = i;
+        }
+
+        Card.VecCurrent = vec;
+        Card.VecEnd = vec + count;
+        Card.VecBlock = 0;
+        Card.VecChunk = chunk;
+
+        *first = NextVecBlock ();
+        *second = NextVecBlock ();
+
+        /*!< Single chunk : Memory1 is never used, but must be valid */
+        if (*second == NULL) {
+                *second = *first;
+        }
+
+        *NumberOfBlocks = total;
+        return (SD_OK);
+}
+
+/**
+ * @brief  Returns the next chunk of the vector and advances the cursor. A chunk
+ *         may span several entries, only when they are contiguous.
+ * @param  None
+ * @retval Chunk address, NULL past the end.
+ */
+static uint8_t *NextVecBlock (void)
+{
+        uint8_t *block;
+
+        if (Card.VecCurrent == Card.VecEnd) {
+                return (NULL);
+        }
+
+        block = Card.VecCurrent->buffer + Card.VecBlock * 512;
+        Card.VecBlock += Card.VecChunk;
+
+        while ((Card.VecCurrent != Card.VecEnd) && (Card.VecBlock >= Card.VecCurrent->NumberOfBlocks)) {
+                Card.VecBlock -= Card.VecCurrent->NumberOfBlocks;
+                Card.VecCurrent++;
+        }
+
+        return (block);
+}
+
+/**
+ * @brief  Greatest common divisor, Gcd (0, b) is b.
+ */
+static uint32_t Gcd (uint32_t a, uint32_t b)
+{
+        uint32_t t;
+
+        while (b) {
+                t = a % b;
+                a = b;
+                b = t;
+        }
+
+        return (a);
+}
+
+/**
+ * @brief  Double buffer callback of the vectored transfers. The register of the
+ *         block just done is idle now, so it gets the block after next.
+ * @param  buffer: block just done.
+ * @param  context: unused.
+ * @retval None
+ */
+static void VecBufferDone (uint8_t *buffer, void *context)
+{
+        uint8_t *next;
+
+        if (!Card.DoubleBufferActive || ((next = NextVecBlock ()) == NULL)) {
+                return;
+        }
+
+        DMA_MemoryTargetConfig (SD_SDIO_DMA_STREAM, (uint32_t) next, (DMA_GetCurrentMemoryTarget (SD_SDIO_DMA_STREAM) == 0) ? DMA_Memory_1 : DMA_Memory_0);
+}
+
+/**
+ * @brief  Validates the arguments of the double buffered transfers. The DMA needs
+ *         word aligned buffers and the total must be whole buffers, otherwise the
+ *         last TC would never come.
+ * @retval SD_Error: SD_INVALID_PARAMETER or SD_OK.
+ */
+static SD_Error CheckDoubleBuffer (uint8_t *buffer0, uint8_t *buffer1, uint32_t BufferBlocks, uint32_t NumberOfBlocks)
+{
+        if ((BufferBlocks == 0) || (NumberOfBlocks == 0) || (NumberOfBlocks % BufferBlocks) || (NumberOfBlocks > 0x01FFFFFF / 512)
+                        || (BufferBlocks * 512 / 4 > 0xFFFF) || (((uint32_t) buffer0 | (uint32_t) buffer1) & 0x03)) {
+                return (SD_INVALID_PARAMETER);
+        }
+
+        return (SD_OK);
+}
+
+/**
+ * @brief  Sets up the bookkeeping of a double buffered transfer, before the DMA is
+ *         enabled.
+ * @retval None
+ */
+static void StartDoubleBuffer (uint32_t BufferBlocks, uint32_t NumberOfBlocks, SD_BufferCallback callback, void *context)
+{
+        Card.BufferBlocksEach = BufferBlocks;
+        Card.BufferTotal = NumberOfBlocks;
+        Card.BufferDone = 0;
+        Card.BufferCallback = callback;
+        Card.BufferContext = context;
+        Card.DoubleBufferActive = 1;
+}
+
+/**
+ * @brief  Checks, on a TC of a double buffered transfer, that the DMA is still in
+ *         the buffer after the one just done : CT must point to it, and the SDIO
+ *         must not be past its end (CT alone can not tell two swaps from none).
+ *         Otherwise the IRQ came too late and the DMA went on into a buffer
+ *         that was neither refilled nor reloaded.
+ * @param  None
+ * @retval 1 if a swap was missed.
+ */
+static uint8_t MissedSwap (void)
+{
+        uint32_t moved, end;
+
+        if (DMA_GetCurrentMemoryTarget (SD_SDIO_DMA_STREAM) != ((Card.BufferDone / Card.BufferBlocksEach) & 1)) {
+                return (1);
+        }
+
+        moved = Card.BufferTotal * 512 - SDIO_GetDataCounter ();
+        end = (Card.BufferDone + Card.BufferBlocksEach) * 512;
+        return (moved > end + SD_DMA_LAG_BYTES);
+}
+
+/**
+ * @brief  Ends the transfer on a DMA failure. The SDIO overruns or underruns next :
+ *         its interrupts go off so that the DMA error is the one reported.
+ * @param  error: SD_DMA_ERROR or SD_DMA_LATE.
+ * @retval None
+ */
+static void FailDma (SD_Error error)
+{
+        SDIO_ITConfig (SDIO_IT_DCRCFAIL | SDIO_IT_DTIMEOUT | SDIO_IT_DATAEND | SDIO_IT_TXFIFOHE | SDIO_IT_RXFIFOHF | SDIO_IT_TXUNDERR | SDIO_IT_RXOVERR | SDIO_IT_STBITERR, DISABLE);
+
+        if (Card.DoubleBufferActive) {
+                StopDoubleBuffer ();
+        }
+
+        Card.TransferError = error;
+}
+
+/**
+ * @brief  Stops the circular DMA of a double buffered transfer. Any words the DMA
+ *         pushed into the SDIO FIFO past the end are dropped with the data path.
+ * @param  None
+ * @retval None
+ */
+static void StopDoubleBuffer (void)
+{
+        Card.DoubleBufferActive = 0;
+        DMA_Cmd (SD_SDIO_DMA_STREAM, DISABLE);
+}
+
+/**
+ * @brief  Claims the asynchronous transfer slot and resets its state. The deadline
+ *         is armed by ArmAsync, once the command phase computed it.
+ * @param  callback: see SD_ReadMultiBlocksAsync.
+ * @param  context: passed to the callback.
+ * @retval 0 if a transfer is already in flight.
+ */
+static uint8_t StartAsync (SD_TransferCallback callback, void *context)
+{
+        __disable_irq ();
+
+        if (Card.AsyncState != ASYNC_IDLE) {
+                __enable_irq ();
+                return (0);
+        }
+
+        SD_DeadlineStart (&Card.AsyncDeadline, 0xFFFFFFFF);
+        Card.AsyncExpired = 0;
+        Card.AsyncCallback = callback;
+        Card.AsyncContext = context;
+        Card.AsyncStatus = SD_OK;
+        Card.DMAEndOfTransfer = 0x00;
+        Card.AsyncState = ASYNC_RUNNING;
+        __enable_irq ();
+        return (1);
+}
+
+/**
+ * @brief  Second half of StartAsync, after the command phase : starts the deadline
+ *         of the transfer (WaitTimeoutUs, see SetDataTimeout), or frees the slot if
+ *         the command failed. A completion the IRQs may have reported for the
+ *         failed transfer is dropped with it.
+ * @param  errorstatus: status of the command phase.
+ * @retval SD_Error: errorstatus.
+ */
+static SD_Error ArmAsync (SD_Error errorstatus)
+{
+        __disable_irq ();
+
+        if (errorstatus != SD_OK) {
+                Card.AsyncStatus = errorstatus;
+                Card.AsyncState = ASYNC_IDLE;
+        }
+        else {
+                SD_DeadlineStart (&Card.AsyncDeadline, Card.WaitTimeoutUs);
+        }
+
+        __enable_irq ();
+        return (errorstatus);
+}
+
+/**
+ * @brief  Gives up the asynchronous transfer once its deadline passed, i.e. when
+ *         neither the SDIO nor the DMA will ever report (the DPSM waits for data
+ *         in Wait_S without a timeout). Called with the interrupts disabled.
+ * @param  None
+ * @retval None
+ */
+static void CheckAsyncDeadline (void)
+{
+        if ((Card.AsyncState == ASYNC_RUNNING) && SD_DeadlineExpired (&Card.AsyncDeadline)) {
+                Card.AsyncExpired = 1;
+                Card.AsyncState = ASYNC_DONE;
+                SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+        }
+}
+
+/**
+ * @brief  Ends the data phase of the asynchronous transfer if both the SDIO and the
+ *         DMA side are done (or one of them reported an error). Called from both
+ *         IRQ handlers, which run at different priorities, hence the critical
+ *         section. Nothing that waits is done here : CMD12 and the callback are
+ *         left to SD_ProcessAsync, in PendSV.
+ * @param  None
+ * @retval None
+ */
+static void CompleteAsyncTransfer (void)
+{
+        __disable_irq ();
+
+        if ((Card.AsyncState != ASYNC_RUNNING) || ((Card.TransferError == SD_OK) && ((Card.TransferEnd == 0) || (Card.DMAEndOfTransfer == 0x00)))) {
+                __enable_irq ();
+                return;
+        }
+
+        Card.AsyncState = ASYNC_DONE;
+        __enable_irq ();
+
+        if (Card.TransferError != SD_OK) {
+                DMA_Cmd (SD_SDIO_DMA_STREAM, DISABLE);
+        }
+
+        SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+}
+
+/**
+ * @brief  Finishes the asynchronous transfer if it is DONE : CMD12, the callback.
+ * @param  None
+ * @retval None
+ */
+static void FinishAsyncTransfer (void)
+{
+        SD_Error errorstatus = SD_OK;
+        SD_TransferCallback callback;
+
+        __disable_irq ();
+
+        if (Card.AsyncState != ASYNC_DONE) {
+                __enable_irq ();
+                return;
+        }
+
+        Card.AsyncState = ASYNC_FINISHING;
+        __enable_irq ();
+
+        if (Card.AsyncExpired) {
+                SDIO_ITConfig (SDIO_IT_DCRCFAIL | SDIO_IT_DTIMEOUT | SDIO_IT_DATAEND | SDIO_IT_TXFIFOHE | SDIO_IT_RXFIFOHF | SDIO_IT_TXUNDERR | SDIO_IT_RXOVERR | SDIO_IT_STBITERR, DISABLE);
+                DMA_Cmd (SD_SDIO_DMA_STREAM, DISABLE);
+                Card.TransferError = SD_DATA_TIMEOUT;
+                dlogf ("SD async : deadline passed\r\n");
+        }
+
+        Card.DMAEndOfTransfer = 0x00;
+
+        if (Card.StopCondition == 1) {
+                errorstatus = SD_StopTransfer ();
+                Card.StopCondition = 0;
+        }
+
+        /*!< Clear all the static flags */
+        SDIO_ClearFlag (SDIO_STATIC_FLAGS );
+
+        Card.AsyncStatus = (Card.TransferError != SD_OK) ? Card.TransferError : errorstatus;
+        callback = Card.AsyncCallback;
+
+        /*!< The callback may start the next transfer */
+        Card.AsyncState = ASYNC_IDLE;
+
+        if (callback) {
+                callback (Card.AsyncStatus, Card.AsyncContext);
+        }
+}
+
+/**
+ * @brief  Checks for error conditions for CMD0.
+ * @param  None
+ * @retval SD_Error: SD Card Error code.
+ */
+static SD_Error CmdError (void)
+{
+        SD_Error errorstatus = SD_OK;
+        SD_Deadline deadline;
+        uint8_t expired = 0;
+
+        SD_DeadlineStart (&deadline, SD_CMD_TIMEOUT_US);
+
+        while (!(expired = SD_DeadlineExpired (&deadline)) && (SDIO_GetFlagStatus (SDIO_FLAG_CMDSENT) == RESET)) {
+        }
+
+        if (expired && (SDIO_GetFlagStatus (SDIO_FLAG_CMDSENT) == RESET)) {
+                errorstatus = SD_CMD_RSP_TIMEOUT;
+                return (errorstatus);
+        }
+
+        /*!< Clear all the static flags */
+        SDIO_ClearFlag (SDIO_STATIC_FLAGS );
+
+        return (errorstatus);
+}
+
+/**
+ * @brief  Checks for error conditions for R7 response.
+ * @param  None
+ * @retval SD_Error: SD Card Error code.
+ */
+static SD_Error CmdResp7Error (void)
+{
+        SD_Error errorstatus = SD_OK;
+        uint32_t status;
+
+        status = WaitCmdResponse ();
+
+        if (status & SDIO_FLAG_CTIMEOUT) {
+                /*!< Card is not V2.0 complient or card does not support the set voltage range */
+                errorstatus = SD_CMD_RSP_TIMEOUT;
+                SDIO_ClearFlag (SDIO_FLAG_CTIMEOUT);
+                return (errorstatus);
+        }
+
+        if (status & SDIO_FLAG_CMDREND) {
+                /*!< Card is SD V2.0 compliant */
+                errorstatus = SD_OK;
+                SDIO_ClearFlag (SDIO_FLAG_CMDREND);
+                return (errorstatus);
+        }
+        return (errorstatus);
+}
+
+/**
+ * @brief  Checks for error conditions for R1 response.
+ * @param  cmd: The sent command index.
+ * @retval SD_Error: SD Card Error code.
+ */
+static SD_Error CmdResp1Error (uint8_t cmd)
+{
+        SD_Error errorstatus = SD_OK;
+        uint32_t status;
+        uint32_t response_r1;
+
+        SD_TRACE_TIMER (spin);
+        status = WaitCmdResponse ();
+        SD_TRACE_CMD (cmd, spin, status);
+
+        if (status & SDIO_FLAG_CTIMEOUT) {
+                errorstatus = SD_CMD_RSP_TIMEOUT;
+                SDIO_ClearFlag (SDIO_FLAG_CTIMEOUT);
+                return (errorstatus);
+        }
+        else if (status & SDIO_FLAG_CCRCFAIL) {
+                errorstatus = SD_CMD_CRC_FAIL;
+                SDIO_ClearFlag (SDIO_FLAG_CCRCFAIL);
+                return (errorstatus);
+        }
+
+        /*!< Check response received is of desired command */
+        if (SDIO_GetCommandResponse () != cmd) {
+                errorstatus = SD_ILLEGAL_CMD;
+                return (errorstatus);
+        }
+
+        /*!< Clear all the static flags */
+        SDIO_ClearFlag (SDIO_STATIC_FLAGS );
+
+        /*!< We have received response, retrieve it for analysis  */
         response_r1 = SDIO_GetResponse (SDIO_RESP1);
 
         if ((response_r1 & SD_OCR_ERRORBITS )== SD_ALLZERO) {
@@ -2183,11 +3224,7 @@ static SD_Error CmdResp3Error (void)
         SD_Error errorstatus = SD_OK;
         uint32_t status;
 
-        status = SDIO ->STA;
-
-        while (!(status & (SDIO_FLAG_CCRCFAIL | SDIO_FLAG_CMDREND | SDIO_FLAG_CTIMEOUT))) {
-                status = SDIO ->STA;
-        }
+        status = WaitCmdResponse ();
 
         if (status & SDIO_FLAG_CTIMEOUT) {
                 errorstatus = SD_CMD_RSP_TIMEOUT;
@@ -2209,11 +3246,7 @@ static SD_Error CmdResp2Error (void)
         SD_Error errorstatus = SD_OK;
         uint32_t status;
 
-        status = SDIO ->STA;
-
-        while (!(status & (SDIO_FLAG_CCRCFAIL | SDIO_FLAG_CTIMEOUT | SDIO_FLAG_CMDREND))) {
-                status = SDIO ->STA;
-        }
+        status = WaitCmdResponse ();
 
         if (status & SDIO_FLAG_CTIMEOUT) {
                 errorstatus = SD_CMD_RSP_TIMEOUT;
@@ -2245,11 +3278,7 @@ static SD_Error CmdResp6Error (uint8_t cmd, uint16_t *prca)
         uint32_t status;
         uint32_t response_r1;
 
-        status = SDIO ->STA;
-
-        while (!(status & (SDIO_FLAG_CCRCFAIL | SDIO_FLAG_CTIMEOUT | SDIO_FLAG_CMDREND))) {
-                status = SDIO ->STA;
-        }
+        status = WaitCmdResponse ();
 
         if (status & SDIO_FLAG_CTIMEOUT) {
                 errorstatus = SD_CMD_RSP_TIMEOUT;
@@ -2312,7 +3341,7 @@ static SD_Error SDEnWideBus (FunctionalState NewState)
         }
 
         /*!< Get SCR Register */
-        errorstatus = FindSCR (RCA, scr);
+        errorstatus = FindSCR (Card.RCA, scr);
 
         if (errorstatus != SD_OK) {
                 return (errorstatus);
@@ -2323,7 +3352,7 @@ static SD_Error SDEnWideBus (FunctionalState NewState)
                 /*!< If requested card supports wide bus operation */
                 if ((scr[1] & SD_WIDE_BUS_SUPPORT )!= SD_ALLZERO) {
                         /*!< Send CMD55 APP_CMD with argument as card's RCA.*/
-                        SDIO_CmdInitStructure.SDIO_Argument = (uint32_t) RCA << 16;
+                        SDIO_CmdInitStructure.SDIO_Argument = (uint32_t) Card.RCA << 16;
                         SDIO_CmdInitStructure.SDIO_CmdIndex = SD_CMD_APP_CMD;
                         SDIO_CmdInitStructure.SDIO_Response = SDIO_Response_Short;
                         SDIO_CmdInitStructure.SDIO_Wait = SDIO_Wait_No;
@@ -2360,7 +3389,7 @@ static SD_Error SDEnWideBus (FunctionalState NewState)
                 /*!< If requested card supports 1 bit mode operation */
                 if ((scr[1] & SD_SINGLE_BUS_SUPPORT )!= SD_ALLZERO) {
                         /*!< Send CMD55 APP_CMD with argument as card's RCA.*/
-                        SDIO_CmdInitStructure.SDIO_Argument = (uint32_t) RCA << 16;
+                        SDIO_CmdInitStructure.SDIO_Argument = (uint32_t) Card.RCA << 16;
                         SDIO_CmdInitStructure.SDIO_CmdIndex = SD_CMD_APP_CMD;
                         SDIO_CmdInitStructure.SDIO_Response = SDIO_Response_Short;
                         SDIO_CmdInitStructure.SDIO_Wait = SDIO_Wait_No;
@@ -2406,17 +3435,16 @@ static SD_Error IsCardProgramming (uint8_t *pstatus)
         SD_Error errorstatus = SD_OK;
         __IO uint32_t respR1 = 0, status = 0;
 
-        SDIO_CmdInitStructure.SDIO_Argument = (uint32_t) RCA << 16;
+        SDIO_CmdInitStructure.SDIO_Argument = (uint32_t) Card.RCA << 16;
         SDIO_CmdInitStructure.SDIO_CmdIndex = SD_CMD_SEND_STATUS;
         SDIO_CmdInitStructure.SDIO_Response = SDIO_Response_Short;
         SDIO_CmdInitStructure.SDIO_Wait = SDIO_Wait_No;
         SDIO_CmdInitStructure.SDIO_CPSM = SDIO_CPSM_Enable;
         SDIO_SendCommand (&SDIO_CmdInitStructure);
 
-        status = SDIO ->STA;
-        while (!(status & (SDIO_FLAG_CCRCFAIL | SDIO_FLAG_CMDREND | SDIO_FLAG_CTIMEOUT))) {
-                status = SDIO ->STA;
-        }
+        SD_TRACE_TIMER (spin);
+        status = WaitCmdResponse ();
+        SD_TRACE_CMD (SD_CMD_SEND_STATUS, spin, status);
 
         if (status & SDIO_FLAG_CTIMEOUT) {
                 errorstatus = SD_CMD_RSP_TIMEOUT;
@@ -2535,29 +3563,21 @@ static SD_Error IsCardProgramming (uint8_t *pstatus)
  * @param  pscr: pointer to the buffer that will contain the SCR value.
  * @retval SD_Error: SD Card Error code.
  */
-static SD_Error FindSCR (uint16_t rca, uint32_t *pscr)
-{
-        uint32_t index = 0;
-        SD_Error errorstatus = SD_OK;
-        uint32_t tempscr[2] = { 0, 0 };
-
-        /*!< Set Block Size To 8 Bytes */
-        /*!< Send CMD55 APP_CMD with argument as card's RCA */
-        SDIO_CmdInitStructure.SDIO_Argument = (uint32_t) 8;
-        SDIO_CmdInitStructure.SDIO_CmdIndex = SD_CMD_SET_BLOCKLEN;
-        SDIO_CmdInitStructure.SDIO_Response = SDIO_Response_Short;
-        SDIO_CmdInitStructure.SDIO_Wait = SDIO_Wait_No;
-        SDIO_CmdInitStructure.SDIO_CPSM = SDIO_CPSM_Enable;
-        SDIO_SendCommand (&SDIO_CmdInitStructure);
+static SD_Error FindSCR (uint16_t rca, uint32_t *pscr)
+{
+        uint32_t index = 0;
+        SD_Error errorstatus = SD_OK;
+        uint32_t tempscr[2] = { 0, 0 };
 
-        errorstatus = CmdResp1Error (SD_CMD_SET_BLOCKLEN );
+        /*!< Set Block Size To 8 Bytes */
+        errorstatus = SetBlockLen (8);
 
         if (errorstatus != SD_OK) {
                 return (errorstatus);
         }
 
         /*!< Send CMD55 APP_CMD with argument as card's RCA */
-        SDIO_CmdInitStructure.SDIO_Argument = (uint32_t) RCA << 16;
+        SDIO_CmdInitStructure.SDIO_Argument = (uint32_t) Card.RCA << 16;
         SDIO_CmdInitStructure.SDIO_CmdIndex = SD_CMD_APP_CMD;
         SDIO_CmdInitStructure.SDIO_Response = SDIO_Response_Short;
         SDIO_CmdInitStructure.SDIO_Wait = SDIO_Wait_No;
@@ -2569,7 +3589,7 @@ static SD_Error FindSCR (uint16_t rca, uint32_t *pscr)
         if (errorstatus != SD_OK) {
                 return (errorstatus);
         }
-        SDIO_DataInitStructure.SDIO_DataTimeOut = SD_DATATIMEOUT;
+        SetDataTimeout (1, 0);
         SDIO_DataInitStructure.SDIO_DataLength = 8;
         SDIO_DataInitStructure.SDIO_DataBlockSize = SDIO_DataBlockSize_8b;
         SDIO_DataInitStructure.SDIO_TransferDir = SDIO_TransferDir_ToSDIO;
@@ -2629,6 +3649,100 @@ static SD_Error FindSCR (uint16_t rca, uint32_t *pscr)
         return (errorstatus);
 }
 
+/**
+ * @brief  Command phase of a multiple block write : CMD16 (if needed), ACMD23 and
+ *         CMD25. The data phase is configured by the caller.
+ * @param  WriteAddr: card address, already in blocks for SDHC.
+ * @param  BlockSize: the SD card Data block size.
+ * @param  PreEraseBlocks: number of blocks to pre-erase with ACMD23, 0 to skip it.
+ * @retval SD_Error: SD Card Error code.
+ */
+static SD_Error SendWriteMultiBlockCmd (uint64_t WriteAddr, uint16_t BlockSize, uint32_t PreEraseBlocks)
+{
+        SD_Error errorstatus = SD_OK;
+
+        /* Set Block Size for Card */
+        errorstatus = SetBlockLen (BlockSize);
+
+        if (SD_OK != errorstatus) {
+                return (errorstatus);
+        }
+
+        if (PreEraseBlocks) {
+                /*!< To improve performance */
+                SDIO_CmdInitStructure.SDIO_Argument = (uint32_t) (Card.RCA << 16);
+                SDIO_CmdInitStructure.SDIO_CmdIndex = SD_CMD_APP_CMD;
+                SDIO_CmdInitStructure.SDIO_Response = SDIO_Response_Short;
+                SDIO_CmdInitStructure.SDIO_Wait = SDIO_Wait_No;
+                SDIO_CmdInitStructure.SDIO_CPSM = SDIO_CPSM_Enable;
+                SDIO_SendCommand (&SDIO_CmdInitStructure);
+
+                errorstatus = CmdResp1Error (SD_CMD_APP_CMD );
+
+                if (errorstatus != SD_OK) {
+                        return (errorstatus);
+                }
+                /*!< To improve performance */
+                SDIO_CmdInitStructure.SDIO_Argument = PreEraseBlocks;
+                SDIO_CmdInitStructure.SDIO_CmdIndex = SD_CMD_SET_BLOCK_COUNT;
+                SDIO_CmdInitStructure.SDIO_Response = SDIO_Response_Short;
+                SDIO_CmdInitStructure.SDIO_Wait = SDIO_Wait_No;
+                SDIO_CmdInitStructure.SDIO_CPSM = SDIO_CPSM_Enable;
+                SDIO_SendCommand (&SDIO_CmdInitStructure);
+
+                errorstatus = CmdResp1Error (SD_CMD_SET_BLOCK_COUNT );
+
+                if (errorstatus != SD_OK) {
+                        return (errorstatus);
+                }
+        }
+
+        /*!< Send CMD25 WRITE_MULT_BLOCK with argument data address */
+        SDIO_CmdInitStructure.SDIO_Argument = (uint32_t) WriteAddr;
+        SDIO_CmdInitStructure.SDIO_CmdIndex = SD_CMD_WRITE_MULT_BLOCK;
+        SDIO_CmdInitStructure.SDIO_Response = SDIO_Response_Short;
+        SDIO_CmdInitStructure.SDIO_Wait = SDIO_Wait_No;
+        SDIO_CmdInitStructure.SDIO_CPSM = SDIO_CPSM_Enable;
+        SDIO_SendCommand (&SDIO_CmdInitStructure);
+
+        errorstatus = CmdResp1Error (SD_CMD_WRITE_MULT_BLOCK );
+
+        return (errorstatus);
+}
+
+/**
+ * @brief  Sends CMD16 SET_BLOCKLEN unless the card already uses this block length.
+ *         Saves a command round trip on every read/write. The cache is dropped on
+ *         CMD0 (SD_PowerON) and whenever CMD16 fails.
+ * @param  BlockLen: block length in bytes.
+ * @retval SD_Error: SD Card Error code.
+ */
+static SD_Error SetBlockLen (uint32_t BlockLen)
+{
+        SD_Error errorstatus = SD_OK;
+
+        if (BlockLen == Card.BlockLen) {
+                return (errorstatus);
+        }
+
+        Card.BlockLen = 0;
+
+        SDIO_CmdInitStructure.SDIO_Argument = BlockLen;
+        SDIO_CmdInitStructure.SDIO_CmdIndex = SD_CMD_SET_BLOCKLEN;
+        SDIO_CmdInitStructure.SDIO_Response = SDIO_Response_Short;
+        SDIO_CmdInitStructure.SDIO_Wait = SDIO_Wait_No;
+        SDIO_CmdInitStructure.SDIO_CPSM = SDIO_CPSM_Enable;
+        SDIO_SendCommand (&SDIO_CmdInitStructure);
+
+        errorstatus = CmdResp1Error (SD_CMD_SET_BLOCKLEN );
+
+        if (errorstatus == SD_OK) {
+                Card.BlockLen = BlockLen;
+        }
+
+        return (errorstatus);
+}
+
 /**
  * @brief  Converts the number of bytes in power of two and returns the power.
  * @param  NumberOfBytes: number of bytes.
@@ -2660,14 +3774,14 @@ SD_Error SD_HighSpeed (void)
         uint32_t SD_SPEC = 0;
         uint8_t hs[64] = { 0 };
         uint32_t count = 0, *tempbuff = (uint32_t *) hs;
-        TransferError = SD_OK;
-        TransferEnd = 0;
-        StopCondition = 0;
+        Card.TransferError = SD_OK;
+        Card.TransferEnd = 0;
+        Card.StopCondition = 0;
 
         SDIO ->DCTRL = 0x0;
 
         /*!< Get SCR Register */
-        errorstatus = FindSCR (RCA, scr);
+        errorstatus = FindSCR (Card.RCA, scr);
 
         if (errorstatus != SD_OK) {
                 return (errorstatus);
@@ -2678,17 +3792,11 @@ SD_Error SD_HighSpeed (void)
 
         if (SD_SPEC != SD_ALLZERO ) {
                 /* Set Block Size for Card */
-                SDIO_CmdInitStructure.SDIO_Argument = (uint32_t) 64;
-                SDIO_CmdInitStructure.SDIO_CmdIndex = SD_CMD_SET_BLOCKLEN;
-                SDIO_CmdInitStructure.SDIO_Response = SDIO_Response_Short;
-                SDIO_CmdInitStructure.SDIO_Wait = SDIO_Wait_No;
-                SDIO_CmdInitStructure.SDIO_CPSM = SDIO_CPSM_Enable;
-                SDIO_SendCommand (&SDIO_CmdInitStructure);
-                errorstatus = CmdResp1Error (SD_CMD_SET_BLOCKLEN );
+                errorstatus = SetBlockLen (64);
                 if (errorstatus != SD_OK) {
                         return (errorstatus);
                 }
-                SDIO_DataInitStructure.SDIO_DataTimeOut = SD_DATATIMEOUT;
+                SetDataTimeout (1, 0);
                 SDIO_DataInitStructure.SDIO_DataLength = 64;
                 SDIO_DataInitStructure.SDIO_DataBlockSize = SDIO_DataBlockSize_64b;
                 SDIO_DataInitStructure.SDIO_TransferDir = SDIO_TransferDir_ToSDIO;
@@ -2747,9 +3855,10 @@ SD_Error SD_HighSpeed (void)
                 /*!< Clear all the static flags */
                 SDIO_ClearFlag (SDIO_STATIC_FLAGS );
 
-                /* Test if the switch mode HS is ok */
-                if ((hs[13] & 0x2) == 0x2) {
+                /* Test if the switch mode HS is ok (supported and selected) */
+                if (((hs[13] & 0x2) == 0x2) && ((hs[16] & 0x0F) == 0x01)) {
                         errorstatus = SD_OK;
+                        Card.HighSpeedMode = 1;
                 }
                 else {
                         errorstatus = SD_UNSUPPORTED_FEATURE;
@@ -2758,3 +3867,380 @@ SD_Error SD_HighSpeed (void)
         return (errorstatus);
 }
 
+/**
+ * @brief  Changes SDIO_CK. The card has to be in high speed mode (SD_HighSpeed)
+ *         for SD_BUS_SPEED_HIGH. Must not be called during a transfer.
+ * @param  speed: one of the SD_BusSpeed steps.
+ * @retval SD_Error: SD_UNSUPPORTED_FEATURE if the card is not in high speed mode.
+ */
+SD_Error SD_SetBusSpeed (SD_BusSpeed speed)
+{
+        if (speed > SD_BUS_SPEED_INIT) {
+                return (SD_INVALID_PARAMETER);
+        }
+
+        if ((speed == SD_BUS_SPEED_HIGH) && !Card.HighSpeedMode) {
+                return (SD_UNSUPPORTED_FEATURE);
+        }
+
+        Card.BusSpeed = speed;
+        ConfigureSDIO (Card.BusWide);
+        Card.Info.BusClock = BusClockHz[Card.BusSpeed];
+        return (SD_OK);
+}
+
+/**
+ * @brief  Returns the current SDIO_CK step.
+ * @param  None
+ * @retval SD_BusSpeed
+ */
+SD_BusSpeed SD_GetBusSpeed (void)
+{
+        return (Card.BusSpeed);
+}
+
+/**
+ * @brief  Programs the SDIO peripheral with the current bus speed and the given
+ *         bus width.
+ * @param  Wide: SDIO_BusWide_1b or SDIO_BusWide_4b.
+ * @retval None
+ */
+static void ConfigureSDIO (uint32_t Wide)
+{
+        Card.BusWide = Wide;
+        SDIO_InitStructure.SDIO_ClockDiv = BusClockDiv[Card.BusSpeed];
+        SDIO_InitStructure.SDIO_ClockEdge = SDIO_ClockEdge_Rising;
+        SDIO_InitStructure.SDIO_ClockBypass = (Card.BusSpeed == SD_BUS_SPEED_HIGH) ? SDIO_ClockBypass_Enable : SDIO_ClockBypass_Disable;
+        SDIO_InitStructure.SDIO_ClockPowerSave = SDIO_ClockPowerSave_Disable;
+        SDIO_InitStructure.SDIO_BusWide = Card.BusWide;
+        SDIO_InitStructure.SDIO_HardwareFlowControl = SDIO_HardwareFlowControl_Disable;
+        SDIO_Init (&SDIO_InitStructure);
+}
+
+/**
+ * @brief  Picks the fastest clock the card and the wiring can take : switches the
+ *         card to high speed with CMD6 at 24 MHz, then reads block 0. Both step the
+ *         clock down on every transmission error until they pass. High speed only
+ *         if CMD6 went through at 24 MHz.
+ * @param  None
+ * @retval SD_Error: error of the last verify read.
+ */
+static SD_Error NegotiateBusSpeed (void)
+{
+        SD_Error errorstatus = SD_OK;
+        uint32_t block[128];
+        SD_BusSpeed speed = SD_BUS_SPEED_DEFAULT;
+
+        while (1) {
+                SD_SetBusSpeed (speed);
+                errorstatus = SD_HighSpeed ();
+
+                if (!SD_IsBusError (errorstatus)) {
+                        break;
+                }
+
+                logf ("CMD6 failed at %u Hz\r\n", (unsigned int) BusClockHz[speed]);
+
+                /*!< The card may still be sending the switch status : let it get back to */
+                /*!< tran, and empty the FIFO, the DMA of the next read would take it */
+                SDIO ->DCTRL = 0x0;
+                SD_WaitReady ();
+
+                while (SDIO_GetFlagStatus (SDIO_FLAG_RXDAVL) != RESET) {
+                        SDIO_ReadData ();
+                }
+
+                SDIO_ClearFlag (SDIO_STATIC_FLAGS );
+
+                if (speed == SD_BUS_SPEED_INIT) {
+                        break;
+                }
+
+                speed++;
+        }
+
+        if ((errorstatus == SD_OK) && (speed == SD_BUS_SPEED_DEFAULT)) {
+                speed = SD_BUS_SPEED_HIGH;
+        }
+
+        while (1) {
+                SD_SetBusSpeed (speed);
+
+                errorstatus = SD_ReadBlock ((uint8_t *) block, 0, 512);
+
+                if (errorstatus == SD_OK) {
+                        errorstatus = SD_WaitReadOperation ();
+                }
+
+                if (!SD_IsBusError (errorstatus) || (speed == SD_BUS_SPEED_INIT)) {
+                        break;
+                }
+
+                logf ("Verify read failed at %u Hz\r\n", (unsigned int) BusClockHz[speed]);
+                speed++;
+        }
+
+        return (errorstatus);
+}
+
+/**
+ * @brief  Tells the errors a slower SDIO_CK or a retry can cure (signal integrity)
+ *         from the ones it can not.
+ * @param  errorstatus: error to check.
+ * @retval 1 for CRC, timeout, FIFO and start bit errors, 0 otherwise.
+ */
+uint8_t SD_IsBusError (SD_Error errorstatus)
+{
+        return ((errorstatus == SD_CMD_CRC_FAIL) || (errorstatus == SD_DATA_CRC_FAIL) || (errorstatus == SD_CMD_RSP_TIMEOUT) || (errorstatus == SD_DATA_TIMEOUT)
+                        || (errorstatus == SD_TX_UNDERRUN) || (errorstatus == SD_RX_OVERRUN) || (errorstatus == SD_START_BIT_ERR));
+}
+
+/**
+ * @brief  Waits for the end of a command (response, CRC error or timeout). The
+ *         CPSM times out by itself after 64 SDIO_CK, the deadline only guards
+ *         against a CPSM that never started.
+ * @param  None
+ * @retval SDIO->STA, with SDIO_FLAG_CTIMEOUT set if the deadline expired.
+ */
+static uint32_t WaitCmdResponse (void)
+{
+        SD_Deadline deadline;
+        uint32_t status;
+
+        SD_DeadlineStart (&deadline, SD_CMD_TIMEOUT_US);
+        status = SDIO ->STA;
+
+        while (!(status & (SDIO_FLAG_CCRCFAIL | SDIO_FLAG_CMDREND | SDIO_FLAG_CTIMEOUT))) {
+                if (SD_DeadlineExpired (&deadline)) {
+                        status |= SDIO_FLAG_CTIMEOUT;
+                        break;
+                }
+
+                status = SDIO ->STA;
+        }
+
+        return (status);
+}
+
+/**
+ * @brief  Sets the data timeout of the DPSM (per block, in SDIO_CK cycles) and the
+ *         deadline of the whole transfer for the SD_Wait functions.
+ * @param  NumberOfBlocks: length of the transfer.
+ * @param  write: 1 for writes, 0 for reads.
+ * @retval None
+ */
+static void SetDataTimeout (uint32_t NumberOfBlocks, uint8_t write)
+{
+        uint32_t us = (write) ? Card.WriteTimeoutUs : Card.ReadTimeoutUs;
+        uint32_t clock = BusClockHz[Card.BusSpeed];
+        uint64_t cycles = (uint64_t) us * clock / 1000000;
+        uint64_t total;
+
+        SDIO_DataInitStructure.SDIO_DataTimeOut = (cycles > 0xFFFFFFFF) ? 0xFFFFFFFF : (uint32_t) cycles;
+
+        /*!< Access time plus the data itself (1024 clocks per block on 4 bits) */
+        total = (uint64_t) NumberOfBlocks * (us + 1024ULL * 1000000 / clock);
+        Card.WaitTimeoutUs = (total > 0xFFFFFFFF) ? 0xFFFFFFFF : (uint32_t) total;
+}
+
+/**
+ * @brief  Computes the read and write timeouts. SDHC/SDXC have fixed ones, for
+ *         SDSC it is 100 times the typical access time (TAAC + NSAC), times
+ *         R2W_FACTOR for writes, capped by the same fixed limits.
+ * @param  csd: CSD of the card.
+ * @retval None
+ */
+static void ComputeTimeouts (SD_CSD *csd)
+{
+        static const uint8_t taacValue[16] = { 0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80 };
+        uint32_t unit, ns, us;
+
+        Card.ReadTimeoutUs = SD_READ_TIMEOUT_US;
+        Card.WriteTimeoutUs = SD_WRITE_TIMEOUT_US;
+
+        if ((Card.Type == SDIO_HIGH_CAPACITY_SD_CARD) || (csd->CSDStruct != 0)) {
+                return;
+        }
+
+        /*!< TAAC : time unit 1ns * 10^(bits 2:0), value / 10 in bits 6:3 */
+        for (unit = 1, ns = csd->TAAC & 0x07; ns > 0; ns--) {
+                unit *= 10;
+        }
+
+        ns = unit * taacValue[(csd->TAAC >> 3) & 0x0F] / 10;
+        us = ns / 1000 + (uint32_t) ((uint64_t) csd->NSAC * 100 * 1000000 / BusClockHz[Card.BusSpeed]) + 1;
+
+        if (us * 100 < Card.ReadTimeoutUs) {
+                Card.ReadTimeoutUs = us * 100;
+        }
+
+        if ((Card.ReadTimeoutUs << (csd->WrSpeedFact & 0x07)) < Card.WriteTimeoutUs) {
+                Card.WriteTimeoutUs = Card.ReadTimeoutUs << (csd->WrSpeedFact & 0x07);
+        }
+}
+
+/**
+ * @brief  Tells if the card is busy programming, from the D0 line. No command is
+ *         sent. Only meaningful between transfers.
+ * @param  None
+ * @retval 1 if busy, 0 otherwise.
+ */
+uint8_t SD_IsBusy (void)
+{
+        return (SD_LowLevel_IsBusy ());
+}
+
+/**
+ * @brief  Waits until the card is back in the transfer state after a write or an
+ *         erase, without polling it with CMD13 : sleeps until the end of busy
+ *         interrupt on D0, then checks the state once.
+ * @param  None
+ * @retval SD_Error: SD_DATA_TIMEOUT if the card is still busy after the write
+ *         timeout, SD_ERROR if the card reports an error state.
+ */
+SD_Error SD_WaitReady (void)
+{
+        SDTransferState state;
+        SD_Deadline deadline;
+
+        SD_DeadlineStart (&deadline, Card.WriteTimeoutUs);
+
+        while (1) {
+                if (WaitNotBusy (&deadline)) {
+                        return (SD_DATA_TIMEOUT);
+                }
+
+                state = SD_GetStatus ();
+
+                if (state == SD_TRANSFER_OK) {
+                        return (SD_OK);
+                }
+                else if (state == SD_TRANSFER_ERROR) {
+                        return (SD_ERROR);
+                }
+
+                /*!< D0 released but not in tran yet, look again on the next tick */
+                if (SD_DeadlineExpired (&deadline)) {
+                        return (SD_DATA_TIMEOUT);
+                }
+
+                SD_Sleep ();
+        }
+}
+
+/**
+ * @brief  Calls callback once the card releases D0 (end of programming), or right
+ *         away if it is not busy. Used to chain the next command after a write
+ *         without polling. The D0 EXTI interrupt only notes the edge, callback is
+ *         called from SD_ProcessAsync (PendSV), so it may send commands.
+ * @param  callback: called with SD_OK.
+ * @param  context: passed to the callback.
+ * @retval None
+ */
+void SD_NotifyWhenReady (SD_TransferCallback callback, void *context)
+{
+        __disable_irq ();
+        Card.ReadyCallback = callback;
+        Card.ReadyContext = context;
+        SD_LowLevel_BusyIRQConfig (ENABLE);
+        __enable_irq ();
+
+        /*!< The edge may have come before the line was unmasked */
+        if (!SD_LowLevel_IsBusy ()) {
+                CompleteReady ();
+        }
+}
+
+/**
+ * @brief  Handles the end of busy interrupt (D0 rising edge).
+ * @param  None
+ * @retval None
+ */
+void SD_ProcessBusyIRQ (void)
+{
+        if (EXTI_GetITStatus (SD_BUSY_EXTI_LINE) != RESET) {
+                EXTI_ClearITPendingBit (SD_BUSY_EXTI_LINE);
+
+                if (Card.ReadyCallback != NULL) {
+                        SD_LowLevel_BusyIRQConfig (DISABLE);
+                        Card.ReadyFired = 1;
+                        SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+                }
+        }
+}
+
+/**
+ * @brief  Masks the busy interrupt and calls the pending SD_NotifyWhenReady
+ *         callback, exactly once even if both the IRQ and the caller get here.
+ * @param  None
+ * @retval None
+ */
+static void CompleteReady (void)
+{
+        SD_TransferCallback callback;
+        void *context;
+
+        __disable_irq ();
+        callback = Card.ReadyCallback;
+        context = Card.ReadyContext;
+        Card.ReadyCallback = NULL;
+        SD_LowLevel_BusyIRQConfig (DISABLE);
+        __enable_irq ();
+
+        if (callback) {
+                callback (SD_OK, context);
+        }
+}
+
+/**
+ * @brief  Sleeps while D0 is held low, woken by its rising edge (or SysTick).
+ * @param  deadline: deadline of the wait.
+ * @retval 1 if the deadline expired first.
+ */
+static uint8_t WaitNotBusy (SD_Deadline *deadline)
+{
+        uint8_t expired = 0;
+
+        __disable_irq ();
+
+        if (Card.ReadyCallback == NULL) {
+                SD_LowLevel_BusyIRQConfig (ENABLE);
+        }
+
+        while (SD_LowLevel_IsBusy () && !(expired = SD_DeadlineExpired (deadline))) {
+                SD_Sleep ();
+                __enable_irq ();
+                __disable_irq ();
+        }
+
+        if (Card.ReadyCallback == NULL) {
+                SD_LowLevel_BusyIRQConfig (DISABLE);
+        }
+
+        __enable_irq ();
+        return (expired);
+}
+
+/**
+ * @brief  Sleeps until the data transfer ends or fails. The end is both the SDIO
+ *         DATAEND and the DMA TC : the TC of a write comes while the last blocks
+ *         are still in the FIFO, DATAEND of a read while the FIFO still drains.
+ *         SysTick wakes the core regularly so the deadline is still checked.
+ * @param  deadline: deadline of the transfer.
+ * @retval 1 if the deadline expired first.
+ */
+static uint8_t WaitDataEnd (SD_Deadline *deadline)
+{
+        uint8_t expired = 0;
+
+        __disable_irq ();
+
+        while (((Card.DMAEndOfTransfer == 0x00) || (Card.TransferEnd == 0)) && (Card.TransferError == SD_OK) && !(expired = SD_DeadlineExpired (deadline))) {
+                SD_Sleep ();
+                __enable_irq ();
+                __disable_irq ();
+        }
+
+        __enable_irq ();
+        return (expired);
+}
@@ -87,6 +87,8 @@ typedef enum
         SD_INVALID_PARAMETER,
         SD_UNSUPPORTED_FEATURE,
         SD_UNSUPPORTED_HW,
+        SD_DMA_ERROR, /*!< DMA transfer or direct mode error, the data is incomplete */
+        SD_DMA_LATE, /*!< Double buffer IRQ served after the DMA reused a buffer */
         SD_ERROR,
         SD_OK = 0
 } SD_Error;
@@ -98,6 +100,42 @@ typedef enum {
         SD_TRANSFER_OK = 0, SD_TRANSFER_BUSY = 1, SD_TRANSFER_ERROR
 } SDTransferState;
 
+/**
+ * @brief  SDIO_CK settings, fastest first. Each step down is the fallback of the
+ *         previous one.
+ */
+typedef enum {
+        SD_BUS_SPEED_HIGH = 0, /*!< 48MHz, bypass, card in high speed mode */
+        SD_BUS_SPEED_DEFAULT = 1, /*!< 24MHz, divider 0 */
+        SD_BUS_SPEED_16MHZ = 2, /*!< divider 1 */
+        SD_BUS_SPEED_8MHZ = 3, /*!< divider 4 */
+        SD_BUS_SPEED_INIT = 4 /*!< 400KHz, SDIO_INIT_CLK_DIV */
+} SD_BusSpeed;
+
+/**
+ * @brief  Completion callback of an asynchronous transfer. Runs from SD_ProcessAsync,
+ *         i.e. in PendSV below every interrupt (or in the waiter calling
+ *         SD_AsyncSleep), after CMD12. It may start the next transfer.
+ */
+typedef void (*SD_TransferCallback) (SD_Error status, void *context);
+
+/**
+ * @brief  Called from the DMA2 Stream3 IRQ each time one of the two buffers of a
+ *         double buffered transfer is done. For writes the buffer may be refilled,
+ *         for reads it holds fresh data. Either way it must be handled before the
+ *         DMA gets to it again, i.e. within one buffer time.
+ */
+typedef void (*SD_BufferCallback) (uint8_t *buffer, void *context);
+
+/**
+ * @brief  One element of a scatter-gather list : NumberOfBlocks 512 byte blocks
+ *         at buffer. Consecutive elements contiguous in memory are coalesced.
+ */
+typedef struct {
+        uint8_t *buffer;
+        uint32_t NumberOfBlocks;
+} SD_IoVec;
+
 /** 
  * @brief  SD Card States
  */
@@ -189,6 +227,7 @@ typedef struct {
         uint32_t CardBlockSize; /*!< Card Block Size */
         uint16_t RCA;
         uint8_t CardType;
+        uint32_t BusClock; /*!< SDIO_CK negotiated by SD_Init, in Hz */
 } SD_CardInfo;
 
 /**
@@ -350,6 +389,30 @@ void SD_ProcessDMAIRQ (void);
 SD_Error SD_WaitReadOperation (void);
 SD_Error SD_WaitWriteOperation (void);
 SD_Error SD_HighSpeed (void);
+SD_Error SD_SetBusSpeed (SD_BusSpeed speed);
+SD_BusSpeed SD_GetBusSpeed (void);
+uint8_t SD_IsBusError (SD_Error errorstatus);
+uint8_t SD_IsBusy (void);
+SD_Error SD_WaitReady (void);
+void SD_NotifyWhenReady (SD_TransferCallback callback, void *context);
+void SD_ProcessBusyIRQ (void);
+SD_Error SD_ReadMultiBlocksAsync (uint8_t *readbuff, uint64_t ReadAddr, uint16_t BlockSize, uint32_t NumberOfBlocks, SD_TransferCallback callback, void *context);
+SD_Error SD_WriteMultiBlocksAsync (uint8_t *writebuff, uint64_t WriteAddr, uint16_t BlockSize, uint32_t NumberOfBlocks, SD_TransferCallback callback, void *context);
+SDTransferState SD_GetAsyncState (void);
+SD_Error SD_GetAsyncError (void);
+void SD_ProcessAsync (void);
+void SD_ProcessTick (void);
+void SD_AsyncSleep (void);
+SD_Error SD_StreamOpen (uint64_t WriteAddr, uint32_t PreEraseBlocks);
+SD_Error SD_StreamWrite (uint8_t *writebuff, uint32_t NumberOfBlocks);
+SD_Error SD_StreamWriteAsync (uint8_t *writebuff, uint32_t NumberOfBlocks, SD_TransferCallback callback, void *context);
+SD_Error SD_StreamClose (void);
+uint32_t SD_StreamGetBlocks (void);
+SD_Error SD_ReadMultiBlocksDoubleBuffer (uint8_t *buffer0, uint8_t *buffer1, uint32_t BufferBlocks, uint64_t ReadAddr, uint32_t NumberOfBlocks, SD_BufferCallback callback, void *context);
+SD_Error SD_WriteMultiBlocksDoubleBuffer (uint8_t *buffer0, uint8_t *buffer1, uint32_t BufferBlocks, uint64_t WriteAddr, uint32_t NumberOfBlocks, SD_BufferCallback callback, void *context);
+SD_Error SD_ReadMultiBlocksVec (const SD_IoVec *vec, uint32_t count, uint64_t ReadAddr);
+SD_Error SD_WriteMultiBlocksVec (const SD_IoVec *vec, uint32_t count, uint64_t WriteAddr);
+SD_Error SD_StreamWriteDoubleBuffer (uint8_t *buffer0, uint8_t *buffer1, uint32_t BufferBlocks, uint32_t NumberOfBlocks, SD_BufferCallback callback, void *context);
 #ifdef __cplusplus
 }
 #endif
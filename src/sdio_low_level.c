@@ -116,11 +116,45 @@ void SD_LowLevel_Init (void)
 
         /* Enable the DMA2 Clock */
         RCC_AHB1PeriphClockCmd (SD_SDIO_DMA_CLK, ENABLE);
+
+        /* Route PC.08 (D0) to its EXTI line for the busy detection, left masked */
+        RCC_APB2PeriphClockCmd (RCC_APB2Periph_SYSCFG, ENABLE);
+        SYSCFG_EXTILineConfig (SD_BUSY_EXTI_PORT_SOURCE, SD_BUSY_EXTI_PIN_SOURCE);
+        SD_LowLevel_BusyIRQConfig (DISABLE);
+}
+
+/**
+ * @brief  Unmasks or masks the end of busy (D0 rising edge) interrupt. The pending
+ *         bit is cleared first, D0 toggles during data transfers.
+ * @param  NewState: ENABLE or DISABLE.
+ * @retval None
+ */
+void SD_LowLevel_BusyIRQConfig (FunctionalState NewState)
+{
+        EXTI_InitTypeDef EXTI_InitStructure;
+
+        EXTI_ClearITPendingBit (SD_BUSY_EXTI_LINE);
+
+        EXTI_InitStructure.EXTI_Line = SD_BUSY_EXTI_LINE;
+        EXTI_InitStructure.EXTI_Mode = EXTI_Mode_Interrupt;
+        EXTI_InitStructure.EXTI_Trigger = EXTI_Trigger_Rising;
+        EXTI_InitStructure.EXTI_LineCmd = NewState;
+        EXTI_Init (&EXTI_InitStructure);
+}
+
+/**
+ * @brief  Reads D0.
+ * @param  None
+ * @retval 1 while the card holds D0 low (busy), 0 otherwise.
+ */
+uint8_t SD_LowLevel_IsBusy (void)
+{
+        return ((SD_BUSY_GPIO_PORT->IDR & SD_BUSY_PIN) == 0);
 }
 
 /**
  * @brief  Configures the DMA2 Channel4 for SDIO Tx request.
- * @param  BufferSRC: pointer to the source buffer
+ * @param  BufferSRC: pointer to the source buffer, any alignment
  * @param  BufferSize: buffer size
  * @retval None
  */
@@ -144,15 +178,23 @@ void SD_LowLevel_DMA_TxConfig (uint32_t *BufferSRC, uint32_t BufferSize)
         SDDMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
         SDDMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
         SDDMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Word;
-        SDDMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Word;
         SDDMA_InitStructure.DMA_Mode = DMA_Mode_Normal;
         SDDMA_InitStructure.DMA_Priority = DMA_Priority_VeryHigh;
         SDDMA_InitStructure.DMA_FIFOMode = DMA_FIFOMode_Enable;
         SDDMA_InitStructure.DMA_FIFOThreshold = DMA_FIFOThreshold_Full;
-        SDDMA_InitStructure.DMA_MemoryBurst = DMA_MemoryBurst_INC4;
+        /* Unaligned buffer : the FIFO packs words into bytes, single beats so that
+           no burst crosses a 1KB boundary */
+        if ((uint32_t) BufferSRC & 0x03) {
+                SDDMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+                SDDMA_InitStructure.DMA_MemoryBurst = DMA_MemoryBurst_Single;
+        }
+        else {
+                SDDMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Word;
+                SDDMA_InitStructure.DMA_MemoryBurst = DMA_MemoryBurst_INC4;
+        }
         SDDMA_InitStructure.DMA_PeripheralBurst = DMA_PeripheralBurst_INC4;
         DMA_Init (SD_SDIO_DMA_STREAM, &SDDMA_InitStructure);
-        DMA_ITConfig (SD_SDIO_DMA_STREAM, DMA_IT_TC, ENABLE);
+        DMA_ITConfig (SD_SDIO_DMA_STREAM, DMA_IT_TC | DMA_IT_TE | DMA_IT_FE | DMA_IT_DME, ENABLE);
         DMA_FlowControllerConfig (SD_SDIO_DMA_STREAM, DMA_FlowCtrl_Peripheral);
 
         /* DMA2 Stream3  or Stream6 enable */
@@ -161,7 +203,7 @@ void SD_LowLevel_DMA_TxConfig (uint32_t *BufferSRC, uint32_t BufferSize)
 }
 /**
  * @brief  Configures the DMA2 Channel4 for SDIO Rx request.
- * @param  BufferDST: pointer to the destination buffer
+ * @param  BufferDST: pointer to the destination buffer, any alignment
  * @param  BufferSize: buffer size
  * @retval None
  */
@@ -185,17 +227,117 @@ void SD_LowLevel_DMA_RxConfig (uint32_t *BufferDST, uint32_t BufferSize)
         SDDMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
         SDDMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
         SDDMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Word;
-        SDDMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Word;
         SDDMA_InitStructure.DMA_Mode = DMA_Mode_Normal;
         SDDMA_InitStructure.DMA_Priority = DMA_Priority_VeryHigh;
         SDDMA_InitStructure.DMA_FIFOMode = DMA_FIFOMode_Enable;
         SDDMA_InitStructure.DMA_FIFOThreshold = DMA_FIFOThreshold_Full;
-        SDDMA_InitStructure.DMA_MemoryBurst = DMA_MemoryBurst_INC4;
+        /* Unaligned buffer : the FIFO packs words into bytes, single beats so that
+           no burst crosses a 1KB boundary */
+        if ((uint32_t) BufferDST & 0x03) {
+                SDDMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+                SDDMA_InitStructure.DMA_MemoryBurst = DMA_MemoryBurst_Single;
+        }
+        else {
+                SDDMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Word;
+                SDDMA_InitStructure.DMA_MemoryBurst = DMA_MemoryBurst_INC4;
+        }
         SDDMA_InitStructure.DMA_PeripheralBurst = DMA_PeripheralBurst_INC4;
         DMA_Init (SD_SDIO_DMA_STREAM, &SDDMA_InitStructure);
-        DMA_ITConfig (SD_SDIO_DMA_STREAM, DMA_IT_TC, ENABLE);
+        DMA_ITConfig (SD_SDIO_DMA_STREAM, DMA_IT_TC | DMA_IT_TE | DMA_IT_FE | DMA_IT_DME, ENABLE);
         DMA_FlowControllerConfig (SD_SDIO_DMA_STREAM, DMA_FlowCtrl_Peripheral);
 
         /* DMA2 Stream3 or Stream6 enable */
         DMA_Cmd (SD_SDIO_DMA_STREAM, ENABLE);
 }
+
+/**
+ * @brief  Configures the DMA2 Channel4 for SDIO Tx request in double buffer mode.
+ *         The DMA is the flow controller here (the SDIO cannot be with DBM) and
+ *         swaps Buffer0 and Buffer1 every BufferSize bytes until it is disabled.
+ *         TC is raised after each buffer.
+ * @param  Buffer0: first source buffer, used first.
+ * @param  Buffer1: second source buffer.
+ * @param  BufferSize: size of each buffer in bytes, a multiple of 16.
+ * @retval None
+ */
+void SD_LowLevel_DMA_TxConfigDoubleBuffer (uint32_t *Buffer0, uint32_t *Buffer1, uint32_t BufferSize)
+{
+        DMA_InitTypeDef SDDMA_InitStructure;
+
+        DMA_ClearFlag (SD_SDIO_DMA_STREAM, SD_SDIO_DMA_FLAG_FEIF | SD_SDIO_DMA_FLAG_DMEIF | SD_SDIO_DMA_FLAG_TEIF | SD_SDIO_DMA_FLAG_HTIF | SD_SDIO_DMA_FLAG_TCIF);
+
+        /* DMA2 Stream3 or Stream6 disable */
+        DMA_Cmd (SD_SDIO_DMA_STREAM, DISABLE);
+
+        /* DMA2 Stream3 or Stream6 Config */
+        DMA_DeInit (SD_SDIO_DMA_STREAM );
+
+        SDDMA_InitStructure.DMA_Channel = SD_SDIO_DMA_CHANNEL;
+        SDDMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t) SDIO_FIFO_ADDRESS;
+        SDDMA_InitStructure.DMA_Memory0BaseAddr = (uint32_t) Buffer0;
+        SDDMA_InitStructure.DMA_DIR = DMA_DIR_MemoryToPeripheral;
+        SDDMA_InitStructure.DMA_BufferSize = BufferSize / 4;
+        SDDMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+        SDDMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
+        SDDMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Word;
+        SDDMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Word;
+        SDDMA_InitStructure.DMA_Mode = DMA_Mode_Circular;
+        SDDMA_InitStructure.DMA_Priority = DMA_Priority_VeryHigh;
+        SDDMA_InitStructure.DMA_FIFOMode = DMA_FIFOMode_Enable;
+        SDDMA_InitStructure.DMA_FIFOThreshold = DMA_FIFOThreshold_Full;
+        SDDMA_InitStructure.DMA_MemoryBurst = DMA_MemoryBurst_INC4;
+        SDDMA_InitStructure.DMA_PeripheralBurst = DMA_PeripheralBurst_INC4;
+        DMA_Init (SD_SDIO_DMA_STREAM, &SDDMA_InitStructure);
+        DMA_DoubleBufferModeConfig (SD_SDIO_DMA_STREAM, (uint32_t) Buffer1, DMA_Memory_0);
+        DMA_DoubleBufferModeCmd (SD_SDIO_DMA_STREAM, ENABLE);
+        DMA_ITConfig (SD_SDIO_DMA_STREAM, DMA_IT_TC | DMA_IT_TE | DMA_IT_FE | DMA_IT_DME, ENABLE);
+
+        /* DMA2 Stream3 or Stream6 enable */
+        DMA_Cmd (SD_SDIO_DMA_STREAM, ENABLE);
+}
+
+/**
+ * @brief  Configures the DMA2 Channel4 for SDIO Rx request in double buffer mode.
+ *         The DMA is the flow controller here (the SDIO cannot be with DBM) and
+ *         swaps Buffer0 and Buffer1 every BufferSize bytes until it is disabled.
+ *         TC is raised after each buffer.
+ * @param  Buffer0: first destination buffer, used first.
+ * @param  Buffer1: second destination buffer.
+ * @param  BufferSize: size of each buffer in bytes, a multiple of 16.
+ * @retval None
+ */
+void SD_LowLevel_DMA_RxConfigDoubleBuffer (uint32_t *Buffer0, uint32_t *Buffer1, uint32_t BufferSize)
+{
+        DMA_InitTypeDef SDDMA_InitStructure;
+
+        DMA_ClearFlag (SD_SDIO_DMA_STREAM, SD_SDIO_DMA_FLAG_FEIF | SD_SDIO_DMA_FLAG_DMEIF | SD_SDIO_DMA_FLAG_TEIF | SD_SDIO_DMA_FLAG_HTIF | SD_SDIO_DMA_FLAG_TCIF);
+
+        /* DMA2 Stream3 or Stream6 disable */
+        DMA_Cmd (SD_SDIO_DMA_STREAM, DISABLE);
+
+        /* DMA2 Stream3 or Stream6 Config */
+        DMA_DeInit (SD_SDIO_DMA_STREAM );
+
+        SDDMA_InitStructure.DMA_Channel = SD_SDIO_DMA_CHANNEL;
+        SDDMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t) SDIO_FIFO_ADDRESS;
+        SDDMA_InitStructure.DMA_Memory0BaseAddr = (uint32_t) Buffer0;
+        SDDMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralToMemory;
+        SDDMA_InitStructure.DMA_BufferSize = BufferSize / 4;
+        SDDMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+        SDDMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
+        SDDMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Word;
+        SDDMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Word;
+        SDDMA_InitStructure.DMA_Mode = DMA_Mode_Circular;
+        SDDMA_InitStructure.DMA_Priority = DMA_Priority_VeryHigh;
+        SDDMA_InitStructure.DMA_FIFOMode = DMA_FIFOMode_Enable;
+        SDDMA_InitStructure.DMA_FIFOThreshold = DMA_FIFOThreshold_Full;
+        SDDMA_InitStructure.DMA_MemoryBurst = DMA_MemoryBurst_INC4;
+        SDDMA_InitStructure.DMA_PeripheralBurst = DMA_PeripheralBurst_INC4;
+        DMA_Init (SD_SDIO_DMA_STREAM, &SDDMA_InitStructure);
+        DMA_DoubleBufferModeConfig (SD_SDIO_DMA_STREAM, (uint32_t) Buffer1, DMA_Memory_0);
+        DMA_DoubleBufferModeCmd (SD_SDIO_DMA_STREAM, ENABLE);
+        DMA_ITConfig (SD_SDIO_DMA_STREAM, DMA_IT_TC | DMA_IT_TE | DMA_IT_FE | DMA_IT_DME, ENABLE);
+
+        /* DMA2 Stream3 or Stream6 enable */
+        DMA_Cmd (SD_SDIO_DMA_STREAM, ENABLE);
+}
@@ -19,9 +19,11 @@
 #define IOE16_REG_GPPIR_MSB        0x17
 
 /**
- * @brief  SD FLASH SDIO Interface
+ * @brief  SD FLASH SDIO Interface. Derived from the SDIO register block (0x40012C80
+ *         on the F4) rather than hardcoded, so DMA always targets the same FIFO the
+ *         driver polls, wherever the SDIO block is mapped.
  */
-#define SDIO_FIFO_ADDRESS             ((uint32_t)0x40012C80)
+#define SDIO_FIFO_ADDRESS             ((uint32_t)&SDIO->FIFO)
 /**
  * @brief  SDIO Intialization Frequency (400KHz max)
  */
@@ -29,10 +31,10 @@
 #define SDIO_INIT_CLK_DIV             ((uint8_t)0x76)
 
 /**
- * @brief  SDIO Data Transfer Frequency (25MHz max)
+ * @brief  SDIO Data Transfer Frequency (25MHz max). Default speed, SD_Init moves to
+ *         the bypass (48MHz) if the card switches to high speed.
  */
-//#define SDIO_TRANSFER_CLK_DIV         ((uint8_t)0x0)
-#define SDIO_TRANSFER_CLK_DIV         ((uint8_t)0x76)
+#define SDIO_TRANSFER_CLK_DIV         ((uint8_t)0x0)
 
 #define SD_SDIO_DMA                   DMA2
 #define SD_SDIO_DMA_CLK               RCC_AHB1Periph_DMA2
@@ -61,10 +63,26 @@
 #define SD_SDIO_DMA_IRQHANDLER        DMA2_Stream6_IRQHandler
 #endif /* SD_SDIO_DMA_STREAM3 */
 
+/**
+ * @brief  Card busy (DAT0 held low while programming) detection on SDIO D0 (PC.08)
+ *         through EXTI. The pin stays in AF mode, EXTI and IDR still see it.
+ */
+#define SD_BUSY_GPIO_PORT             GPIOC
+#define SD_BUSY_PIN                   GPIO_Pin_8
+#define SD_BUSY_EXTI_LINE             EXTI_Line8
+#define SD_BUSY_EXTI_PORT_SOURCE      EXTI_PortSourceGPIOC
+#define SD_BUSY_EXTI_PIN_SOURCE       EXTI_PinSource8
+#define SD_BUSY_IRQn                  EXTI9_5_IRQn
+#define SD_BUSY_IRQHANDLER            EXTI9_5_IRQHandler
+
 void SD_LowLevel_DeInit (void);
 void SD_LowLevel_Init (void);
 void SD_LowLevel_DMA_TxConfig (uint32_t *BufferSRC, uint32_t BufferSize);
 void SD_LowLevel_DMA_RxConfig (uint32_t *BufferDST, uint32_t BufferSize);
+void SD_LowLevel_DMA_TxConfigDoubleBuffer (uint32_t *Buffer0, uint32_t *Buffer1, uint32_t BufferSize);
+void SD_LowLevel_DMA_RxConfigDoubleBuffer (uint32_t *Buffer0, uint32_t *Buffer1, uint32_t BufferSize);
 uint8_t IOE16_MonitorIOPin (uint16_t IO_Pin);
+void SD_LowLevel_BusyIRQConfig (FunctionalState NewState);
+uint8_t SD_LowLevel_IsBusy (void);
 
 #endif /* SDIO_LOW_LEVEL_H_ */
@@ -1,5 +1,10 @@
 #include "stm32fxxx_it.h"
 #include "logf.h"
+#include "dlog.h"
+#include "console.h"
+#ifdef USE_SD_SPI
+#include "sd_spi.h"
+#endif
 #include "sdio_high_level.h"
 
 /******************************************************************************/
@@ -23,6 +28,7 @@ void NMI_Handler (void)
 void HardFault_Handler (void)
 {
         logf ("HardFault_Handler\r\n");
+        Console_Flush ();
 
         /* Go to infinite loop when Hard Fault exception occurs */
         while (1) {
@@ -37,6 +43,7 @@ void HardFault_Handler (void)
 void MemManage_Handler (void)
 {
         logf ("MemManage_Handler\r\n");
+        Console_Flush ();
 
         /* Go to infinite loop when Memory Manage exception occurs */
         while (1) {
@@ -51,6 +58,7 @@ void MemManage_Handler (void)
 void BusFault_Handler (void)
 {
         logf ("BusFault_Handler\r\n");
+        Console_Flush ();
 
         /* Go to infinite loop when Bus Fault exception occurs */
         while (1) {
@@ -65,6 +73,7 @@ void BusFault_Handler (void)
 void UsageFault_Handler (void)
 {
         logf ("UsageFault_Handler\r\n");
+        Console_Flush ();
 
         /* Go to infinite loop when Usage Fault exception occurs */
         while (1) {
@@ -96,6 +105,8 @@ void DebugMon_Handler (void)
  */
 void PendSV_Handler (void)
 {
+        /* Finishes the asynchronous SD transfers (CMD12, callback) */
+        SD_ProcessAsync ();
 }
 
 /**
@@ -105,12 +116,13 @@ void PendSV_Handler (void)
  */
 void SysTick_Handler (void)
 {
+        SD_ProcessTick ();
 }
 
 
 void WWDG_IRQHandler (void)
 {
-        logf ("WWDG_IRQHandler\r\n");
+        dlogf ("WWDG_IRQHandler\r\n");
 }
 
 /**
@@ -122,7 +134,6 @@ void SDIO_IRQHandler (void)
 {
         /* Process All SDIO Interrupt Sources */
         SD_ProcessIRQSrc ();
-        logf ("SDIO_IRQHandler end \r\n");
 }
 
 /**
@@ -137,6 +148,38 @@ void SD_SDIO_DMA_IRQHANDLER (void)
         SD_ProcessDMAIRQ ();
 }
 
+/**
+ * @brief  This function handles the end of card busy (SDIO D0 rising edge) EXTI
+ *         interrupt.
+ * @param  None
+ * @retval None
+ */
+void SD_BUSY_IRQHANDLER (void)
+{
+        SD_ProcessBusyIRQ ();
+}
+
+/**
+ * @brief  This function handles the console (USART1 TX) DMA2 Stream7 interrupt.
+ * @param  None
+ * @retval None
+ */
+void CONSOLE_DMA_IRQHANDLER (void)
+{
+        Console_ProcessDMAIRQ ();
+}
+
+#ifdef USE_SD_SPI
+/**
+ * @brief  This function handles the SPI SD card RX DMA (DMA1 Stream3) interrupt.
+ * @param  None
+ * @retval None
+ */
+void SD_SPI_DMA_IRQHANDLER (void)
+{
+        SD_SpiProcessDMAIRQ ();
+}
+#endif
 
 //void DMA2_Stream3_IRQHandler (void)
 //{
@@ -9,6 +9,7 @@
 #include <sys/times.h>
 #include <sys/unistd.h>
 #include <stm32f4xx.h>
+#include "console.h"
 
 
 #ifndef STDOUT_USART
@@ -38,6 +39,7 @@ int _write(int file, char *ptr, int len);
 
 void _exit(int status) {
     _write(1, "exit", 4);
+    Console_Flush();
     while (1) {
         ;
     }
@@ -236,14 +238,16 @@ int _wait(int *status) {
  Returns -1 on error or number of bytes sent
  */
 int _write(int file, char *ptr, int len) {
+#if STDOUT_USART != 1 || STDERR_USART != 1
     int n;
+#endif
     switch (file) {
     case STDOUT_FILENO: /*stdout*/
-        for (n = 0; n < len; n++) {
 #if STDOUT_USART == 1
-            while ((USART1->SR & USART_FLAG_TC) == (uint16_t)RESET) {}
-            USART1->DR = (*ptr++ & (uint16_t)0x01FF);
-#elif  STDOUT_USART == 2
+        Console_Write (ptr, len);
+#else
+        for (n = 0; n < len; n++) {
+#if  STDOUT_USART == 2
             while ((USART2->SR & USART_FLAG_TC) == (uint16_t) RESET) {
             }
             USART2->DR = (*ptr++ & (uint16_t) 0x01FF);
@@ -252,13 +256,14 @@ int _write(int file, char *ptr, int len) {
             USART3->DR = (*ptr++ & (uint16_t)0x01FF);
 #endif
         }
+#endif
         break;
     case STDERR_FILENO: /* stderr */
-        for (n = 0; n < len; n++) {
 #if STDERR_USART == 1
-            while ((USART1->SR & USART_FLAG_TC) == (uint16_t)RESET) {}
-            USART1->DR = (*ptr++ & (uint16_t)0x01FF);
-#elif  STDERR_USART == 2
+        Console_Write (ptr, len);
+#else
+        for (n = 0; n < len; n++) {
+#if  STDERR_USART == 2
             while ((USART2->SR & USART_FLAG_TC) == (uint16_t) RESET) {
             }
             USART2->DR = (*ptr++ & (uint16_t) 0x01FF);
@@ -267,6 +272,7 @@ int _write(int file, char *ptr, int len) {
             USART3->DR = (*ptr++ & (uint16_t)0x01FF);
 #endif
         }
+#endif
         break;
     default:
         errno = EBADF;
@@ -0,0 +1,378 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+/*
+ * USB Mass Storage (STM32 USB Device Library MSC class) backend on the SDIO
+ * driver. Built with -DWITH_USB_MSC=ON, see build/CMakeLists.txt.
+ *
+ * Zero copy : the SDIO DMA works straight on the ping-pong pair of BOT buffers
+ * (MSC_BOT_Data / MSC_BOT_Data1). While one goes to the host, SCSI_ProcessRead has
+ * the next packet read into the other one with Prefetch (async CMD18), and Read
+ * only waits for it. Write starts an async CMD25 from the packet just received and
+ * returns, the next OUT packet is received into the other buffer meanwhile.
+ * SCSI_ProcessWrite calls Sync before the CSW of the last packet.
+ *
+ * MSC_MEDIA_PACKET (usbd_conf.h) should be a few blocks at least (4096 or more),
+ * every packet is one multi block command.
+ *
+ * The SCSI layer runs in the OTG interrupt, and sleeps there until the SDIO DMA
+ * and the D0 busy EXTI interrupts end the transfer : the OTG IRQ must have a
+ * strictly lower preemption priority than both (2 with the NVIC_PriorityGroup_2
+ * set up of main.c). STORAGE_Init lowers it if USB_OTG_BSP_EnableInterrupt did
+ * not, and fails if the grouping leaves no level below them.
+ */
+
+#ifdef USE_USB_MSC
+
+#include <stddef.h>
+#include "usbd_msc_mem.h"
+#include "sdio_high_level.h"
+#include "sdio_low_level.h"
+#include "sd_recovery.h"
+#include "sd_time.h"
+
+#if (MSC_MEDIA_PACKET % 512) != 0
+#error "MSC_MEDIA_PACKET must be a multiple of the 512 byte block"
+#endif
+
+#define STORAGE_LUN_NBR               1
+#define STORAGE_BLOCK_SIZE            512
+
+#ifdef USE_USB_OTG_HS
+#define STORAGE_OTG_IRQn              OTG_HS_IRQn
+#else
+#define STORAGE_OTG_IRQn              OTG_FS_IRQn
+#endif
+
+typedef enum {
+        STORAGE_OP_NONE = 0, STORAGE_OP_READ = 1, STORAGE_OP_WRITE = 2
+} StorageOp;
+
+static int8_t STORAGE_Init (uint8_t lun);
+static int8_t STORAGE_GetCapacity (uint8_t lun, uint32_t *block_num, uint32_t *block_size);
+static int8_t STORAGE_IsReady (uint8_t lun);
+static int8_t STORAGE_IsWriteProtected (uint8_t lun);
+static int8_t STORAGE_Read (uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
+static int8_t STORAGE_Write (uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
+static int8_t STORAGE_GetMaxLun (void);
+static int8_t STORAGE_Sync (uint8_t lun);
+static int8_t STORAGE_Prefetch (uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
+
+static SD_Error Start (StorageOp op, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
+static void TransferDone (SD_Error status, void *context);
+static SD_Error Finish (StorageOp *op);
+static int8_t CheckPriority (void);
+
+/*
+ * USB Mass storage Standard Inquiry Data.
+ */
+static const int8_t STORAGE_Inquirydata[] = {
+        /* LUN 0 */
+        0x00, 0x80, 0x02, 0x02, (USBD_STD_INQUIRY_LENGTH - 5), 0x00, 0x00, 0x00,
+        'i', 'w', 'a', 's', 'z', ' ', ' ', ' ', /* Manufacturer : 8 bytes */
+        'S', 'D', 'I', 'O', ' ', 'c', 'a', 'r', /* Product : 16 Bytes */
+        'd', ' ', ' ', ' ', ' ', ' ', ' ', ' ',
+        '1', '.', '0', '0' /* Version : 4 Bytes */
+};
+
+static USBD_STORAGE_cb_TypeDef USBD_SD_fops = {
+        STORAGE_Init,
+        STORAGE_GetCapacity,
+        STORAGE_IsReady,
+        STORAGE_IsWriteProtected,
+        STORAGE_Read,
+        STORAGE_Write,
+        STORAGE_GetMaxLun,
+        (int8_t *) STORAGE_Inquirydata,
+        STORAGE_Sync,
+        STORAGE_Prefetch
+};
+
+USBD_STORAGE_cb_TypeDef *USBD_STORAGE_fops = &USBD_SD_fops;
+
+/*
+ * The transfer running in the background (a prefetch or a write), and the BOT
+ * buffer it works on. Pending and PendingStatus are set by the completion IRQ.
+ */
+static StorageOp Op = STORAGE_OP_NONE;
+static uint8_t *OpBuffer = NULL;
+static uint32_t OpAddr = 0;
+static uint16_t OpLen = 0;
+static __IO uint8_t Pending = 0;
+static __IO SD_Error PendingStatus = SD_OK;
+static uint8_t Ready = 0;
+
+/**
+ * @brief  Initializes the card, unless already done by the application.
+ * @param  lun: logical unit number.
+ * @retval 0 on success, -1 otherwise.
+ */
+static int8_t STORAGE_Init (uint8_t lun)
+{
+        if (CheckPriority () != 0) {
+                return (-1);
+        }
+
+        if (!Ready) {
+                if (SD_Init () != SD_OK) {
+                        return (-1);
+                }
+
+                Ready = 1;
+        }
+
+        return (0);
+}
+
+/**
+ * @brief  Card capacity.
+ * @param  lun: logical unit number.
+ * @param  block_num: number of 512 byte blocks.
+ * @param  block_size: block size.
+ * @retval 0 on success, -1 otherwise.
+ */
+static int8_t STORAGE_GetCapacity (uint8_t lun, uint32_t *block_num, uint32_t *block_size)
+{
+        SD_CardInfo cardinfo;
+
+        if (!Ready || (SD_GetCardInfo (&cardinfo) != SD_OK)) {
+                return (-1);
+        }
+
+        *block_num = (uint32_t) (cardinfo.CardCapacity / STORAGE_BLOCK_SIZE);
+        *block_size = STORAGE_BLOCK_SIZE;
+        return (0);
+}
+
+/**
+ * @brief  Tells if the card is there and initialized.
+ * @param  lun: logical unit number.
+ * @retval 0 if ready, -1 otherwise.
+ */
+static int8_t STORAGE_IsReady (uint8_t lun)
+{
+        if (SD_Detect () != SD_PRESENT) {
+                Ready = 0;
+                return (-1);
+        }
+
+        return ((Ready) ? 0 : -1);
+}
+
+/**
+ * @brief  No write protection switch on this board.
+ * @param  lun: logical unit number.
+ * @retval 0
+ */
+static int8_t STORAGE_IsWriteProtected (uint8_t lun)
+{
+        return (0);
+}
+
+/**
+ * @brief  Reads one packet into buf. If it is the one prefetched, only waits for
+ *         the DMA to finish.
+ * @param  lun: logical unit number.
+ * @param  buf: destination (MSC_BOT_Data or MSC_BOT_Data1).
+ * @param  blk_addr: first block.
+ * @param  blk_len: number of blocks.
+ * @retval 0 on success, -1 otherwise.
+ */
+static int8_t STORAGE_Read (uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len)
+{
+        uint8_t hit = (Op == STORAGE_OP_READ) && (OpBuffer == buf) && (OpAddr == blk_addr) && (OpLen == blk_len);
+        StorageOp op;
+        SD_Error errorstatus = Finish (&op);
+
+        if (hit) {
+                return ((errorstatus == SD_OK) ? 0 : -1);
+        }
+
+        /*!< A failed background write is reported here, a useless prefetch is not */
+        if ((op == STORAGE_OP_WRITE) && (errorstatus != SD_OK)) {
+                return (-1);
+        }
+
+        if (SD_RecoveryRead (buf, (uint64_t) blk_addr * STORAGE_BLOCK_SIZE, blk_len) != SD_OK) {
+                return (-1);
+        }
+
+        return (0);
+}
+
+/**
+ * @brief  Starts writing one packet straight from buf and returns once the
+ *         previous write is over, so that the SCSI layer can receive the next
+ *         packet into the other buffer meanwhile. An error is reported on the next
+ *         call or on Sync.
+ * @param  lun: logical unit number.
+ * @param  buf: data (MSC_BOT_Data or MSC_BOT_Data1), in use until the next call.
+ * @param  blk_addr: first block.
+ * @param  blk_len: number of blocks.
+ * @retval 0 on success, -1 otherwise.
+ */
+static int8_t STORAGE_Write (uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len)
+{
+        StorageOp op;
+
+        if ((Finish (&op) != SD_OK) && (op == STORAGE_OP_WRITE)) {
+                return (-1);
+        }
+
+        return ((Start (STORAGE_OP_WRITE, buf, blk_addr, blk_len) == SD_OK) ? 0 : -1);
+}
+
+/**
+ * @brief  Starts reading the next packet into buf (async CMD18) while the current
+ *         one goes to the host. Errors are reported by the Read of that packet.
+ * @param  lun: logical unit number.
+ * @param  buf: destination (MSC_BOT_Data or MSC_BOT_Data1).
+ * @param  blk_addr: first block.
+ * @param  blk_len: number of blocks.
+ * @retval 0 on success, -1 otherwise.
+ */
+static int8_t STORAGE_Prefetch (uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len)
+{
+        StorageOp op;
+
+        Finish (&op);
+        return ((Start (STORAGE_OP_READ, buf, blk_addr, blk_len) == SD_OK) ? 0 : -1);
+}
+
+/**
+ * @brief  Number of logical units - 1.
+ * @param  None
+ * @retval 0
+ */
+static int8_t STORAGE_GetMaxLun (void)
+{
+        return (STORAGE_LUN_NBR - 1);
+}
+
+/**
+ * @brief  Waits for the background transfer to end (card programming included).
+ * @param  lun: logical unit number.
+ * @retval 0 on success, -1 if a write failed.
+ */
+static int8_t STORAGE_Sync (uint8_t lun)
+{
+        StorageOp op;
+
+        return (((Finish (&op) != SD_OK) && (op == STORAGE_OP_WRITE)) ? -1 : 0);
+}
+
+/**
+ * @brief  Starts an async transfer on a BOT buffer.
+ * @retval SD_Error: status of the command phase.
+ */
+static SD_Error Start (StorageOp op, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len)
+{
+        SD_Error errorstatus;
+        uint64_t address = (uint64_t) blk_addr * STORAGE_BLOCK_SIZE;
+
+        Op = op;
+        OpBuffer = buf;
+        OpAddr = blk_addr;
+        OpLen = blk_len;
+        PendingStatus = SD_OK;
+        Pending = 1;
+
+        if (op == STORAGE_OP_WRITE) {
+                errorstatus = SD_WriteMultiBlocksAsync (buf, address, STORAGE_BLOCK_SIZE, blk_len, TransferDone, NULL);
+        }
+        else {
+                errorstatus = SD_ReadMultiBlocksAsync (buf, address, STORAGE_BLOCK_SIZE, blk_len, TransferDone, NULL);
+        }
+
+        if (errorstatus != SD_OK) {
+                Pending = 0;
+                Op = STORAGE_OP_NONE;
+        }
+
+        return (errorstatus);
+}
+
+/**
+ * @brief  Completion of the async transfer, in interrupt context.
+ */
+static void TransferDone (SD_Error status, void *context)
+{
+        PendingStatus = status;
+        Pending = 0;
+}
+
+/**
+ * @brief  Puts the OTG IRQ one preemption level below the SD DMA and busy EXTI
+ *         ones, unless it is already lower : Finish sleeps in it.
+ * @param  None
+ * @retval 0 on success, -1 if there is no preemption level left below them.
+ */
+static int8_t CheckPriority (void)
+{
+        uint32_t group = NVIC_GetPriorityGrouping ();
+        uint32_t bits = ((7 - group) > __NVIC_PRIO_BITS) ? __NVIC_PRIO_BITS : 7 - group;
+        uint32_t otg, dma, busy, sub;
+
+        NVIC_DecodePriority (NVIC_GetPriority (STORAGE_OTG_IRQn), group, &otg, &sub);
+        NVIC_DecodePriority (NVIC_GetPriority (SD_SDIO_DMA_IRQn), group, &dma, &sub);
+        NVIC_DecodePriority (NVIC_GetPriority (SD_BUSY_IRQn), group, &busy, &sub);
+
+        if (busy > dma) {
+                dma = busy;
+        }
+
+        if (otg > dma) {
+                return (0);
+        }
+
+        if (dma + 1 >= (1UL << bits)) {
+                return (-1);
+        }
+
+        NVIC_SetPriority (STORAGE_OTG_IRQn, NVIC_EncodePriority (group, dma + 1, 0));
+        return (0);
+}
+
+/**
+ * @brief  Sleeps until the background transfer is over, and after a write until
+ *         the card stopped programming. The buffer is free on return.
+ * @param  op: what it was, STORAGE_OP_NONE if there was nothing running.
+ * @retval SD_Error: status of that transfer.
+ */
+static SD_Error Finish (StorageOp *op)
+{
+        SD_Error errorstatus;
+
+        __disable_irq ();
+
+        while (Pending) {
+                SD_AsyncSleep ();
+                __enable_irq ();
+                __disable_irq ();
+        }
+
+        __enable_irq ();
+
+        *op = Op;
+        Op = STORAGE_OP_NONE;
+        errorstatus = PendingStatus;
+        PendingStatus = SD_OK;
+
+        if (*op == STORAGE_OP_WRITE) {
+                if (errorstatus == SD_OK) {
+                        errorstatus = SD_WaitReady ();
+                }
+                else {
+                        SD_WaitReady ();
+                }
+        }
+
+        return (errorstatus);
+}
+
+#endif /* USE_USB_MSC */
@@ -0,0 +1,58 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef DISKIO_H_
+#define DISKIO_H_
+
+/*
+ * FatFs is not in the tree. The declarations of its diskio.h (R0.09, the one
+ * usbh_msc_fatfs.c is written against) that sd_diskio.c uses, so that the host
+ * build (test_diskio) can compile it. Not FatFs itself.
+ */
+
+#include <stdint.h>
+
+#define _READONLY                     0
+#define _USE_IOCTL                    1
+
+typedef uint8_t BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+
+typedef BYTE DSTATUS;
+
+typedef enum {
+        RES_OK = 0,
+        RES_ERROR,
+        RES_WRPRT,
+        RES_NOTRDY,
+        RES_PARERR
+} DRESULT;
+
+DSTATUS disk_initialize (BYTE drv);
+DSTATUS disk_status (BYTE drv);
+DRESULT disk_read (BYTE drv, BYTE *buff, DWORD sector, BYTE count);
+DRESULT disk_write (BYTE drv, const BYTE *buff, DWORD sector, BYTE count);
+DRESULT disk_ioctl (BYTE drv, BYTE ctrl, void *buff);
+
+/*
+ * Disk status bits.
+ */
+#define STA_NOINIT                    0x01
+#define STA_NODISK                    0x02
+#define STA_PROTECT                   0x04
+
+/*
+ * disk_ioctl commands.
+ */
+#define CTRL_SYNC                     0
+#define GET_SECTOR_COUNT              1
+#define GET_SECTOR_SIZE               2
+#define GET_BLOCK_SIZE                3
+
+#endif /* DISKIO_H_ */
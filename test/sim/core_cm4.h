@@ -0,0 +1,113 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef SIM_CORE_CM4_H_
+#define SIM_CORE_CM4_H_
+
+/*
+ * Host build of the CMSIS core header. Found before 3rdparty/CMSIS/Include, it
+ * keeps the register definitions of the real core_cm4.h but replaces the ARM
+ * instruction wrappers (core_cmInstr.h, core_cmFunc.h, core_cm4_simd.h) with
+ * calls into the simulator : PRIMASK, WFI and the exclusive monitor are modeled
+ * in sim_core.c.
+ */
+
+#include <stdint.h>
+
+#define __CORE_CMINSTR_H
+#define __CORE_CMFUNC_H
+#define __CORE_CM4_SIMD_H
+
+void Sim_SetPrimask (uint32_t primask);
+uint32_t Sim_GetPrimask (void);
+void Sim_Wfi (void);
+uint32_t Sim_LoadExclusive (volatile uint32_t *addr);
+uint32_t Sim_StoreExclusive (uint32_t value, volatile uint32_t *addr);
+void Sim_ClearExclusive (void);
+
+static inline void __enable_irq (void)
+{
+        Sim_SetPrimask (0);
+}
+
+static inline void __disable_irq (void)
+{
+        Sim_SetPrimask (1);
+}
+
+static inline uint32_t __get_PRIMASK (void)
+{
+        return (Sim_GetPrimask ());
+}
+
+static inline void __set_PRIMASK (uint32_t priMask)
+{
+        Sim_SetPrimask (priMask);
+}
+
+static inline void __WFI (void)
+{
+        Sim_Wfi ();
+}
+
+static inline void __WFE (void)
+{
+        Sim_Wfi ();
+}
+
+static inline void __SEV (void)
+{
+}
+
+static inline void __NOP (void)
+{
+}
+
+static inline void __ISB (void)
+{
+        __asm__ volatile ("" ::: "memory");
+}
+
+static inline void __DSB (void)
+{
+        __asm__ volatile ("" ::: "memory");
+}
+
+static inline void __DMB (void)
+{
+        __asm__ volatile ("" ::: "memory");
+}
+
+static inline uint32_t __LDREXW (volatile uint32_t *addr)
+{
+        return (Sim_LoadExclusive (addr));
+}
+
+static inline uint32_t __STREXW (uint32_t value, volatile uint32_t *addr)
+{
+        return (Sim_StoreExclusive (value, addr));
+}
+
+static inline void __CLREX (void)
+{
+        Sim_ClearExclusive ();
+}
+
+static inline uint32_t __REV (uint32_t value)
+{
+        return (__builtin_bswap32 (value));
+}
+
+static inline uint32_t __get_MSP (void)
+{
+        return (0);
+}
+
+#include_next <core_cm4.h>
+
+#endif /* SIM_CORE_CM4_H_ */
@@ -0,0 +1,163 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef SIM_H_
+#define SIM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Host simulator of the parts of the STM32F4 the SD code touches, so that the
+ * unmodified driver (sdio_high_level.c, sdio_low_level.c and the StdPeriph
+ * drivers) runs on a PC. The peripheral address ranges are mapped at their real
+ * addresses with no access rights : every register access faults, is served by a
+ * model (sim_core.c) and single stepped. Modeled :
+ *
+ * - SDIO : CPSM, DPSM, the 32 word FIFO, the flags and the interrupt (sim_sdio.c),
+ *   with a SD card behind it : states, commands, read latency, busy after writes,
+ *   a write cache programmed on CMD12, fault and power cut injection. The card
+ *   data is a file backed image.
+ * - DMA1 / DMA2 : streams, peripheral and DMA flow control, circular and double
+ *   buffer modes, the interrupt flags (sim_dma.c).
+ * - GPIO (D0 busy on PC8) and EXTI.
+ * - USART1 transmitter with its TX DMA, the line captured (sim_usart.c).
+ * - SPI2 with its RX / TX DMA, and a second SD card behind it in SPI mode : its
+ *   own image, the same timings, fault injection (sim_spi.c).
+ * - NVIC priorities and preemption, PendSV, SysTick, PRIMASK, WFI, DWT->CYCCNT,
+ *   spurious interrupts injected to wake the waits up.
+ *
+ * Time is simulated : a 168 MHz cycle counter advanced by the register accesses
+ * and by WFI (up to the next event), so the numbers do not depend on the host.
+ * The test body runs on a thread with its stack below 4 GB, the code keeps
+ * addresses in uint32_t (DMA registers). Link with -no-pie.
+ */
+
+#define SIM_HZ                        168000000
+#define SIM_US(us)                    ((uint64_t) (us) * (SIM_HZ / 1000000))
+
+/**
+ * @brief  Checks a condition, counts and prints the failures. Sim_Run returns
+ *         non zero if any.
+ */
+#define SIM_CHECK(cond)               Sim_Check ((cond) != 0, #cond, __FILE__, __LINE__)
+
+/**
+ * @brief  Faults injected into the card.
+ */
+typedef enum {
+        SIM_FAULT_NONE = 0,
+        SIM_FAULT_CRC, /*!< Command : CCRCFAIL. Data : DCRCFAIL (read) or a negative CRC status (write) */
+        SIM_FAULT_TIMEOUT /*!< Command : no response. Data : the block never comes (DTIMEOUT) */
+} Sim_Fault;
+
+/**
+ * @brief  SD card model. Times are in microseconds. Sim_CardDefaults gives a
+ *         SDHC card with the typical values below.
+ */
+typedef struct {
+        uint32_t Blocks; /*!< Capacity in 512 byte blocks, a multiple of 1024 */
+        uint8_t HighCapacity; /*!< SDHC (block addresses, CSD v2) or SDSC v2 (byte addresses, CSD v1) */
+        uint8_t HighSpeed; /*!< Accepts the CMD6 switch to 50 MHz */
+        uint8_t AuSize; /*!< AU_SIZE code of the SD status */
+        uint32_t InitPolls; /*!< ACMD41 answered busy this many times */
+        uint32_t ReadLatencyUs; /*!< Command to first block of a read */
+        uint32_t ReadGapUs; /*!< Between the blocks of a CMD18 */
+        uint32_t BlockBusyUs; /*!< Busy after each block of a CMD25 */
+        uint32_t ProgramUs; /*!< Busy after CMD24, after CMD12 of a CMD25 */
+        uint32_t ProgramBlockUs; /*!< Plus this per cached block when the cache is programmed */
+        uint32_t CacheBlocks; /*!< Blocks of a CMD25 held before programming, at most SIM_CARD_CACHE_MAX */
+        uint32_t EraseBlockUs; /*!< Busy per erased block */
+        const char *ImagePath; /*!< Image file, created if missing. NULL : anonymous memory */
+} Sim_CardConfig;
+
+#define SIM_CARD_CACHE_MAX            64
+
+/**
+ * @brief  Counters since Sim_ResetStats. Bus times are in CPU cycles (SIM_HZ).
+ */
+typedef struct {
+        uint32_t Commands[64]; /*!< Per command index, ACMDs excluded */
+        uint32_t AppCommands[64]; /*!< Per ACMD index */
+        uint32_t CommandTotal; /*!< CMD and ACMD */
+        uint32_t StaReads; /*!< SDIO->STA reads : polling */
+        uint32_t BusyReads; /*!< D0 (PC8) reads : polling */
+        uint32_t Accesses; /*!< All register accesses */
+        uint64_t CmdBusCycles; /*!< CMD line busy : commands and responses */
+        uint64_t DataBusCycles; /*!< DAT lines busy : blocks, CRCs, tokens */
+        uint64_t CardBusyCycles; /*!< D0 held low by the card */
+        uint32_t BlocksRead; /*!< Blocks sent by the card */
+        uint32_t BlocksWritten; /*!< Blocks received by the card */
+        uint32_t BlocksProgrammed; /*!< Blocks written to the image */
+        uint32_t Interrupts[98]; /*!< Per exception number (IRQn + 16) */
+        uint32_t Wfi; /*!< WFI executed */
+        uint64_t SleepCycles; /*!< Time spent in WFI */
+        uint32_t DmaWords; /*!< Words moved by the SDIO DMA stream */
+        uint32_t SpiCommands[64]; /*!< Card on SPI2 : per command index, ACMDs included */
+        uint32_t SpiBytes; /*!< Bytes exchanged on SPI2 */
+        uint32_t SpiBusyBytes; /*!< Of which DO held low by the card */
+        uint32_t SpiBlocksRead;
+        uint32_t SpiBlocksWritten;
+} Sim_Stats;
+
+/*
+ * Core.
+ */
+int Sim_Run (void (*test) (void));
+void Sim_Check (int ok, const char *expr, const char *file, int line);
+void Sim_Fatal (const char *fmt, ...) __attribute__ ((noreturn, format (printf, 1, 2)));
+uint64_t Sim_Now (void);
+void Sim_Advance (uint64_t cycles);
+uint32_t Sim_ActiveException (void);
+void Sim_GetStats (Sim_Stats *stats);
+void Sim_ResetStats (void);
+void Sim_PrintStats (const char *title, const Sim_Stats *stats);
+void Sim_BoardInit (void);
+void Sim_InjectWakes (int irqn, uint64_t period);
+
+/*
+ * SD card on SDIO (sim_sdio.c).
+ */
+void Sim_CardDefaults (Sim_CardConfig *config);
+void Sim_CardInsert (const Sim_CardConfig *config);
+uint8_t *Sim_CardImage (void);
+void Sim_CardFailCommand (uint8_t cmd, uint8_t app, Sim_Fault fault, uint32_t count);
+void Sim_CardFailBlock (uint32_t block, Sim_Fault fault, uint32_t count);
+void Sim_CardPowerCut (void);
+void Sim_CardPowerCutAfter (uint32_t blocks);
+void Sim_CardPowerOn (void);
+uint8_t Sim_CardIsBusy (void);
+uint32_t Sim_CardPendingBlocks (void);
+
+/*
+ * DMA (sim_dma.c).
+ */
+void Sim_DmaFail (uint8_t controller, uint8_t stream, uint32_t flags);
+
+/*
+ * USART1 (sim_usart.c).
+ */
+uint32_t Sim_UsartTake (uint8_t *data, uint32_t max);
+uint32_t Sim_UsartLost (void);
+uint64_t Sim_UsartCharCycles (void);
+
+/*
+ * SD card on SPI2 (sim_spi.c).
+ */
+void Sim_SpiCardInsert (const Sim_CardConfig *config);
+uint8_t *Sim_SpiCardImage (void);
+void Sim_SpiCardFailBlock (uint32_t block, Sim_Fault fault, uint32_t count);
+uint8_t Sim_SpiCardIsBusy (void);
+
+/*
+ * Image files (sim_image.c).
+ */
+uint8_t *Sim_ImageOpen (const char *path, uint32_t blocks);
+void Sim_ImageClose (uint8_t *image, uint32_t blocks);
+
+#endif /* SIM_H_ */
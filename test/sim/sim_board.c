@@ -0,0 +1,39 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include "stm32f4xx.h"
+#include "misc.h"
+#include "sdio_low_level.h"
+#include "sd_time.h"
+#include "sim.h"
+
+/**
+ * @brief  The interrupt set up of main.c : SDIO above its DMA stream and the busy
+ *         EXTI, PriorityGroup_2 (level 2 free for an SD waiter like the OTG IRQ).
+ *         Then the time base, like SD_Init does.
+ */
+void Sim_BoardInit (void)
+{
+        NVIC_InitTypeDef NVIC_InitStructure;
+
+        NVIC_PriorityGroupConfig (NVIC_PriorityGroup_2);
+
+        NVIC_InitStructure.NVIC_IRQChannel = SDIO_IRQn;
+        NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 0;
+        NVIC_InitStructure.NVIC_IRQChannelSubPriority = 0;
+        NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+        NVIC_Init (&NVIC_InitStructure);
+        NVIC_InitStructure.NVIC_IRQChannel = SD_SDIO_DMA_IRQn;
+        NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 1;
+        NVIC_Init (&NVIC_InitStructure);
+        NVIC_InitStructure.NVIC_IRQChannel = SD_BUSY_IRQn;
+        NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 1;
+        NVIC_Init (&NVIC_InitStructure);
+
+        SD_TimeInit ();
+}
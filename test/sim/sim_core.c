@@ -0,0 +1,968 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include "stm32f4xx.h"
+#include "sim_device.h"
+
+/*
+ * Trap engine, time, NVIC and the core peripherals (SysTick, SCB, DWT).
+ *
+ * A register access faults (SIGSEGV) on the PROT_NONE page. The handler opens the
+ * page, stores the model's value in the accessed word and sets the trap flag : the
+ * instruction is replayed, then SIGTRAP comes after it. There the stored word is
+ * passed to the write hook if it was a store, the page is closed again, time moves
+ * by the access cost and the pending interrupts are taken. Handlers run from there,
+ * nested like on the core : an access in a handler traps the same way.
+ */
+
+#define PAGE_SIZE_                    4096
+#define PERIPH_AREA                   0x40000000
+#define PERIPH_AREA_SIZE              0x00100000
+#define BITBAND_AREA                  0x42000000
+#define BITBAND_AREA_SIZE             0x02000000
+#define CORE_AREA                     0xE0000000
+#define CORE_AREA_SIZE                0x00100000
+#define SCS_PAGE                      0xE000E000
+#define DWT_PAGE                      0xE0001000
+#define RCC_CFGR_ADDR                 0x40023808
+#define RCC_PLLCFGR_ADDR              0x40023804
+#define RCC_CR_ADDR                   0x40023800
+
+#define SIM_REGIONS                   16
+#define SIM_EXCEPTIONS                98
+#define SIM_STACK_SIZE                (8 * 1024 * 1024)
+#define SIM_TIME_LIMIT                ((uint64_t) SIM_HZ * 600)
+#define SIM_STORM_LIMIT               100000
+#define SIM_ENTRY_CYCLES              12
+
+#define EFLAGS_TF                     0x100
+#define PF_WRITE                      0x2
+
+/*
+ * SCS offsets in its page.
+ */
+#define SYST_CSR                      0x010
+#define SYST_RVR                      0x014
+#define SYST_CVR                      0x018
+#define NVIC_ISER                     0x100
+#define NVIC_ICER                     0x180
+#define NVIC_ISPR                     0x200
+#define NVIC_ICPR                     0x280
+#define NVIC_IABR                     0x300
+#define NVIC_IPR                      0x400
+#define SCB_ICSR                      0xD04
+#define SCB_AIRCR                     0xD0C
+#define SCB_SHPR                      0xD18
+
+#define EXC_PENDSV                    14
+#define EXC_SYSTICK                   15
+#define EXC_IRQ0                      16
+
+typedef struct {
+        uint32_t Page;
+        Sim_ReadHook Read;
+        Sim_WriteHook Write;
+        uint32_t Cost;
+        uint32_t Mirror[PAGE_SIZE_ / 4];
+} SimRegion;
+
+typedef struct {
+        uint64_t When;
+        void (*Fire) (void);
+} SimEvent;
+
+/*
+ * The access being replayed, between SIGSEGV and SIGTRAP.
+ */
+typedef struct {
+        SimRegion *Region;
+        volatile uint32_t *Word; /*!< Word accessed, in the register or the bit-band alias page */
+        uint32_t Offset; /*!< Register offset in the region */
+        uint8_t Write;
+        int8_t Bit; /*!< Bit-band : register bit, -1 otherwise */
+        volatile uint32_t *Plain; /*!< Bit-band on plain memory : target word */
+        uint32_t Loaded;
+} SimAccess;
+
+Sim_Stats SimStats;
+uint32_t SystemCoreClock = SIM_HZ;
+
+static SimRegion Regions[SIM_REGIONS];
+static uint32_t RegionCount = 0;
+static SimAccess Access;
+static SimEvent Events[SIM_EVENT_COUNT];
+static uint64_t Now = 0;
+static uint32_t Failures = 0;
+static uint8_t Initialized = 0;
+
+static uint32_t Primask = 0;
+static uint32_t ActiveStack[SIM_EXCEPTIONS];
+static uint32_t ActivePriority[SIM_EXCEPTIONS];
+static uint32_t ActiveDepth = 0;
+static uint8_t SoftPending[SIM_EXCEPTIONS];
+static uint8_t (*Lines[SIM_EXCEPTIONS]) (void);
+static uint32_t Enabled[3];
+static uint32_t StormException = 0;
+static uint32_t StormCount = 0;
+static uint32_t WakeException = 0;
+static uint64_t WakePeriod = 0;
+
+static volatile uint32_t *Exclusive = NULL;
+
+static uint32_t *Scs;
+static uint32_t *Dwt;
+static uint64_t TickBase = 0;
+static uint64_t CycBase = 0;
+static uint32_t CycFrozen = 0;
+
+static void RunUntil (uint64_t target);
+static void Dispatch (void);
+
+/*
+ * Weak references to the handlers the code may define.
+ */
+extern void PendSV_Handler (void) __attribute__ ((weak));
+extern void SysTick_Handler (void) __attribute__ ((weak));
+extern void EXTI9_5_IRQHandler (void) __attribute__ ((weak));
+extern void DMA1_Stream3_IRQHandler (void) __attribute__ ((weak));
+extern void DMA1_Stream4_IRQHandler (void) __attribute__ ((weak));
+extern void SPI2_IRQHandler (void) __attribute__ ((weak));
+extern void USART1_IRQHandler (void) __attribute__ ((weak));
+extern void SDIO_IRQHandler (void) __attribute__ ((weak));
+extern void DMA2_Stream3_IRQHandler (void) __attribute__ ((weak));
+extern void OTG_FS_IRQHandler (void) __attribute__ ((weak));
+extern void DMA2_Stream6_IRQHandler (void) __attribute__ ((weak));
+extern void DMA2_Stream7_IRQHandler (void) __attribute__ ((weak));
+
+static const struct {
+        uint32_t Exception;
+        void (*Handler) (void);
+} HandlerTable[] = {
+        { EXC_PENDSV, PendSV_Handler },
+        { EXC_SYSTICK, SysTick_Handler },
+        { EXC_IRQ0 + 23, EXTI9_5_IRQHandler },
+        { EXC_IRQ0 + 14, DMA1_Stream3_IRQHandler },
+        { EXC_IRQ0 + 15, DMA1_Stream4_IRQHandler },
+        { EXC_IRQ0 + 36, SPI2_IRQHandler },
+        { EXC_IRQ0 + 37, USART1_IRQHandler },
+        { EXC_IRQ0 + 49, SDIO_IRQHandler },
+        { EXC_IRQ0 + 59, DMA2_Stream3_IRQHandler },
+        { EXC_IRQ0 + 67, OTG_FS_IRQHandler },
+        { EXC_IRQ0 + 69, DMA2_Stream6_IRQHandler },
+        { EXC_IRQ0 + 70, DMA2_Stream7_IRQHandler }
+};
+
+/*****************************************************************************/
+
+/**
+ * @brief  Reports a broken test or model and exits.
+ */
+void Sim_Fatal (const char *fmt, ...)
+{
+        va_list ap;
+
+        fflush (stdout);
+        va_start (ap, fmt);
+        fprintf (stderr, "SIM FATAL at %llu us : ", (unsigned long long) (Now / (SIM_HZ / 1000000)));
+        vfprintf (stderr, fmt, ap);
+        va_end (ap);
+        fprintf (stderr, "\n");
+        _exit (3);
+}
+
+/**
+ * @brief  SIM_CHECK backend.
+ */
+void Sim_Check (int ok, const char *expr, const char *file, int line)
+{
+        if (!ok) {
+                printf ("FAIL %s:%d : %s\n", file, line, expr);
+                fflush (stdout);
+                Failures++;
+        }
+}
+
+/*****************************************************************************/
+
+/**
+ * @brief  Maps a page of registers. The page gets no access rights, every access
+ *         goes through read / write (NULL : plain storage in the mirror).
+ * @retval The mirror : the register values the hooks do not model.
+ */
+uint32_t *Sim_MapRegion (uint32_t page, Sim_ReadHook read, Sim_WriteHook write, uint32_t cost)
+{
+        SimRegion *region;
+
+        if (RegionCount == SIM_REGIONS) {
+                Sim_Fatal ("too many regions");
+        }
+
+        region = &Regions[RegionCount++];
+        region->Page = page;
+        region->Read = read;
+        region->Write = write;
+        region->Cost = cost;
+        memset (region->Mirror, 0, sizeof (region->Mirror));
+
+        if (mprotect ((void *) (uintptr_t) page, PAGE_SIZE_, PROT_NONE) != 0) {
+                Sim_Fatal ("mprotect %08x", page);
+        }
+
+        return (region->Mirror);
+}
+
+static SimRegion *FindRegion (uint32_t page)
+{
+        uint32_t i;
+
+        for (i = 0; i < RegionCount; i++) {
+                if (Regions[i].Page == page) {
+                        return (&Regions[i]);
+                }
+        }
+
+        return (NULL);
+}
+
+static uint32_t RegionRead (SimRegion *region, uint32_t offset, uint8_t pop)
+{
+        return ((region->Read) ? region->Read (offset, pop) : region->Mirror[offset / 4]);
+}
+
+static void RegionWrite (SimRegion *region, uint32_t offset, uint32_t value)
+{
+        if (region->Write) {
+                region->Write (offset, value);
+        }
+        else {
+                region->Mirror[offset / 4] = value;
+        }
+}
+
+static void Crash (ucontext_t *uc, uintptr_t addr)
+{
+        fprintf (stderr, "SIM : segmentation fault at %p, pc %p\n", (void *) addr, (void *) uc->uc_mcontext.gregs[REG_RIP]);
+        signal (SIGSEGV, SIG_DFL);
+        raise (SIGSEGV);
+        _exit (4);
+}
+
+/**
+ * @brief  Access to a register page : loads the model's value and replays the
+ *         instruction with the trap flag set.
+ */
+static void SegvHandler (int sig, siginfo_t *info, void *context)
+{
+        ucontext_t *uc = context;
+        uintptr_t addr = (uintptr_t) info->si_addr;
+        uintptr_t target;
+        uint32_t value;
+
+        Access.Write = (uc->uc_mcontext.gregs[REG_ERR] & PF_WRITE) != 0;
+        Access.Word = (volatile uint32_t *) (addr & ~(uintptr_t) 3);
+        Access.Bit = -1;
+        Access.Plain = NULL;
+        Access.Region = NULL;
+
+        if ((addr >= BITBAND_AREA) && (addr < BITBAND_AREA + BITBAND_AREA_SIZE)) {
+                /*!< Alias word n is bit n % 32 of the register word n / 32 */
+                target = PERIPH_AREA + ((addr - BITBAND_AREA) >> 5);
+                Access.Bit = (int8_t) ((((addr - BITBAND_AREA) >> 2) & 0x07) + (target & 0x03) * 8);
+                target &= ~(uintptr_t) 3;
+                Access.Region = FindRegion ((uint32_t) (target & ~(uintptr_t) (PAGE_SIZE_ - 1)));
+
+                if (Access.Region) {
+                        Access.Offset = (uint32_t) (target & (PAGE_SIZE_ - 1));
+                        value = (RegionRead (Access.Region, Access.Offset, 0) >> Access.Bit) & 1;
+                }
+                else {
+                        Access.Plain = (volatile uint32_t *) target;
+                        value = (*Access.Plain >> Access.Bit) & 1;
+                }
+        }
+        else {
+                Access.Region = FindRegion ((uint32_t) (addr & ~(uintptr_t) (PAGE_SIZE_ - 1)));
+
+                if (Access.Region == NULL) {
+                        Crash (uc, addr);
+                }
+
+                Access.Offset = (uint32_t) (addr & (PAGE_SIZE_ - 1) & ~3U);
+                value = RegionRead (Access.Region, Access.Offset, !Access.Write);
+        }
+
+        mprotect ((void *) (addr & ~(uintptr_t) (PAGE_SIZE_ - 1)), PAGE_SIZE_, PROT_READ | PROT_WRITE);
+        *Access.Word = value;
+        Access.Loaded = value;
+        uc->uc_mcontext.gregs[REG_EFL] |= EFLAGS_TF;
+}
+
+/**
+ * @brief  After the replayed instruction : store, close the page, time, interrupts.
+ */
+static void TrapHandler (int sig, siginfo_t *info, void *context)
+{
+        ucontext_t *uc = context;
+        SimRegion *region = Access.Region;
+        uint32_t value = *Access.Word;
+        uint32_t cost = (region) ? region->Cost : SIM_COST_PERIPH;
+        uint32_t current;
+
+        uc->uc_mcontext.gregs[REG_EFL] &= ~EFLAGS_TF;
+
+        if (Access.Write || (value != Access.Loaded)) {
+                if (Access.Bit >= 0) {
+                        current = (Access.Plain) ? *Access.Plain : RegionRead (region, Access.Offset, 0);
+                        current = (value & 1) ? (current | (1U << Access.Bit)) : (current & ~(1U << Access.Bit));
+
+                        if (Access.Plain) {
+                                *Access.Plain = current;
+                        }
+                        else {
+                                RegionWrite (region, Access.Offset, current);
+                        }
+                }
+                else {
+                        RegionWrite (region, Access.Offset, value);
+                }
+        }
+
+        mprotect ((void *) ((uintptr_t) Access.Word & ~(uintptr_t) (PAGE_SIZE_ - 1)), PAGE_SIZE_, PROT_NONE);
+        SimStats.Accesses++;
+        RunUntil (Now + cost);
+        Dispatch ();
+}
+
+/*****************************************************************************/
+
+void Sim_EventSetup (Sim_EventId id, void (*fire) (void))
+{
+        Events[id].Fire = fire;
+        Events[id].When = SIM_NEVER;
+}
+
+void Sim_Schedule (Sim_EventId id, uint64_t when)
+{
+        Events[id].When = (when < Now) ? Now : when;
+}
+
+void Sim_Cancel (Sim_EventId id)
+{
+        Events[id].When = SIM_NEVER;
+}
+
+uint64_t Sim_EventTime (Sim_EventId id)
+{
+        return (Events[id].When);
+}
+
+static uint64_t NextEvent (void)
+{
+        uint64_t next = SIM_NEVER;
+        uint32_t i;
+
+        for (i = 0; i < SIM_EVENT_COUNT; i++) {
+                if (Events[i].When < next) {
+                        next = Events[i].When;
+                }
+        }
+
+        return (next);
+}
+
+/**
+ * @brief  Runs the events up to target and moves the time there.
+ */
+static void RunUntil (uint64_t target)
+{
+        uint64_t next;
+        uint32_t i;
+
+        while ((next = NextEvent ()) <= target) {
+                Now = next;
+
+                for (i = 0; i < SIM_EVENT_COUNT; i++) {
+                        if (Events[i].When == next) {
+                                Events[i].When = SIM_NEVER;
+                                Events[i].Fire ();
+                                break;
+                        }
+                }
+        }
+
+        Now = target;
+
+        if (Now > SIM_TIME_LIMIT) {
+                Sim_Fatal ("simulated time limit reached");
+        }
+}
+
+uint64_t Sim_Now (void)
+{
+        return (Now);
+}
+
+/**
+ * @brief  Lets time pass, as if the core was busy computing : the interrupts the
+ *         events raise preempt it as they come.
+ */
+void Sim_Advance (uint64_t cycles)
+{
+        uint64_t target = Now + cycles, next;
+
+        do {
+                next = NextEvent ();
+                next = (next < Now) ? Now : next;
+                RunUntil ((next < target) ? next : target);
+                Dispatch ();
+        } while (Now < target);
+}
+
+/*****************************************************************************/
+
+void Sim_IrqLine (int irqn, uint8_t (*line) (void))
+{
+        Lines[EXC_IRQ0 + irqn] = line;
+}
+
+static uint8_t Priority (uint32_t exception)
+{
+        const uint8_t *bytes = (const uint8_t *) Scs;
+
+        if (exception < EXC_IRQ0) {
+                return (bytes[SCB_SHPR + exception - 4]);
+        }
+
+        return (bytes[NVIC_IPR + exception - EXC_IRQ0]);
+}
+
+static uint32_t GroupPriority (uint32_t exception)
+{
+        uint32_t group = (Scs[SCB_AIRCR / 4] >> 8) & 0x07;
+
+        return (Priority (exception) >> (group + 1));
+}
+
+static uint8_t IsEnabled (uint32_t exception)
+{
+        uint32_t irq = exception - EXC_IRQ0;
+
+        if (exception < EXC_IRQ0) {
+                return (1);
+        }
+
+        return ((Enabled[irq / 32] >> (irq % 32)) & 1);
+}
+
+static uint8_t IsPending (uint32_t exception)
+{
+        return (SoftPending[exception] || (Lines[exception] && Lines[exception] ()));
+}
+
+/**
+ * @brief  Highest priority pending exception that would preempt the current
+ *         execution priority, PRIMASK aside.
+ * @retval Exception number, 0 if none.
+ */
+static uint32_t FindPending (void)
+{
+        uint32_t current = (ActiveDepth) ? ActivePriority[ActiveDepth - 1] : 0x100;
+        uint32_t best = 0, bestGroup = 0x100, bestPriority = 0x100;
+        uint32_t exception, group;
+
+        for (exception = EXC_PENDSV; exception < SIM_EXCEPTIONS; exception++) {
+                if (!IsEnabled (exception) || !IsPending (exception)) {
+                        continue;
+                }
+
+                group = GroupPriority (exception);
+
+                if ((group < current) && ((group < bestGroup) || ((group == bestGroup) && (Priority (exception) < bestPriority)))) {
+                        best = exception;
+                        bestGroup = group;
+                        bestPriority = Priority (exception);
+                }
+        }
+
+        return (best);
+}
+
+static void (*FindHandler (uint32_t exception)) (void)
+{
+        uint32_t i;
+
+        for (i = 0; i < sizeof (HandlerTable) / sizeof (HandlerTable[0]); i++) {
+                if (HandlerTable[i].Exception == exception) {
+                        return (HandlerTable[i].Handler);
+                }
+        }
+
+        return (NULL);
+}
+
+/**
+ * @brief  Takes the pending exceptions that can preempt, like the core does
+ *         between two instructions.
+ */
+static void Dispatch (void)
+{
+        uint32_t exception;
+        void (*handler) (void);
+
+        while (!Primask && ((exception = FindPending ()) != 0)) {
+                handler = FindHandler (exception);
+
+                if (handler == NULL) {
+                        Sim_Fatal ("no handler for exception %u", exception);
+                }
+
+                SoftPending[exception] = 0;
+                SimStats.Interrupts[exception]++;
+                ActiveStack[ActiveDepth] = exception;
+                ActivePriority[ActiveDepth] = GroupPriority (exception);
+                ActiveDepth++;
+                Exclusive = NULL;
+                RunUntil (Now + SIM_ENTRY_CYCLES);
+
+                handler ();
+
+                ActiveDepth--;
+                Exclusive = NULL;
+
+                /*!< A handler that never clears its request */
+                if ((exception == StormException) && IsPending (exception)) {
+                        if (++StormCount > SIM_STORM_LIMIT) {
+                                Sim_Fatal ("interrupt storm on exception %u", exception);
+                        }
+                }
+                else {
+                        StormException = exception;
+                        StormCount = 0;
+                }
+        }
+}
+
+/**
+ * @brief  Exception being handled, 0 in thread mode (IPSR).
+ */
+uint32_t Sim_ActiveException (void)
+{
+        return ((ActiveDepth) ? ActiveStack[ActiveDepth - 1] : 0);
+}
+
+/*****************************************************************************/
+
+void Sim_SetPrimask (uint32_t primask)
+{
+        Primask = primask & 1;
+
+        if (!Primask) {
+                Dispatch ();
+        }
+}
+
+uint32_t Sim_GetPrimask (void)
+{
+        return (Primask);
+}
+
+/**
+ * @brief  Sleeps until an exception that could preempt is pending (PRIMASK does
+ *         not keep the core asleep) : time jumps from event to event.
+ */
+void Sim_Wfi (void)
+{
+        uint64_t start = Now, next;
+
+        SimStats.Wfi++;
+
+        while (!FindPending ()) {
+                next = NextEvent ();
+
+                if (next == SIM_NEVER) {
+                        Sim_Fatal ("WFI with nothing to wake the core up");
+                }
+
+                RunUntil (next);
+        }
+
+        SimStats.SleepCycles += Now - start;
+        Dispatch ();
+}
+
+uint32_t Sim_LoadExclusive (volatile uint32_t *addr)
+{
+        Exclusive = addr;
+        return (*addr);
+}
+
+uint32_t Sim_StoreExclusive (uint32_t value, volatile uint32_t *addr)
+{
+        if (Exclusive != addr) {
+                return (1);
+        }
+
+        *addr = value;
+        Exclusive = NULL;
+        return (0);
+}
+
+void Sim_ClearExclusive (void)
+{
+        Exclusive = NULL;
+}
+
+/*****************************************************************************/
+
+static uint32_t TickPeriod (void)
+{
+        return ((Scs[SYST_RVR / 4] & 0x00FFFFFF) + 1);
+}
+
+static void TickFire (void)
+{
+        Scs[SYST_CSR / 4] |= SysTick_CTRL_COUNTFLAG_Msk;
+
+        if (Scs[SYST_CSR / 4] & SysTick_CTRL_TICKINT_Msk) {
+                SoftPending[EXC_SYSTICK] = 1;
+        }
+
+        TickBase += TickPeriod ();
+        Sim_Schedule (SIM_EVENT_SYSTICK, TickBase + TickPeriod ());
+}
+
+static void WakeFire (void)
+{
+        SoftPending[WakeException] = 1;
+        Sim_Schedule (SIM_EVENT_WAKE, Now + WakePeriod);
+}
+
+/**
+ * @brief  Pends irqn every period cycles, without any flag behind it : spurious
+ *         wake ups of the waits. A period of 0 stops them.
+ */
+void Sim_InjectWakes (int irqn, uint64_t period)
+{
+        WakeException = EXC_IRQ0 + irqn;
+        WakePeriod = period;
+
+        if (period) {
+                Sim_Schedule (SIM_EVENT_WAKE, Now + period);
+        }
+        else {
+                Sim_Cancel (SIM_EVENT_WAKE);
+        }
+}
+
+static void TickRestart (void)
+{
+        TickBase = Now;
+
+        if (Scs[SYST_CSR / 4] & SysTick_CTRL_ENABLE_Msk) {
+                Sim_Schedule (SIM_EVENT_SYSTICK, TickBase + TickPeriod ());
+        }
+        else {
+                Sim_Cancel (SIM_EVENT_SYSTICK);
+        }
+}
+
+static uint32_t ScsRead (uint32_t offset, uint8_t pop)
+{
+        uint32_t value, i, irq;
+
+        switch (offset) {
+                case SYST_CSR:
+                        value = Scs[SYST_CSR / 4];
+
+                        if (pop) {
+                                Scs[SYST_CSR / 4] &= ~SysTick_CTRL_COUNTFLAG_Msk;
+                        }
+
+                        return (value);
+
+                case SYST_CVR:
+                        if (!(Scs[SYST_CSR / 4] & SysTick_CTRL_ENABLE_Msk)) {
+                                return (Scs[SYST_CVR / 4]);
+                        }
+
+                        return ((uint32_t) (TickPeriod () - 1 - (Now - TickBase) % TickPeriod ()));
+
+                case SCB_ICSR:
+                        value = (ActiveDepth) ? ActiveStack[ActiveDepth - 1] : 0;
+                        value |= (SoftPending[EXC_PENDSV]) ? SCB_ICSR_PENDSVSET_Msk : 0;
+                        value |= (SoftPending[EXC_SYSTICK]) ? SCB_ICSR_PENDSTSET_Msk : 0;
+                        return (value);
+
+                default:
+                        break;
+        }
+
+        if ((offset >= NVIC_ISER) && (offset < NVIC_ICER + 12)) {
+                return (Enabled[(offset & 0x7F) / 4 % 3]);
+        }
+
+        if ((offset >= NVIC_ISPR) && (offset < NVIC_ICPR + 12)) {
+                for (value = 0, i = 0; i < 32; i++) {
+                        irq = ((offset & 0x7F) / 4) * 32 + i;
+
+                        if ((EXC_IRQ0 + irq < SIM_EXCEPTIONS) && IsPending (EXC_IRQ0 + irq)) {
+                                value |= 1U << i;
+                        }
+                }
+
+                return (value);
+        }
+
+        return (Scs[offset / 4]);
+}
+
+static void ScsWrite (uint32_t offset, uint32_t value)
+{
+        uint32_t i, irq;
+
+        switch (offset) {
+                case SYST_CSR:
+                        Scs[SYST_CSR / 4] = (Scs[SYST_CSR / 4] & SysTick_CTRL_COUNTFLAG_Msk) | (value & 0x07);
+                        TickRestart ();
+                        return;
+
+                case SYST_RVR:
+                        Scs[SYST_RVR / 4] = value & 0x00FFFFFF;
+                        return;
+
+                case SYST_CVR:
+                        Scs[SYST_CSR / 4] &= ~SysTick_CTRL_COUNTFLAG_Msk;
+                        TickRestart ();
+                        return;
+
+                case SCB_ICSR:
+                        if (value & SCB_ICSR_PENDSVSET_Msk) {
+                                SoftPending[EXC_PENDSV] = 1;
+                        }
+
+                        if (value & SCB_ICSR_PENDSVCLR_Msk) {
+                                SoftPending[EXC_PENDSV] = 0;
+                        }
+
+                        if (value & SCB_ICSR_PENDSTSET_Msk) {
+                                SoftPending[EXC_SYSTICK] = 1;
+                        }
+
+                        if (value & SCB_ICSR_PENDSTCLR_Msk) {
+                                SoftPending[EXC_SYSTICK] = 0;
+                        }
+
+                        return;
+
+                default:
+                        break;
+        }
+
+        if ((offset >= NVIC_ISER) && (offset < NVIC_ISER + 12)) {
+                Enabled[(offset - NVIC_ISER) / 4] |= value;
+                return;
+        }
+
+        if ((offset >= NVIC_ICER) && (offset < NVIC_ICER + 12)) {
+                Enabled[(offset - NVIC_ICER) / 4] &= ~value;
+                return;
+        }
+
+        if (((offset >= NVIC_ISPR) && (offset < NVIC_ISPR + 12)) || ((offset >= NVIC_ICPR) && (offset < NVIC_ICPR + 12))) {
+                for (i = 0; i < 32; i++) {
+                        irq = ((offset & 0x7F) / 4) * 32 + i;
+
+                        if ((value & (1U << i)) && (EXC_IRQ0 + irq < SIM_EXCEPTIONS)) {
+                                SoftPending[EXC_IRQ0 + irq] = (offset < NVIC_ICPR);
+                        }
+                }
+
+                return;
+        }
+
+        Scs[offset / 4] = value;
+}
+
+static uint32_t DwtRead (uint32_t offset, uint8_t pop)
+{
+        if (offset == 0x04) {
+                return ((Dwt[0] & DWT_CTRL_CYCCNTENA_Msk) ? (uint32_t) (Now - CycBase) : CycFrozen);
+        }
+
+        return (Dwt[offset / 4]);
+}
+
+static void DwtWrite (uint32_t offset, uint32_t value)
+{
+        if (offset == 0x04) {
+                CycBase = Now - value;
+                CycFrozen = value;
+                return;
+        }
+
+        if ((offset == 0x00) && ((value ^ Dwt[0]) & DWT_CTRL_CYCCNTENA_Msk)) {
+                if (value & DWT_CTRL_CYCCNTENA_Msk) {
+                        CycBase = Now - CycFrozen;
+                }
+                else {
+                        CycFrozen = (uint32_t) (Now - CycBase);
+                }
+        }
+
+        Dwt[offset / 4] = value;
+}
+
+/*****************************************************************************/
+
+/**
+ * @brief  Clock tree as left by SystemInit : HSE 8 MHz, PLL to 168 MHz, APB1 / 4,
+ *         APB2 / 2. RCC is plain memory.
+ */
+static void RccReset (void)
+{
+        *(volatile uint32_t *) RCC_CR_ADDR = 0x03036783;
+        *(volatile uint32_t *) RCC_PLLCFGR_ADDR = (8 << 0) | (336 << 6) | (0 << 16) | (1 << 22) | (7 << 24);
+        *(volatile uint32_t *) RCC_CFGR_ADDR = 0x02 | (0x02 << 2) | (0x05 << 10) | (0x04 << 13);
+}
+
+static void MapArea (uint32_t base, uint32_t size, int prot)
+{
+        void *area = mmap ((void *) (uintptr_t) base, size, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+
+        if (area != (void *) (uintptr_t) base) {
+                Sim_Fatal ("can not map %08x", base);
+        }
+}
+
+static void Init (void)
+{
+        struct sigaction sa;
+
+        if (Initialized) {
+                return;
+        }
+
+        Initialized = 1;
+
+        /*!< Keep the heap below 4 GB too, in one arena */
+        mallopt (M_MMAP_MAX, 0);
+        mallopt (M_ARENA_MAX, 1);
+
+        MapArea (PERIPH_AREA, PERIPH_AREA_SIZE, PROT_READ | PROT_WRITE);
+        MapArea (BITBAND_AREA, BITBAND_AREA_SIZE, PROT_NONE);
+        MapArea (CORE_AREA, CORE_AREA_SIZE, PROT_READ | PROT_WRITE);
+
+        memset (&sa, 0, sizeof (sa));
+        sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sa.sa_sigaction = SegvHandler;
+        sigaction (SIGSEGV, &sa, NULL);
+        sa.sa_sigaction = TrapHandler;
+        sigaction (SIGTRAP, &sa, NULL);
+
+        RccReset ();
+        Sim_EventSetup (SIM_EVENT_SYSTICK, TickFire);
+        Sim_EventSetup (SIM_EVENT_WAKE, WakeFire);
+        Scs = Sim_MapRegion (SCS_PAGE, ScsRead, ScsWrite, SIM_COST_CORE);
+        Dwt = Sim_MapRegion (DWT_PAGE, DwtRead, DwtWrite, SIM_COST_CORE);
+        Scs[SCB_AIRCR / 4] = 0xFA050000;
+
+        Sim_DmaInit ();
+        Sim_GpioInit ();
+        Sim_SdioInit ();
+        Sim_UsartInit ();
+        Sim_SpiInit ();
+}
+
+static void *ThreadMain (void *test)
+{
+        ((void (*) (void)) test) ();
+        return (NULL);
+}
+
+/**
+ * @brief  Runs test in the simulated machine, on a thread whose stack is below
+ *         4 GB.
+ * @retval 0 if all SIM_CHECKs passed.
+ */
+int Sim_Run (void (*test) (void))
+{
+        pthread_attr_t attr;
+        pthread_t thread;
+        void *stack;
+
+        setvbuf (stdout, NULL, _IOLBF, 0);
+        Init ();
+
+        stack = mmap (NULL, SIM_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT | MAP_STACK, -1, 0);
+
+        if (stack == MAP_FAILED) {
+                Sim_Fatal ("no stack below 4 GB");
+        }
+
+        pthread_attr_init (&attr);
+        pthread_attr_setstack (&attr, stack, SIM_STACK_SIZE);
+
+        if (pthread_create (&thread, &attr, ThreadMain, (void *) test) != 0) {
+                Sim_Fatal ("pthread_create");
+        }
+
+        pthread_join (thread, NULL);
+        printf ("%s (%u failed checks, %llu us simulated)\n", (Failures) ? "FAILED" : "PASSED", Failures, (unsigned long long) (Now / (SIM_HZ / 1000000)));
+        return ((Failures) ? 1 : 0);
+}
+
+/*****************************************************************************/
+
+void Sim_GetStats (Sim_Stats *stats)
+{
+        *stats = SimStats;
+}
+
+void Sim_ResetStats (void)
+{
+        memset (&SimStats, 0, sizeof (SimStats));
+}
+
+/**
+ * @brief  Prints the counters that matter for the driver : commands, polling and
+ *         the modeled bus time.
+ */
+void Sim_PrintStats (const char *title, const Sim_Stats *stats)
+{
+        uint32_t i;
+
+        printf ("%s : %u commands (", title, stats->CommandTotal);
+
+        for (i = 0; i < 64; i++) {
+                if (stats->Commands[i]) {
+                        printf (" CMD%u:%u", i, stats->Commands[i]);
+                }
+        }
+
+        for (i = 0; i < 64; i++) {
+                if (stats->AppCommands[i]) {
+                        printf (" ACMD%u:%u", i, stats->AppCommands[i]);
+                }
+        }
+
+        printf (" ), %u STA polls, %u D0 polls, %u register accesses, %u WFI\n", stats->StaReads, stats->BusyReads, stats->Accesses, stats->Wfi);
+        printf ("%s : bus CMD %llu us, DAT %llu us, card busy %llu us, asleep %llu us\n", title, (unsigned long long) (stats->CmdBusCycles / (SIM_HZ / 1000000)),
+                        (unsigned long long) (stats->DataBusCycles / (SIM_HZ / 1000000)), (unsigned long long) (stats->CardBusyCycles / (SIM_HZ / 1000000)),
+                        (unsigned long long) (stats->SleepCycles / (SIM_HZ / 1000000)));
+}
@@ -0,0 +1,92 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef SIM_DEVICE_H_
+#define SIM_DEVICE_H_
+
+#include "sim.h"
+
+/*
+ * Interface between the simulator core (sim_core.c) and the peripheral models.
+ * Not for the tests.
+ */
+
+/**
+ * @brief  Register access hooks of a 4 KB page. offset is word aligned, relative
+ *         to the page. pop is 0 when the value is only needed for a write (read
+ *         modify write, byte store) : no read side effect then.
+ */
+typedef uint32_t (*Sim_ReadHook) (uint32_t offset, uint8_t pop);
+typedef void (*Sim_WriteHook) (uint32_t offset, uint32_t value);
+
+/**
+ * @brief  Access costs, in CPU cycles. A peripheral on APB2 through the bus
+ *         matrix, the core private peripherals.
+ */
+#define SIM_COST_PERIPH               8
+#define SIM_COST_CORE                 2
+
+uint32_t *Sim_MapRegion (uint32_t page, Sim_ReadHook read, Sim_WriteHook write, uint32_t cost);
+
+/**
+ * @brief  Timed events of the models. One pending time per id.
+ */
+typedef enum {
+        SIM_EVENT_SYSTICK = 0,
+        SIM_EVENT_SDIO_CMD,
+        SIM_EVENT_SDIO_DATA,
+        SIM_EVENT_SDIO_TIMEOUT,
+        SIM_EVENT_CARD_BUSY,
+        SIM_EVENT_WAKE,
+        SIM_EVENT_USART_TX,
+        SIM_EVENT_SPI_BYTE,
+        SIM_EVENT_COUNT
+} Sim_EventId;
+
+#define SIM_NEVER                     UINT64_MAX
+
+void Sim_EventSetup (Sim_EventId id, void (*fire) (void));
+void Sim_Schedule (Sim_EventId id, uint64_t when);
+void Sim_Cancel (Sim_EventId id);
+uint64_t Sim_EventTime (Sim_EventId id);
+
+/**
+ * @brief  Interrupt request lines. line returns 1 while the peripheral requests
+ *         (level), the NVIC pends it then.
+ */
+void Sim_IrqLine (int irqn, uint8_t (*line) (void));
+
+extern Sim_Stats SimStats;
+
+/*
+ * Model initialisation, from Sim_Run.
+ */
+void Sim_DmaInit (void);
+void Sim_GpioInit (void);
+void Sim_SdioInit (void);
+void Sim_UsartInit (void);
+void Sim_SpiInit (void);
+
+/*
+ * DMA request interface of the peripherals (sim_dma.c). controller is 1 or 2.
+ */
+uint8_t Sim_DmaEnabled (uint8_t controller, uint8_t stream, uint8_t toMemory);
+uint8_t Sim_DmaFlowControl (uint8_t controller, uint8_t stream);
+uint8_t Sim_DmaToMemory (uint8_t controller, uint8_t stream, uint32_t value);
+uint8_t Sim_DmaFromMemory (uint8_t controller, uint8_t stream, uint32_t *value);
+void Sim_DmaPeripheralEnd (uint8_t controller, uint8_t stream);
+void Sim_DmaSetKick (uint8_t controller, uint8_t stream, void (*kick) (void));
+
+/*
+ * GPIO (sim_gpio.c). port 0 is GPIOA.
+ */
+void Sim_GpioSetInput (uint8_t port, uint8_t pin, uint8_t level);
+uint8_t Sim_GpioGetOutput (uint8_t port, uint8_t pin);
+void Sim_GpioWatch (uint8_t port, uint8_t pin, void (*changed) (uint8_t level));
+
+#endif /* SIM_DEVICE_H_ */
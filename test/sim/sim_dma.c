@@ -0,0 +1,394 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <string.h>
+#include "stm32f4xx.h"
+#include "sim_device.h"
+
+/*
+ * DMA1 and DMA2. A stream moves one peripheral sized item per request of its
+ * peripheral (Sim_DmaToMemory, Sim_DmaFromMemory), at once. The stream FIFO is
+ * not modeled : an item is PSIZE bytes in memory whatever MSIZE is, which is what
+ * the packing gives. Peripheral flow control (the SDIO) ends on Sim_DmaPeripheralEnd,
+ * DMA flow control on NDTR reaching 0, with the circular and double buffer
+ * reloads.
+ */
+
+#define DMA_PAGE                      0x40026000
+#define DMA_CONTROLLER_OFFSET         0x400
+#define DMA_STREAMS                   8
+
+#define FLAG_FE                       0x01
+#define FLAG_DME                      0x04
+#define FLAG_TE                       0x08
+#define FLAG_HT                       0x10
+#define FLAG_TC                       0x20
+
+#define CR_IE_MASK                    (DMA_SxCR_DMEIE | DMA_SxCR_TEIE | DMA_SxCR_HTIE | DMA_SxCR_TCIE)
+#define NDTR_PERIPHERAL_FLOW          0xFFFF
+
+typedef struct {
+        uint32_t Cr;
+        uint32_t Ndtr;
+        uint32_t Par;
+        uint32_t M0ar;
+        uint32_t M1ar;
+        uint32_t Fcr;
+        uint32_t Reload; /*!< NDTR when enabled */
+        uint32_t Index; /*!< Items done in the current buffer */
+        uint8_t Flags;
+        void (*Kick) (void);
+} SimStream;
+
+static SimStream Streams[2][DMA_STREAMS];
+
+static const uint8_t FlagShift[4] = { 0, 6, 16, 22 };
+
+static const int8_t StreamIrq[2][DMA_STREAMS] = {
+        { DMA1_Stream0_IRQn, DMA1_Stream1_IRQn, DMA1_Stream2_IRQn, DMA1_Stream3_IRQn, DMA1_Stream4_IRQn, DMA1_Stream5_IRQn, DMA1_Stream6_IRQn, DMA1_Stream7_IRQn },
+        { DMA2_Stream0_IRQn, DMA2_Stream1_IRQn, DMA2_Stream2_IRQn, DMA2_Stream3_IRQn, DMA2_Stream4_IRQn, DMA2_Stream5_IRQn, DMA2_Stream6_IRQn, DMA2_Stream7_IRQn }
+};
+
+static SimStream *Stream (uint8_t controller, uint8_t stream)
+{
+        return (&Streams[controller - 1][stream]);
+}
+
+static uint8_t StreamLine (const SimStream *s)
+{
+        uint8_t enabled = 0;
+
+        enabled |= (s->Cr & DMA_SxCR_TCIE) ? FLAG_TC : 0;
+        enabled |= (s->Cr & DMA_SxCR_HTIE) ? FLAG_HT : 0;
+        enabled |= (s->Cr & DMA_SxCR_TEIE) ? FLAG_TE : 0;
+        enabled |= (s->Cr & DMA_SxCR_DMEIE) ? FLAG_DME : 0;
+        enabled |= (s->Fcr & DMA_SxFCR_FEIE) ? FLAG_FE : 0;
+        return ((s->Flags & enabled) != 0);
+}
+
+/*
+ * One line function per stream for the NVIC.
+ */
+#define STREAM_LINE(c, n) static uint8_t Line ## c ## _ ## n (void) { return (StreamLine (&Streams[c - 1][n])); }
+STREAM_LINE (1, 0) STREAM_LINE (1, 1) STREAM_LINE (1, 2) STREAM_LINE (1, 3)
+STREAM_LINE (1, 4) STREAM_LINE (1, 5) STREAM_LINE (1, 6) STREAM_LINE (1, 7)
+STREAM_LINE (2, 0) STREAM_LINE (2, 1) STREAM_LINE (2, 2) STREAM_LINE (2, 3)
+STREAM_LINE (2, 4) STREAM_LINE (2, 5) STREAM_LINE (2, 6) STREAM_LINE (2, 7)
+
+static uint8_t (* const LineTable[2][DMA_STREAMS]) (void) = {
+        { Line1_0, Line1_1, Line1_2, Line1_3, Line1_4, Line1_5, Line1_6, Line1_7 },
+        { Line2_0, Line2_1, Line2_2, Line2_3, Line2_4, Line2_5, Line2_6, Line2_7 }
+};
+
+/*****************************************************************************/
+
+static void Disable (SimStream *s)
+{
+        s->Cr &= ~DMA_SxCR_EN;
+}
+
+static void Enable (SimStream *s)
+{
+        s->Cr |= DMA_SxCR_EN;
+        s->Index = 0;
+
+        if (s->Cr & DMA_SxCR_PFCTRL) {
+                s->Ndtr = NDTR_PERIPHERAL_FLOW;
+        }
+
+        s->Reload = s->Ndtr;
+
+        if ((s->M0ar == 0) || ((s->Cr & DMA_SxCR_DBM) && (s->M1ar == 0))) {
+                s->Flags |= FLAG_TE;
+                Disable (s);
+                return;
+        }
+
+        if (s->Kick) {
+                s->Kick ();
+        }
+}
+
+static uint32_t MemoryAddress (const SimStream *s)
+{
+        uint32_t base = ((s->Cr & DMA_SxCR_DBM) && (s->Cr & DMA_SxCR_CT)) ? s->M1ar : s->M0ar;
+        uint32_t size = 1U << ((s->Cr & DMA_SxCR_PSIZE) >> 11);
+
+        return ((s->Cr & DMA_SxCR_MINC) ? base + s->Index * size : base);
+}
+
+/**
+ * @brief  Accounts one item : NDTR, half and full transfer, reloads.
+ */
+static void Item (SimStream *s)
+{
+        s->Index++;
+        s->Ndtr = (s->Ndtr - 1) & 0xFFFF;
+
+        if (s->Cr & DMA_SxCR_PFCTRL) {
+                return;
+        }
+
+        if (s->Ndtr == s->Reload / 2) {
+                s->Flags |= FLAG_HT;
+        }
+
+        if (s->Ndtr != 0) {
+                return;
+        }
+
+        s->Flags |= FLAG_TC;
+
+        if (s->Cr & (DMA_SxCR_CIRC | DMA_SxCR_DBM)) {
+                s->Ndtr = s->Reload;
+                s->Index = 0;
+
+                if (s->Cr & DMA_SxCR_DBM) {
+                        s->Cr ^= DMA_SxCR_CT;
+                }
+        }
+        else {
+                Disable (s);
+        }
+}
+
+uint8_t Sim_DmaEnabled (uint8_t controller, uint8_t stream, uint8_t toMemory)
+{
+        SimStream *s = Stream (controller, stream);
+        uint32_t dir = (toMemory) ? 0 : DMA_SxCR_DIR_0;
+
+        return ((s->Cr & DMA_SxCR_EN) && ((s->Cr & DMA_SxCR_DIR) == dir));
+}
+
+uint8_t Sim_DmaFlowControl (uint8_t controller, uint8_t stream)
+{
+        return ((Stream (controller, stream)->Cr & DMA_SxCR_PFCTRL) == 0);
+}
+
+/**
+ * @brief  Peripheral to memory request.
+ * @retval 1 if the stream took value.
+ */
+uint8_t Sim_DmaToMemory (uint8_t controller, uint8_t stream, uint32_t value)
+{
+        SimStream *s = Stream (controller, stream);
+        uint32_t size = 1U << ((s->Cr & DMA_SxCR_PSIZE) >> 11);
+
+        if (!Sim_DmaEnabled (controller, stream, 1)) {
+                return (0);
+        }
+
+        memcpy ((void *) (uintptr_t) MemoryAddress (s), &value, size);
+        Item (s);
+        return (1);
+}
+
+/**
+ * @brief  Memory to peripheral request.
+ * @retval 1 if the stream gave *value.
+ */
+uint8_t Sim_DmaFromMemory (uint8_t controller, uint8_t stream, uint32_t *value)
+{
+        SimStream *s = Stream (controller, stream);
+        uint32_t size = 1U << ((s->Cr & DMA_SxCR_PSIZE) >> 11);
+
+        if (!Sim_DmaEnabled (controller, stream, 0)) {
+                return (0);
+        }
+
+        *value = 0;
+        memcpy (value, (const void *) (uintptr_t) MemoryAddress (s), size);
+        Item (s);
+        return (1);
+}
+
+/**
+ * @brief  Last request of a peripheral flow controlled transfer.
+ */
+void Sim_DmaPeripheralEnd (uint8_t controller, uint8_t stream)
+{
+        SimStream *s = Stream (controller, stream);
+
+        if ((s->Cr & DMA_SxCR_EN) && (s->Cr & DMA_SxCR_PFCTRL)) {
+                s->Flags |= FLAG_TC;
+                Disable (s);
+        }
+}
+
+void Sim_DmaSetKick (uint8_t controller, uint8_t stream, void (*kick) (void))
+{
+        Stream (controller, stream)->Kick = kick;
+}
+
+/**
+ * @brief  Raises error flags on a stream, flags in the LISR layout of stream 0
+ *         (DMA_FLAG_FEIF0 ...). A transfer error disables the stream.
+ */
+void Sim_DmaFail (uint8_t controller, uint8_t stream, uint32_t flags)
+{
+        SimStream *s = Stream (controller, stream);
+
+        s->Flags |= flags & 0x3D;
+
+        if (flags & FLAG_TE) {
+                Disable (s);
+        }
+}
+
+/*****************************************************************************/
+
+static uint32_t DmaRead (uint32_t offset, uint8_t pop)
+{
+        uint8_t controller = (offset >= DMA_CONTROLLER_OFFSET) ? 2 : 1;
+        uint32_t reg = offset % DMA_CONTROLLER_OFFSET;
+        uint32_t value = 0, i;
+        SimStream *s;
+
+        if (reg < 0x10) {
+                if (reg >= 0x08) {
+                        return (0);
+                }
+
+                for (i = 0; i < 4; i++) {
+                        value |= (uint32_t) Stream (controller, (reg / 4) * 4 + i)->Flags << FlagShift[i];
+                }
+
+                return (value);
+        }
+
+        if ((reg - 0x10) / 0x18 >= DMA_STREAMS) {
+                return (0);
+        }
+
+        s = Stream (controller, (reg - 0x10) / 0x18);
+
+        switch ((reg - 0x10) % 0x18) {
+                case 0x00:
+                        return (s->Cr);
+
+                case 0x04:
+                        return (s->Ndtr);
+
+                case 0x08:
+                        return (s->Par);
+
+                case 0x0C:
+                        return (s->M0ar);
+
+                case 0x10:
+                        return (s->M1ar);
+
+                default:
+                        /*!< FIFO always empty */
+                        return ((s->Fcr & ~DMA_SxFCR_FS) | DMA_SxFCR_FS_2);
+        }
+}
+
+static void DmaWrite (uint32_t offset, uint32_t value)
+{
+        uint8_t controller = (offset >= DMA_CONTROLLER_OFFSET) ? 2 : 1;
+        uint32_t reg = offset % DMA_CONTROLLER_OFFSET;
+        uint32_t i;
+        SimStream *s;
+
+        if (reg < 0x10) {
+                if (reg >= 0x08) {
+                        for (i = 0; i < 4; i++) {
+                                Stream (controller, ((reg - 0x08) / 4) * 4 + i)->Flags &= ~(uint8_t) ((value >> FlagShift[i]) & 0x3D);
+                        }
+                }
+
+                return;
+        }
+
+        if ((reg - 0x10) / 0x18 >= DMA_STREAMS) {
+                return;
+        }
+
+        s = Stream (controller, (reg - 0x10) / 0x18);
+
+        switch ((reg - 0x10) % 0x18) {
+                case 0x00:
+                        if (s->Cr & DMA_SxCR_EN) {
+                                /*!< Only EN and the interrupt enables while running. Disabling by software
+                                     raises TC */
+                                s->Cr = (s->Cr & ~CR_IE_MASK) | (value & CR_IE_MASK);
+
+                                if (!(value & DMA_SxCR_EN)) {
+                                        s->Flags |= FLAG_TC;
+                                        Disable (s);
+                                }
+                        }
+                        else {
+                                s->Cr = value & ~DMA_SxCR_EN;
+
+                                if (value & DMA_SxCR_EN) {
+                                        Enable (s);
+                                }
+                        }
+
+                        break;
+
+                case 0x04:
+                        if (!(s->Cr & DMA_SxCR_EN)) {
+                                s->Ndtr = value & 0xFFFF;
+                        }
+
+                        break;
+
+                case 0x08:
+                        if (!(s->Cr & DMA_SxCR_EN)) {
+                                s->Par = value;
+                        }
+
+                        break;
+
+                case 0x0C:
+                case 0x10:
+                        if (s->Cr & DMA_SxCR_EN) {
+                                /*!< Only the target not in use can change, in double buffer mode */
+                                if (!(s->Cr & DMA_SxCR_DBM)) {
+                                        break;
+                                }
+
+                                if (((s->Cr & DMA_SxCR_CT) != 0) == (((reg - 0x10) % 0x18) == 0x10)) {
+                                        s->Flags |= FLAG_TE;
+                                        Disable (s);
+                                        break;
+                                }
+                        }
+
+                        if (((reg - 0x10) % 0x18) == 0x0C) {
+                                s->M0ar = value;
+                        }
+                        else {
+                                s->M1ar = value;
+                        }
+
+                        break;
+
+                default:
+                        s->Fcr = value & (DMA_SxFCR_FEIE | DMA_SxFCR_DMDIS | DMA_SxFCR_FTH);
+                        break;
+        }
+}
+
+void Sim_DmaInit (void)
+{
+        uint8_t c, n;
+
+        memset (Streams, 0, sizeof (Streams));
+        Sim_MapRegion (DMA_PAGE, DmaRead, DmaWrite, SIM_COST_PERIPH);
+
+        for (c = 0; c < 2; c++) {
+                for (n = 0; n < DMA_STREAMS; n++) {
+                        Streams[c][n].Fcr = DMA_SxFCR_DMDIS | DMA_SxFCR_FTH_0;
+                        Sim_IrqLine (StreamIrq[c][n], LineTable[c][n]);
+                }
+        }
+}
@@ -0,0 +1,228 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <string.h>
+#include "stm32f4xx.h"
+#include "sim_device.h"
+
+/*
+ * GPIOA to GPIOD, SYSCFG (EXTI routing) and EXTI. Pins driven by a model
+ * (Sim_GpioSetInput) raise the EXTI edges, the output pins are watched for the
+ * models (SPI chip select).
+ */
+
+#define GPIO_PAGE                     0x40020000
+#define GPIO_PORT_SIZE                0x400
+#define GPIO_PORTS                    4
+#define EXTI_PAGE                     0x40013000
+#define SYSCFG_OFFSET                 0x800
+#define EXTI_OFFSET                   0xC00
+#define PORT_C                        2
+
+typedef struct {
+        uint32_t Registers[GPIO_PORT_SIZE / 4];
+        uint16_t Input;
+        void (*Watch[16]) (uint8_t level);
+} SimPort;
+
+static SimPort Ports[GPIO_PORTS];
+static uint32_t ExtiCr[4];
+static uint32_t Imr, Emr, Rtsr, Ftsr, Pr;
+
+/*****************************************************************************/
+
+static uint16_t PinLevels (const SimPort *port)
+{
+        uint16_t levels = port->Input;
+        uint32_t moder = port->Registers[0x00 / 4];
+        uint32_t odr = port->Registers[0x14 / 4];
+        uint8_t pin;
+
+        for (pin = 0; pin < 16; pin++) {
+                if (((moder >> (pin * 2)) & 0x03) == 0x01) {
+                        levels = (uint16_t) ((levels & ~(1U << pin)) | (odr & (1U << pin)));
+                }
+        }
+
+        return (levels);
+}
+
+static void SetOutput (SimPort *port, uint32_t odr)
+{
+        uint32_t changed = (port->Registers[0x14 / 4] ^ odr) & 0xFFFF;
+        uint8_t pin;
+
+        port->Registers[0x14 / 4] = odr & 0xFFFF;
+
+        for (pin = 0; pin < 16; pin++) {
+                if ((changed & (1U << pin)) && port->Watch[pin]) {
+                        port->Watch[pin] ((odr >> pin) & 1);
+                }
+        }
+}
+
+static uint32_t GpioRead (uint32_t offset, uint8_t pop)
+{
+        SimPort *port = &Ports[offset / GPIO_PORT_SIZE];
+        uint32_t reg = offset % GPIO_PORT_SIZE;
+
+        if (reg == 0x10) {
+                if (pop && (port == &Ports[PORT_C])) {
+                        SimStats.BusyReads++;
+                }
+
+                return (PinLevels (port));
+        }
+
+        if (reg == 0x18) {
+                return (0);
+        }
+
+        return (port->Registers[reg / 4]);
+}
+
+static void GpioWrite (uint32_t offset, uint32_t value)
+{
+        SimPort *port = &Ports[offset / GPIO_PORT_SIZE];
+        uint32_t reg = offset % GPIO_PORT_SIZE;
+
+        switch (reg) {
+                case 0x10:
+                        break;
+
+                case 0x14:
+                        SetOutput (port, value);
+                        break;
+
+                case 0x18:
+                        SetOutput (port, (port->Registers[0x14 / 4] | (value & 0xFFFF)) & ~(value >> 16));
+                        break;
+
+                default:
+                        port->Registers[reg / 4] = value;
+                        break;
+        }
+}
+
+/**
+ * @brief  Drives an input pin from a model, with the EXTI edge detection.
+ */
+void Sim_GpioSetInput (uint8_t port, uint8_t pin, uint8_t level)
+{
+        uint16_t before = Ports[port].Input;
+        uint32_t line = 1U << pin;
+
+        Ports[port].Input = (uint16_t) ((level) ? (before | line) : (before & ~line));
+
+        if ((before ^ Ports[port].Input) == 0) {
+                return;
+        }
+
+        if (((ExtiCr[pin / 4] >> ((pin % 4) * 4)) & 0x0F) != port) {
+                return;
+        }
+
+        if ((level && (Rtsr & line)) || (!level && (Ftsr & line))) {
+                Pr |= line;
+        }
+}
+
+uint8_t Sim_GpioGetOutput (uint8_t port, uint8_t pin)
+{
+        return ((Ports[port].Registers[0x14 / 4] >> pin) & 1);
+}
+
+void Sim_GpioWatch (uint8_t port, uint8_t pin, void (*changed) (uint8_t level))
+{
+        Ports[port].Watch[pin] = changed;
+}
+
+/*****************************************************************************/
+
+static uint32_t ExtiRead (uint32_t offset, uint8_t pop)
+{
+        if ((offset >= SYSCFG_OFFSET + 0x08) && (offset < SYSCFG_OFFSET + 0x18)) {
+                return (ExtiCr[(offset - SYSCFG_OFFSET - 0x08) / 4]);
+        }
+
+        switch (offset) {
+                case EXTI_OFFSET + 0x00:
+                        return (Imr);
+
+                case EXTI_OFFSET + 0x04:
+                        return (Emr);
+
+                case EXTI_OFFSET + 0x08:
+                        return (Rtsr);
+
+                case EXTI_OFFSET + 0x0C:
+                        return (Ftsr);
+
+                case EXTI_OFFSET + 0x14:
+                        return (Pr);
+
+                default:
+                        return (0);
+        }
+}
+
+static void ExtiWrite (uint32_t offset, uint32_t value)
+{
+        if ((offset >= SYSCFG_OFFSET + 0x08) && (offset < SYSCFG_OFFSET + 0x18)) {
+                ExtiCr[(offset - SYSCFG_OFFSET - 0x08) / 4] = value & 0xFFFF;
+                return;
+        }
+
+        switch (offset) {
+                case EXTI_OFFSET + 0x00:
+                        Imr = value;
+                        break;
+
+                case EXTI_OFFSET + 0x04:
+                        Emr = value;
+                        break;
+
+                case EXTI_OFFSET + 0x08:
+                        Rtsr = value;
+                        break;
+
+                case EXTI_OFFSET + 0x0C:
+                        Ftsr = value;
+                        break;
+
+                case EXTI_OFFSET + 0x10:
+                        Pr |= value;
+                        break;
+
+                case EXTI_OFFSET + 0x14:
+                        Pr &= ~value;
+                        break;
+
+                default:
+                        break;
+        }
+}
+
+static uint8_t Exti9_5Line (void)
+{
+        return ((Pr & Imr & 0x03E0) != 0);
+}
+
+static uint8_t Exti15_10Line (void)
+{
+        return ((Pr & Imr & 0xFC00) != 0);
+}
+
+void Sim_GpioInit (void)
+{
+        memset (Ports, 0, sizeof (Ports));
+        Sim_MapRegion (GPIO_PAGE, GpioRead, GpioWrite, SIM_COST_PERIPH);
+        Sim_MapRegion (EXTI_PAGE, ExtiRead, ExtiWrite, SIM_COST_PERIPH);
+        Sim_IrqLine (EXTI9_5_IRQn, Exti9_5Line);
+        Sim_IrqLine (EXTI15_10_IRQn, Exti15_10Line);
+}
@@ -0,0 +1,66 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sim.h"
+
+/*
+ * Card images : a file mapped shared (the data survives the run and can be
+ * inspected, or prepared by mkfs), or anonymous memory. Grown to the card size,
+ * never shrunk.
+ */
+
+static size_t ImageSize (uint32_t blocks)
+{
+        return ((size_t) blocks * 512);
+}
+
+uint8_t *Sim_ImageOpen (const char *path, uint32_t blocks)
+{
+        struct stat st;
+        void *image;
+        int fd;
+
+        if (path == NULL) {
+                image = mmap (NULL, ImageSize (blocks), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+                if (image == MAP_FAILED) {
+                        Sim_Fatal ("can not allocate a %u block image", blocks);
+                }
+
+                return (image);
+        }
+
+        fd = open (path, O_RDWR | O_CREAT, 0644);
+
+        if ((fd < 0) || (fstat (fd, &st) != 0)) {
+                Sim_Fatal ("can not open %s", path);
+        }
+
+        if (((size_t) st.st_size < ImageSize (blocks)) && (ftruncate (fd, (off_t) ImageSize (blocks)) != 0)) {
+                Sim_Fatal ("can not grow %s", path);
+        }
+
+        image = mmap (NULL, ImageSize (blocks), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close (fd);
+
+        if (image == MAP_FAILED) {
+                Sim_Fatal ("can not map %s", path);
+        }
+
+        return (image);
+}
+
+void Sim_ImageClose (uint8_t *image, uint32_t blocks)
+{
+        msync (image, ImageSize (blocks), MS_SYNC);
+        munmap (image, ImageSize (blocks));
+}
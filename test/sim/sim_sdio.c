@@ -0,0 +1,1456 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <string.h>
+#include "stm32f4xx.h"
+#include "sim_device.h"
+
+/*
+ * SDIO and the SD card behind it.
+ *
+ * The CPSM sends a command and sets the response flags when the response (or its
+ * timeout) is over on the CMD line. The DPSM follows RM0090 : Wait_R / Receive
+ * for reads, Wait_S / Send / Busy for writes, DATAEND only after the card ends the
+ * busy of the last block, DTIMEOUT from the data timer in Wait_R and Busy. The 32
+ * word FIFO is fed and drained by DMA2 Stream3 one word per bus word time, or by
+ * the CPU through SDIO->FIFO.
+ *
+ * The card runs the SD state machine (idle ... tran, data, rcv, prg). Reads give
+ * the first block ReadLatencyUs after the command. A CMD25 block makes the card
+ * busy BlockBusyUs, every CacheBlocks blocks it programs its cache, CMD12 and
+ * CMD24 program what is left. D0 (PC8) is low while the card is busy.
+ */
+
+#define SDIO_PAGE                     0x40012000
+#define SDIO_OFFSET                   0x0C00
+#define SDIOCLK                       48000000
+#define FIFO_WORDS                    32
+#define DMA_CONTROLLER                2
+#define DMA_STREAM                    3
+#define PORT_C                        2
+#define D0_PIN                        8
+#define BLOCK_SIZE                    512
+#define FAULTS_MAX                    8
+
+/* Register offsets in the page */
+#define REG_POWER                     (SDIO_OFFSET + 0x00)
+#define REG_CLKCR                     (SDIO_OFFSET + 0x04)
+#define REG_ARG                       (SDIO_OFFSET + 0x08)
+#define REG_CMD                       (SDIO_OFFSET + 0x0C)
+#define REG_RESPCMD                   (SDIO_OFFSET + 0x10)
+#define REG_RESP1                     (SDIO_OFFSET + 0x14)
+#define REG_RESP4                     (SDIO_OFFSET + 0x20)
+#define REG_DTIMER                    (SDIO_OFFSET + 0x24)
+#define REG_DLEN                      (SDIO_OFFSET + 0x28)
+#define REG_DCTRL                     (SDIO_OFFSET + 0x2C)
+#define REG_DCOUNT                    (SDIO_OFFSET + 0x30)
+#define REG_STA                       (SDIO_OFFSET + 0x34)
+#define REG_ICR                       (SDIO_OFFSET + 0x38)
+#define REG_MASK                      (SDIO_OFFSET + 0x3C)
+#define REG_FIFOCNT                   (SDIO_OFFSET + 0x48)
+#define REG_FIFO                      (SDIO_OFFSET + 0x80)
+#define REG_FIFO_END                  (SDIO_OFFSET + 0xC0)
+
+#define STA_STATIC                    0x00C007FF
+
+/* Bus timing, in SDIO_CK periods */
+#define CLOCKS_COMMAND                48
+#define CLOCKS_NCR                    8
+#define CLOCKS_SHORT                  48
+#define CLOCKS_LONG                   136
+#define CLOCKS_NO_RESPONSE            64
+#define CLOCKS_BLOCK_TAIL             17 /*!< CRC16 and end bit */
+#define CLOCKS_CRC_STATUS             9 /*!< Nwr, CRC status token */
+#define CLOCKS_START                  2
+
+/* Card status (R1) */
+#define R1_OUT_OF_RANGE               0x80000000
+#define R1_ILLEGAL_COMMAND            0x00400000
+#define R1_READY_FOR_DATA             0x00000100
+#define R1_APP_CMD                    0x00000020
+#define OCR_BUSY                      0x80000000
+#define OCR_CCS                       0x40000000
+#define OCR_VOLTAGE                   0x00FF8000
+
+typedef enum { CARD_IDLE = 0, CARD_READY, CARD_IDENT, CARD_STBY, CARD_TRAN, CARD_DATA, CARD_RCV, CARD_PRG, CARD_DIS, CARD_OFF = 15 } CardState;
+
+typedef enum { RESPONSE_NONE = 0, RESPONSE_SHORT, RESPONSE_LONG, RESPONSE_R3 } ResponseType;
+
+typedef enum { DPSM_IDLE = 0, DPSM_WAIT_R, DPSM_RECEIVE, DPSM_WAIT_S, DPSM_SEND, DPSM_BUSY, DPSM_NO_STATUS } DpsmState;
+
+typedef enum { LINE_IDLE = 0, LINE_READ, LINE_WRITE, LINE_WRITE_STATUS } LineState;
+
+typedef struct {
+        uint32_t Block;
+        uint8_t Data[BLOCK_SIZE];
+} CachedBlock;
+
+typedef struct {
+        uint32_t Match; /*!< Command index or block */
+        uint8_t App;
+        Sim_Fault Fault;
+        uint32_t Count;
+} FaultEntry;
+
+/*
+ * Controller.
+ */
+static uint32_t Power, Clkcr, Arg, Cmd, RespCmd, Resp[4], Dtimer, Dlen, Dctrl, Mask, Sta;
+static uint32_t Dcount;
+static uint32_t Fifo[FIFO_WORDS];
+static uint32_t FifoHead, FifoCount;
+static uint8_t CmdActive;
+static DpsmState Dpsm;
+static uint8_t DpsmTx;
+static uint32_t DpsmBlockBytes;
+static uint32_t DpsmBlockDone; /*!< Bytes of the current block */
+static uint32_t TxRequested; /*!< Words the DMA gave for this transfer */
+static LineState Line;
+static uint64_t LineStart;
+
+static struct {
+        uint32_t Flags;
+        uint32_t RespCmd;
+        uint32_t Resp[4];
+} Pending;
+
+/*
+ * Card.
+ */
+static Sim_CardConfig Config;
+static uint8_t *Image;
+static uint8_t Inserted;
+static CardState State;
+static uint8_t AppCmd;
+static uint32_t Rca;
+static uint32_t ErrorBits;
+static uint32_t InitCount;
+static uint8_t CardWide;
+static uint8_t CardHighSpeed;
+static uint32_t EraseStart, EraseEnd;
+static uint8_t Busy;
+static uint64_t BusyStart;
+static uint8_t BusyCommit; /*!< Programs the cache when the busy ends */
+static uint32_t BusyErase; /*!< Erases this many blocks from EraseStart when the busy ends */
+static CachedBlock Cache[SIM_CARD_CACHE_MAX];
+static uint32_t CacheCount;
+static uint32_t Received;
+static uint32_t CutAfter;
+static FaultEntry CommandFaults[FAULTS_MAX];
+static FaultEntry BlockFaults[FAULTS_MAX];
+
+static struct {
+        uint8_t FromImage;
+        uint8_t Multi;
+        uint32_t Block;
+        uint32_t Word;
+        uint32_t Words;
+        uint8_t Crc; /*!< CRC error on this block */
+        uint8_t Buffer[64];
+} Send;
+
+static struct {
+        uint8_t Active;
+        uint8_t Multi;
+        uint32_t Block;
+        uint32_t Word;
+        uint8_t Data[BLOCK_SIZE];
+} Recv;
+
+static void HostBusyEnd (void);
+
+/*****************************************************************************/
+
+static uint32_t BusHz (void)
+{
+        if (Clkcr & SDIO_CLKCR_BYPASS) {
+                return (SDIOCLK);
+        }
+
+        return (SDIOCLK / ((Clkcr & SDIO_CLKCR_CLKDIV) + 2));
+}
+
+static uint64_t Clocks (uint32_t n)
+{
+        return ((uint64_t) n * SIM_HZ / BusHz ());
+}
+
+static uint32_t HostWidth (void)
+{
+        return ((Clkcr & SDIO_CLKCR_WIDBUS_0) ? 4 : ((Clkcr & SDIO_CLKCR_WIDBUS_1) ? 8 : 1));
+}
+
+static uint32_t WordClocks (void)
+{
+        return (32 / HostWidth ());
+}
+
+/**
+ * @brief  Data is garbled when the host and the card do not agree on the bus :
+ *         width, or a clock above 25 MHz without the high speed switch.
+ */
+static uint8_t BusMismatch (void)
+{
+        return ((HostWidth () != ((CardWide) ? 4 : 1)) || ((BusHz () > 25000000) && !CardHighSpeed));
+}
+
+static Sim_Fault TakeFault (FaultEntry *table, uint32_t match, uint8_t app)
+{
+        uint32_t i;
+
+        for (i = 0; i < FAULTS_MAX; i++) {
+                if (table[i].Count && (table[i].Match == match) && (table[i].App == app)) {
+                        table[i].Count--;
+                        return (table[i].Fault);
+                }
+        }
+
+        return (SIM_FAULT_NONE);
+}
+
+static void AddFault (FaultEntry *table, uint32_t match, uint8_t app, Sim_Fault fault, uint32_t count)
+{
+        uint32_t i;
+
+        for (i = 0; i < FAULTS_MAX; i++) {
+                if (table[i].Count == 0) {
+                        table[i].Match = match;
+                        table[i].App = app;
+                        table[i].Fault = fault;
+                        table[i].Count = count;
+                        return;
+                }
+        }
+
+        Sim_Fatal ("too many faults");
+}
+
+/*****************************************************************************/
+/* FIFO                                                                      */
+/*****************************************************************************/
+
+static void FifoPush (uint32_t word)
+{
+        Fifo[(FifoHead + FifoCount) % FIFO_WORDS] = word;
+        FifoCount++;
+}
+
+static uint32_t FifoPop (void)
+{
+        uint32_t word;
+
+        if (FifoCount == 0) {
+                return (0);
+        }
+
+        word = Fifo[FifoHead];
+        FifoHead = (FifoHead + 1) % FIFO_WORDS;
+        FifoCount--;
+        return (word);
+}
+
+static uint8_t DmaRequests (uint8_t toMemory)
+{
+        return ((Dctrl & SDIO_DCTRL_DMAEN) && Sim_DmaEnabled (DMA_CONTROLLER, DMA_STREAM, toMemory));
+}
+
+/**
+ * @brief  Receive : the DMA empties the FIFO.
+ */
+static void RxDrain (void)
+{
+        while (FifoCount && !DpsmTx && DmaRequests (1)) {
+                Sim_DmaToMemory (DMA_CONTROLLER, DMA_STREAM, FifoPop ());
+                SimStats.DmaWords++;
+        }
+}
+
+/**
+ * @brief  Transmit : the DMA fills the FIFO up to the transfer length. The last
+ *         word ends a peripheral flow controlled stream.
+ */
+static void TxFill (void)
+{
+        uint32_t word;
+
+        while ((Dpsm >= DPSM_WAIT_S) && (FifoCount < FIFO_WORDS) && (TxRequested < (Dlen + 3) / 4) && DmaRequests (0)) {
+                if (!Sim_DmaFromMemory (DMA_CONTROLLER, DMA_STREAM, &word)) {
+                        break;
+                }
+
+                FifoPush (word);
+                TxRequested++;
+                SimStats.DmaWords++;
+
+                if (TxRequested == (Dlen + 3) / 4) {
+                        Sim_DmaPeripheralEnd (DMA_CONTROLLER, DMA_STREAM);
+                }
+        }
+}
+
+/*****************************************************************************/
+/* Card                                                                      */
+/*****************************************************************************/
+
+static void SetD0 (uint8_t level)
+{
+        Sim_GpioSetInput (PORT_C, D0_PIN, level);
+}
+
+static uint32_t Capacity (void)
+{
+        return (Config.Blocks);
+}
+
+static void ProgramCache (void)
+{
+        uint32_t i;
+
+        for (i = 0; i < CacheCount; i++) {
+                memcpy (Image + (size_t) Cache[i].Block * BLOCK_SIZE, Cache[i].Data, BLOCK_SIZE);
+                SimStats.BlocksProgrammed++;
+        }
+
+        CacheCount = 0;
+}
+
+static void CardBusy (uint32_t us, uint8_t commit)
+{
+        uint64_t start = (Busy) ? Sim_EventTime (SIM_EVENT_CARD_BUSY) : Sim_Now ();
+
+        if (!Busy) {
+                BusyStart = Sim_Now ();
+        }
+
+        Busy = 1;
+        BusyCommit |= commit;
+        SetD0 (0);
+        Sim_Schedule (SIM_EVENT_CARD_BUSY, start + SIM_US (us));
+}
+
+static void CardBusyEnd (void)
+{
+        Busy = 0;
+        SimStats.CardBusyCycles += Sim_Now () - BusyStart;
+
+        if (BusyCommit) {
+                ProgramCache ();
+                BusyCommit = 0;
+        }
+
+        if (BusyErase) {
+                memset (Image + (size_t) EraseStart * BLOCK_SIZE, 0, (size_t) BusyErase * BLOCK_SIZE);
+                BusyErase = 0;
+        }
+
+        if (State == CARD_PRG) {
+                State = CARD_TRAN;
+        }
+
+        SetD0 (1);
+        HostBusyEnd ();
+}
+
+static void StopSending (void)
+{
+        if (Line == LINE_READ) {
+                Line = LINE_IDLE;
+                Sim_Cancel (SIM_EVENT_SDIO_DATA);
+        }
+}
+
+static void CardReset (void)
+{
+        StopSending ();
+        State = CARD_IDLE;
+        AppCmd = 0;
+        Rca = 0;
+        ErrorBits = 0;
+        InitCount = 0;
+        CardWide = 0;
+        CardHighSpeed = 0;
+        Recv.Active = 0;
+        CacheCount = 0;
+        BusyCommit = 0;
+        BusyErase = 0;
+
+        if (Busy) {
+                Busy = 0;
+                Sim_Cancel (SIM_EVENT_CARD_BUSY);
+        }
+
+        SetD0 (1);
+}
+
+static uint32_t Status (CardState state)
+{
+        uint32_t status = ErrorBits | ((uint32_t) state << 9);
+
+        if (!Busy) {
+                status |= R1_READY_FOR_DATA;
+        }
+
+        if (AppCmd) {
+                status |= R1_APP_CMD;
+        }
+
+        ErrorBits = 0;
+        return (status);
+}
+
+/**
+ * @brief  Card side start of a data block towards the host, after delayUs.
+ */
+static void SendStart (uint64_t from, uint32_t delayUs)
+{
+        Sim_Fault fault;
+
+        Send.Word = 0;
+        Send.Crc = 0;
+        Line = LINE_READ;
+        LineStart = from + SIM_US (delayUs) + Clocks (CLOCKS_START);
+
+        if (Send.FromImage) {
+                fault = TakeFault (BlockFaults, Send.Block, 0);
+
+                if (fault == SIM_FAULT_TIMEOUT) {
+                        /*!< The block never comes, the card hangs in the data state */
+                        Line = LINE_IDLE;
+                        return;
+                }
+
+                Send.Crc = (fault == SIM_FAULT_CRC);
+        }
+
+        Sim_Schedule (SIM_EVENT_SDIO_DATA, LineStart + Clocks (WordClocks ()));
+}
+
+static void SendBuffer (uint64_t from, uint32_t bytes)
+{
+        Send.FromImage = 0;
+        Send.Multi = 0;
+        Send.Words = bytes / 4;
+        State = CARD_DATA;
+        SendStart (from, 0);
+}
+
+static uint32_t CardBlock (uint32_t arg)
+{
+        return ((Config.HighCapacity) ? arg : arg / BLOCK_SIZE);
+}
+
+static void CsdFill (uint8_t *csd)
+{
+        uint32_t size;
+
+        memset (csd, 0, 16);
+        csd[1] = 0x0E;
+        csd[3] = (Config.HighSpeed) ? 0x5A : 0x32;
+        csd[4] = 0x5B;
+        csd[5] = 0x59;
+
+        if (Config.HighCapacity) {
+                size = Config.Blocks / 1024 - 1;
+                csd[0] = 0x40;
+                csd[7] = (uint8_t) ((size >> 16) & 0x3F);
+                csd[8] = (uint8_t) (size >> 8);
+                csd[9] = (uint8_t) size;
+                csd[10] = 0x7F;
+        }
+        else {
+                /*!< C_SIZE_MULT 7 : 512 blocks per C_SIZE unit */
+                size = Config.Blocks / 512 - 1;
+                csd[6] = (uint8_t) ((size >> 10) & 0x03);
+                csd[7] = (uint8_t) (size >> 2);
+                csd[8] = (uint8_t) ((size & 0x03) << 6);
+                csd[9] = 0x03;
+                csd[10] = 0xFF;
+        }
+
+        csd[11] = 0x80;
+        csd[12] = 0x0A;
+        csd[13] = 0x40;
+        csd[15] = 0x01;
+}
+
+static void LongResponse (const uint8_t *bytes, uint32_t *resp)
+{
+        uint32_t i;
+
+        for (i = 0; i < 4; i++) {
+                resp[i] = ((uint32_t) bytes[i * 4] << 24) | ((uint32_t) bytes[i * 4 + 1] << 16) | ((uint32_t) bytes[i * 4 + 2] << 8) | bytes[i * 4 + 3];
+        }
+}
+
+static uint8_t Illegal (void)
+{
+        ErrorBits |= R1_ILLEGAL_COMMAND;
+        return (RESPONSE_NONE);
+}
+
+/**
+ * @brief  Application specific commands. Anything else is taken as a CMD.
+ * @retval RESPONSE_*, or 0xFF if cmd is not an ACMD.
+ */
+static uint8_t CardAppCommand (uint8_t cmd, uint32_t arg, uint64_t end, uint32_t *resp)
+{
+        CardState before = State;
+
+        switch (cmd) {
+                case 6:
+                        if (State != CARD_TRAN) {
+                                return (Illegal ());
+                        }
+
+                        CardWide = ((arg & 0x03) == 2);
+                        resp[0] = Status (before);
+                        return (RESPONSE_SHORT);
+
+                case 13:
+                        if (State != CARD_TRAN) {
+                                return (Illegal ());
+                        }
+
+                        memset (Send.Buffer, 0, 64);
+                        Send.Buffer[0] = (CardWide) ? 0x80 : 0x00;
+                        Send.Buffer[8] = 0x04;
+                        Send.Buffer[9] = 0x01;
+                        Send.Buffer[10] = (uint8_t) (Config.AuSize << 4);
+                        Send.Buffer[12] = 0x08;
+                        Send.Buffer[13] = 0x09;
+                        resp[0] = Status (before);
+                        SendBuffer (end, 64);
+                        return (RESPONSE_SHORT);
+
+                case 23:
+                        if (State != CARD_TRAN) {
+                                return (Illegal ());
+                        }
+
+                        resp[0] = Status (before);
+                        return (RESPONSE_SHORT);
+
+                case 41:
+                        if ((State != CARD_IDLE) && (State != CARD_READY)) {
+                                return (Illegal ());
+                        }
+
+                        resp[0] = OCR_VOLTAGE;
+
+                        if ((InitCount++ >= Config.InitPolls) && (!Config.HighCapacity || (arg & OCR_CCS))) {
+                                resp[0] |= OCR_BUSY | ((Config.HighCapacity) ? OCR_CCS : 0);
+                                State = CARD_READY;
+                        }
+
+                        return (RESPONSE_R3);
+
+                case 51:
+                        if (State != CARD_TRAN) {
+                                return (Illegal ());
+                        }
+
+                        memset (Send.Buffer, 0, 8);
+                        Send.Buffer[0] = 0x02;
+                        Send.Buffer[1] = 0x35;
+                        Send.Buffer[2] = 0x80;
+                        resp[0] = Status (before);
+                        SendBuffer (end, 8);
+                        return (RESPONSE_SHORT);
+
+                default:
+                        return (0xFF);
+        }
+}
+
+/**
+ * @brief  Runs a command in the card. end is when the response is over.
+ */
+static uint8_t CardCommand (uint8_t cmd, uint32_t arg, uint64_t end, uint32_t *resp)
+{
+        static const uint8_t Cid[16] = { 0x03, 'S', 'D', 'S', 'I', 'M', 'U', 'L', 0x10, 0x12, 0x34, 0x56, 0x78, 0x01, 0x5A, 0x01 };
+        CardState before = State;
+        uint8_t csd[16];
+        uint8_t app = AppCmd;
+        uint8_t response;
+        uint32_t block;
+
+        if (State == CARD_OFF) {
+                return (RESPONSE_NONE);
+        }
+
+        AppCmd = 0;
+
+        if (app && (cmd != 55)) {
+                AppCmd = 1;
+                response = CardAppCommand (cmd, arg, end, resp);
+                AppCmd = 0;
+
+                if (response != 0xFF) {
+                        return (response);
+                }
+        }
+
+        switch (cmd) {
+                case 0:
+                        CardReset ();
+                        return (RESPONSE_NONE);
+
+                case 2:
+                        if (State != CARD_READY) {
+                                return (Illegal ());
+                        }
+
+                        LongResponse (Cid, resp);
+                        State = CARD_IDENT;
+                        return (RESPONSE_LONG);
+
+                case 3:
+                        if ((State != CARD_IDENT) && (State != CARD_STBY)) {
+                                return (Illegal ());
+                        }
+
+                        Rca = 0xB368;
+                        State = CARD_STBY;
+                        resp[0] = (Rca << 16) | ((uint32_t) before << 9) | R1_READY_FOR_DATA;
+                        return (RESPONSE_SHORT);
+
+                case 6:
+                        if (State != CARD_TRAN) {
+                                return (Illegal ());
+                        }
+
+                        /*!< Function group 1 : 0 default, 1 high speed */
+                        memset (Send.Buffer, 0, 64);
+                        Send.Buffer[1] = 0x64;
+                        Send.Buffer[13] = (Config.HighSpeed) ? 0x03 : 0x01;
+                        Send.Buffer[16] = ((arg & 0x0F) == 1) ? ((Config.HighSpeed) ? 0x01 : 0x0F) : 0x00;
+
+                        if ((arg & 0x80000000) && ((arg & 0x0F) == 1) && Config.HighSpeed) {
+                                CardHighSpeed = 1;
+                        }
+
+                        resp[0] = Status (before);
+                        SendBuffer (end, 64);
+                        return (RESPONSE_SHORT);
+
+                case 7:
+                        if ((arg >> 16) == Rca) {
+                                if (State != CARD_STBY) {
+                                        return (Illegal ());
+                                }
+
+                                State = CARD_TRAN;
+                        }
+                        else if (State == CARD_TRAN) {
+                                State = CARD_STBY;
+                                return (RESPONSE_NONE);
+                        }
+
+                        resp[0] = Status (before);
+                        return (RESPONSE_SHORT);
+
+                case 8:
+                        if (State != CARD_IDLE) {
+                                return (Illegal ());
+                        }
+
+                        resp[0] = arg & 0xFFF;
+                        return (RESPONSE_SHORT);
+
+                case 9:
+                        if ((State != CARD_STBY) || ((arg >> 16) != Rca)) {
+                                return (Illegal ());
+                        }
+
+                        CsdFill (csd);
+                        LongResponse (csd, resp);
+                        return (RESPONSE_LONG);
+
+                case 12:
+                        if (State == CARD_DATA) {
+                                StopSending ();
+                                State = CARD_TRAN;
+                        }
+                        else if (State == CARD_RCV) {
+                                Recv.Active = 0;
+                                State = CARD_PRG;
+                                CardBusy (Config.ProgramUs + CacheCount * Config.ProgramBlockUs, 1);
+                        }
+                        else {
+                                return (Illegal ());
+                        }
+
+                        resp[0] = Status (before);
+                        return (RESPONSE_SHORT);
+
+                case 13:
+                        if ((State < CARD_STBY) || ((arg >> 16) != Rca)) {
+                                return (Illegal ());
+                        }
+
+                        resp[0] = Status (before);
+                        return (RESPONSE_SHORT);
+
+                case 16:
+                        if (State != CARD_TRAN) {
+                                return (Illegal ());
+                        }
+
+                        resp[0] = Status (before);
+                        return (RESPONSE_SHORT);
+
+                case 17:
+                case 18:
+                        if (State != CARD_TRAN) {
+                                return (Illegal ());
+                        }
+
+                        block = CardBlock (arg);
+
+                        if (block >= Capacity ()) {
+                                ErrorBits |= R1_OUT_OF_RANGE;
+                                resp[0] = Status (before);
+                                return (RESPONSE_SHORT);
+                        }
+
+                        resp[0] = Status (before);
+                        State = CARD_DATA;
+                        Send.FromImage = 1;
+                        Send.Multi = (cmd == 18);
+                        Send.Block = block;
+                        Send.Words = BLOCK_SIZE / 4;
+                        SendStart (end, Config.ReadLatencyUs);
+                        return (RESPONSE_SHORT);
+
+                case 24:
+                case 25:
+                        if (State != CARD_TRAN) {
+                                return (Illegal ());
+                        }
+
+                        block = CardBlock (arg);
+
+                        if (block >= Capacity ()) {
+                                ErrorBits |= R1_OUT_OF_RANGE;
+                                resp[0] = Status (before);
+                                return (RESPONSE_SHORT);
+                        }
+
+                        resp[0] = Status (before);
+                        State = CARD_RCV;
+                        Recv.Multi = (cmd == 25);
+                        Recv.Block = block;
+                        return (RESPONSE_SHORT);
+
+                case 32:
+                case 33:
+                        if (State != CARD_TRAN) {
+                                return (Illegal ());
+                        }
+
+                        if (cmd == 32) {
+                                EraseStart = CardBlock (arg);
+                        }
+                        else {
+                                EraseEnd = CardBlock (arg);
+                        }
+
+                        resp[0] = Status (before);
+                        return (RESPONSE_SHORT);
+
+                case 38:
+                        if ((State != CARD_TRAN) || (EraseEnd < EraseStart) || (EraseEnd >= Capacity ())) {
+                                return (Illegal ());
+                        }
+
+                        resp[0] = Status (before);
+                        State = CARD_PRG;
+                        BusyErase = EraseEnd - EraseStart + 1;
+                        CardBusy (BusyErase * Config.EraseBlockUs, 0);
+                        return (RESPONSE_SHORT);
+
+                case 55:
+                        if ((State != CARD_IDLE) && ((State < CARD_STBY) || ((arg >> 16) != Rca))) {
+                                return (Illegal ());
+                        }
+
+                        AppCmd = 1;
+                        resp[0] = Status (before);
+                        return (RESPONSE_SHORT);
+
+                default:
+                        return (Illegal ());
+        }
+}
+
+/**
+ * @brief  A whole block reached the card.
+ * @retval 0 : no CRC status (the card was not receiving), 1 : accepted, 2 : CRC
+ *         error.
+ */
+static uint8_t CardBlockReceived (void)
+{
+        Sim_Fault fault;
+
+        if (!Recv.Active || (State != CARD_RCV)) {
+                return (0);
+        }
+
+        fault = TakeFault (BlockFaults, Recv.Block, 0);
+
+        if (fault == SIM_FAULT_TIMEOUT) {
+                return (0);
+        }
+
+        if ((fault == SIM_FAULT_CRC) || BusMismatch ()) {
+                return (2);
+        }
+
+        Cache[CacheCount].Block = Recv.Block;
+        memcpy (Cache[CacheCount].Data, Recv.Data, BLOCK_SIZE);
+        CacheCount++;
+        Recv.Block++;
+        Received++;
+        SimStats.BlocksWritten++;
+
+        if (!Recv.Multi) {
+                State = CARD_PRG;
+                CardBusy (Config.ProgramUs + CacheCount * Config.ProgramBlockUs, 1);
+        }
+        else if ((CacheCount >= Config.CacheBlocks) || (CacheCount == SIM_CARD_CACHE_MAX) || (Recv.Block >= Capacity ())) {
+                CardBusy (Config.BlockBusyUs + CacheCount * Config.ProgramBlockUs, 1);
+        }
+        else {
+                CardBusy (Config.BlockBusyUs, 0);
+        }
+
+        if (CutAfter && (Received == CutAfter)) {
+                CutAfter = 0;
+                Sim_CardPowerCut ();
+        }
+
+        return (1);
+}
+
+/*****************************************************************************/
+/* DPSM                                                                      */
+/*****************************************************************************/
+
+static void DataTimer (void)
+{
+        Sim_Schedule (SIM_EVENT_SDIO_TIMEOUT, Sim_Now () + Clocks (Dtimer));
+}
+
+static void DpsmStop (uint32_t flag)
+{
+        Sta |= flag;
+        Dpsm = DPSM_IDLE;
+        Sim_Cancel (SIM_EVENT_SDIO_TIMEOUT);
+
+        if ((Line == LINE_WRITE) || (Line == LINE_WRITE_STATUS)) {
+                Line = LINE_IDLE;
+                Recv.Active = 0;
+                Sim_Cancel (SIM_EVENT_SDIO_DATA);
+        }
+}
+
+static void DataEnd (void)
+{
+        Sta |= SDIO_STA_DATAEND;
+        Dpsm = DPSM_IDLE;
+        Sim_Cancel (SIM_EVENT_SDIO_TIMEOUT);
+
+        if (!DpsmTx) {
+                Sim_DmaPeripheralEnd (DMA_CONTROLLER, DMA_STREAM);
+        }
+}
+
+static void TimeoutEvent (void)
+{
+        DpsmStop (SDIO_STA_DTIMEOUT);
+}
+
+/**
+ * @brief  Wait_S : a block goes out as soon as the FIFO has data.
+ */
+static void TxTryStart (void)
+{
+        if ((Dpsm != DPSM_WAIT_S) || (FifoCount == 0) || (Line != LINE_IDLE) || (Dcount == 0)) {
+                return;
+        }
+
+        Dpsm = DPSM_SEND;
+        Line = LINE_WRITE;
+        LineStart = Sim_Now ();
+        DpsmBlockDone = 0;
+        Recv.Active = (State == CARD_RCV);
+        Recv.Word = 0;
+        Sim_Schedule (SIM_EVENT_SDIO_DATA, Sim_Now () + Clocks (CLOCKS_START + WordClocks ()));
+}
+
+static void HostSendWord (void)
+{
+        uint32_t word;
+
+        if (FifoCount == 0) {
+                DpsmStop (SDIO_STA_TXUNDERR);
+                return;
+        }
+
+        word = FifoPop ();
+        TxFill ();
+
+        if (Recv.Active && (Recv.Word < BLOCK_SIZE / 4)) {
+                memcpy (Recv.Data + Recv.Word * 4, &word, 4);
+                Recv.Word++;
+        }
+
+        Dcount = (Dcount > 4) ? Dcount - 4 : 0;
+        DpsmBlockDone += 4;
+
+        if ((DpsmBlockDone < DpsmBlockBytes) && (Dcount > 0)) {
+                Sim_Schedule (SIM_EVENT_SDIO_DATA, Sim_Now () + Clocks (WordClocks ()));
+                return;
+        }
+
+        Line = LINE_WRITE_STATUS;
+        Sim_Schedule (SIM_EVENT_SDIO_DATA, Sim_Now () + Clocks (CLOCKS_BLOCK_TAIL + CLOCKS_CRC_STATUS));
+}
+
+static void HostSendStatus (void)
+{
+        uint8_t status = CardBlockReceived ();
+
+        Line = LINE_IDLE;
+        SimStats.DataBusCycles += Sim_Now () - LineStart;
+
+        if (status == 0) {
+                Dpsm = DPSM_NO_STATUS;
+                DataTimer ();
+                return;
+        }
+
+        if (status == 2) {
+                DpsmStop (SDIO_STA_DCRCFAIL);
+                return;
+        }
+
+        Sta |= SDIO_STA_DBCKEND;
+        Dpsm = DPSM_BUSY;
+        DataTimer ();
+
+        if (!Busy) {
+                HostBusyEnd ();
+        }
+}
+
+/**
+ * @brief  Busy : D0 went high.
+ */
+static void HostBusyEnd (void)
+{
+        if (Dpsm != DPSM_BUSY) {
+                return;
+        }
+
+        Sim_Cancel (SIM_EVENT_SDIO_TIMEOUT);
+
+        if (Dcount == 0) {
+                DataEnd ();
+                return;
+        }
+
+        Dpsm = DPSM_WAIT_S;
+        TxFill ();
+        TxTryStart ();
+}
+
+static void HostReceiveWord (uint32_t word)
+{
+        if ((Dpsm != DPSM_WAIT_R) && (Dpsm != DPSM_RECEIVE)) {
+                return;
+        }
+
+        if (Dpsm == DPSM_WAIT_R) {
+                Sim_Cancel (SIM_EVENT_SDIO_TIMEOUT);
+                Dpsm = DPSM_RECEIVE;
+                DpsmBlockDone = 0;
+        }
+
+        if (FifoCount == FIFO_WORDS) {
+                DpsmStop (SDIO_STA_RXOVERR);
+                return;
+        }
+
+        FifoPush (word);
+        Dcount = (Dcount > 4) ? Dcount - 4 : 0;
+        DpsmBlockDone += 4;
+        RxDrain ();
+}
+
+static void HostReceiveEnd (uint8_t crc)
+{
+        if (Dpsm != DPSM_RECEIVE) {
+                return;
+        }
+
+        if (crc) {
+                DpsmStop (SDIO_STA_DCRCFAIL);
+                return;
+        }
+
+        Sta |= SDIO_STA_DBCKEND;
+
+        if (Dcount == 0) {
+                DataEnd ();
+                return;
+        }
+
+        Dpsm = DPSM_WAIT_R;
+        DataTimer ();
+}
+
+/**
+ * @brief  Card to host : one word, or the end of a block.
+ */
+static void CardSendEvent (void)
+{
+        uint32_t word;
+
+        if (Send.Word < Send.Words) {
+                if (Send.FromImage) {
+                        memcpy (&word, Image + (size_t) Send.Block * BLOCK_SIZE + Send.Word * 4, 4);
+                }
+                else {
+                        memcpy (&word, Send.Buffer + Send.Word * 4, 4);
+                }
+
+                HostReceiveWord (word);
+
+                if (++Send.Word < Send.Words) {
+                        Sim_Schedule (SIM_EVENT_SDIO_DATA, Sim_Now () + Clocks (WordClocks ()));
+                }
+                else {
+                        Sim_Schedule (SIM_EVENT_SDIO_DATA, Sim_Now () + Clocks (CLOCKS_BLOCK_TAIL));
+                }
+
+                return;
+        }
+
+        Line = LINE_IDLE;
+        SimStats.DataBusCycles += Sim_Now () - LineStart;
+        HostReceiveEnd (Send.Crc || BusMismatch ());
+
+        if (!Send.FromImage) {
+                State = CARD_TRAN;
+                return;
+        }
+
+        SimStats.BlocksRead++;
+
+        if (!Send.Multi) {
+                State = CARD_TRAN;
+                return;
+        }
+
+        if (++Send.Block < Capacity ()) {
+                SendStart (Sim_Now (), Config.ReadGapUs);
+        }
+}
+
+static void DataEvent (void)
+{
+        switch (Line) {
+                case LINE_READ:
+                        CardSendEvent ();
+                        break;
+
+                case LINE_WRITE:
+                        HostSendWord ();
+                        break;
+
+                case LINE_WRITE_STATUS:
+                        HostSendStatus ();
+                        break;
+
+                default:
+                        break;
+        }
+}
+
+static void DpsmStart (void)
+{
+        Dcount = Dlen & 0x01FFFFFF;
+        DpsmTx = !(Dctrl & SDIO_DCTRL_DTDIR);
+        DpsmBlockBytes = 1U << ((Dctrl & SDIO_DCTRL_DBLOCKSIZE) >> 4);
+        DpsmBlockDone = 0;
+        FifoHead = 0;
+        FifoCount = 0;
+        TxRequested = 0;
+
+        if (DpsmTx) {
+                Dpsm = DPSM_WAIT_S;
+                TxFill ();
+                TxTryStart ();
+        }
+        else {
+                Dpsm = DPSM_WAIT_R;
+                DataTimer ();
+        }
+}
+
+/**
+ * @brief  The DMA stream got enabled.
+ */
+static void DmaKick (void)
+{
+        if (DpsmTx) {
+                TxFill ();
+                TxTryStart ();
+        }
+        else {
+                RxDrain ();
+        }
+}
+
+/*****************************************************************************/
+/* CPSM                                                                      */
+/*****************************************************************************/
+
+static void CmdEvent (void)
+{
+        CmdActive = 0;
+        Sta |= Pending.Flags;
+        RespCmd = Pending.RespCmd;
+        memcpy (Resp, Pending.Resp, sizeof (Resp));
+}
+
+static void CmdWrite (uint32_t value)
+{
+        uint8_t index = value & SDIO_CMD_CMDINDEX;
+        uint32_t wait = (value & SDIO_CMD_WAITRESP) >> 6;
+        uint32_t resp[4] = { 0, 0, 0, 0 };
+        uint32_t clocks;
+        uint64_t end;
+        uint8_t response = RESPONSE_NONE;
+        Sim_Fault fault = SIM_FAULT_NONE;
+
+        Cmd = value;
+
+        if (!(value & SDIO_CMD_CPSMEN)) {
+                return;
+        }
+
+        if (AppCmd && (index != 55)) {
+                SimStats.AppCommands[index]++;
+        }
+        else {
+                SimStats.Commands[index]++;
+        }
+
+        SimStats.CommandTotal++;
+
+        if (Inserted) {
+                fault = TakeFault (CommandFaults, index, AppCmd && (index != 55));
+        }
+
+        /*!< The card answers when its response is over, the data start from there */
+        clocks = CLOCKS_COMMAND + CLOCKS_NCR + ((wait == 3) ? CLOCKS_LONG : CLOCKS_SHORT);
+        end = Sim_Now () + Clocks (clocks);
+
+        if (Inserted && (fault != SIM_FAULT_TIMEOUT)) {
+                response = CardCommand (index, Arg, end, resp);
+        }
+
+        memset (&Pending, 0, sizeof (Pending));
+
+        if ((wait == 0) || (wait == 2)) {
+                clocks = CLOCKS_COMMAND;
+                Pending.Flags = SDIO_STA_CMDSENT;
+        }
+        else if (response == RESPONSE_NONE) {
+                clocks = CLOCKS_COMMAND + CLOCKS_NO_RESPONSE;
+                Pending.Flags = SDIO_STA_CTIMEOUT;
+        }
+        else {
+                Pending.RespCmd = (response == RESPONSE_SHORT) ? index : 0x3F;
+                memcpy (Pending.Resp, resp, sizeof (resp));
+                Pending.Flags = ((response == RESPONSE_R3) || (fault == SIM_FAULT_CRC)) ? SDIO_STA_CCRCFAIL : SDIO_STA_CMDREND;
+        }
+
+        CmdActive = 1;
+        SimStats.CmdBusCycles += Clocks (clocks);
+        Sim_Schedule (SIM_EVENT_SDIO_CMD, Sim_Now () + Clocks (clocks));
+}
+
+/*****************************************************************************/
+/* Registers                                                                 */
+/*****************************************************************************/
+
+static uint32_t StaValue (void)
+{
+        uint32_t sta = Sta;
+
+        if (CmdActive) {
+                sta |= SDIO_STA_CMDACT;
+        }
+
+        if (Dpsm != DPSM_IDLE) {
+                sta |= (DpsmTx) ? SDIO_STA_TXACT : SDIO_STA_RXACT;
+        }
+
+        if (DpsmTx && (Dpsm != DPSM_IDLE)) {
+                sta |= (FifoCount <= FIFO_WORDS - 8) ? SDIO_STA_TXFIFOHE : 0;
+                sta |= (FifoCount == FIFO_WORDS) ? SDIO_STA_TXFIFOF : 0;
+                sta |= (FifoCount == 0) ? SDIO_STA_TXFIFOE : SDIO_STA_TXDAVL;
+        }
+        else if (!DpsmTx) {
+                sta |= (FifoCount >= 8) ? SDIO_STA_RXFIFOHF : 0;
+                sta |= (FifoCount == FIFO_WORDS) ? SDIO_STA_RXFIFOF : 0;
+                sta |= (FifoCount == 0) ? SDIO_STA_RXFIFOE : SDIO_STA_RXDAVL;
+        }
+
+        return (sta);
+}
+
+static uint32_t SdioRead (uint32_t offset, uint8_t pop)
+{
+        if ((offset >= REG_FIFO) && (offset < REG_FIFO_END)) {
+                return ((pop) ? FifoPop () : Fifo[FifoHead]);
+        }
+
+        if ((offset >= REG_RESP1) && (offset <= REG_RESP4)) {
+                return (Resp[(offset - REG_RESP1) / 4]);
+        }
+
+        switch (offset) {
+                case REG_POWER:
+                        return (Power);
+
+                case REG_CLKCR:
+                        return (Clkcr);
+
+                case REG_ARG:
+                        return (Arg);
+
+                case REG_CMD:
+                        return (Cmd);
+
+                case REG_RESPCMD:
+                        return (RespCmd);
+
+                case REG_DTIMER:
+                        return (Dtimer);
+
+                case REG_DLEN:
+                        return (Dlen);
+
+                case REG_DCTRL:
+                        return (Dctrl);
+
+                case REG_DCOUNT:
+                        return (Dcount);
+
+                case REG_STA:
+                        if (pop) {
+                                SimStats.StaReads++;
+                        }
+
+                        return (StaValue ());
+
+                case REG_MASK:
+                        return (Mask);
+
+                case REG_FIFOCNT:
+                        return ((Dcount + 3) / 4);
+
+                default:
+                        return (0);
+        }
+}
+
+static void SdioWrite (uint32_t offset, uint32_t value)
+{
+        if ((offset >= REG_FIFO) && (offset < REG_FIFO_END)) {
+                if (FifoCount < FIFO_WORDS) {
+                        FifoPush (value);
+                        TxRequested++;
+                        TxTryStart ();
+                }
+
+                return;
+        }
+
+        switch (offset) {
+                case REG_POWER:
+                        Power = value & 0x03;
+                        break;
+
+                case REG_CLKCR:
+                        Clkcr = value & 0x7FFF;
+                        break;
+
+                case REG_ARG:
+                        Arg = value;
+                        break;
+
+                case REG_CMD:
+                        CmdWrite (value & 0x7FFF);
+                        break;
+
+                case REG_DTIMER:
+                        Dtimer = value;
+                        break;
+
+                case REG_DLEN:
+                        Dlen = value & 0x01FFFFFF;
+                        break;
+
+                case REG_DCTRL:
+                        Dctrl = value & 0x0FFF;
+
+                        if (value & SDIO_DCTRL_DTEN) {
+                                DpsmStart ();
+                        }
+
+                        break;
+
+                case REG_ICR:
+                        Sta &= ~(value & STA_STATIC);
+                        break;
+
+                case REG_MASK:
+                        Mask = value & 0x00FFFFFF;
+                        break;
+
+                default:
+                        break;
+        }
+}
+
+static uint8_t SdioLine (void)
+{
+        return ((StaValue () & Mask) != 0);
+}
+
+void Sim_SdioInit (void)
+{
+        Sim_MapRegion (SDIO_PAGE, SdioRead, SdioWrite, SIM_COST_PERIPH);
+        Sim_IrqLine (SDIO_IRQn, SdioLine);
+        Sim_EventSetup (SIM_EVENT_SDIO_CMD, CmdEvent);
+        Sim_EventSetup (SIM_EVENT_SDIO_DATA, DataEvent);
+        Sim_EventSetup (SIM_EVENT_SDIO_TIMEOUT, TimeoutEvent);
+        Sim_EventSetup (SIM_EVENT_CARD_BUSY, CardBusyEnd);
+        Sim_DmaSetKick (DMA_CONTROLLER, DMA_STREAM, DmaKick);
+        SetD0 (1);
+}
+
+/*****************************************************************************/
+/* Test interface                                                            */
+/*****************************************************************************/
+
+void Sim_CardDefaults (Sim_CardConfig *config)
+{
+        memset (config, 0, sizeof (*config));
+        config->Blocks = 64 * 1024;
+        config->HighCapacity = 1;
+        config->HighSpeed = 1;
+        config->AuSize = 9;
+        config->InitPolls = 3;
+        config->ReadLatencyUs = 100;
+        config->ReadGapUs = 5;
+        config->BlockBusyUs = 20;
+        config->ProgramUs = 500;
+        config->ProgramBlockUs = 50;
+        config->CacheBlocks = 16;
+        config->EraseBlockUs = 1;
+        config->ImagePath = NULL;
+}
+
+/**
+ * @brief  Inserts (or replaces) the card. It starts powered, in the idle state.
+ */
+void Sim_CardInsert (const Sim_CardConfig *config)
+{
+        if (Image) {
+                Sim_ImageClose (Image, Config.Blocks);
+        }
+
+        Config = *config;
+
+        if ((Config.CacheBlocks == 0) || (Config.CacheBlocks > SIM_CARD_CACHE_MAX)) {
+                Config.CacheBlocks = SIM_CARD_CACHE_MAX;
+        }
+
+        Image = Sim_ImageOpen (Config.ImagePath, Config.Blocks);
+        Inserted = 1;
+        memset (CommandFaults, 0, sizeof (CommandFaults));
+        memset (BlockFaults, 0, sizeof (BlockFaults));
+        CutAfter = 0;
+        Received = 0;
+        CardReset ();
+}
+
+uint8_t *Sim_CardImage (void)
+{
+        return (Image);
+}
+
+/**
+ * @brief  The next count cmd (app : ACMD) commands fail.
+ */
+void Sim_CardFailCommand (uint8_t cmd, uint8_t app, Sim_Fault fault, uint32_t count)
+{
+        AddFault (CommandFaults, cmd, app, fault, count);
+}
+
+/**
+ * @brief  The next count transfers of block fail.
+ */
+void Sim_CardFailBlock (uint32_t block, Sim_Fault fault, uint32_t count)
+{
+        AddFault (BlockFaults, block, 0, fault, count);
+}
+
+/**
+ * @brief  Cuts the card power : the cached blocks are lost, a block being
+ *         programmed is torn (its first half written). The card is dead until
+ *         Sim_CardPowerOn.
+ */
+void Sim_CardPowerCut (void)
+{
+        if (Busy && BusyCommit && CacheCount) {
+                memcpy (Image + (size_t) Cache[0].Block * BLOCK_SIZE, Cache[0].Data, BLOCK_SIZE / 2);
+        }
+
+        CardReset ();
+        State = CARD_OFF;
+}
+
+/**
+ * @brief  Cuts the power when the card got blocks more blocks.
+ */
+void Sim_CardPowerCutAfter (uint32_t blocks)
+{
+        CutAfter = Received + blocks;
+}
+
+void Sim_CardPowerOn (void)
+{
+        CardReset ();
+}
+
+uint8_t Sim_CardIsBusy (void)
+{
+        return (Busy);
+}
+
+uint32_t Sim_CardPendingBlocks (void)
+{
+        return (CacheCount);
+}
@@ -0,0 +1,749 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <string.h>
+#include "stm32f4xx.h"
+#include "sim_device.h"
+
+/*
+ * SPI2 master with its RX / TX DMA requests (DMA1 Stream3 / Stream4), and a second
+ * SD card behind it, in SPI mode, chip select on PB12. A byte takes 8 SCK periods
+ * at APB1 (42 MHz) over the BR prescaler ; the TX buffer and the shift register
+ * are modeled, so the DMA runs one byte ahead like on the chip. The card is its
+ * own model (not the SDIO one) with its own image : both can be busy at the same
+ * time. Card timings are the ones of Sim_CardConfig.
+ */
+
+#define SPI_PAGE                      0x40003000
+#define SPI2_OFFSET                   0x800
+#define SPI_SIZE                      0x400
+#define APB1_DIV                      4
+#define DMA_CONTROLLER                1
+#define DMA_RX_STREAM                 3
+#define DMA_TX_STREAM                 4
+#define PORT_B                        1
+#define CS_PIN                        12
+
+#define REG_CR1                       0x00
+#define REG_CR2                       0x04
+#define REG_SR                        0x08
+#define REG_DR                        0x0C
+
+#define BLOCK_SIZE                    512
+#define OUT_SIZE                      (BLOCK_SIZE + 16)
+#define FAULTS_MAX                    8
+
+#define R1_IDLE                       0x01
+#define R1_ILLEGAL_CMD                0x04
+#define R1_CRC_ERROR                  0x08
+#define R1_PARAM_ERROR                0x40
+
+#define TOKEN_START_BLOCK             0xFE
+#define TOKEN_START_MULT_WRITE        0xFC
+#define TOKEN_STOP_TRAN               0xFD
+#define DATA_ACCEPTED                 0xE5
+#define DATA_CRC_REJECTED             0xEB
+
+typedef enum {
+        PHASE_NONE = 0,
+        PHASE_READ, /*!< Sending blocks */
+        PHASE_WRITE_TOKEN, /*!< Waiting for a start (or stop) token */
+        PHASE_WRITE_DATA, /*!< Receiving a block and its CRC */
+        PHASE_BUSY /*!< DO low until BusyUntil */
+} Phase;
+
+typedef struct {
+        uint32_t Block;
+        Sim_Fault Fault;
+        uint32_t Count;
+} FaultEntry;
+
+/*
+ * SPI2.
+ */
+static uint32_t *Registers;
+static uint32_t Sr;
+static uint8_t TxBuf;
+static uint8_t Shift;
+static uint8_t Shifting;
+static uint8_t Rx;
+
+/*
+ * The card.
+ */
+static Sim_CardConfig Config;
+static uint8_t *Image;
+static uint8_t Selected;
+static uint8_t SpiMode;
+static uint8_t Ready; /*!< ACMD41 done */
+static uint32_t InitPolls;
+static uint8_t CrcOn;
+static uint8_t AppNext;
+static uint8_t Frame[6];
+static uint32_t FrameLength;
+static uint8_t Out[OUT_SIZE];
+static uint32_t OutHead, OutLength;
+static Phase CardPhase;
+static Phase BusyNext; /*!< Phase after the busy time */
+static uint8_t Multi;
+static uint32_t NextBlock;
+static uint64_t ReadyAt; /*!< Next read block, SIM_NEVER : never comes */
+static uint8_t BlockQueued; /*!< A read block is in Out */
+static uint64_t BusyUntil;
+static uint8_t Received[BLOCK_SIZE + 2];
+static uint32_t ReceivedLength;
+static uint32_t EraseStart, EraseEnd;
+static FaultEntry Faults[FAULTS_MAX];
+
+/*****************************************************************************/
+/* Card                                                                      */
+/*****************************************************************************/
+
+static uint8_t Crc7 (const uint8_t *data, uint32_t length)
+{
+        uint8_t crc = 0, byte;
+        uint32_t i, j;
+
+        for (i = 0; i < length; i++) {
+                byte = data[i];
+
+                for (j = 0; j < 8; j++) {
+                        crc <<= 1;
+
+                        if ((byte ^ crc) & 0x80) {
+                                crc ^= 0x09;
+                        }
+
+                        byte <<= 1;
+                }
+        }
+
+        return (crc & 0x7F);
+}
+
+static uint16_t Crc16 (const uint8_t *data, uint32_t length)
+{
+        uint16_t crc = 0;
+        uint32_t i, j;
+
+        for (i = 0; i < length; i++) {
+                crc ^= (uint16_t) data[i] << 8;
+
+                for (j = 0; j < 8; j++) {
+                        crc = (crc & 0x8000) ? (uint16_t) ((crc << 1) ^ 0x1021) : (uint16_t) (crc << 1);
+                }
+        }
+
+        return (crc);
+}
+
+static Sim_Fault TakeFault (uint32_t block)
+{
+        uint32_t i;
+
+        for (i = 0; i < FAULTS_MAX; i++) {
+                if (Faults[i].Count && (Faults[i].Block == block)) {
+                        Faults[i].Count--;
+                        return (Faults[i].Fault);
+                }
+        }
+
+        return (SIM_FAULT_NONE);
+}
+
+static void Queue (const uint8_t *data, uint32_t length)
+{
+        if (OutHead + OutLength + length > OUT_SIZE) {
+                memmove (Out, Out + OutHead, OutLength);
+                OutHead = 0;
+        }
+
+        memcpy (Out + OutHead + OutLength, data, length);
+        OutLength += length;
+}
+
+static void QueueByte (uint8_t byte)
+{
+        Queue (&byte, 1);
+}
+
+/**
+ * @brief  Start token, data, CRC16 (wrong if crcFault).
+ */
+static void QueueData (const uint8_t *data, uint32_t length, uint8_t crcFault)
+{
+        uint16_t crc = Crc16 (data, length) ^ ((crcFault) ? 0x0101 : 0);
+
+        QueueByte (TOKEN_START_BLOCK);
+        Queue (data, length);
+        QueueByte ((uint8_t) (crc >> 8));
+        QueueByte ((uint8_t) crc);
+}
+
+static void Busy (uint64_t us, Phase next)
+{
+        BusyUntil = (us == SIM_NEVER) ? SIM_NEVER : Sim_Now () + SIM_US (us);
+        BusyNext = next;
+        CardPhase = PHASE_BUSY;
+}
+
+static uint8_t R1 (uint8_t flags)
+{
+        return ((uint8_t) (flags | ((Ready) ? 0 : R1_IDLE)));
+}
+
+/**
+ * @brief  Block number from a command argument, Config.Blocks if invalid.
+ */
+static uint32_t CardBlock (uint32_t arg)
+{
+        uint32_t block = (Config.HighCapacity) ? arg : arg / BLOCK_SIZE;
+
+        if ((!Config.HighCapacity && (arg % BLOCK_SIZE)) || (block >= Config.Blocks)) {
+                return (Config.Blocks);
+        }
+
+        return (block);
+}
+
+static void Csd (uint8_t *csd)
+{
+        uint32_t size;
+
+        memset (csd, 0, 16);
+
+        if (Config.HighCapacity) {
+                size = Config.Blocks / 1024 - 1;
+                csd[0] = 0x40;
+                csd[5] = 0x09;
+                csd[7] = (uint8_t) ((size >> 16) & 0x3F);
+                csd[8] = (uint8_t) (size >> 8);
+                csd[9] = (uint8_t) size;
+        }
+        else {
+                /*!< READ_BL_LEN 9, C_SIZE_MULT 7 : (C_SIZE + 1) * 256 KB */
+                size = Config.Blocks / 512 - 1;
+                csd[5] = 0x09;
+                csd[6] = (uint8_t) ((size >> 10) & 0x03);
+                csd[7] = (uint8_t) (size >> 2);
+                csd[8] = (uint8_t) (size << 6);
+                csd[9] = 0x03;
+                csd[10] = 0x80;
+        }
+
+        csd[15] = (uint8_t) ((Crc7 (csd, 15) << 1) | 0x01);
+}
+
+static void Execute (void)
+{
+        uint8_t cmd = Frame[0] & 0x3F;
+        uint8_t app = AppNext;
+        uint32_t arg = ((uint32_t) Frame[1] << 24) | ((uint32_t) Frame[2] << 16) | ((uint32_t) Frame[3] << 8) | Frame[4];
+        uint8_t buffer[64];
+        uint32_t block;
+
+        AppNext = 0;
+        SimStats.SpiCommands[cmd]++;
+
+        /*!< NCR : one byte */
+        QueueByte (0xFF);
+
+        if ((CrcOn || (cmd == 0) || (cmd == 8)) && ((Frame[5] >> 1) != Crc7 (Frame, 5))) {
+                QueueByte (R1 (R1_CRC_ERROR));
+                return;
+        }
+
+        if (!SpiMode && (cmd != 0)) {
+                OutLength = 0;
+                return;
+        }
+
+        if (app) {
+                switch (cmd) {
+                        case 41:
+                                if (InitPolls) {
+                                        InitPolls--;
+                                }
+                                else {
+                                        Ready = 1;
+                                }
+
+                                QueueByte (R1 (0));
+                                return;
+
+                        case 13:
+                                /*!< R2, then the SD status : AU_SIZE in bits 431:428 */
+                                QueueByte (R1 (0));
+                                QueueByte (0x00);
+                                QueueByte (0xFF);
+                                memset (buffer, 0, sizeof (buffer));
+                                buffer[10] = (uint8_t) (Config.AuSize << 4);
+                                QueueData (buffer, 64, 0);
+                                return;
+
+                        default:
+                                break;
+                }
+        }
+
+        switch (cmd) {
+                case 0:
+                        SpiMode = 1;
+                        Ready = 0;
+                        InitPolls = Config.InitPolls;
+                        CrcOn = 0;
+                        CardPhase = PHASE_NONE;
+                        QueueByte (R1_IDLE);
+                        break;
+
+                case 8:
+                        QueueByte (R1 (0));
+                        QueueByte (0x00);
+                        QueueByte (0x00);
+                        QueueByte ((uint8_t) ((arg >> 8) & 0x0F));
+                        QueueByte ((uint8_t) arg);
+                        break;
+
+                case 9:
+                        QueueByte (R1 (0));
+                        QueueByte (0xFF);
+                        Csd (buffer);
+                        QueueData (buffer, 16, 0);
+                        break;
+
+                case 12:
+                        /*!< Stuff byte, then R1. The block being sent is cut */
+                        OutLength = 0;
+                        QueueByte (0xFF);
+                        QueueByte (0xFF);
+                        QueueByte (R1 (0));
+                        CardPhase = PHASE_NONE;
+                        BlockQueued = 0;
+                        break;
+
+                case 13:
+                        QueueByte (R1 (0));
+                        QueueByte (0x00);
+                        break;
+
+                case 16:
+                        QueueByte (R1 ((arg == BLOCK_SIZE) ? 0 : R1_PARAM_ERROR));
+                        break;
+
+                case 17:
+                case 18:
+                case 24:
+                case 25:
+                        block = CardBlock (arg);
+
+                        if (!Ready || (block == Config.Blocks)) {
+                                QueueByte (R1 ((Ready) ? R1_PARAM_ERROR : R1_ILLEGAL_CMD));
+                                break;
+                        }
+
+                        QueueByte (R1 (0));
+                        NextBlock = block;
+                        Multi = (cmd == 18) || (cmd == 25);
+
+                        if (cmd <= 18) {
+                                CardPhase = PHASE_READ;
+                                ReadyAt = Sim_Now () + SIM_US (Config.ReadLatencyUs);
+                                BlockQueued = 0;
+                        }
+                        else {
+                                CardPhase = PHASE_WRITE_TOKEN;
+                        }
+
+                        break;
+
+                case 32:
+                        EraseStart = CardBlock (arg);
+                        QueueByte (R1 (0));
+                        break;
+
+                case 33:
+                        EraseEnd = CardBlock (arg);
+                        QueueByte (R1 (0));
+                        break;
+
+                case 38:
+                        if ((EraseStart >= Config.Blocks) || (EraseEnd >= Config.Blocks) || (EraseEnd < EraseStart)) {
+                                QueueByte (R1 (R1_PARAM_ERROR));
+                                break;
+                        }
+
+                        QueueByte (R1 (0));
+                        memset (Image + (size_t) EraseStart * BLOCK_SIZE, 0, (size_t) (EraseEnd - EraseStart + 1) * BLOCK_SIZE);
+                        Busy ((uint64_t) (EraseEnd - EraseStart + 1) * Config.EraseBlockUs, PHASE_NONE);
+                        break;
+
+                case 55:
+                        AppNext = 1;
+                        QueueByte (R1 (0));
+                        break;
+
+                case 58:
+                        QueueByte (R1 (0));
+                        QueueByte ((uint8_t) (((Ready) ? 0x80 : 0x00) | ((Config.HighCapacity) ? 0x40 : 0x00)));
+                        QueueByte (0xFF);
+                        QueueByte (0x80);
+                        QueueByte (0x00);
+                        break;
+
+                case 59:
+                        CrcOn = arg & 0x01;
+                        QueueByte (R1 (0));
+                        break;
+
+                default:
+                        QueueByte (R1 (R1_ILLEGAL_CMD));
+                        break;
+        }
+}
+
+/**
+ * @brief  A block and its CRC came in : data response, then busy.
+ */
+static void BlockReceived (void)
+{
+        Sim_Fault fault = TakeFault (NextBlock);
+        uint16_t crc = (uint16_t) ((Received[BLOCK_SIZE] << 8) | Received[BLOCK_SIZE + 1]);
+        Phase next = (Multi) ? PHASE_WRITE_TOKEN : PHASE_NONE;
+
+        if ((fault == SIM_FAULT_CRC) || (CrcOn && (crc != Crc16 (Received, BLOCK_SIZE))) || (NextBlock >= Config.Blocks)) {
+                QueueByte (DATA_CRC_REJECTED);
+                Busy (0, next);
+                return;
+        }
+
+        memcpy (Image + (size_t) NextBlock * BLOCK_SIZE, Received, BLOCK_SIZE);
+        SimStats.SpiBlocksWritten++;
+        NextBlock++;
+        QueueByte (DATA_ACCEPTED);
+        Busy ((fault == SIM_FAULT_TIMEOUT) ? SIM_NEVER : (Multi) ? Config.BlockBusyUs : Config.ProgramUs, next);
+}
+
+/**
+ * @brief  Queues the next block of a read once it is ready. DO stays high until then.
+ */
+static void ReadNext (void)
+{
+        Sim_Fault fault;
+
+        if (BlockQueued || (ReadyAt == SIM_NEVER) || (Sim_Now () < ReadyAt)) {
+                return;
+        }
+
+        if (NextBlock >= Config.Blocks) {
+                CardPhase = PHASE_NONE;
+                return;
+        }
+
+        fault = TakeFault (NextBlock);
+
+        if (fault == SIM_FAULT_TIMEOUT) {
+                ReadyAt = SIM_NEVER;
+                return;
+        }
+
+        QueueData (Image + (size_t) NextBlock * BLOCK_SIZE, BLOCK_SIZE, fault == SIM_FAULT_CRC);
+        SimStats.SpiBlocksRead++;
+        BlockQueued = 1;
+        NextBlock++;
+}
+
+/**
+ * @brief  One byte on the bus : in from the host, the card's byte out.
+ */
+static uint8_t CardExchange (uint8_t in)
+{
+        uint8_t out = 0xFF;
+
+        if (!Selected || !Image) {
+                return (0xFF);
+        }
+
+        switch (CardPhase) {
+                case PHASE_WRITE_TOKEN:
+                        if ((in == TOKEN_START_BLOCK) || (in == TOKEN_START_MULT_WRITE)) {
+                                CardPhase = PHASE_WRITE_DATA;
+                                ReceivedLength = 0;
+                                return (0xFF);
+                        }
+
+                        if ((in == TOKEN_STOP_TRAN) && Multi) {
+                                Busy (Config.ProgramUs, PHASE_NONE);
+                                return (0xFF);
+                        }
+
+                        break;
+
+                case PHASE_WRITE_DATA:
+                        Received[ReceivedLength++] = in;
+
+                        if (ReceivedLength == sizeof (Received)) {
+                                BlockReceived ();
+                        }
+
+                        return (0xFF);
+
+                default:
+                        break;
+        }
+
+        /*!< Commands, also in the middle of a read (CMD12) */
+        if (FrameLength || ((in & 0xC0) == 0x40)) {
+                Frame[FrameLength++] = in;
+
+                if (FrameLength == sizeof (Frame)) {
+                        FrameLength = 0;
+                        Execute ();
+                }
+        }
+
+        if (CardPhase == PHASE_READ) {
+                ReadNext ();
+        }
+
+        if (OutLength) {
+                out = Out[OutHead++];
+
+                if (--OutLength == 0) {
+                        OutHead = 0;
+
+                        if ((CardPhase == PHASE_READ) && BlockQueued) {
+                                BlockQueued = 0;
+
+                                if (Multi) {
+                                        ReadyAt = Sim_Now () + SIM_US (Config.ReadGapUs);
+                                }
+                                else {
+                                        CardPhase = PHASE_NONE;
+                                }
+                        }
+                }
+
+                return (out);
+        }
+
+        if (CardPhase == PHASE_BUSY) {
+                if ((BusyUntil != SIM_NEVER) && (Sim_Now () >= BusyUntil)) {
+                        CardPhase = BusyNext;
+                        return (0xFF);
+                }
+
+                SimStats.SpiBusyBytes++;
+                return (0x00);
+        }
+
+        return (0xFF);
+}
+
+static void ChipSelect (uint8_t level)
+{
+        Selected = !level;
+
+        if (!Selected) {
+                FrameLength = 0;
+        }
+}
+
+/*****************************************************************************/
+/* SPI2                                                                      */
+/*****************************************************************************/
+
+static uint64_t ByteCycles (void)
+{
+        uint32_t prescaler = 2U << ((Registers[(SPI2_OFFSET + REG_CR1) / 4] & SPI_CR1_BR) >> 3);
+
+        return ((uint64_t) 8 * prescaler * APB1_DIV);
+}
+
+static uint8_t Enabled (void)
+{
+        return ((Registers[(SPI2_OFFSET + REG_CR1) / 4] & SPI_CR1_SPE) != 0);
+}
+
+static void StartShift (uint8_t value)
+{
+        Shift = value;
+        Shifting = 1;
+        Sr |= SPI_SR_BSY;
+        Sim_Schedule (SIM_EVENT_SPI_BYTE, Sim_Now () + ByteCycles ());
+}
+
+static void Load (uint8_t value)
+{
+        if (!Shifting) {
+                StartShift (value);
+                return;
+        }
+
+        TxBuf = value;
+        Sr &= ~SPI_SR_TXE;
+}
+
+/**
+ * @brief  The DMA requests : RXNE with RXDMAEN, TXE with TXDMAEN.
+ */
+static void Service (void)
+{
+        uint32_t cr2 = Registers[(SPI2_OFFSET + REG_CR2) / 4];
+        uint32_t value;
+
+        if ((Sr & SPI_SR_RXNE) && (cr2 & SPI_CR2_RXDMAEN) && Sim_DmaToMemory (DMA_CONTROLLER, DMA_RX_STREAM, Rx)) {
+                Sr &= ~SPI_SR_RXNE;
+        }
+
+        while (Enabled () && (Sr & SPI_SR_TXE) && (cr2 & SPI_CR2_TXDMAEN)) {
+                if (!Sim_DmaFromMemory (DMA_CONTROLLER, DMA_TX_STREAM, &value)) {
+                        break;
+                }
+
+                Load ((uint8_t) value);
+        }
+}
+
+static void ByteEnd (void)
+{
+        uint8_t in = CardExchange (Shift);
+
+        SimStats.SpiBytes++;
+
+        if (Sr & SPI_SR_RXNE) {
+                Sr |= SPI_SR_OVR;
+        }
+
+        Rx = in;
+        Sr |= SPI_SR_RXNE;
+
+        if (!(Sr & SPI_SR_TXE)) {
+                Sr |= SPI_SR_TXE;
+                StartShift (TxBuf);
+        }
+        else {
+                Shifting = 0;
+                Sr &= ~SPI_SR_BSY;
+        }
+
+        Service ();
+}
+
+static uint32_t SpiRead (uint32_t offset, uint8_t pop)
+{
+        if ((offset < SPI2_OFFSET) || (offset >= SPI2_OFFSET + SPI_SIZE)) {
+                return (Registers[offset / 4]);
+        }
+
+        switch (offset - SPI2_OFFSET) {
+                case REG_SR:
+                        return (Sr);
+
+                case REG_DR:
+                        if (pop) {
+                                Sr &= ~(SPI_SR_RXNE | SPI_SR_OVR);
+                        }
+
+                        return (Rx);
+
+                default:
+                        return (Registers[offset / 4]);
+        }
+}
+
+static void SpiWrite (uint32_t offset, uint32_t value)
+{
+        if ((offset < SPI2_OFFSET) || (offset >= SPI2_OFFSET + SPI_SIZE)) {
+                Registers[offset / 4] = value;
+                return;
+        }
+
+        switch (offset - SPI2_OFFSET) {
+                case REG_SR:
+                        break;
+
+                case REG_DR:
+                        if (Enabled () && (Sr & SPI_SR_TXE)) {
+                                Load ((uint8_t) value);
+                        }
+
+                        break;
+
+                default:
+                        Registers[offset / 4] = value;
+                        Service ();
+                        break;
+        }
+}
+
+void Sim_SpiInit (void)
+{
+        Registers = Sim_MapRegion (SPI_PAGE, SpiRead, SpiWrite, SIM_COST_PERIPH);
+        Sr = SPI_SR_TXE;
+        Shifting = 0;
+        Selected = 0;
+        Sim_EventSetup (SIM_EVENT_SPI_BYTE, ByteEnd);
+        Sim_DmaSetKick (DMA_CONTROLLER, DMA_RX_STREAM, Service);
+        Sim_DmaSetKick (DMA_CONTROLLER, DMA_TX_STREAM, Service);
+        Sim_GpioWatch (PORT_B, CS_PIN, ChipSelect);
+}
+
+/*****************************************************************************/
+/* Test interface                                                            */
+/*****************************************************************************/
+
+/**
+ * @brief  Inserts (or replaces) the card on SPI2, in SD mode until CMD0. Only
+ *         Blocks, HighCapacity, AuSize, InitPolls, the read latency and gap, the
+ *         busy times and ImagePath apply.
+ */
+void Sim_SpiCardInsert (const Sim_CardConfig *config)
+{
+        if (Image) {
+                Sim_ImageClose (Image, Config.Blocks);
+        }
+
+        Config = *config;
+        Image = Sim_ImageOpen (Config.ImagePath, Config.Blocks);
+        SpiMode = Ready = CrcOn = AppNext = 0;
+        FrameLength = OutHead = OutLength = 0;
+        CardPhase = PHASE_NONE;
+        BlockQueued = 0;
+        memset (Faults, 0, sizeof (Faults));
+}
+
+uint8_t *Sim_SpiCardImage (void)
+{
+        return (Image);
+}
+
+/**
+ * @brief  The next count transfers of block fail : CRC, a rejected write or a
+ *         read block with a bad CRC16 ; timeout, a read block which never comes or
+ *         a write which never ends programming.
+ */
+void Sim_SpiCardFailBlock (uint32_t block, Sim_Fault fault, uint32_t count)
+{
+        uint32_t i;
+
+        for (i = 0; i < FAULTS_MAX; i++) {
+                if (Faults[i].Count == 0) {
+                        Faults[i].Block = block;
+                        Faults[i].Fault = fault;
+                        Faults[i].Count = count;
+                        return;
+                }
+        }
+
+        Sim_Fatal ("too many faults");
+}
+
+uint8_t Sim_SpiCardIsBusy (void)
+{
+        return ((CardPhase == PHASE_BUSY) && ((BusyUntil == SIM_NEVER) || (Sim_Now () < BusyUntil)));
+}
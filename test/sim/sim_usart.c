@@ -0,0 +1,210 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <string.h>
+#include "stm32f4xx.h"
+#include "sim_device.h"
+
+/*
+ * USART1 transmitter : the data register, the shift register, TXE and TC, the
+ * TX DMA request (DMA2 Stream7, the channel is not checked). A character takes
+ * 10 bit times at the rate BRR and OVER8 give from PCLK2 (84 MHz). What goes out
+ * on the line is kept for the test (Sim_UsartTake). No receiver.
+ */
+
+#define USART_PAGE                    0x40011000
+#define APB2_DIV                      2
+#define CHAR_BITS                     10
+#define DMA_CONTROLLER                2
+#define DMA_STREAM                    7
+#define CAPTURE_SIZE                  (256 * 1024)
+
+#define REG_SR                        0x00
+#define REG_DR                        0x04
+#define REG_BRR                       0x08
+#define REG_CR1                       0x0C
+#define REG_CR3                       0x14
+
+static uint32_t *Registers;
+static uint32_t Sr;
+static uint8_t Tdr;
+static uint8_t Shift;
+static uint8_t Shifting;
+static uint8_t Capture[CAPTURE_SIZE];
+static uint32_t Captured;
+static uint32_t Lost;
+
+/*****************************************************************************/
+
+static uint8_t Transmitting (void)
+{
+        uint32_t cr1 = Registers[REG_CR1 / 4];
+
+        return ((cr1 & USART_CR1_UE) && (cr1 & USART_CR1_TE));
+}
+
+/**
+ * @brief  One character on the line, in CPU cycles.
+ */
+static uint64_t CharCycles (void)
+{
+        uint32_t brr = Registers[REG_BRR / 4] & 0xFFFF;
+        uint32_t divider = (Registers[REG_CR1 / 4] & USART_CR1_OVER8) ? ((brr >> 4) << 3) | (brr & 0x07) : brr;
+
+        if (divider == 0) {
+                Sim_Fatal ("USART1 BRR is 0");
+        }
+
+        return ((uint64_t) divider * APB2_DIV * CHAR_BITS);
+}
+
+static void Load (uint8_t value)
+{
+        Sr &= ~USART_SR_TC;
+
+        if (!Shifting) {
+                Shift = value;
+                Shifting = 1;
+                Sim_Schedule (SIM_EVENT_USART_TX, Sim_Now () + CharCycles ());
+                return;
+        }
+
+        Tdr = value;
+        Sr &= ~USART_SR_TXE;
+}
+
+/**
+ * @brief  TXE with DMAT : the DMA fills the data register.
+ */
+static void Feed (void)
+{
+        uint32_t value;
+
+        while (Transmitting () && (Sr & USART_SR_TXE) && (Registers[REG_CR3 / 4] & USART_CR3_DMAT)) {
+                if (!Sim_DmaFromMemory (DMA_CONTROLLER, DMA_STREAM, &value)) {
+                        return;
+                }
+
+                Load ((uint8_t) value);
+        }
+}
+
+/**
+ * @brief  End of a character : it is on the line, the next one starts shifting.
+ */
+static void CharEnd (void)
+{
+        if (Captured < CAPTURE_SIZE) {
+                Capture[Captured++] = Shift;
+        }
+        else {
+                Lost++;
+        }
+
+        if (Sr & USART_SR_TXE) {
+                Shifting = 0;
+                Sr |= USART_SR_TC;
+        }
+        else {
+                Shift = Tdr;
+                Sr |= USART_SR_TXE;
+                Sim_Schedule (SIM_EVENT_USART_TX, Sim_Now () + CharCycles ());
+        }
+
+        Feed ();
+}
+
+/*****************************************************************************/
+
+static uint32_t UsartRead (uint32_t offset, uint8_t pop)
+{
+        switch (offset) {
+                case REG_SR:
+                        return (Sr);
+
+                case REG_DR:
+                        return (0);
+
+                default:
+                        return (Registers[offset / 4]);
+        }
+}
+
+static void UsartWrite (uint32_t offset, uint32_t value)
+{
+        switch (offset) {
+                case REG_SR:
+                        /*!< TC and RXNE are cleared by writing 0 */
+                        Sr &= value | ~(USART_SR_TC | USART_SR_RXNE);
+                        break;
+
+                case REG_DR:
+                        if (Transmitting () && (Sr & USART_SR_TXE)) {
+                                Load ((uint8_t) value);
+                        }
+
+                        break;
+
+                default:
+                        Registers[offset / 4] = value;
+                        Feed ();
+                        break;
+        }
+}
+
+static uint8_t UsartLine (void)
+{
+        uint32_t cr1 = Registers[REG_CR1 / 4];
+
+        return (((cr1 & USART_CR1_TXEIE) && (Sr & USART_SR_TXE)) || ((cr1 & USART_CR1_TCIE) && (Sr & USART_SR_TC)));
+}
+
+void Sim_UsartInit (void)
+{
+        Registers = Sim_MapRegion (USART_PAGE, UsartRead, UsartWrite, SIM_COST_PERIPH);
+        Sr = USART_SR_TXE | USART_SR_TC;
+        Shifting = 0;
+        Captured = Lost = 0;
+        Sim_IrqLine (USART1_IRQn, UsartLine);
+        Sim_EventSetup (SIM_EVENT_USART_TX, CharEnd);
+        Sim_DmaSetKick (DMA_CONTROLLER, DMA_STREAM, Feed);
+}
+
+/*****************************************************************************/
+/* Test interface                                                            */
+/*****************************************************************************/
+
+/**
+ * @brief  Moves out what was sent on the line since the last call.
+ * @retval Bytes copied, at most max. The rest stays for the next call.
+ */
+uint32_t Sim_UsartTake (uint8_t *data, uint32_t max)
+{
+        uint32_t n = (Captured < max) ? Captured : max;
+
+        memcpy (data, Capture, n);
+        memmove (Capture, Capture + n, Captured - n);
+        Captured -= n;
+        return (n);
+}
+
+/**
+ * @brief  Bytes sent while the capture was full, never seen by Sim_UsartTake.
+ */
+uint32_t Sim_UsartLost (void)
+{
+        return (Lost);
+}
+
+/**
+ * @brief  The character time, to check the baud rate.
+ */
+uint64_t Sim_UsartCharCycles (void)
+{
+        return (CharCycles ());
+}
@@ -0,0 +1,217 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <string.h>
+#include "sim.h"
+#include "sdio_high_level.h"
+
+/*
+ * Asynchronous transfers : the caller runs while the data moves, CMD12 and the
+ * callback come from PendSV, DMA errors and lost interrupts end the transfer.
+ */
+
+#define TEST_BLOCKS                   64
+#define EXC_PENDSV                    14
+#define EXC_OTG_FS                    (16 + OTG_FS_IRQn)
+
+static uint8_t Buffer[TEST_BLOCKS * 512] __attribute__ ((aligned (4)));
+static uint8_t Check[TEST_BLOCKS * 512] __attribute__ ((aligned (4)));
+
+static volatile uint32_t Calls;
+static volatile SD_Error CallStatus;
+static volatile uint32_t CallException;
+
+static void Fill (uint8_t *buffer, uint32_t size, uint32_t seed)
+{
+        uint32_t i;
+
+        for (i = 0; i < size; i++) {
+                buffer[i] = (uint8_t) (i * 13 + seed + (i >> 9));
+        }
+}
+
+static void Done (SD_Error status, void *context)
+{
+        (void) context;
+        CallStatus = status;
+        CallException = Sim_ActiveException ();
+        Calls++;
+}
+
+/**
+ * @brief  Lets the simulated time run until the transfer is over.
+ * @retval Number of steps the caller got while it was in flight.
+ */
+static uint32_t Poll (uint64_t step)
+{
+        uint32_t samples = 0;
+
+        while (SD_GetAsyncState () == SD_TRANSFER_BUSY) {
+                Sim_Advance (step);
+                samples++;
+        }
+
+        return (samples);
+}
+
+static void Submitted (void)
+{
+        Calls = 0;
+        CallStatus = SD_ERROR;
+        CallException = 0;
+        Sim_ResetStats ();
+}
+
+static void TestWriteRead (void)
+{
+        Sim_Stats stats;
+
+        Fill (Buffer, sizeof (Buffer), 3);
+        Submitted ();
+        SIM_CHECK (SD_WriteMultiBlocksAsync (Buffer, 200 * 512, 512, TEST_BLOCKS, Done, NULL) == SD_OK);
+        SIM_CHECK (SD_WriteMultiBlocksAsync (Buffer, 200 * 512, 512, TEST_BLOCKS, Done, NULL) == SD_REQUEST_PENDING);
+        SIM_CHECK (Poll (SIM_US (10)) > 0);
+        SIM_CHECK (Calls == 1);
+        SIM_CHECK (CallStatus == SD_OK);
+        SIM_CHECK (CallException == EXC_PENDSV);
+        SIM_CHECK (SD_GetAsyncError () == SD_OK);
+        SIM_CHECK (SD_WaitReady () == SD_OK);
+        SIM_CHECK (memcmp (Sim_CardImage () + 200 * 512, Buffer, sizeof (Buffer)) == 0);
+        Sim_GetStats (&stats);
+        SIM_CHECK (stats.Commands[12] == 1);
+        Sim_PrintStats ("async write 64 blocks", &stats);
+
+        memset (Check, 0, sizeof (Check));
+        Submitted ();
+        SIM_CHECK (SD_ReadMultiBlocksAsync (Check, 200 * 512, 512, TEST_BLOCKS, Done, NULL) == SD_OK);
+        SIM_CHECK (Poll (SIM_US (10)) > 0);
+        SIM_CHECK (Calls == 1);
+        SIM_CHECK (CallStatus == SD_OK);
+        SIM_CHECK (CallException == EXC_PENDSV);
+        SIM_CHECK (memcmp (Check, Buffer, sizeof (Check)) == 0);
+        Sim_GetStats (&stats);
+        SIM_CHECK (stats.Commands[12] == 1);
+        Sim_PrintStats ("async read 64 blocks", &stats);
+}
+
+/**
+ * @brief  A waiter in an interrupt handler (the USB mass storage in the OTG IRQ),
+ *         which PendSV can not preempt : SD_AsyncSleep finishes the transfer.
+ */
+void OTG_FS_IRQHandler (void)
+{
+        __disable_irq ();
+
+        while (Calls == 0) {
+                SD_AsyncSleep ();
+                __enable_irq ();
+                __disable_irq ();
+        }
+
+        __enable_irq ();
+}
+
+static void TestHandlerWaiter (void)
+{
+        /*!< 16 preemption levels : SDIO, DMA, then OTG, PendSV last */
+        NVIC_SetPriorityGrouping (3);
+        NVIC_SetPriority (SDIO_IRQn, 0);
+        NVIC_SetPriority (DMA2_Stream3_IRQn, 1);
+        NVIC_SetPriority (OTG_FS_IRQn, 2);
+        NVIC_EnableIRQ (OTG_FS_IRQn);
+
+        memset (Check, 0, sizeof (Check));
+        Submitted ();
+        SIM_CHECK (SD_ReadMultiBlocksAsync (Check, 200 * 512, 512, 8, Done, NULL) == SD_OK);
+        NVIC_SetPendingIRQ (OTG_FS_IRQn);
+
+        SIM_CHECK (Calls == 1);
+        SIM_CHECK (CallStatus == SD_OK);
+        SIM_CHECK (CallException == EXC_OTG_FS);
+        SIM_CHECK (SD_GetAsyncState () == SD_TRANSFER_OK);
+        SIM_CHECK (memcmp (Check, Buffer, 8 * 512) == 0);
+
+        NVIC_DisableIRQ (OTG_FS_IRQn);
+        Sim_BoardInit ();
+}
+
+static void TestDmaErrors (void)
+{
+        /*!< FIFO error : reported, not fatal */
+        memset (Check, 0, sizeof (Check));
+        Submitted ();
+        SIM_CHECK (SD_ReadMultiBlocksAsync (Check, 200 * 512, 512, TEST_BLOCKS, Done, NULL) == SD_OK);
+        Sim_Advance (SIM_US (500));
+        Sim_DmaFail (2, 3, 0x01);
+        Poll (SIM_US (10));
+        SIM_CHECK (CallStatus == SD_OK);
+        SIM_CHECK (memcmp (Check, Buffer, sizeof (Check)) == 0);
+
+        /*!< Transfer error : the stream stops, the transfer fails */
+        Submitted ();
+        SIM_CHECK (SD_ReadMultiBlocksAsync (Check, 200 * 512, 512, TEST_BLOCKS, Done, NULL) == SD_OK);
+        Sim_Advance (SIM_US (500));
+        Sim_DmaFail (2, 3, 0x08);
+        Poll (SIM_US (10));
+        SIM_CHECK (Calls == 1);
+        SIM_CHECK (CallStatus == SD_DMA_ERROR);
+        SIM_CHECK (CallException == EXC_PENDSV);
+        SIM_CHECK (SD_GetAsyncState () == SD_TRANSFER_ERROR);
+
+        /*!< The driver is usable again */
+        memset (Check, 0, sizeof (Check));
+        SIM_CHECK (SD_ReadMultiBlocks (Check, 200 * 512, 512, TEST_BLOCKS) == SD_OK);
+        SIM_CHECK (SD_WaitReadOperation () == SD_OK);
+        SIM_CHECK (memcmp (Check, Buffer, sizeof (Check)) == 0);
+}
+
+/**
+ * @brief  A lost SDIO interrupt : nothing ever ends the transfer but the
+ *         deadline, checked from SysTick.
+ */
+static void TestDeadline (void)
+{
+        uint64_t start;
+
+        Submitted ();
+        NVIC_DisableIRQ (SDIO_IRQn);
+        start = Sim_Now ();
+        SIM_CHECK (SD_ReadMultiBlocksAsync (Check, 200 * 512, 512, 2, Done, NULL) == SD_OK);
+        Poll (SIM_US (1000));
+        NVIC_EnableIRQ (SDIO_IRQn);
+
+        SIM_CHECK (Calls == 1);
+        SIM_CHECK (CallStatus == SD_DATA_TIMEOUT);
+        SIM_CHECK (CallException == EXC_PENDSV);
+        SIM_CHECK (Sim_Now () - start >= SIM_US (2 * 100000));
+
+        memset (Check, 0, sizeof (Check));
+        SIM_CHECK (SD_ReadMultiBlocks (Check, 200 * 512, 512, 2) == SD_OK);
+        SIM_CHECK (SD_WaitReadOperation () == SD_OK);
+        SIM_CHECK (memcmp (Check, Buffer, 2 * 512) == 0);
+}
+
+static void Test (void)
+{
+        Sim_CardConfig config;
+
+        Sim_CardDefaults (&config);
+        Sim_CardInsert (&config);
+        Sim_BoardInit ();
+
+        SIM_CHECK (SD_Init () == SD_OK);
+        TestWriteRead ();
+        TestHandlerWaiter ();
+        TestDmaErrors ();
+        TestDeadline ();
+}
+
+int main (void)
+{
+        return (Sim_Run (Test));
+}
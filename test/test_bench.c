@@ -0,0 +1,189 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim.h"
+#include "sd_bench.h"
+
+/*
+ * The benchmark suite (sd_bench.c) on the simulated card, the way CI tracks it : the
+ * BENCH and HIST records SD_BenchRun prints are captured and parsed. Every request
+ * succeeds, the percentiles are in order, the histograms hold every request, and the
+ * sequential throughput rises with the request size. The records are printed again
+ * for the log.
+ */
+
+#define BASE_ADDR                     ((uint64_t) 65536 * 512)
+#define OUTPUT_MAX                    8192
+#define RECORDS_MAX                   32
+
+typedef struct {
+        char Test[16];
+        unsigned int Blocks, Ops, Errors, Us, KBps, Iops, P50Us, P99Us, MaxUs;
+        unsigned int HistOps; /*!< Sum of the HIST line of the same test and size */
+} Record;
+
+static uint8_t Buffer[SD_BENCH_MAX_BLOCKS * 512] __attribute__ ((aligned (4)));
+static char Output[OUTPUT_MAX];
+static Record Records[RECORDS_MAX];
+static uint32_t RecordCount;
+
+/**
+ * @brief  Runs the suite with stdout going to a temporary file, then reads it back.
+ * @retval Number of bytes captured.
+ */
+static size_t RunCaptured (void)
+{
+        FILE *capture = tmpfile ();
+        int saved;
+        size_t n;
+
+        if (capture == NULL) {
+                return (0);
+        }
+
+        fflush (stdout);
+        saved = dup (STDOUT_FILENO);
+        dup2 (fileno (capture), STDOUT_FILENO);
+
+        SD_BenchRun (Buffer, SD_BENCH_MAX_BLOCKS, BASE_ADDR);
+
+        fflush (stdout);
+        dup2 (saved, STDOUT_FILENO);
+        close (saved);
+
+        rewind (capture);
+        n = fread (Output, 1, sizeof (Output) - 1, capture);
+        Output[n] = '\0';
+        fclose (capture);
+        return (n);
+}
+
+static Record *Find (const char *test, unsigned int blocks)
+{
+        uint32_t i;
+
+        for (i = 0; i < RecordCount; i++) {
+                if ((strcmp (Records[i].Test, test) == 0) && (Records[i].Blocks == blocks)) {
+                        return (&Records[i]);
+                }
+        }
+
+        return (NULL);
+}
+
+/**
+ * @brief  BENCH lines into Records, the HIST lines summed into their record.
+ * @retval 1 if every line between BENCH_BEGIN and BENCH_END was understood.
+ */
+static uint8_t Parse (void)
+{
+        char *line, *next, test[16];
+        unsigned int blocks, count, bucket, core, bus, ops;
+        uint8_t begin = 0, end = 0;
+        int used, at;
+        Record *record;
+
+        for (line = strtok_r (Output, "\r\n", &next); line; line = strtok_r (NULL, "\r\n", &next)) {
+                if (sscanf (line, "BENCH_BEGIN core_hz=%u bus_hz=%u ops=%u", &core, &bus, &ops) == 3) {
+                        begin = (core == SIM_HZ) && (bus > 0) && (ops == SD_BENCH_OPS);
+                }
+                else if (strcmp (line, "BENCH_END") == 0) {
+                        end = 1;
+                }
+                else if (strncmp (line, "BENCH ", 6) == 0) {
+                        if (RecordCount == RECORDS_MAX) {
+                                return (0);
+                        }
+
+                        record = &Records[RecordCount++];
+                        memset (record, 0, sizeof (*record));
+
+                        if (sscanf (line, "BENCH test=%15s blocks=%u ops=%u err=%u us=%u kBps=%u iops=%u p50_us=%u p99_us=%u max_us=%u", record->Test,
+                                        &record->Blocks, &record->Ops, &record->Errors, &record->Us, &record->KBps, &record->Iops, &record->P50Us,
+                                        &record->P99Us, &record->MaxUs) != 10) {
+                                return (0);
+                        }
+                }
+                else if (sscanf (line, "HIST test=%15s blocks=%u%n", test, &blocks, &at) == 2) {
+                        if ((record = Find (test, blocks)) == NULL) {
+                                return (0);
+                        }
+
+                        for (bucket = 0; sscanf (line + at, " %u%n", &count, &used) == 1; bucket++) {
+                                record->HistOps += count;
+                                at += used;
+                        }
+
+                        if (bucket != SD_BENCH_HIST_BUCKETS) {
+                                return (0);
+                        }
+                }
+                else if (begin && !end) {
+                        return (0);
+                }
+        }
+
+        return (begin && end);
+}
+
+static void TestRecords (void)
+{
+        uint32_t i;
+        Record *record, *half;
+        unsigned int blocks;
+
+        SIM_CHECK (RunCaptured () > 0);
+        fputs (Output, stdout);
+        SIM_CHECK (Parse ());
+
+        /*!< 1 .. SD_BENCH_MAX_BLOCKS, written and read, then random writes and reads */
+        SIM_CHECK (RecordCount == 2 * 8 + 2);
+
+        for (i = 0; i < RecordCount; i++) {
+                record = &Records[i];
+                SIM_CHECK (record->Ops == SD_BENCH_OPS && record->Errors == 0);
+                SIM_CHECK (record->HistOps == record->Ops);
+                SIM_CHECK (record->P50Us > 0 && record->P50Us <= record->P99Us && record->P99Us <= record->MaxUs);
+                SIM_CHECK (record->Us >= record->P50Us * (record->Ops / 2) && record->KBps > 0);
+        }
+
+        for (blocks = 2; blocks <= SD_BENCH_MAX_BLOCKS; blocks *= 2) {
+                record = Find ("seq_write", blocks);
+                half = Find ("seq_write", blocks / 2);
+                SIM_CHECK (record && half && record->KBps > half->KBps);
+
+                record = Find ("seq_read", blocks);
+                half = Find ("seq_read", blocks / 2);
+                SIM_CHECK (record && half && record->KBps > half->KBps);
+        }
+
+        SIM_CHECK (Find ("rand_write", SD_BENCH_RANDOM_BLOCKS) && Find ("rand_read", SD_BENCH_RANDOM_BLOCKS));
+}
+
+static void Test (void)
+{
+        Sim_CardConfig config;
+
+        Sim_CardDefaults (&config);
+        config.InitPolls = 1;
+        /*!< The random requests are spread over SD_BENCH_SPAN_BLOCKS past BASE_ADDR */
+        config.Blocks = 4 * SD_BENCH_SPAN_BLOCKS;
+        Sim_CardInsert (&config);
+        Sim_BoardInit ();
+        SIM_CHECK (SD_Init () == SD_OK);
+
+        TestRecords ();
+}
+
+int main (void)
+{
+        return (Sim_Run (Test));
+}
@@ -0,0 +1,198 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim.h"
+#include "sd_blockdev.h"
+#include "sd_spi.h"
+
+/*
+ * Two simulated cards in one process, each behind its own SD_BlockDev : the SDIO
+ * slot and the SPI one, each with its own image file. Both identified, then the
+ * same block numbers written and read on both at the same time through the async
+ * calls : each image gets its own data, and the transfers overlap (the pair takes
+ * less than the two one after the other).
+ */
+
+#define SDIO_IMAGE                    "test_blockdev_sdio.img"
+#define SPI_IMAGE                     "test_blockdev_spi.img"
+#define FIRST_BLOCK                   4096
+#define SDIO_BLOCKS                   96
+#define SPI_BLOCKS                    8
+#define BLOCK                         SD_BLOCKDEV_BLOCK_SIZE
+
+typedef struct {
+        volatile uint8_t Done;
+        volatile SD_Error Status;
+} Transfer;
+
+static uint8_t SdioData[SDIO_BLOCKS * BLOCK] __attribute__ ((aligned (4)));
+static uint8_t SpiData[SPI_BLOCKS * BLOCK] __attribute__ ((aligned (4)));
+static uint8_t SdioBuffer[SDIO_BLOCKS * BLOCK] __attribute__ ((aligned (4)));
+static uint8_t SpiBuffer[SPI_BLOCKS * BLOCK] __attribute__ ((aligned (4)));
+
+static void Fill (uint8_t *buffer, uint32_t size, uint32_t seed)
+{
+        uint32_t i;
+
+        for (i = 0; i < size; i++) {
+                buffer[i] = (uint8_t) (i * 31 + seed + (i >> 9));
+        }
+}
+
+static uint32_t Us (uint64_t cycles)
+{
+        return ((uint32_t) (cycles / (SIM_HZ / 1000000)));
+}
+
+static void Done (SD_Error status, void *context)
+{
+        Transfer *transfer = (Transfer *) context;
+
+        transfer->Status = status;
+        transfer->Done = 1;
+}
+
+static void WaitBoth (Transfer *a, Transfer *b)
+{
+        __disable_irq ();
+
+        while (!a->Done || !b->Done) {
+                SD_AsyncSleep ();
+                __enable_irq ();
+                __disable_irq ();
+        }
+
+        __enable_irq ();
+}
+
+static void TestInfo (const Sim_CardConfig *config)
+{
+        SD_BlockDevInfo info;
+
+        SIM_CHECK (SD_DevGetInfo (&SD_SdioDev, &info) == SD_OK);
+        SIM_CHECK (info.Blocks == config->Blocks);
+        SIM_CHECK (info.AuBlocks == SD_AuBlocks (config->AuSize));
+
+        SIM_CHECK (SD_DevGetInfo (&SD_SpiDev, &info) == SD_OK);
+        SIM_CHECK (info.Blocks == config->Blocks);
+        SIM_CHECK (info.AuBlocks == SD_AuBlocks (config->AuSize));
+}
+
+/**
+ * @brief  The same blocks on both cards, one after the other then at the same
+ *         time. Programming included.
+ */
+static void TestWrite (void)
+{
+        Transfer sdio = { 0, SD_ERROR }, spi = { 0, SD_ERROR };
+        uint64_t start, tSdio, tSpi, tBoth;
+
+        start = Sim_Now ();
+        SIM_CHECK (SD_DevWrite (&SD_SdioDev, SdioData, FIRST_BLOCK, SDIO_BLOCKS) == SD_OK);
+        tSdio = Sim_Now () - start;
+
+        start = Sim_Now ();
+        SIM_CHECK (SD_DevWrite (&SD_SpiDev, SpiData, FIRST_BLOCK, SPI_BLOCKS) == SD_OK);
+        tSpi = Sim_Now () - start;
+
+        /*!< Other data, so that the concurrent writes are seen in the images */
+        Fill (SdioData, sizeof (SdioData), 5);
+        Fill (SpiData, sizeof (SpiData), 6);
+        start = Sim_Now ();
+        SIM_CHECK (SD_DevWriteAsync (&SD_SdioDev, SdioData, FIRST_BLOCK, SDIO_BLOCKS, Done, &sdio) == SD_OK);
+        SIM_CHECK (SD_DevWriteAsync (&SD_SpiDev, SpiData, FIRST_BLOCK, SPI_BLOCKS, Done, &spi) == SD_OK);
+        WaitBoth (&sdio, &spi);
+        SIM_CHECK (SD_DevWaitReady (&SD_SdioDev) == SD_OK);
+        SIM_CHECK (SD_DevWaitReady (&SD_SpiDev) == SD_OK);
+        tBoth = Sim_Now () - start;
+
+        printf ("write : sdio %u us, spi %u us, both at once %u us\n", Us (tSdio), Us (tSpi), Us (tBoth));
+        SIM_CHECK (sdio.Status == SD_OK);
+        SIM_CHECK (spi.Status == SD_OK);
+        SIM_CHECK (memcmp (Sim_CardImage () + (size_t) FIRST_BLOCK * BLOCK, SdioData, sizeof (SdioData)) == 0);
+        SIM_CHECK (memcmp (Sim_SpiCardImage () + (size_t) FIRST_BLOCK * BLOCK, SpiData, sizeof (SpiData)) == 0);
+        SIM_CHECK (!Sim_CardIsBusy () && !Sim_SpiCardIsBusy ());
+        SIM_CHECK (tBoth < tSdio + tSpi - ((tSdio < tSpi) ? tSdio : tSpi) / 2);
+}
+
+static void TestRead (void)
+{
+        Transfer sdio = { 0, SD_ERROR }, spi = { 0, SD_ERROR };
+        uint64_t start, tSdio, tSpi, tBoth;
+
+        start = Sim_Now ();
+        SIM_CHECK (SD_DevRead (&SD_SdioDev, SdioBuffer, FIRST_BLOCK, SDIO_BLOCKS) == SD_OK);
+        tSdio = Sim_Now () - start;
+
+        start = Sim_Now ();
+        SIM_CHECK (SD_DevRead (&SD_SpiDev, SpiBuffer, FIRST_BLOCK, SPI_BLOCKS) == SD_OK);
+        tSpi = Sim_Now () - start;
+
+        memset (SdioBuffer, 0, sizeof (SdioBuffer));
+        memset (SpiBuffer, 0, sizeof (SpiBuffer));
+        start = Sim_Now ();
+        SIM_CHECK (SD_DevReadAsync (&SD_SpiDev, SpiBuffer, FIRST_BLOCK, SPI_BLOCKS, Done, &spi) == SD_OK);
+        SIM_CHECK (SD_DevReadAsync (&SD_SdioDev, SdioBuffer, FIRST_BLOCK, SDIO_BLOCKS, Done, &sdio) == SD_OK);
+        WaitBoth (&sdio, &spi);
+        tBoth = Sim_Now () - start;
+
+        printf ("read  : sdio %u us, spi %u us, both at once %u us\n", Us (tSdio), Us (tSpi), Us (tBoth));
+        SIM_CHECK (sdio.Status == SD_OK);
+        SIM_CHECK (spi.Status == SD_OK);
+        SIM_CHECK (memcmp (SdioBuffer, SdioData, sizeof (SdioData)) == 0);
+        SIM_CHECK (memcmp (SpiBuffer, SpiData, sizeof (SpiData)) == 0);
+        SIM_CHECK (tBoth < tSdio + tSpi - ((tSdio < tSpi) ? tSdio : tSpi) / 2);
+}
+
+/**
+ * @brief  A second transfer on a busy device is refused, the other device still
+ *         takes one.
+ */
+static void TestBusy (void)
+{
+        Transfer spi = { 0, SD_ERROR }, sdio = { 0, SD_ERROR };
+
+        SIM_CHECK (SD_DevReadAsync (&SD_SpiDev, SpiBuffer, FIRST_BLOCK, SPI_BLOCKS, Done, &spi) == SD_OK);
+        SIM_CHECK (SD_DevReadAsync (&SD_SpiDev, SpiBuffer, FIRST_BLOCK, 1, NULL, NULL) == SD_REQUEST_PENDING);
+        SIM_CHECK (SD_DevReadAsync (&SD_SdioDev, SdioBuffer, FIRST_BLOCK, 1, Done, &sdio) == SD_OK);
+        WaitBoth (&sdio, &spi);
+        SIM_CHECK ((sdio.Status == SD_OK) && (spi.Status == SD_OK));
+}
+
+static void Test (void)
+{
+        Sim_CardConfig config;
+
+        unlink (SDIO_IMAGE);
+        unlink (SPI_IMAGE);
+        Sim_CardDefaults (&config);
+        config.InitPolls = 1;
+        config.ImagePath = SDIO_IMAGE;
+        Sim_CardInsert (&config);
+        config.ImagePath = SPI_IMAGE;
+        Sim_SpiCardInsert (&config);
+        Sim_BoardInit ();
+
+        SIM_CHECK (SD_DevInit (&SD_SdioDev) == SD_OK);
+        SIM_CHECK (SD_DevInit (&SD_SpiDev) == SD_OK);
+        Fill (SdioData, sizeof (SdioData), 1);
+        Fill (SpiData, sizeof (SpiData), 2);
+
+        TestInfo (&config);
+        TestWrite ();
+        TestRead ();
+        TestBusy ();
+}
+
+int main (void)
+{
+        return (Sim_Run (Test));
+}
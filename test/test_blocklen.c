@@ -0,0 +1,102 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include "sim.h"
+#include "sdio_high_level.h"
+
+/*
+ * Block length cache : CMD16 only when the length changes. Commands per 4 KB
+ * random request, on SDHC and SDSC cards, and the 64 byte SD status read in
+ * between, which must be followed by one CMD16 back to 512.
+ */
+
+#define REQUEST_BLOCKS                8
+#define REQUESTS                      64
+#define AREA_BLOCKS                   8192
+
+static uint8_t Buffer[REQUEST_BLOCKS * 512] __attribute__ ((aligned (4)));
+
+static uint32_t Address (uint32_t i)
+{
+        return (((i * 2654435761u) >> 8) % (AREA_BLOCKS / REQUEST_BLOCKS)) * REQUEST_BLOCKS;
+}
+
+/**
+ * @brief  REQUESTS random 4 KB writes then reads.
+ * @retval Number of CMD16 sent.
+ */
+static uint32_t Run (const char *card)
+{
+        Sim_Stats stats;
+        uint32_t i;
+
+        Sim_ResetStats ();
+
+        for (i = 0; i < REQUESTS; i++) {
+                SIM_CHECK (SD_WriteMultiBlocks (Buffer, (uint64_t) Address (i) * 512, 512, REQUEST_BLOCKS) == SD_OK);
+                SIM_CHECK (SD_WaitWriteOperation () == SD_OK);
+                SIM_CHECK (SD_WaitReady () == SD_OK);
+        }
+
+        for (i = 0; i < REQUESTS; i++) {
+                SIM_CHECK (SD_ReadMultiBlocks (Buffer, (uint64_t) Address (i) * 512, 512, REQUEST_BLOCKS) == SD_OK);
+                SIM_CHECK (SD_WaitReadOperation () == SD_OK);
+        }
+
+        Sim_GetStats (&stats);
+        printf ("%s : %u requests, %u commands, %u.%02u per request, %u CMD16 (%u without the cache)\n", card, 2 * REQUESTS, stats.CommandTotal,
+                stats.CommandTotal / (2 * REQUESTS), stats.CommandTotal * 100 / (2 * REQUESTS) % 100, stats.Commands[16], 2 * REQUESTS);
+        return (stats.Commands[16]);
+}
+
+/**
+ * @brief  The SD status is read with a 64 byte block : the next 512 byte command
+ *         sets the length back, once.
+ */
+static void TestStatusRead (void)
+{
+        Sim_Stats stats;
+        uint32_t status[16];
+
+        SIM_CHECK (SD_SendSDStatus (status) == SD_OK);
+        Sim_ResetStats ();
+        SIM_CHECK (SD_ReadMultiBlocks (Buffer, 0, 512, REQUEST_BLOCKS) == SD_OK);
+        SIM_CHECK (SD_WaitReadOperation () == SD_OK);
+        SIM_CHECK (SD_ReadMultiBlocks (Buffer, 0, 512, REQUEST_BLOCKS) == SD_OK);
+        SIM_CHECK (SD_WaitReadOperation () == SD_OK);
+        Sim_GetStats (&stats);
+        SIM_CHECK (stats.Commands[16] == 1);
+}
+
+static void TestCard (uint8_t highCapacity)
+{
+        Sim_CardConfig config;
+
+        Sim_CardDefaults (&config);
+        config.HighCapacity = highCapacity;
+        Sim_CardInsert (&config);
+        SIM_CHECK (SD_Init () == SD_OK);
+
+        /*!< SD_Init leaves the length at 512 */
+        SIM_CHECK (Run ((highCapacity) ? "SDHC" : "SDSC") == 0);
+        TestStatusRead ();
+}
+
+static void Test (void)
+{
+        Sim_BoardInit ();
+        TestCard (1);
+        TestCard (0);
+}
+
+int main (void)
+{
+        return (Sim_Run (Test));
+}
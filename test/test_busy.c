@@ -0,0 +1,155 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include "sim.h"
+#include "sd_time.h"
+#include "sdio_high_level.h"
+
+/*
+ * End of card programming : CMD13 polling (what main.c did) against the D0 busy
+ * line (SD_WaitReady, SD_NotifyWhenReady), for programming delays from 100 us to
+ * 4 ms. Commands and register polling per write, and the time per write : the
+ * D0 waits must not end later than the polling.
+ */
+
+#define WRITES                        4
+#define WRITE_BLOCKS                  8
+#define WRITE_ADDR                    (8192 * 512)
+
+typedef enum {
+        WAIT_CMD13,
+        WAIT_D0,
+        WAIT_NOTIFY
+} WaitKind;
+
+static const char *const WaitName[] = { "CMD13 polling", "D0 wait", "D0 notify" };
+static const uint32_t ProgramUs[] = { 100, 1000, 4000 };
+
+static uint8_t Data[WRITE_BLOCKS * 512] __attribute__ ((aligned (4)));
+static volatile uint32_t Notified;
+
+typedef struct {
+        uint32_t Cmd13; /*!< Per write */
+        uint32_t StaReads; /*!< Per write */
+        uint32_t Us; /*!< Per write, programming included */
+        uint8_t Ok;
+} Result;
+
+static void Ready (SD_Error error, void *context)
+{
+        Notified = 1;
+}
+
+/**
+ * @brief  Waits for the end of programming, the old way or on D0.
+ */
+static SD_Error Wait (WaitKind kind)
+{
+        SDCardState state;
+
+        switch (kind) {
+                case WAIT_CMD13:
+                        do {
+                                state = SD_GetState ();
+                        } while (state == SD_CARD_PROGRAMMING);
+
+                        return ((state == SD_CARD_TRANSFER) ? SD_OK : SD_ERROR);
+
+                case WAIT_D0:
+                        return (SD_WaitReady ());
+
+                default:
+                        Notified = 0;
+                        SD_NotifyWhenReady (Ready, NULL);
+
+                        __disable_irq ();
+
+                        while (!Notified) {
+                                SD_Sleep ();
+                                __enable_irq ();
+                                __disable_irq ();
+                        }
+
+                        __enable_irq ();
+                        return (SD_OK);
+        }
+}
+
+static void Run (WaitKind kind, Result *result)
+{
+        Sim_Stats stats;
+        uint64_t start = Sim_Now ();
+        uint32_t i;
+
+        memset (result, 0, sizeof (*result));
+        result->Ok = 1;
+        Sim_ResetStats ();
+
+        for (i = 0; i < WRITES; i++) {
+                memset (Data, (int) (i + kind * WRITES), sizeof (Data));
+                result->Ok &= (SD_WriteMultiBlocks (Data, WRITE_ADDR + (uint64_t) i * sizeof (Data), 512, WRITE_BLOCKS) == SD_OK);
+                result->Ok &= (SD_WaitWriteOperation () == SD_OK);
+                result->Ok &= (Wait (kind) == SD_OK);
+                result->Ok &= !Sim_CardIsBusy ();
+                result->Ok &= (memcmp (Sim_CardImage () + WRITE_ADDR + i * sizeof (Data), Data, sizeof (Data)) == 0);
+        }
+
+        Sim_GetStats (&stats);
+        result->Cmd13 = stats.Commands[13] / WRITES;
+        result->StaReads = stats.StaReads / WRITES;
+        result->Us = (uint32_t) ((Sim_Now () - start) / WRITES / (SIM_HZ / 1000000));
+}
+
+static void Sweep (uint32_t programUs)
+{
+        Sim_CardConfig config;
+        Result result[3];
+        uint32_t kind;
+
+        Sim_CardDefaults (&config);
+        config.ProgramUs = programUs;
+        config.ProgramBlockUs = 0;
+        Sim_CardInsert (&config);
+        SIM_CHECK (SD_Init () == SD_OK);
+
+        for (kind = WAIT_CMD13; kind <= WAIT_NOTIFY; kind++) {
+                Run ((WaitKind) kind, &result[kind]);
+                SIM_CHECK (result[kind].Ok);
+                printf ("program %5u us, %-13s : %5u CMD13, %6u STA polls, %6u us per write\n", (unsigned int) programUs, WaitName[kind],
+                        (unsigned int) result[kind].Cmd13, (unsigned int) result[kind].StaReads, (unsigned int) result[kind].Us);
+        }
+
+        /*!< Polling grows with the delay, the D0 waits do not */
+        SIM_CHECK (result[WAIT_D0].Cmd13 <= 1);
+        SIM_CHECK (result[WAIT_NOTIFY].Cmd13 == 0);
+        SIM_CHECK (result[WAIT_D0].StaReads <= result[WAIT_CMD13].StaReads);
+        SIM_CHECK (result[WAIT_D0].Us <= result[WAIT_CMD13].Us + 2);
+        SIM_CHECK (result[WAIT_NOTIFY].Us <= result[WAIT_CMD13].Us + 2);
+
+        if (programUs >= 1000) {
+                SIM_CHECK (result[WAIT_CMD13].Cmd13 > 10 * result[WAIT_D0].Cmd13);
+        }
+}
+
+static void Test (void)
+{
+        uint32_t i;
+
+        Sim_BoardInit ();
+
+        for (i = 0; i < sizeof (ProgramUs) / sizeof (ProgramUs[0]); i++) {
+                Sweep (ProgramUs[i]);
+        }
+}
+
+int main (void)
+{
+        return (Sim_Run (Test));
+}
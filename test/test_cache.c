@@ -0,0 +1,259 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "sim.h"
+#include "sd_cache.h"
+#include "sd_recovery.h"
+
+/*
+ * The write-back cache (sd_cache.c) on a card backed by an image file : random
+ * reads and writes checked against a shadow copy, then the file itself after the
+ * flush. LRU replacement in a set, dirty neighbours written back with one CMD25,
+ * bypassed transfers kept coherent with the lines, and a FAT like access pattern
+ * with and without the cache.
+ */
+
+#define IMAGE_PATH                    "test_cache.img"
+#define AREA_BLOCK                    2048
+#define AREA_BLOCKS                   96
+#define BLOCK                         SD_CACHE_BLOCK_SIZE
+
+static uint8_t Shadow[AREA_BLOCKS * BLOCK];
+static uint8_t Buffer[8 * BLOCK] __attribute__ ((aligned (4)));
+static uint8_t File[AREA_BLOCKS * BLOCK];
+static uint32_t Seed = 1;
+
+static uint32_t Random (void)
+{
+        Seed = Seed * 1103515245 + 12345;
+        return (Seed >> 8);
+}
+
+static uint64_t Addr (uint32_t block)
+{
+        return ((uint64_t) (AREA_BLOCK + block) * BLOCK);
+}
+
+static SD_CacheStats Stats (void)
+{
+        SD_CacheStats stats;
+
+        SD_CacheGetStats (&stats);
+        return (stats);
+}
+
+/**
+ * @brief  Compares the area in the image file (not the mapping) with the shadow.
+ */
+static uint8_t FileMatches (void)
+{
+        int fd = open (IMAGE_PATH, O_RDONLY);
+        ssize_t got;
+
+        if (fd < 0) {
+                return (0);
+        }
+
+        got = pread (fd, File, sizeof (File), Addr (0));
+        close (fd);
+        return ((got == sizeof (File)) && (memcmp (File, Shadow, sizeof (File)) == 0));
+}
+
+/**
+ * @brief  Random short and long, aligned and unaligned reads and writes over an
+ *         area three times the size of the cache. Every read is checked against
+ *         the shadow, the file after the flush.
+ */
+static void TestRandom (void)
+{
+        uint32_t i, k, block, count, offset;
+        uint8_t mismatch = 0;
+
+        memcpy (Shadow, Sim_CardImage () + Addr (0), sizeof (Shadow));
+        SD_CacheInit ();
+
+        for (i = 0; i < 3000; i++) {
+                count = 1 + Random () % 6;
+                block = Random () % (AREA_BLOCKS - count);
+                offset = (Random () % 4 == 0) ? 1 : 0;
+
+                if (Random () % 3 == 0) {
+                        for (k = 0; k < count * BLOCK; k++) {
+                                Buffer[offset + k] = (uint8_t) Random ();
+                        }
+
+                        SIM_CHECK (SD_CacheWrite (Buffer + offset, Addr (block), count) == SD_OK);
+                        memcpy (Shadow + block * BLOCK, Buffer + offset, count * BLOCK);
+                }
+                else {
+                        SIM_CHECK (SD_CacheRead (Buffer + offset, Addr (block), count) == SD_OK);
+                        mismatch |= (memcmp (Buffer + offset, Shadow + block * BLOCK, count * BLOCK) != 0);
+                }
+        }
+
+        SIM_CHECK (!mismatch);
+        SIM_CHECK (SD_CacheFlush () == SD_OK);
+        SIM_CHECK (FileMatches ());
+        printf ("random : %u hits, %u misses, %u bypassed, %u evictions, %u write backs of %u blocks\n", Stats ().Hits, Stats ().Misses,
+                Stats ().Bypassed, Stats ().Evictions, Stats ().WriteBacks, Stats ().BlocksWritten);
+}
+
+/**
+ * @brief  Five blocks of set 0 : the least recently used one goes.
+ */
+static void TestLru (void)
+{
+        uint32_t i, misses;
+
+        SD_CacheInit ();
+
+        for (i = 0; i < SD_CACHE_WAYS; i++) {
+                SIM_CHECK (SD_CacheRead (Buffer, Addr (i * SD_CACHE_SETS), 1) == SD_OK);
+        }
+
+        /*!< Block 0 used again, block SD_CACHE_SETS is now the oldest */
+        SIM_CHECK (SD_CacheRead (Buffer, Addr (0), 1) == SD_OK);
+        SIM_CHECK (SD_CacheRead (Buffer, Addr (SD_CACHE_WAYS * SD_CACHE_SETS), 1) == SD_OK);
+        SIM_CHECK (Stats ().Evictions == 1);
+
+        misses = Stats ().Misses;
+        SIM_CHECK (SD_CacheRead (Buffer, Addr (0), 1) == SD_OK);
+        SIM_CHECK (Stats ().Misses == misses);
+        SIM_CHECK (SD_CacheRead (Buffer, Addr (SD_CACHE_SETS), 1) == SD_OK);
+        SIM_CHECK (Stats ().Misses == misses + 1);
+}
+
+/**
+ * @brief  Eight single block writes in reverse order : nothing reaches the card
+ *         before the flush, which writes them with one CMD25.
+ */
+static void TestCoalesce (void)
+{
+        Sim_Stats stats;
+        int32_t i;
+
+        SD_CacheInit ();
+        Sim_ResetStats ();
+
+        for (i = SD_CACHE_SETS - 1; i >= 0; i--) {
+                memset (Buffer, 0xC0 + i, BLOCK);
+                SIM_CHECK (SD_CacheWrite (Buffer, Addr (i), 1) == SD_OK);
+                memcpy (Shadow + i * BLOCK, Buffer, BLOCK);
+        }
+
+        Sim_GetStats (&stats);
+        SIM_CHECK (stats.BlocksWritten == 0);
+        SIM_CHECK (!FileMatches ());
+
+        SIM_CHECK (SD_CacheFlush () == SD_OK);
+        Sim_GetStats (&stats);
+        SIM_CHECK (stats.Commands[25] == 1);
+        SIM_CHECK (stats.Commands[24] == 0);
+        SIM_CHECK (Stats ().WriteBacks == 1);
+        SIM_CHECK (Stats ().BlocksWritten == SD_CACHE_SETS);
+        SIM_CHECK (FileMatches ());
+}
+
+/**
+ * @brief  A bypassed write over a dirty line : the flush must not bring the old
+ *         line back. A bypassed read over a dirty line sees the line's data.
+ */
+static void TestBypass (void)
+{
+        uint32_t n = SD_CACHE_BYPASS_BLOCKS;
+
+        SD_CacheInit ();
+
+        memset (Buffer, 0x11, BLOCK);
+        SIM_CHECK (SD_CacheWrite (Buffer, Addr (1), 1) == SD_OK);
+        memset (Buffer, 0x22, n * BLOCK);
+        SIM_CHECK (SD_CacheWrite (Buffer, Addr (0), n) == SD_OK);
+        memcpy (Shadow, Buffer, n * BLOCK);
+        SIM_CHECK (SD_CacheFlush () == SD_OK);
+        SIM_CHECK (FileMatches ());
+
+        memset (Buffer, 0x33, BLOCK);
+        SIM_CHECK (SD_CacheWrite (Buffer, Addr (2), 1) == SD_OK);
+        memcpy (Shadow + 2 * BLOCK, Buffer, BLOCK);
+        SIM_CHECK (SD_CacheRead (Buffer, Addr (0), n) == SD_OK);
+        SIM_CHECK (memcmp (Buffer, Shadow, n * BLOCK) == 0);
+        SIM_CHECK (SD_CacheInvalidate () == SD_OK);
+        SIM_CHECK (FileMatches ());
+}
+
+/**
+ * @brief  FAT like : a FAT block and a directory block read and updated around
+ *         each short data write. Commands sent with and without the cache.
+ */
+static uint32_t Fat (uint8_t cached)
+{
+        Sim_Stats stats;
+        uint32_t i;
+
+        SD_CacheInit ();
+        Sim_ResetStats ();
+
+        for (i = 0; i < 64; i++) {
+                if (cached) {
+                        SIM_CHECK (SD_CacheRead (Buffer, Addr (0), 1) == SD_OK);
+                        SIM_CHECK (SD_CacheWrite (Buffer, Addr (0), 1) == SD_OK);
+                        SIM_CHECK (SD_CacheRead (Buffer, Addr (1), 1) == SD_OK);
+                        SIM_CHECK (SD_CacheWrite (Buffer, Addr (1), 1) == SD_OK);
+                        SIM_CHECK (SD_CacheWrite (Buffer, Addr (16 + i), 1) == SD_OK);
+                }
+                else {
+                        SIM_CHECK (SD_RecoveryRead (Buffer, Addr (0), 1) == SD_OK);
+                        SIM_CHECK (SD_RecoveryWrite (Buffer, Addr (0), 1) == SD_OK);
+                        SIM_CHECK (SD_RecoveryRead (Buffer, Addr (1), 1) == SD_OK);
+                        SIM_CHECK (SD_RecoveryWrite (Buffer, Addr (1), 1) == SD_OK);
+                        SIM_CHECK (SD_RecoveryWrite (Buffer, Addr (16 + i), 1) == SD_OK);
+                }
+        }
+
+        SIM_CHECK (SD_CacheFlush () == SD_OK);
+        Sim_GetStats (&stats);
+        return (stats.CommandTotal);
+}
+
+static void TestFat (void)
+{
+        uint32_t direct = Fat (0);
+        uint32_t cached = Fat (1);
+
+        printf ("FAT pattern : %u commands direct, %u through the cache, %u hits %u misses\n", direct, cached, Stats ().Hits, Stats ().Misses);
+        SIM_CHECK (cached * 4 < direct);
+        SIM_CHECK (Stats ().Hits > 3 * Stats ().Misses);
+}
+
+static void Test (void)
+{
+        Sim_CardConfig config;
+
+        unlink (IMAGE_PATH);
+        Sim_CardDefaults (&config);
+        config.ImagePath = IMAGE_PATH;
+        Sim_CardInsert (&config);
+        Sim_BoardInit ();
+        SIM_CHECK (SD_Init () == SD_OK);
+        SD_RecoveryInit ();
+
+        TestRandom ();
+        TestLru ();
+        TestCoalesce ();
+        TestBypass ();
+        TestFat ();
+}
+
+int main (void)
+{
+        return (Sim_Run (Test));
+}
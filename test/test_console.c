@@ -0,0 +1,210 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include "sim.h"
+#include "misc.h"
+#include "console.h"
+
+/*
+ * The DMA driven console (console.c) on the simulated USART1 : the baud rates,
+ * a write returning long before its bytes are on the line, messages coming out
+ * whole and in order across the ring wrap, and the two policies when the ring is
+ * full : blocking until the DMA made room, dropping and counting.
+ */
+
+#define FAST_BAUD                     10500000
+#define SLOW_BAUD                     921600
+#define SLOW_BYTES                    100
+#define MESSAGES                      80
+
+static char Expected[8 * CONSOLE_TX_SIZE];
+static uint8_t Line[8 * CONSOLE_TX_SIZE];
+
+static uint32_t CharUs100 (void)
+{
+        return ((uint32_t) (Sim_UsartCharCycles () * 100 / (SIM_HZ / 1000000)));
+}
+
+/**
+ * @brief  Sends everything queued, then checks the line against Expected.
+ */
+static uint8_t LineMatches (uint32_t length)
+{
+        uint32_t n;
+
+        Console_Flush ();
+        n = Sim_UsartTake (Line, sizeof (Line));
+        return ((n == length) && (memcmp (Line, Expected, length) == 0));
+}
+
+/**
+ * @brief  The character time BRR gives, 8x oversampling above APB2 / 16.
+ */
+static void TestBaud (void)
+{
+        static const uint32_t Bauds[] = { 9600, 115200, 2000000, 4000000, 10500000 };
+        uint64_t expected, got;
+        uint32_t i;
+
+        for (i = 0; i < sizeof (Bauds) / sizeof (Bauds[0]); i++) {
+                Console_Init (Bauds[i]);
+                expected = (uint64_t) SIM_HZ * 10 / Bauds[i];
+                got = Sim_UsartCharCycles ();
+                printf ("%8u baud : %u.%02u us per character\n", (unsigned int) Bauds[i], CharUs100 () / 100, CharUs100 () % 100);
+                SIM_CHECK (got * 100 >= expected * 99);
+                SIM_CHECK (got * 100 <= expected * 101);
+        }
+}
+
+/**
+ * @brief  SLOW_BYTES at SLOW_BAUD : the write takes microseconds, the line about
+ *         a millisecond.
+ */
+static void TestNonBlocking (void)
+{
+        Console_Stats stats;
+        uint64_t start, wrote;
+        uint32_t i;
+
+        Console_Init (SLOW_BAUD);
+
+        for (i = 0; i < SLOW_BYTES; i++) {
+                Expected[i] = (char) ('a' + i % 26);
+        }
+
+        start = Sim_Now ();
+        SIM_CHECK (Console_Write (Expected, SLOW_BYTES) == SLOW_BYTES);
+        wrote = Sim_Now () - start;
+        SIM_CHECK (LineMatches (SLOW_BYTES));
+
+        printf ("%u bytes at %u baud : queued in %u us, sent in %u us\n", SLOW_BYTES, SLOW_BAUD, (unsigned int) (wrote / (SIM_HZ / 1000000)),
+                (unsigned int) ((Sim_Now () - start) / (SIM_HZ / 1000000)));
+        SIM_CHECK (wrote < SIM_US (20));
+        SIM_CHECK (Sim_Now () - start >= SLOW_BYTES * Sim_UsartCharCycles ());
+        Console_GetStats (&stats);
+        SIM_CHECK (stats.Written == SLOW_BYTES);
+        SIM_CHECK (stats.DroppedBytes == 0);
+}
+
+/**
+ * @brief  MESSAGES lines of 2 to 80 characters, more than the ring : blocking,
+ *         all of them come out whole, in order, through the wraps.
+ */
+static void TestOrdering (void)
+{
+        Console_Stats stats;
+        char message[96];
+        uint32_t i, n, length = 0;
+
+        Console_Init (FAST_BAUD);
+        Console_SetPolicy (CONSOLE_BLOCK);
+
+        for (i = 0; i < MESSAGES; i++) {
+                n = (uint32_t) snprintf (message, sizeof (message), "%u:%.*s\r\n", (unsigned int) i, (int) ((i * 37) % 72),
+                                "abcdefghijklmnopqrstuvwxyz0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789abcdefghij");
+                memcpy (Expected + length, message, n);
+                length += n;
+                SIM_CHECK (Console_Write (message, (int) n) == (int) n);
+        }
+
+        SIM_CHECK (LineMatches (length));
+        Console_GetStats (&stats);
+        printf ("ordering : %u messages, %u bytes, %u dropped\n", MESSAGES, (unsigned int) length, (unsigned int) stats.DroppedBytes);
+        SIM_CHECK (length > CONSOLE_TX_SIZE);
+        SIM_CHECK (stats.Written == length);
+        SIM_CHECK (stats.DroppedBytes == 0);
+}
+
+/**
+ * @brief  A write larger than the free room, blocking : it returns once the DMA
+ *         sent enough, nothing lost.
+ */
+static void TestBlock (void)
+{
+        Console_Stats stats;
+        uint64_t start;
+        uint32_t i, length = CONSOLE_TX_SIZE + 300;
+
+        Console_Init (FAST_BAUD);
+        Console_SetPolicy (CONSOLE_BLOCK);
+
+        for (i = 0; i < length; i++) {
+                Expected[i] = (char) ('0' + i % 10);
+        }
+
+        start = Sim_Now ();
+        SIM_CHECK (Console_Write (Expected, (int) length) == (int) length);
+        SIM_CHECK (Sim_Now () - start >= 300 * Sim_UsartCharCycles ());
+        SIM_CHECK (LineMatches (length));
+        Console_GetStats (&stats);
+        SIM_CHECK (stats.Written == length);
+        SIM_CHECK (stats.DroppedBytes == 0);
+        SIM_CHECK (stats.DroppedWrites == 0);
+}
+
+/**
+ * @brief  The same, dropping : returns at once, what did not fit is counted, the
+ *         line has exactly the bytes that fitted. Accepted again once drained.
+ */
+static void TestDrop (void)
+{
+        Console_Stats stats;
+        uint64_t start;
+        uint32_t i, length = CONSOLE_TX_SIZE + 300;
+
+        Console_Init (FAST_BAUD);
+        Console_SetPolicy (CONSOLE_DROP);
+
+        for (i = 0; i < length; i++) {
+                Expected[i] = (char) ('A' + i % 26);
+        }
+
+        start = Sim_Now ();
+        SIM_CHECK (Console_Write (Expected, (int) length) == (int) length);
+        SIM_CHECK (Console_Write ("lost\r\n", 6) == 6);
+        SIM_CHECK (Sim_Now () - start < SIM_US (20));
+
+        Console_GetStats (&stats);
+        SIM_CHECK (stats.Written == CONSOLE_TX_SIZE);
+        SIM_CHECK (stats.DroppedBytes == 300 + 6);
+        SIM_CHECK (stats.DroppedWrites == 2);
+        SIM_CHECK (LineMatches (CONSOLE_TX_SIZE));
+
+        memcpy (Expected, "back\r\n", 6);
+        SIM_CHECK (Console_Write ("back\r\n", 6) == 6);
+        SIM_CHECK (LineMatches (6));
+        Console_SetPolicy (CONSOLE_BLOCK);
+}
+
+static void Test (void)
+{
+        NVIC_InitTypeDef NVIC_InitStructure;
+
+        Sim_BoardInit ();
+
+        /*!< As main.c */
+        NVIC_InitStructure.NVIC_IRQChannel = CONSOLE_DMA_IRQn;
+        NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 1;
+        NVIC_InitStructure.NVIC_IRQChannelSubPriority = 1;
+        NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+        NVIC_Init (&NVIC_InitStructure);
+
+        TestBaud ();
+        TestNonBlocking ();
+        TestOrdering ();
+        TestBlock ();
+        TestDrop ();
+        SIM_CHECK (Sim_UsartLost () == 0);
+}
+
+int main (void)
+{
+        return (Sim_Run (Test));
+}
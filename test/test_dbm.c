@@ -0,0 +1,235 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include "sim.h"
+#include "sdio_high_level.h"
+
+/*
+ * Double buffered transfers, the way main.c uses them on the board : a 48 KB
+ * pattern written and read back through two 2 KB buffers, an erased area read
+ * the same way, a stream fed from two buffers. The buffers must be handed out
+ * in turns, once per buffer time, and the bus must not wait for the refills.
+ */
+
+#define BUFFER_BLOCKS                 4
+#define BUFFER_SIZE                   (BUFFER_BLOCKS * 512)
+#define TEST_BLOCKS                   96
+#define TEST_SIZE                     (TEST_BLOCKS * 512)
+#define TEST_ADDR                     (2048 * 512)
+
+static uint8_t Buffer0[BUFFER_SIZE] __attribute__ ((aligned (4)));
+static uint8_t Buffer1[BUFFER_SIZE] __attribute__ ((aligned (4)));
+static uint8_t Flat[TEST_SIZE] __attribute__ ((aligned (4)));
+
+typedef struct {
+        uint32_t Offset; /*!< Pattern bytes produced or checked so far */
+        uint32_t Calls;
+        uint8_t *Last; /*!< Buffer of the previous call */
+        uint8_t Failed;
+} Producer;
+
+static uint8_t Pattern (uint32_t offset)
+{
+        return ((uint8_t) (offset * 3 + (offset >> 9) + 0x5A));
+}
+
+static void Fill (uint8_t *buffer, uint32_t size, uint32_t offset)
+{
+        uint32_t i;
+
+        for (i = 0; i < size; i++) {
+                buffer[i] = Pattern (offset + i);
+        }
+}
+
+/**
+ * @brief  Checks that the buffers come in turns, starting with buffer0.
+ */
+static void Turn (Producer *p, uint8_t *buffer)
+{
+        if (buffer != ((p->Calls & 1) ? Buffer1 : Buffer0) || buffer == p->Last) {
+                p->Failed = 1;
+        }
+
+        p->Last = buffer;
+        ++p->Calls;
+}
+
+/**
+ * @brief  Write callback : the buffer just sent gets the next part of the pattern.
+ */
+static void Refill (uint8_t *buffer, void *context)
+{
+        Producer *p = (Producer *) context;
+
+        Turn (p, buffer);
+
+        if (p->Offset < TEST_SIZE) {
+                Fill (buffer, BUFFER_SIZE, p->Offset);
+                p->Offset += BUFFER_SIZE;
+        }
+}
+
+/**
+ * @brief  Read callback : compares the full buffer with the pattern.
+ */
+static void Consume (uint8_t *buffer, void *context)
+{
+        Producer *p = (Producer *) context;
+        uint32_t i;
+
+        Turn (p, buffer);
+
+        for (i = 0; i < BUFFER_SIZE; i++) {
+                if (buffer[i] != Pattern (p->Offset + i)) {
+                        p->Failed = 1;
+                        break;
+                }
+        }
+
+        p->Offset += BUFFER_SIZE;
+}
+
+/**
+ * @brief  Read callback after the erase : every byte as erased.
+ */
+static void ConsumeErased (uint8_t *buffer, void *context)
+{
+        Producer *p = (Producer *) context;
+        uint32_t i;
+
+        Turn (p, buffer);
+
+        for (i = 0; i < BUFFER_SIZE; i++) {
+                if (buffer[i] != Sim_CardImage ()[TEST_ADDR]) {
+                        p->Failed = 1;
+                        break;
+                }
+        }
+}
+
+static void Prime (Producer *p)
+{
+        memset (p, 0, sizeof (*p));
+        Fill (Buffer0, BUFFER_SIZE, 0);
+        Fill (Buffer1, BUFFER_SIZE, BUFFER_SIZE);
+        p->Offset = 2 * BUFFER_SIZE;
+}
+
+static void Check (const Producer *p)
+{
+        uint32_t i;
+
+        SIM_CHECK (!p->Failed);
+        SIM_CHECK (p->Calls == TEST_BLOCKS / BUFFER_BLOCKS);
+
+        for (i = 0; i < TEST_SIZE; i++) {
+                if (Sim_CardImage ()[TEST_ADDR + i] != Pattern (i)) {
+                        break;
+                }
+        }
+
+        SIM_CHECK (i == TEST_SIZE);
+}
+
+/**
+ * @brief  Writes and reads the pattern through the two buffers. Both must take
+ *         about as long as the same transfer from one flat buffer.
+ */
+static void TestMultiBlock (void)
+{
+        Producer p;
+        uint64_t start, dbm, flat;
+
+        Prime (&p);
+        SIM_CHECK (SD_WriteMultiBlocksDoubleBuffer (Buffer0, Buffer1, BUFFER_BLOCKS, TEST_ADDR, TEST_BLOCKS, Refill, &p) == SD_OK);
+        SIM_CHECK (SD_WaitWriteOperation () == SD_OK);
+        SIM_CHECK (SD_WaitReady () == SD_OK);
+        Check (&p);
+
+        memset (&p, 0, sizeof (p));
+        start = Sim_Now ();
+        SIM_CHECK (SD_ReadMultiBlocksDoubleBuffer (Buffer0, Buffer1, BUFFER_BLOCKS, TEST_ADDR, TEST_BLOCKS, Consume, &p) == SD_OK);
+        SIM_CHECK (SD_WaitReadOperation () == SD_OK);
+        dbm = Sim_Now () - start;
+        SIM_CHECK (!p.Failed);
+        SIM_CHECK (p.Calls == TEST_BLOCKS / BUFFER_BLOCKS);
+
+        start = Sim_Now ();
+        SIM_CHECK (SD_ReadMultiBlocks (Flat, TEST_ADDR, 512, TEST_BLOCKS) == SD_OK);
+        SIM_CHECK (SD_WaitReadOperation () == SD_OK);
+        flat = Sim_Now () - start;
+
+        printf ("%u blocks through 2 x %u bytes : %.1f us, from one %u byte buffer : %.1f us\n", TEST_BLOCKS, BUFFER_SIZE,
+                (double) dbm / (SIM_HZ / 1000000), TEST_SIZE, (double) flat / (SIM_HZ / 1000000));
+        SIM_CHECK (dbm < flat + flat / 20);
+}
+
+/**
+ * @brief  The erase test of main.c : the erased area read through the two buffers.
+ */
+static void TestErase (void)
+{
+        Producer p;
+
+        SIM_CHECK (SD_Erase (TEST_ADDR, TEST_ADDR + TEST_SIZE - 1) == SD_OK);
+        SIM_CHECK (SD_WaitReady () == SD_OK);
+
+        memset (&p, 0, sizeof (p));
+        SIM_CHECK (SD_ReadMultiBlocksDoubleBuffer (Buffer0, Buffer1, BUFFER_BLOCKS, TEST_ADDR, TEST_BLOCKS, ConsumeErased, &p) == SD_OK);
+        SIM_CHECK (SD_WaitReadOperation () == SD_OK);
+        SIM_CHECK (!p.Failed);
+        SIM_CHECK (p.Calls == TEST_BLOCKS / BUFFER_BLOCKS);
+}
+
+/**
+ * @brief  The pattern pushed into a stream from the two buffers, in two calls.
+ */
+static void TestStream (void)
+{
+        Producer p;
+        uint32_t first;
+
+        Prime (&p);
+        SIM_CHECK (SD_StreamOpen (TEST_ADDR, TEST_BLOCKS) == SD_OK);
+        SIM_CHECK (SD_StreamWriteDoubleBuffer (Buffer0, Buffer1, BUFFER_BLOCKS, TEST_BLOCKS / 2, Refill, &p) == SD_OK);
+        SIM_CHECK (SD_WaitWriteOperation () == SD_OK);
+
+        /*!< Both buffers were refilled past the first half, start again from buffer0 */
+        first = p.Calls;
+        p.Calls = 0;
+        p.Last = NULL;
+        SIM_CHECK (SD_StreamWriteDoubleBuffer (Buffer0, Buffer1, BUFFER_BLOCKS, TEST_BLOCKS / 2, Refill, &p) == SD_OK);
+        SIM_CHECK (SD_WaitWriteOperation () == SD_OK);
+        SIM_CHECK (SD_StreamClose () == SD_OK);
+        SIM_CHECK (SD_WaitReady () == SD_OK);
+
+        p.Calls += first;
+        Check (&p);
+}
+
+static void Test (void)
+{
+        Sim_CardConfig config;
+
+        Sim_CardDefaults (&config);
+        Sim_CardInsert (&config);
+        Sim_BoardInit ();
+        SIM_CHECK (SD_Init () == SD_OK);
+
+        TestMultiBlock ();
+        TestErase ();
+        TestStream ();
+}
+
+int main (void)
+{
+        return (Sim_Run (Test));
+}
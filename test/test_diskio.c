@@ -0,0 +1,197 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "sim.h"
+#include "diskio.h"
+
+/*
+ * The FatFs diskio backend (sd_diskio.c) on SDHC and SDSC cards backed by an
+ * image file : multi sector reads and writes go out as one CMD18 / CMD25 whatever
+ * the buffer alignment, the data lands in the file, the ioctls report what the
+ * card says.
+ */
+
+#define IMAGE_PATH                    "test_diskio.img"
+#define SECTOR                        512
+#define AREA_SECTOR                   4096
+#define COUNT                         128
+#define OFFSETS                       4
+
+static uint8_t Buffer[COUNT * SECTOR + OFFSETS] __attribute__ ((aligned (4)));
+static uint8_t Data[COUNT * SECTOR];
+static uint8_t File[COUNT * SECTOR];
+
+static void Fill (uint8_t *buffer, uint32_t size, uint32_t seed)
+{
+        uint32_t i;
+
+        for (i = 0; i < size; i++) {
+                buffer[i] = (uint8_t) (i * 13 + seed + (i >> 9));
+        }
+}
+
+/**
+ * @brief  Compares count sectors of the image file (not the mapping) with Data.
+ */
+static uint8_t FileMatches (DWORD sector, uint32_t count)
+{
+        int fd = open (IMAGE_PATH, O_RDONLY);
+        ssize_t got;
+
+        if (fd < 0) {
+                return (0);
+        }
+
+        got = pread (fd, File, count * SECTOR, (off_t) sector * SECTOR);
+        close (fd);
+        return ((got == count * SECTOR) && (memcmp (File, Data, count * SECTOR) == 0));
+}
+
+/**
+ * @brief  Not initialized yet : everything but disk_initialize is refused.
+ */
+static void TestNotReady (void)
+{
+        DWORD count;
+
+        SIM_CHECK (disk_status (0) & STA_NOINIT);
+        SIM_CHECK (disk_read (0, Buffer, AREA_SECTOR, 1) == RES_NOTRDY);
+        SIM_CHECK (disk_write (0, Buffer, AREA_SECTOR, 1) == RES_NOTRDY);
+        SIM_CHECK (disk_ioctl (0, GET_SECTOR_COUNT, &count) == RES_NOTRDY);
+}
+
+/**
+ * @brief  Drive numbers other than 0, zero sector counts, unknown ioctls.
+ */
+static void TestParameters (void)
+{
+        SIM_CHECK (disk_initialize (1) == STA_NOINIT);
+        SIM_CHECK (disk_status (1) == STA_NOINIT);
+        SIM_CHECK (disk_read (1, Buffer, AREA_SECTOR, 1) == RES_PARERR);
+        SIM_CHECK (disk_read (0, Buffer, AREA_SECTOR, 0) == RES_PARERR);
+        SIM_CHECK (disk_write (0, Buffer, AREA_SECTOR, 0) == RES_PARERR);
+        SIM_CHECK (disk_ioctl (0, 0xFF, Buffer) == RES_PARERR);
+}
+
+/**
+ * @brief  Capacity and sector size from the CSD, erase block from the AU size.
+ */
+static void TestIoctl (const Sim_CardConfig *config)
+{
+        DWORD count = 0, block = 0;
+        WORD size = 0;
+
+        SIM_CHECK (disk_ioctl (0, GET_SECTOR_COUNT, &count) == RES_OK);
+        SIM_CHECK (count == config->Blocks);
+        SIM_CHECK (disk_ioctl (0, GET_SECTOR_SIZE, &size) == RES_OK);
+        SIM_CHECK (size == SECTOR);
+        SIM_CHECK (disk_ioctl (0, GET_BLOCK_SIZE, &block) == RES_OK);
+        SIM_CHECK (block == (16 * 1024 / SECTOR) << (config->AuSize - 1));
+        printf ("%u sectors of %u bytes, erase block %u sectors\n", (unsigned int) count, (unsigned int) size, (unsigned int) block);
+}
+
+/**
+ * @brief  COUNT sectors from buffers at every alignment : one CMD25 each, in the
+ *         file after CTRL_SYNC. Then read back into every alignment with one CMD18.
+ */
+static void TestMulti (void)
+{
+        Sim_Stats stats;
+        DWORD sector;
+        uint32_t offset;
+
+        for (offset = 0; offset < OFFSETS; offset++) {
+                sector = AREA_SECTOR + offset * COUNT;
+                Fill (Data, sizeof (Data), offset);
+                memcpy (Buffer + offset, Data, sizeof (Data));
+
+                Sim_ResetStats ();
+                SIM_CHECK (disk_write (0, Buffer + offset, sector, COUNT) == RES_OK);
+                SIM_CHECK (disk_ioctl (0, CTRL_SYNC, NULL) == RES_OK);
+                Sim_GetStats (&stats);
+                SIM_CHECK (stats.Commands[25] == 1);
+                SIM_CHECK (stats.Commands[24] == 0);
+                SIM_CHECK (!Sim_CardIsBusy ());
+                SIM_CHECK (FileMatches (sector, COUNT));
+        }
+
+        for (offset = 0; offset < OFFSETS; offset++) {
+                sector = AREA_SECTOR + offset * COUNT;
+                Fill (Data, sizeof (Data), offset);
+                memset (Buffer, 0, sizeof (Buffer));
+
+                Sim_ResetStats ();
+                SIM_CHECK (disk_read (0, Buffer + offset, sector, COUNT) == RES_OK);
+                Sim_GetStats (&stats);
+                SIM_CHECK (stats.Commands[18] == 1);
+                SIM_CHECK (stats.Commands[17] == 0);
+                SIM_CHECK (memcmp (Buffer + offset, Data, sizeof (Data)) == 0);
+        }
+}
+
+/**
+ * @brief  One sector, unaligned : one command each way (the recovery layer sends
+ *         CMD25 / CMD18 for a single block too).
+ */
+static void TestSingle (void)
+{
+        Sim_Stats stats;
+        DWORD sector = AREA_SECTOR + OFFSETS * COUNT;
+
+        Fill (Data, SECTOR, 77);
+        memcpy (Buffer + 1, Data, SECTOR);
+        Sim_ResetStats ();
+        SIM_CHECK (disk_write (0, Buffer + 1, sector, 1) == RES_OK);
+        SIM_CHECK (disk_ioctl (0, CTRL_SYNC, NULL) == RES_OK);
+        SIM_CHECK (FileMatches (sector, 1));
+
+        memset (Buffer, 0, sizeof (Buffer));
+        SIM_CHECK (disk_read (0, Buffer + 3, sector, 1) == RES_OK);
+        SIM_CHECK (memcmp (Buffer + 3, Data, SECTOR) == 0);
+        Sim_GetStats (&stats);
+        SIM_CHECK (stats.Commands[25] + stats.Commands[24] == 1);
+        SIM_CHECK (stats.Commands[18] + stats.Commands[17] == 1);
+}
+
+static void Run (uint8_t highCapacity)
+{
+        Sim_CardConfig config;
+
+        unlink (IMAGE_PATH);
+        Sim_CardDefaults (&config);
+        config.HighCapacity = highCapacity;
+        config.ImagePath = IMAGE_PATH;
+        Sim_CardInsert (&config);
+
+        SIM_CHECK (disk_initialize (0) == 0);
+        SIM_CHECK (disk_status (0) == 0);
+        printf ("%s : ", (highCapacity) ? "SDHC" : "SDSC");
+
+        TestIoctl (&config);
+        TestParameters ();
+        TestMulti ();
+        TestSingle ();
+}
+
+static void Test (void)
+{
+        Sim_BoardInit ();
+
+        TestNotReady ();
+        Run (1);
+        Run (0);
+}
+
+int main (void)
+{
+        return (Sim_Run (Test));
+}
@@ -0,0 +1,160 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include "sim.h"
+#include "dlog.h"
+#include "sdio_high_level.h"
+
+/*
+ * The deferred logger (dlog.c) costs the same whatever the state of its ring :
+ * a push, accepted or dropped, touches no peripheral and takes no simulated time,
+ * and reads logging from the SDIO interrupt take exactly as long with the ring
+ * full of unprinted records as with it empty. Records and drops are counted.
+ */
+
+#define TEST_BLOCKS                   16
+#define TEST_ADDR                     (1024 * 512)
+#define READS                         8
+
+static uint8_t Buffer[TEST_BLOCKS * 512] __attribute__ ((aligned (4)));
+
+typedef struct {
+        uint64_t Cycles;
+        uint32_t Accesses;
+        uint32_t Wfi;
+} Cost;
+
+static void Begin (Cost *cost)
+{
+        /*!< From a SysTick : both windows see the ticks at the same place */
+        __WFI ();
+        Sim_ResetStats ();
+        cost->Cycles = Sim_Now ();
+}
+
+static void End (Cost *cost)
+{
+        Sim_Stats stats;
+
+        Sim_GetStats (&stats);
+        cost->Cycles = Sim_Now () - cost->Cycles;
+        cost->Accesses = stats.Accesses;
+        cost->Wfi = stats.Wfi;
+}
+
+/**
+ * @brief  One push with n records already in the ring.
+ */
+static void Push (uint32_t n, Cost *cost)
+{
+        uint32_t i, overflows;
+
+        while (DLog_Process ()) {
+        }
+
+        for (i = 0; i < n; i++) {
+                DLog_Push ("fill %u\r\n", i, 0, 0);
+        }
+
+        overflows = DLog_GetOverflows ();
+        Begin (cost);
+        DLog_Push ("push %u %u %u\r\n", 1, 2, 3);
+        End (cost);
+
+        SIM_CHECK (DLog_GetOverflows () == overflows + (n >= DLOG_DEPTH));
+}
+
+/**
+ * @brief  Empty, half full, one slot left, full : no register access, no time.
+ */
+static void TestPush (void)
+{
+        static const uint32_t Fill[] = { 0, DLOG_DEPTH / 2, DLOG_DEPTH - 1, DLOG_DEPTH };
+        Cost cost;
+        uint32_t i;
+
+        for (i = 0; i < sizeof (Fill) / sizeof (Fill[0]); i++) {
+                Push (Fill[i], &cost);
+                SIM_CHECK (cost.Cycles == 0);
+                SIM_CHECK (cost.Accesses == 0);
+                SIM_CHECK (cost.Wfi == 0);
+        }
+
+        /*!< The DLOG_DEPTH - 1 fills and the push of the last run, the rest dropped */
+        SIM_CHECK (DLog_Process () == DLOG_DEPTH);
+        SIM_CHECK (DLog_Process () == 0);
+}
+
+/**
+ * @brief  READS reads, their SDIO interrupts each log the end of the transfer.
+ */
+static void Reads (Cost *cost)
+{
+        uint32_t i;
+
+        Begin (cost);
+
+        for (i = 0; i < READS; i++) {
+                SIM_CHECK (SD_ReadMultiBlocks (Buffer, TEST_ADDR, 512, TEST_BLOCKS) == SD_OK);
+                SIM_CHECK (SD_WaitReadOperation () == SD_OK);
+        }
+
+        End (cost);
+}
+
+/**
+ * @brief  The same reads with the ring empty and with it full : same time, same
+ *         register accesses. Logged in the first case, counted as dropped in the
+ *         second.
+ */
+static void TestIsr (void)
+{
+        Cost empty, full;
+        uint32_t i, logged, overflows;
+
+        while (DLog_Process ()) {
+        }
+
+        Reads (&empty);
+        logged = DLog_Process ();
+
+        for (i = 0; i < DLOG_DEPTH; i++) {
+                DLog_Push ("fill %u\r\n", i, 0, 0);
+        }
+
+        overflows = DLog_GetOverflows ();
+        Reads (&full);
+
+        printf ("%u reads : %u records logged from the IRQs, %u dropped with the ring full, %u / %u cycles\n", READS, (unsigned int) logged,
+                (unsigned int) (DLog_GetOverflows () - overflows), (unsigned int) empty.Cycles, (unsigned int) full.Cycles);
+        SIM_CHECK (logged >= READS);
+        SIM_CHECK (DLog_GetOverflows () - overflows == logged);
+        SIM_CHECK (full.Cycles == empty.Cycles);
+        SIM_CHECK (full.Accesses == empty.Accesses);
+        SIM_CHECK (DLog_Process () == DLOG_DEPTH);
+}
+
+static void Test (void)
+{
+        Sim_CardConfig config;
+
+        Sim_CardDefaults (&config);
+        Sim_CardInsert (&config);
+        Sim_BoardInit ();
+        SIM_CHECK (SD_Init () == SD_OK);
+
+        TestPush ();
+        TestIsr ();
+}
+
+int main (void)
+{
+        return (Sim_Run (Test));
+}
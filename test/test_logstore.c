@@ -0,0 +1,289 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim.h"
+#include "sd_logstore.h"
+#include "sd_recovery.h"
+
+/*
+ * The log store (sd_logstore.c) on a card with 16 KB allocation units and an image
+ * file : AU aligned segments written with one ACMD23 + CMD25 each, the records
+ * read back in order, the write head found again after a reboot, the circle of
+ * segments. Then power cuts after 1 to 40 received blocks, torn blocks and lost
+ * cached ones included : after the reboot the log must read back as an unbroken
+ * run of the records appended, holding at least everything synced before the cut,
+ * and go on from its end.
+ */
+
+#define IMAGE_PATH                    "test_logstore.img"
+#define AU_SIZE                       1 /*!< 16 KB : 32 blocks */
+#define SEGMENT_BLOCKS                32
+#define SEGMENTS                      4
+#define BASE_BLOCK                    1000
+#define BASE_ALIGNED                  1024
+#define RECORD_MAX                    200
+
+static uint32_t Appended; /*!< Index of the next record */
+static uint32_t Synced; /*!< Records on the card for sure */
+
+/**
+ * @brief  Record index : its index first, then bytes made from it. 4 .. 200 bytes.
+ */
+static uint16_t MakeRecord (uint32_t index, uint8_t *record)
+{
+        uint16_t length = (uint16_t) (4 + (index * 37) % (RECORD_MAX - 3));
+        uint16_t i;
+
+        memcpy (record, &index, 4);
+
+        for (i = 4; i < length; i++) {
+                record[i] = (uint8_t) (index * 7 + i);
+        }
+
+        return (length);
+}
+
+/**
+ * @brief  Appends count records.
+ * @retval Number appended before the first error.
+ */
+static uint32_t Append (uint32_t count)
+{
+        uint8_t record[RECORD_MAX];
+        uint32_t i;
+
+        for (i = 0; i < count; i++) {
+                if (SD_LogAppend (record, MakeRecord (Appended, record)) != SD_OK) {
+                        break;
+                }
+
+                Appended++;
+        }
+
+        return (i);
+}
+
+static SD_Error Sync (void)
+{
+        SD_Error errorstatus = SD_LogSync ();
+
+        if (errorstatus == SD_OK) {
+                Synced = Appended;
+        }
+
+        return (errorstatus);
+}
+
+/**
+ * @brief  Reads the whole log back : consecutive records, each as made.
+ * @param  first: index of the first (oldest) record.
+ * @param  count: number of records.
+ * @retval 1 if the records are an unbroken run, 0 otherwise.
+ */
+static uint8_t ReadBack (uint32_t *first, uint32_t *count)
+{
+        SD_LogCursor cursor;
+        uint8_t record[RECORD_MAX], expected[RECORD_MAX];
+        uint16_t length;
+        uint32_t index;
+
+        *count = 0;
+
+        if (SD_LogReadOpen (&cursor) != SD_OK) {
+                return (0);
+        }
+
+        while (SD_LogReadNext (&cursor, record, sizeof (record), &length) == SD_OK) {
+                if (length == 0) {
+                        return (1);
+                }
+
+                memcpy (&index, record, 4);
+
+                if (*count == 0) {
+                        *first = index;
+                }
+
+                if ((index != *first + *count) || (length != MakeRecord (index, expected)) || (memcmp (record, expected, length) != 0)) {
+                        return (0);
+                }
+
+                (*count)++;
+        }
+
+        return (0);
+}
+
+static SD_Error Boot (void)
+{
+        SD_Error errorstatus = SD_Init ();
+
+        if (errorstatus != SD_OK) {
+                return (errorstatus);
+        }
+
+        SD_RecoveryInit ();
+        return (SD_LogInit (BASE_BLOCK, SEGMENTS));
+}
+
+/**
+ * @brief  A few syncs in the first segment, then up to its end : one stream per
+ *         sync and one to the end of the segment, nothing else on the card.
+ */
+static void TestAppend (void)
+{
+        const SD_LogBlockHeader *header = (const SD_LogBlockHeader *) (Sim_CardImage () + (size_t) BASE_ALIGNED * 512);
+        SD_LogStats stats;
+        Sim_Stats sim;
+        uint32_t first, count;
+
+        SIM_CHECK (Boot () == SD_OK);
+        SD_LogGetStats (&stats);
+        SIM_CHECK (stats.SegmentBlocks == SEGMENT_BLOCKS);
+        SIM_CHECK (stats.Seq == 1 && stats.Head == 0 && stats.NextBlock == 0);
+
+        Sim_ResetStats ();
+        SIM_CHECK (Append (10) == 10);
+        SIM_CHECK (Sync () == SD_OK);
+        SIM_CHECK (Append (10) == 10);
+        SIM_CHECK (Sync () == SD_OK);
+
+        /*!< The first block of the area is on an AU boundary */
+        SIM_CHECK (header->Magic == SD_LOG_MAGIC && header->Seq == 1 && header->Block == 0);
+
+        /*!< Up to the end of the segment */
+        do {
+                SIM_CHECK (Append (1) == 1);
+                SD_LogGetStats (&stats);
+        } while (stats.Head == 0);
+
+        SIM_CHECK (stats.Head == 1 && stats.Seq == 2 && stats.NextBlock == 0);
+        Sim_GetStats (&sim);
+        SIM_CHECK (stats.Streams == 3);
+        SIM_CHECK (sim.Commands[25] == stats.Streams && sim.AppCommands[23] == stats.Streams);
+        SIM_CHECK (sim.Commands[24] == 0);
+
+        SIM_CHECK (Sync () == SD_OK);
+        SIM_CHECK (ReadBack (&first, &count));
+        SIM_CHECK (first == 0 && count == Appended);
+}
+
+/**
+ * @brief  SD_LogInit again on the same card : same head, the appends go on after
+ *         the records already there.
+ */
+static void TestReboot (void)
+{
+        SD_LogStats before, after;
+        uint32_t first, count;
+
+        SIM_CHECK (Append (25) == 25);
+        SIM_CHECK (Sync () == SD_OK);
+        SD_LogGetStats (&before);
+
+        SIM_CHECK (Boot () == SD_OK);
+        SD_LogGetStats (&after);
+        SIM_CHECK (after.Head == before.Head && after.Seq == before.Seq && after.NextBlock == before.NextBlock);
+
+        SIM_CHECK (Append (25) == 25);
+        SIM_CHECK (Sync () == SD_OK);
+        SIM_CHECK (ReadBack (&first, &count));
+        SIM_CHECK (first == 0 && count == Appended);
+}
+
+/**
+ * @brief  Twice around the circle : the oldest segments are reused, the log reads
+ *         back from the oldest record left to the last one.
+ */
+static void TestWrap (void)
+{
+        SD_LogStats stats;
+        uint32_t first, count;
+
+        SIM_CHECK (Append (SEGMENTS * SEGMENT_BLOCKS * 7) == SEGMENTS * SEGMENT_BLOCKS * 7);
+        SIM_CHECK (Sync () == SD_OK);
+        SD_LogGetStats (&stats);
+        SIM_CHECK (stats.Seq > SEGMENTS * 2);
+
+        SIM_CHECK (ReadBack (&first, &count));
+        SIM_CHECK (first > 0 && first + count == Appended);
+        printf ("wrap : %u records, segment %u seq %u, %u left from %u on\n", Appended, stats.Head, stats.Seq, count, first);
+
+        SIM_CHECK (Boot () == SD_OK);
+        SIM_CHECK (ReadBack (&first, &count));
+        SIM_CHECK (first + count == Appended);
+}
+
+/**
+ * @brief  Cuts the power after blocks received blocks, while appending. After the
+ *         reboot : an unbroken run ending between the last sync and the last
+ *         append, which the next appends continue.
+ */
+static void PowerCut (uint32_t blocks, uint32_t syncEvery)
+{
+        uint32_t first, count, i;
+        uint8_t failed = 0;
+
+        Sim_CardPowerCutAfter (blocks);
+
+        for (i = 0; (i < 100) && !failed; i++) {
+                failed = (Append (syncEvery) != syncEvery) || (Sync () != SD_OK);
+        }
+
+        SIM_CHECK (failed);
+        Sim_CardPowerOn ();
+        SIM_CHECK (Boot () == SD_OK);
+
+        SIM_CHECK (ReadBack (&first, &count));
+        printf ("cut after %2u blocks : %u synced, %u appended, %u read back\n", blocks, Synced, Appended, first + count);
+        SIM_CHECK (first + count >= Synced && first + count <= Appended);
+
+        /*!< What was lost is appended again */
+        Appended = first + count;
+        Synced = Appended;
+        SIM_CHECK (Append (30) == 30);
+        SIM_CHECK (Sync () == SD_OK);
+        SIM_CHECK (ReadBack (&first, &count));
+        SIM_CHECK (first + count == Appended);
+}
+
+static void TestPowerCut (void)
+{
+        /*!< Around the 16 block card cache and the segment end, rare and frequent syncs */
+        static const uint32_t Cuts[] = { 1, 15, 16, 17, 33, 40 };
+        uint32_t i;
+
+        for (i = 0; i < sizeof (Cuts) / sizeof (Cuts[0]); i++) {
+                PowerCut (Cuts[i], (i & 1) ? 3 : 40);
+        }
+}
+
+static void Test (void)
+{
+        Sim_CardConfig config;
+
+        unlink (IMAGE_PATH);
+        Sim_CardDefaults (&config);
+        config.AuSize = AU_SIZE;
+        config.ImagePath = IMAGE_PATH;
+        Sim_CardInsert (&config);
+        Sim_BoardInit ();
+
+        TestAppend ();
+        TestReboot ();
+        TestWrap ();
+        TestPowerCut ();
+}
+
+int main (void)
+{
+        return (Sim_Run (Test));
+}
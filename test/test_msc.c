@@ -0,0 +1,547 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include "sim.h"
+#include "usbd_msc_bot.h"
+#include "usbd_msc_scsi.h"
+#include "usbd_msc_mem.h"
+#include "sdio_high_level.h"
+#include "sdio_low_level.h"
+#include "sd_readahead.h"
+
+/*
+ * USB Mass Storage on the SD card : the MSC class (BOT and SCSI layers) and
+ * usbd_storage_sd.c, driven by a host sending CBWs. The endpoints are modeled
+ * here : a transfer takes its bytes over the bus rate, then its completion runs
+ * in the OTG interrupt, like DCD_Handle_ISR would call the class. MB/s of
+ * READ10/WRITE10 at full speed, and with a bus fast enough to show the card side,
+ * and the bytes copied by the CPU per MB : the zero copy backend against the
+ * copying one it replaced. BOT reset and clear feature in the middle of a
+ * command wait for the transfer running on the BOT buffers.
+ */
+
+#define COMMAND_BLOCKS                128
+#define COMMAND_SIZE                  (COMMAND_BLOCKS * 512)
+#define COMMANDS                      16
+#define AREA_LBA                      4096
+
+#define SCSI_OP_READ_CAPACITY10       0x25
+#define SCSI_OP_READ10                0x28
+#define SCSI_OP_WRITE10               0x2A
+
+/*!< Full speed bulk : 19 packets of 64 bytes per 1 ms frame */
+#define BUS_FULL_SPEED                (19 * 64 * 1000)
+#define BUS_FAST                      (40 * 1000 * 1000)
+
+typedef enum {
+        HOST_NONE, HOST_OUT, HOST_IN, HOST_RESET, HOST_CLEAR_IN
+} HostEvent;
+
+static USB_OTG_CORE_HANDLE Device;
+static uint32_t BusRate;
+static volatile HostEvent Event;
+
+/*!< Endpoint state : what the device armed */
+static uint8_t *RxBuffer;
+static uint16_t RxLength, RxCount;
+static uint8_t *TxBuffer;
+static uint32_t TxLength;
+static uint32_t Stalls;
+
+static uint8_t Data[COMMAND_SIZE] __attribute__ ((aligned (4)));
+static uint8_t Check[COMMAND_SIZE] __attribute__ ((aligned (4)));
+
+/*!< Bytes of READ10/WRITE10 data the CPU copied on their way */
+static uint32_t Copied;
+
+/*****************************************************************************/
+
+uint32_t DCD_EP_PrepareRx (USB_OTG_CORE_HANDLE *pdev, uint8_t ep_addr, uint8_t *pbuf, uint16_t buf_len)
+{
+        RxBuffer = pbuf;
+        RxLength = buf_len;
+        return (0);
+}
+
+uint32_t DCD_EP_Tx (USB_OTG_CORE_HANDLE *pdev, uint8_t ep_addr, uint8_t *pbuf, uint32_t buf_len)
+{
+        TxBuffer = pbuf;
+        TxLength = buf_len;
+        return (0);
+}
+
+uint32_t DCD_EP_Stall (USB_OTG_CORE_HANDLE *pdev, uint8_t epnum)
+{
+        Stalls++;
+        return (0);
+}
+
+uint32_t DCD_EP_Flush (USB_OTG_CORE_HANDLE *pdev, uint8_t epnum)
+{
+        return (0);
+}
+
+uint16_t USBD_GetRxCount (USB_OTG_CORE_HANDLE *pdev, uint8_t epnum)
+{
+        return (RxCount);
+}
+
+/**
+ * @brief  Transfer completions, like DCD_Handle_ISR : the SCSI layer, and the SD
+ *         transfers it waits for, run here.
+ */
+void OTG_FS_IRQHandler (void)
+{
+        HostEvent event = Event;
+
+        Event = HOST_NONE;
+
+        if (event == HOST_OUT) {
+                MSC_BOT_DataOut (&Device, MSC_OUT_EP);
+        }
+        else if (event == HOST_IN) {
+                MSC_BOT_DataIn (&Device, MSC_IN_EP & 0x7F);
+        }
+        else if (event == HOST_RESET) {
+                MSC_BOT_Reset (&Device);
+        }
+        else if (event == HOST_CLEAR_IN) {
+                MSC_BOT_CplClrFeature (&Device, MSC_IN_EP);
+        }
+}
+
+/*****************************************************************************/
+
+/*
+ * The zero copy backend (usbd_storage_sd.c), checked : the SDIO DMA must work on
+ * the BOT buffer itself, anything else had to be copied.
+ */
+static USBD_STORAGE_cb_TypeDef *ZeroCopy;
+static USBD_STORAGE_cb_TypeDef Checked;
+
+static void CheckInPlace (uint8_t *buf, uint16_t blk_len)
+{
+        if (SD_SDIO_DMA_STREAM ->M0AR != (uint32_t) (uintptr_t) buf) {
+                Copied += blk_len * 512;
+        }
+}
+
+static int8_t CheckedRead (uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len)
+{
+        int8_t status = ZeroCopy->Read (lun, buf, blk_addr, blk_len);
+
+        CheckInPlace (buf, blk_len);
+        return (status);
+}
+
+static int8_t CheckedWrite (uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len)
+{
+        int8_t status = ZeroCopy->Write (lun, buf, blk_addr, blk_len);
+
+        CheckInPlace (buf, blk_len);
+        return (status);
+}
+
+/*
+ * The backend before the zero copy change, for comparison : reads through the
+ * read-ahead buffer, writes through a staging buffer.
+ */
+static uint8_t Staging[MSC_MEDIA_PACKET] __attribute__ ((aligned (4)));
+static volatile uint8_t StagingBusy;
+static volatile SD_Error StagingStatus;
+static uint8_t StagingWritten;
+
+static int8_t CopyInit (uint8_t lun)
+{
+        SD_ReadAheadInit ();
+        return (0);
+}
+
+static int8_t CopyGetCapacity (uint8_t lun, uint32_t *block_num, uint32_t *block_size)
+{
+        return (ZeroCopy->GetCapacity (lun, block_num, block_size));
+}
+
+static int8_t CopyReady (uint8_t lun)
+{
+        return (0);
+}
+
+static int8_t CopyGetMaxLun (void)
+{
+        return (0);
+}
+
+static void StagingDone (SD_Error status, void *context)
+{
+        StagingStatus = status;
+        StagingBusy = 0;
+}
+
+static int8_t CopySync (uint8_t lun)
+{
+        /*!< No CMD13 while a read-ahead CMD18 may be running */
+        if (!StagingWritten) {
+                return (0);
+        }
+
+        StagingWritten = 0;
+        __disable_irq ();
+
+        while (StagingBusy) {
+                SD_AsyncSleep ();
+                __enable_irq ();
+                __disable_irq ();
+        }
+
+        __enable_irq ();
+
+        if (SD_WaitReady () != SD_OK) {
+                return (-1);
+        }
+
+        return ((StagingStatus == SD_OK) ? 0 : -1);
+}
+
+static int8_t CopyRead (uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len)
+{
+        SD_ReadAheadStats before, after;
+        SD_Error errorstatus;
+
+        if (CopySync (lun) < 0) {
+                return (-1);
+        }
+
+        SD_ReadAheadGetStats (&before);
+        errorstatus = SD_ReadAheadRead (buf, (uint64_t) blk_addr * 512, blk_len);
+        SD_ReadAheadGetStats (&after);
+        Copied += (after.HitBlocks - before.HitBlocks) * 512;
+        return ((errorstatus == SD_OK) ? 0 : -1);
+}
+
+static int8_t CopyWrite (uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len)
+{
+        if (CopySync (lun) < 0) {
+                return (-1);
+        }
+
+        SD_ReadAheadInvalidate ();
+        memcpy (Staging, buf, blk_len * 512);
+        Copied += blk_len * 512;
+        StagingStatus = SD_OK;
+        StagingBusy = 1;
+        StagingWritten = 1;
+
+        if (SD_WriteMultiBlocksAsync (Staging, (uint64_t) blk_addr * 512, 512, blk_len, StagingDone, NULL) != SD_OK) {
+                StagingBusy = 0;
+                return (-1);
+        }
+
+        return (0);
+}
+
+static USBD_STORAGE_cb_TypeDef Copying = {
+        CopyInit,
+        CopyGetCapacity,
+        CopyReady,
+        CopyReady,
+        CopyRead,
+        CopyWrite,
+        CopyGetMaxLun,
+        NULL,
+        CopySync,
+        NULL
+};
+
+/*****************************************************************************/
+
+/**
+ * @brief  The host sends len bytes into the armed OUT endpoint.
+ */
+static void HostOut (const void *data, uint16_t len)
+{
+        SIM_CHECK ((RxBuffer != NULL) && (len <= RxLength));
+        Sim_Advance ((uint64_t) len * SIM_HZ / BusRate);
+        memcpy (RxBuffer, data, len);
+        RxBuffer = NULL;
+        RxCount = len;
+        Event = HOST_OUT;
+        NVIC_SetPendingIRQ (OTG_FS_IRQn);
+}
+
+/**
+ * @brief  The host takes what the device put on the IN endpoint.
+ * @retval Number of bytes.
+ */
+static uint32_t HostIn (void *data, uint32_t max)
+{
+        uint32_t len = TxLength;
+
+        SIM_CHECK ((TxBuffer != NULL) && (len <= max));
+        Sim_Advance ((uint64_t) len * SIM_HZ / BusRate);
+        memcpy (data, TxBuffer, len);
+        TxBuffer = NULL;
+        Event = HOST_IN;
+        NVIC_SetPendingIRQ (OTG_FS_IRQn);
+        return (len);
+}
+
+/**
+ * @brief  One command : CBW, data stage, CSW.
+ * @param  in: data stage direction, 1 for device to host.
+ * @retval CSW status, 0xFF if the CSW is wrong.
+ */
+static uint8_t Command (uint8_t opcode, uint32_t lba, uint16_t blocks, uint32_t length, uint8_t in, uint8_t *data)
+{
+        static uint32_t tag;
+        MSC_BOT_CBW_TypeDef cbw;
+        MSC_BOT_CSW_TypeDef csw;
+        uint32_t done = 0;
+
+        memset (&cbw, 0, sizeof (cbw));
+        cbw.dSignature = BOT_CBW_SIGNATURE;
+        cbw.dTag = ++tag;
+        cbw.dDataLength = length;
+        cbw.bmFlags = (in) ? 0x80 : 0x00;
+        cbw.bCBLength = 10;
+        cbw.CB[0] = opcode;
+        cbw.CB[2] = (uint8_t) (lba >> 24);
+        cbw.CB[3] = (uint8_t) (lba >> 16);
+        cbw.CB[4] = (uint8_t) (lba >> 8);
+        cbw.CB[5] = (uint8_t) lba;
+        cbw.CB[7] = (uint8_t) (blocks >> 8);
+        cbw.CB[8] = (uint8_t) blocks;
+        HostOut (&cbw, BOT_CBW_LENGTH);
+
+        while (done < length) {
+                if (in) {
+                        done += HostIn (data + done, length - done);
+                }
+                else {
+                        HostOut (data + done, (RxLength < length - done) ? RxLength : length - done);
+                        done += RxCount;
+                }
+        }
+
+        memset (&csw, 0, sizeof (csw));
+
+        if (HostIn (&csw, BOT_CSW_LENGTH) != BOT_CSW_LENGTH) {
+                return (0xFF);
+        }
+
+        if ((csw.dSignature != BOT_CSW_SIGNATURE) || (csw.dTag != tag)) {
+                return (0xFF);
+        }
+
+        return (csw.bStatus);
+}
+
+static void Fill (uint8_t *buffer, uint32_t lba)
+{
+        uint32_t i;
+
+        for (i = 0; i < COMMAND_SIZE; i++) {
+                buffer[i] = (uint8_t) (lba * 3 + i * 5 + (i >> 9));
+        }
+}
+
+/**
+ * @brief  COMMANDS sequential READ10 or WRITE10 of COMMAND_BLOCKS each.
+ * @param  copied: bytes copied per MB.
+ * @retval KB/s.
+ */
+static uint32_t Run (uint8_t opcode, const char *bus, uint32_t *copied)
+{
+        uint64_t start, cycles;
+        uint32_t i, lba, kbs;
+
+        Copied = 0;
+        start = Sim_Now ();
+
+        for (i = 0; i < COMMANDS; i++) {
+                lba = AREA_LBA + i * COMMAND_BLOCKS;
+
+                if (opcode == SCSI_OP_WRITE10) {
+                        Fill (Data, lba);
+                        SIM_CHECK (Command (opcode, lba, COMMAND_BLOCKS, COMMAND_SIZE, 0, Data) == CSW_CMD_PASSED);
+                }
+                else {
+                        memset (Check, 0, sizeof (Check));
+                        SIM_CHECK (Command (opcode, lba, COMMAND_BLOCKS, COMMAND_SIZE, 1, Check) == CSW_CMD_PASSED);
+                        Fill (Data, lba);
+                        SIM_CHECK (memcmp (Check, Data, COMMAND_SIZE) == 0);
+                }
+        }
+
+        cycles = Sim_Now () - start;
+        kbs = (uint32_t) ((uint64_t) COMMANDS * COMMAND_SIZE * SIM_HZ / 1024 / cycles);
+        *copied = (uint32_t) ((uint64_t) Copied * 1024 * 1024 / (COMMANDS * COMMAND_SIZE));
+        printf ("%-7s %-10s bus, %-9s : %u.%02u MB/s, %7u bytes copied per MB\n", (opcode == SCSI_OP_READ10) ? "READ10" : "WRITE10", bus,
+                (USBD_STORAGE_fops == &Copying) ? "copying" : "zero copy", kbs / 1024, (kbs % 1024) * 100 / 1024, *copied);
+        return (kbs);
+}
+
+/**
+ * @brief  Writes then reads with the current backend.
+ * @param  copied: bytes copied per MB, writes and reads together.
+ */
+static void Benchmark (uint32_t rate, const char *bus, uint32_t *copied)
+{
+        uint32_t write, read, busKbs = rate / 1024, writeCopied, readCopied;
+
+        BusRate = rate;
+        write = Run (SCSI_OP_WRITE10, bus, &writeCopied);
+        read = Run (SCSI_OP_READ10, bus, &readCopied);
+        *copied = writeCopied + readCopied;
+
+        /*!< At full speed the card side hides behind the bus */
+        if (rate == BUS_FULL_SPEED) {
+                SIM_CHECK (read * 100 >= busKbs * 90);
+                SIM_CHECK (write * 100 >= busKbs * 80);
+        }
+}
+
+/**
+ * @brief  Sends the CBW of a 4 packet READ10 or WRITE10, and the first packet of
+ *         a write. The device is then busy with the second packet of the read, the
+ *         first of the write.
+ */
+static void Start (uint8_t opcode, uint32_t lba)
+{
+        static uint32_t tag = 0x1000;
+        MSC_BOT_CBW_TypeDef cbw;
+
+        memset (&cbw, 0, sizeof (cbw));
+        cbw.dSignature = BOT_CBW_SIGNATURE;
+        cbw.dTag = ++tag;
+        cbw.dDataLength = 4 * MSC_MEDIA_PACKET;
+        cbw.bmFlags = (opcode == SCSI_OP_READ10) ? 0x80 : 0x00;
+        cbw.bCBLength = 10;
+        cbw.CB[0] = opcode;
+        cbw.CB[4] = (uint8_t) (lba >> 8);
+        cbw.CB[5] = (uint8_t) lba;
+        cbw.CB[8] = 4 * MSC_MEDIA_PACKET / 512;
+        HostOut (&cbw, BOT_CBW_LENGTH);
+
+        if (opcode == SCSI_OP_WRITE10) {
+                Fill (Data, lba);
+                HostOut (Data, MSC_MEDIA_PACKET);
+        }
+
+        SIM_CHECK (SD_GetAsyncState () == SD_TRANSFER_BUSY);
+}
+
+static void HostRequest (HostEvent event)
+{
+        Event = event;
+        NVIC_SetPendingIRQ (OTG_FS_IRQn);
+}
+
+/**
+ * @brief  The BSP enables the OTG IRQ at the level of the SD DMA : the class init
+ *         must put it below, or Finish would wait forever for the DMA IRQ.
+ */
+static void TestPriority (void)
+{
+        uint32_t otg, dma, sub, group = NVIC_GetPriorityGrouping ();
+
+        NVIC_SetPriority (OTG_FS_IRQn, NVIC_EncodePriority (group, 1, 0));
+        NVIC_EnableIRQ (OTG_FS_IRQn);
+        MSC_BOT_Init (&Device);
+
+        NVIC_DecodePriority (NVIC_GetPriority (OTG_FS_IRQn), group, &otg, &sub);
+        NVIC_DecodePriority (NVIC_GetPriority (DMA2_Stream3_IRQn), group, &dma, &sub);
+        SIM_CHECK (otg > dma);
+        SIM_CHECK (RxBuffer == (uint8_t *) &MSC_BOT_cbw);
+}
+
+/**
+ * @brief  Clear feature and BOT reset while a transfer runs on a BOT buffer : it
+ *         is over when the class returns, the buffers can be reused.
+ */
+static void TestReset (void)
+{
+        MSC_BOT_CSW_TypeDef csw;
+        uint8_t capacity[8];
+
+        BusRate = BUS_FULL_SPEED;
+
+        /*!< Clear feature on IN in the middle of a WRITE10 : fails the command, after the write */
+        Start (SCSI_OP_WRITE10, AREA_LBA + 64);
+        HostRequest (HOST_CLEAR_IN);
+        SIM_CHECK (SD_GetAsyncState () != SD_TRANSFER_BUSY);
+        SIM_CHECK (!Sim_CardIsBusy ());
+        SIM_CHECK (memcmp (Sim_CardImage () + (AREA_LBA + 64) * 512, Data, MSC_MEDIA_PACKET) == 0);
+        memset (&csw, 0, sizeof (csw));
+        SIM_CHECK (HostIn (&csw, BOT_CSW_LENGTH) == BOT_CSW_LENGTH);
+        SIM_CHECK (csw.bStatus == CSW_CMD_FAILED);
+        SIM_CHECK (Command (SCSI_OP_READ_CAPACITY10, 0, 0, sizeof (capacity), 1, capacity) == CSW_CMD_PASSED);
+
+        /*!< BOT reset during a READ10 : the prefetch of the second packet */
+        Start (SCSI_OP_READ10, AREA_LBA);
+        HostRequest (HOST_RESET);
+        SIM_CHECK (SD_GetAsyncState () != SD_TRANSFER_BUSY);
+        TxBuffer = NULL;
+        SIM_CHECK (Command (SCSI_OP_READ_CAPACITY10, 0, 0, sizeof (capacity), 1, capacity) == CSW_CMD_PASSED);
+
+        /*!< BOT reset during a WRITE10 : the first packet reaches the card */
+        Start (SCSI_OP_WRITE10, AREA_LBA + 128);
+        HostRequest (HOST_RESET);
+        SIM_CHECK (SD_GetAsyncState () != SD_TRANSFER_BUSY);
+        SIM_CHECK (!Sim_CardIsBusy ());
+        SIM_CHECK (memcmp (Sim_CardImage () + (AREA_LBA + 128) * 512, Data, MSC_MEDIA_PACKET) == 0);
+        SIM_CHECK (Command (SCSI_OP_READ_CAPACITY10, 0, 0, sizeof (capacity), 1, capacity) == CSW_CMD_PASSED);
+}
+
+static void Test (void)
+{
+        Sim_CardConfig config;
+        uint8_t capacity[8];
+        uint32_t before, after;
+
+        Sim_CardDefaults (&config);
+        Sim_CardInsert (&config);
+        Sim_BoardInit ();
+
+        TestPriority ();
+
+        /*!< The SCSI layer needs the capacity before any READ10/WRITE10 */
+        BusRate = BUS_FULL_SPEED;
+        SIM_CHECK (Command (SCSI_OP_READ_CAPACITY10, 0, 0, sizeof (capacity), 1, capacity) == CSW_CMD_PASSED);
+        SIM_CHECK (((capacity[6] << 8) | capacity[7]) == 512);
+
+        /*!< Before : every byte copied once. After : none */
+        ZeroCopy = USBD_STORAGE_fops;
+        Checked = *ZeroCopy;
+        Checked.Read = CheckedRead;
+        Checked.Write = CheckedWrite;
+
+        USBD_STORAGE_fops = &Copying;
+        SIM_CHECK (USBD_STORAGE_fops->Init (0) == 0);
+        Benchmark (BUS_FULL_SPEED, "full speed", &before);
+        Benchmark (BUS_FAST, "40 MB/s", &before);
+        SIM_CHECK (CopySync (0) == 0);
+        SD_ReadAheadInvalidate ();
+
+        USBD_STORAGE_fops = &Checked;
+        Benchmark (BUS_FULL_SPEED, "full speed", &after);
+        SIM_CHECK (after == 0);
+        Benchmark (BUS_FAST, "40 MB/s", &after);
+        SIM_CHECK (after == 0);
+        SIM_CHECK (before >= 1024 * 1024 + 1024 * 1024 * 3 / 4);
+        SIM_CHECK (Stalls == 0);
+
+        TestReset ();
+}
+
+int main (void)
+{
+        return (Sim_Run (Test));
+}
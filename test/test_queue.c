@@ -0,0 +1,181 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include "sim.h"
+#include "sd_queue.h"
+
+/*
+ * Request queue : IOPS of 4 KB requests against the number kept in flight, random
+ * and sequential, reads and writes. Each completion submits the next request, so
+ * the depth stays constant. Checks the data and one CMD13 per chained write.
+ */
+
+#define REQUEST_BLOCKS                8
+#define REQUEST_SIZE                  (REQUEST_BLOCKS * 512)
+#define REQUESTS                      256
+#define AREA_BLOCKS                   32768
+
+static uint8_t Buffer[SD_QUEUE_DEPTH][REQUEST_SIZE] __attribute__ ((aligned (4)));
+static uint32_t Address[REQUESTS];
+
+static SD_QueueDir Dir;
+static uint32_t Submitted, Completed, Failed;
+
+/**
+ * @brief  Card block of request i : a permutation of the area (random) or one
+ *         after the other (sequential).
+ */
+static void MakeAddresses (uint8_t random)
+{
+        uint32_t i, seed = 12345;
+
+        for (i = 0; i < REQUESTS; i++) {
+                seed = seed * 1103515245 + 12345;
+                Address[i] = (random) ? ((seed >> 8) % (AREA_BLOCKS / REQUEST_BLOCKS)) * REQUEST_BLOCKS : i * REQUEST_BLOCKS;
+        }
+}
+
+static void Fill (uint8_t *buffer, uint32_t block)
+{
+        uint32_t i;
+
+        for (i = 0; i < REQUEST_SIZE; i++) {
+                buffer[i] = (uint8_t) (block * 31 + i * 7 + (i >> 9));
+        }
+}
+
+static void Submit (uint32_t slot);
+
+static void RequestDone (SD_Error status, void *context)
+{
+        uint32_t slot = (uint32_t) (uintptr_t) context;
+
+        if (status != SD_OK) {
+                Failed++;
+        }
+
+        Completed++;
+
+        if (Submitted < REQUESTS) {
+                Submit (slot);
+        }
+}
+
+static void Submit (uint32_t slot)
+{
+        uint32_t index = Submitted++;
+
+        if (Dir == SD_QUEUE_WRITE) {
+                Fill (Buffer[slot], Address[index]);
+        }
+
+        SIM_CHECK (SD_QueueSubmit (Dir, Buffer[slot], (uint64_t) Address[index] * 512, REQUEST_BLOCKS, RequestDone, (void *) (uintptr_t) slot) == SD_OK);
+}
+
+/**
+ * @brief  Runs REQUESTS requests with depth of them in flight.
+ * @retval IOPS.
+ */
+static uint32_t Run (SD_QueueDir dir, uint32_t depth, const char *pattern)
+{
+        Sim_Stats stats;
+        uint64_t start, cycles;
+        uint32_t slot, iops;
+
+        Dir = dir;
+        Submitted = Completed = Failed = 0;
+        Sim_ResetStats ();
+        start = Sim_Now ();
+
+        for (slot = 0; slot < depth; slot++) {
+                Submit (slot);
+        }
+
+        SIM_CHECK (SD_QueueSync () == SD_OK);
+        cycles = Sim_Now () - start;
+        Sim_GetStats (&stats);
+
+        SIM_CHECK (Completed == REQUESTS);
+        SIM_CHECK (Failed == 0);
+        iops = (uint32_t) ((uint64_t) REQUESTS * SIM_HZ / cycles);
+
+        if (dir == SD_QUEUE_WRITE) {
+                /*!< At most one CMD13 per CMD25 */
+                SIM_CHECK (stats.Commands[13] <= stats.Commands[25]);
+                SIM_CHECK (stats.Commands[13] > 0);
+        }
+
+        printf ("%-5s %-10s depth %u : %6u IOPS, %u commands (CMD18:%u CMD25:%u CMD13:%u), %u STA polls, asleep %u%%\n", (dir == SD_QUEUE_READ) ? "read" : "write", pattern, depth,
+                iops, stats.CommandTotal, stats.Commands[18], stats.Commands[25], stats.Commands[13], stats.StaReads, (uint32_t) (stats.SleepCycles * 100 / cycles));
+        return (iops);
+}
+
+static void CheckImage (void)
+{
+        static uint8_t expected[REQUEST_SIZE];
+        uint32_t i;
+
+        for (i = 0; i < REQUESTS; i++) {
+                Fill (expected, Address[i]);
+
+                if (memcmp (Sim_CardImage () + (uint64_t) Address[i] * 512, expected, REQUEST_SIZE) != 0) {
+                        SIM_CHECK (0);
+                        return;
+                }
+        }
+}
+
+static void Sweep (uint8_t random)
+{
+        static const uint32_t depths[] = { 1, 2, 4, 8 };
+        const char *pattern = (random) ? "random" : "sequential";
+        uint32_t read[4], write[4], i;
+
+        MakeAddresses (random);
+
+        for (i = 0; i < 4; i++) {
+                write[i] = Run (SD_QUEUE_WRITE, depths[i], pattern);
+                CheckImage ();
+        }
+
+        for (i = 0; i < 4; i++) {
+                read[i] = Run (SD_QUEUE_READ, depths[i], pattern);
+        }
+
+        /*!< A deeper queue never costs, and merges sequential requests */
+        for (i = 1; i < 4; i++) {
+                SIM_CHECK (read[i] * 100 >= read[0] * 95);
+                SIM_CHECK (write[i] * 100 >= write[0] * 95);
+        }
+
+        if (!random) {
+                SIM_CHECK (read[3] > read[0]);
+                SIM_CHECK (write[3] > write[0]);
+        }
+}
+
+static void Test (void)
+{
+        Sim_CardConfig config;
+
+        Sim_CardDefaults (&config);
+        Sim_CardInsert (&config);
+        Sim_BoardInit ();
+
+        SIM_CHECK (SD_Init () == SD_OK);
+        SD_QueueInit ();
+        Sweep (1);
+        Sweep (0);
+}
+
+int main (void)
+{
+        return (Sim_Run (Test));
+}
@@ -0,0 +1,268 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim.h"
+#include "sd_raid.h"
+#include "sd_spi.h"
+
+/*
+ * sd_raid.c over two image backed cards, the SDIO one (member 0) and the SPI one
+ * (member 1). Striping : where each block lands in the two images, and the pieces
+ * of a step transferred at the same time. Mirroring : both copies, reads split,
+ * the per member latency, a member dropped after read errors and after a failed
+ * write, the other one carrying on. A striped request on a failing member fails,
+ * the others do not.
+ */
+
+#define SDIO_IMAGE                    "test_raid_sdio.img"
+#define SPI_IMAGE                     "test_raid_spi.img"
+#define BLOCK                         SD_BLOCKDEV_BLOCK_SIZE
+#define STRIPE                        SD_RAID_STRIPE_BLOCKS
+#define STRIPE_FIRST                  (4 * STRIPE + 10)
+#define STRIPE_COUNT                  (4 * STRIPE)
+#define MIRROR_FIRST                  20000
+#define MIRROR_COUNT                  16
+
+static uint8_t Data[STRIPE_COUNT * BLOCK] __attribute__ ((aligned (4)));
+static uint8_t Buffer[STRIPE_COUNT * BLOCK] __attribute__ ((aligned (4)));
+
+static void Fill (uint8_t *buffer, uint32_t size, uint32_t seed)
+{
+        uint32_t i;
+
+        for (i = 0; i < size; i++) {
+                buffer[i] = (uint8_t) (i * 13 + seed + (i >> 9) * 7);
+        }
+}
+
+static uint32_t Us (uint64_t cycles)
+{
+        return ((uint32_t) (cycles / (SIM_HZ / 1000000)));
+}
+
+/**
+ * @brief  Where a RAID 0 block is, in the image of its member.
+ */
+static const uint8_t *StripeBlock (uint32_t block)
+{
+        uint32_t stripe = block / STRIPE;
+        uint32_t offset = (stripe / 2) * STRIPE + block % STRIPE;
+        const uint8_t *image = (stripe % 2) ? Sim_SpiCardImage () : Sim_CardImage ();
+
+        return (image + (size_t) offset * BLOCK);
+}
+
+static void TestInfo (SD_BlockDev *stripe, const Sim_CardConfig *config)
+{
+        SD_BlockDevInfo info;
+
+        SIM_CHECK (SD_DevGetInfo (stripe, &info) == SD_OK);
+        SIM_CHECK (info.Blocks == 2 * config->Blocks);
+        SIM_CHECK (info.AuBlocks == 2 * SD_AuBlocks (config->AuSize));
+}
+
+/**
+ * @brief  An unaligned request over five stripes : each piece in its member's
+ *         image, read back. Then the member pieces of one step written one after
+ *         the other, directly : the RAID step (both at once) takes less.
+ */
+static void TestStripe (SD_BlockDev *dev, SD_Raid *raid)
+{
+        SD_RaidMemberStats stats[SD_RAID_MEMBERS];
+        uint64_t start, tSdio, tSpi, tStep;
+        uint32_t i;
+        uint8_t same = 1;
+
+        Fill (Data, sizeof (Data), 1);
+        SIM_CHECK (SD_DevWrite (dev, Data, STRIPE_FIRST, STRIPE_COUNT) == SD_OK);
+
+        for (i = 0; i < STRIPE_COUNT; i++) {
+                same &= (memcmp (StripeBlock (STRIPE_FIRST + i), Data + i * BLOCK, BLOCK) == 0);
+        }
+
+        SIM_CHECK (same);
+        SIM_CHECK (SD_DevRead (dev, Buffer, STRIPE_FIRST, STRIPE_COUNT) == SD_OK);
+        SIM_CHECK (memcmp (Buffer, Data, sizeof (Data)) == 0);
+
+        /*!< Five pieces per request, stripes 4, 6 and 8 on the SDIO member */
+        SD_RaidGetStats (raid, stats);
+        SIM_CHECK (stats[0].Ops == 2 * 3 && stats[1].Ops == 2 * 2);
+        SIM_CHECK (stats[0].Errors == 0 && stats[1].Errors == 0);
+
+        /*!< Stripes 0 and 1 : one step, one stripe per member */
+        start = Sim_Now ();
+        SIM_CHECK (SD_DevWrite (&SD_SdioDev, Data, 0, STRIPE) == SD_OK);
+        tSdio = Sim_Now () - start;
+        start = Sim_Now ();
+        SIM_CHECK (SD_DevWrite (&SD_SpiDev, Data + STRIPE * BLOCK, 0, STRIPE) == SD_OK);
+        tSpi = Sim_Now () - start;
+        start = Sim_Now ();
+        SIM_CHECK (SD_DevWrite (dev, Data, 0, 2 * STRIPE) == SD_OK);
+        tStep = Sim_Now () - start;
+
+        printf ("stripe step : sdio %u us + spi %u us one after the other, %u us striped\n", Us (tSdio), Us (tSpi), Us (tStep));
+        SIM_CHECK (tStep < tSdio + tSpi - ((tSdio < tSpi) ? tSdio : tSpi) / 2);
+}
+
+/**
+ * @brief  A bad block on the SPI member : the stripes on it fail, the ones on the
+ *         SDIO member still work. Nothing is dropped.
+ */
+static void TestStripeError (SD_BlockDev *dev, SD_Raid *raid)
+{
+        SD_RaidMemberStats stats[SD_RAID_MEMBERS];
+
+        /*!< RAID block STRIPE + 1 : stripe 1, SPI member block 1 */
+        Sim_SpiCardFailBlock (1, SIM_FAULT_CRC, 1);
+        SIM_CHECK (SD_DevRead (dev, Buffer, STRIPE, 4) != SD_OK);
+        SIM_CHECK (SD_DevRead (dev, Buffer, 0, 4) == SD_OK);
+        SIM_CHECK (SD_DevRead (dev, Buffer, STRIPE, 4) == SD_OK);
+        SIM_CHECK (memcmp (Buffer, Data + STRIPE * BLOCK, 4 * BLOCK) == 0);
+
+        SD_RaidGetStats (raid, stats);
+        SIM_CHECK (stats[1].Errors == 1);
+        SIM_CHECK (!stats[0].Failed && !stats[1].Failed);
+}
+
+/**
+ * @brief  Writes reach both images, a read takes one half from each member.
+ */
+static void TestMirror (SD_BlockDev *dev, SD_Raid *raid)
+{
+        SD_RaidMemberStats stats[SD_RAID_MEMBERS];
+        Sim_Stats sim;
+
+        Fill (Data, MIRROR_COUNT * BLOCK, 2);
+        SIM_CHECK (SD_DevWrite (dev, Data, MIRROR_FIRST, MIRROR_COUNT) == SD_OK);
+        SIM_CHECK (memcmp (Sim_CardImage () + (size_t) MIRROR_FIRST * BLOCK, Data, MIRROR_COUNT * BLOCK) == 0);
+        SIM_CHECK (memcmp (Sim_SpiCardImage () + (size_t) MIRROR_FIRST * BLOCK, Data, MIRROR_COUNT * BLOCK) == 0);
+
+        Sim_ResetStats ();
+        memset (Buffer, 0, MIRROR_COUNT * BLOCK);
+        SIM_CHECK (SD_DevRead (dev, Buffer, MIRROR_FIRST, MIRROR_COUNT) == SD_OK);
+        SIM_CHECK (memcmp (Buffer, Data, MIRROR_COUNT * BLOCK) == 0);
+        Sim_GetStats (&sim);
+        SIM_CHECK (sim.BlocksRead >= MIRROR_COUNT / 2 && sim.BlocksRead < MIRROR_COUNT);
+        SIM_CHECK (sim.SpiBlocksRead >= MIRROR_COUNT / 2 && sim.SpiBlocksRead < MIRROR_COUNT);
+
+        /*!< The SPI card is the slow one */
+        SD_RaidGetStats (raid, stats);
+        printf ("mirror : sdio %u ops avg %u us max %u us, spi %u ops avg %u us max %u us\n", stats[0].Ops, stats[0].AvgUs, stats[0].MaxUs,
+                stats[1].Ops, stats[1].AvgUs, stats[1].MaxUs);
+        SIM_CHECK (stats[0].Ops == 2 && stats[1].Ops == 2);
+        SIM_CHECK (stats[0].AvgUs > 0 && stats[0].MaxUs >= stats[0].AvgUs);
+        SIM_CHECK (stats[1].AvgUs > stats[0].AvgUs && stats[1].MaxUs >= stats[1].AvgUs);
+}
+
+/**
+ * @brief  The SPI half of the reads fails SD_RAID_MAX_ERRORS times : each read is
+ *         still right (that half read again from the SDIO card), then the SPI card
+ *         is dropped. Writes then only reach the SDIO image.
+ */
+static void TestReadDegrade (SD_BlockDev *dev, SD_Raid *raid)
+{
+        SD_RaidMemberStats stats[SD_RAID_MEMBERS];
+        Sim_Stats sim;
+        uint32_t i;
+
+        Sim_SpiCardFailBlock (MIRROR_FIRST + MIRROR_COUNT - 1, SIM_FAULT_CRC, SD_RAID_MAX_ERRORS);
+
+        for (i = 0; i < SD_RAID_MAX_ERRORS; i++) {
+                SIM_CHECK (!SD_RaidIsDegraded (raid));
+                memset (Buffer, 0, MIRROR_COUNT * BLOCK);
+                SIM_CHECK (SD_DevRead (dev, Buffer, MIRROR_FIRST, MIRROR_COUNT) == SD_OK);
+                SIM_CHECK (memcmp (Buffer, Data, MIRROR_COUNT * BLOCK) == 0);
+        }
+
+        SIM_CHECK (SD_RaidIsDegraded (raid));
+        SD_RaidGetStats (raid, stats);
+        SIM_CHECK (stats[1].Failed && !stats[0].Failed);
+        SIM_CHECK (stats[1].Errors == SD_RAID_MAX_ERRORS);
+
+        Sim_ResetStats ();
+        Fill (Data, MIRROR_COUNT * BLOCK, 3);
+        SIM_CHECK (SD_DevWrite (dev, Data, MIRROR_FIRST, MIRROR_COUNT) == SD_OK);
+        SIM_CHECK (SD_DevRead (dev, Buffer, MIRROR_FIRST, MIRROR_COUNT) == SD_OK);
+        SIM_CHECK (memcmp (Buffer, Data, MIRROR_COUNT * BLOCK) == 0);
+        SIM_CHECK (memcmp (Sim_CardImage () + (size_t) MIRROR_FIRST * BLOCK, Data, MIRROR_COUNT * BLOCK) == 0);
+        SIM_CHECK (memcmp (Sim_SpiCardImage () + (size_t) MIRROR_FIRST * BLOCK, Data, MIRROR_COUNT * BLOCK) != 0);
+        Sim_GetStats (&sim);
+        SIM_CHECK (sim.SpiBytes == 0);
+}
+
+/**
+ * @brief  The SDIO copy of a write fails : the write succeeds (the SPI copy was
+ *         made), the SDIO card is dropped at once since its copy is stale, reads
+ *         come from the SPI card.
+ */
+static void TestWriteDegrade (SD_BlockDev *dev, SD_Raid *raid)
+{
+        SD_RaidMemberStats stats[SD_RAID_MEMBERS];
+        Sim_Stats sim;
+
+        Fill (Data, MIRROR_COUNT * BLOCK, 4);
+        Sim_CardFailBlock (MIRROR_FIRST + 2, SIM_FAULT_CRC, 1);
+        SIM_CHECK (SD_DevWrite (dev, Data, MIRROR_FIRST, MIRROR_COUNT) == SD_OK);
+        SIM_CHECK (SD_RaidIsDegraded (raid));
+        SD_RaidGetStats (raid, stats);
+        SIM_CHECK (stats[0].Failed && !stats[1].Failed);
+        SIM_CHECK (memcmp (Sim_SpiCardImage () + (size_t) MIRROR_FIRST * BLOCK, Data, MIRROR_COUNT * BLOCK) == 0);
+
+        Sim_ResetStats ();
+        memset (Buffer, 0, MIRROR_COUNT * BLOCK);
+        SIM_CHECK (SD_DevRead (dev, Buffer, MIRROR_FIRST, MIRROR_COUNT) == SD_OK);
+        SIM_CHECK (memcmp (Buffer, Data, MIRROR_COUNT * BLOCK) == 0);
+        Sim_GetStats (&sim);
+        SIM_CHECK (sim.BlocksRead == 0);
+        SIM_CHECK (sim.SpiBlocksRead == MIRROR_COUNT);
+
+        /*!< The last member is kept : its errors are returned */
+        Sim_SpiCardFailBlock (MIRROR_FIRST, SIM_FAULT_CRC, 1);
+        SIM_CHECK (SD_DevWrite (dev, Data, MIRROR_FIRST, MIRROR_COUNT) != SD_OK);
+        SD_RaidGetStats (raid, stats);
+        SIM_CHECK (!stats[1].Failed);
+}
+
+static void Test (void)
+{
+        Sim_CardConfig config;
+        SD_BlockDev stripe, mirror;
+        SD_Raid stripeRaid, mirrorRaid;
+
+        unlink (SDIO_IMAGE);
+        unlink (SPI_IMAGE);
+        Sim_CardDefaults (&config);
+        config.InitPolls = 1;
+        config.ImagePath = SDIO_IMAGE;
+        Sim_CardInsert (&config);
+        config.ImagePath = SPI_IMAGE;
+        Sim_SpiCardInsert (&config);
+        Sim_BoardInit ();
+
+        SD_RaidCreate (&stripeRaid, &stripe, SD_RAID_0, &SD_SdioDev, &SD_SpiDev);
+        SIM_CHECK (SD_DevInit (&stripe) == SD_OK);
+        TestInfo (&stripe, &config);
+        TestStripe (&stripe, &stripeRaid);
+        TestStripeError (&stripe, &stripeRaid);
+
+        /*!< Same members, already initialized */
+        SD_RaidCreate (&mirrorRaid, &mirror, SD_RAID_1, &SD_SdioDev, &SD_SpiDev);
+        TestMirror (&mirror, &mirrorRaid);
+        TestReadDegrade (&mirror, &mirrorRaid);
+
+        SD_RaidCreate (&mirrorRaid, &mirror, SD_RAID_1, &SD_SdioDev, &SD_SpiDev);
+        TestWriteDegrade (&mirror, &mirrorRaid);
+}
+
+int main (void)
+{
+        return (Sim_Run (Test));
+}
@@ -0,0 +1,168 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <string.h>
+#include "sim.h"
+#include "sd_recovery.h"
+
+/*
+ * Retry and clock downshift (sd_recovery.c) with faults injected into the card :
+ * a single CRC error is retried, a run of them steps the clock down, a clean
+ * streak steps it back up to the negotiated speed and no further, a persistent
+ * fault is given up after SD_RECOVERY_ATTEMPTS. Every event is counted.
+ */
+
+#define TEST_BLOCKS                   8
+#define TEST_ADDR                     (500 * 512)
+#define TEST_BLOCK                    (TEST_ADDR / 512 + 3)
+
+static uint8_t Buffer[TEST_BLOCKS * 512] __attribute__ ((aligned (4)));
+static uint8_t Data[TEST_BLOCKS * 512] __attribute__ ((aligned (4)));
+
+static void Fill (uint8_t *buffer, uint32_t size, uint32_t seed)
+{
+        uint32_t i;
+
+        for (i = 0; i < size; i++) {
+                buffer[i] = (uint8_t) (i * 5 + seed + (i >> 9));
+        }
+}
+
+static SD_RecoveryStats Stats (void)
+{
+        SD_RecoveryStats stats;
+
+        SD_RecoveryGetStats (&stats);
+        return (stats);
+}
+
+static SD_Error Read (void)
+{
+        memset (Buffer, 0, sizeof (Buffer));
+        return (SD_RecoveryRead (Buffer, TEST_ADDR, TEST_BLOCKS));
+}
+
+/**
+ * @brief  One bad block CRC on a read and on a write : one retry each, same speed.
+ */
+static void TestRetry (SD_BusSpeed fastest)
+{
+        SD_RecoveryInit ();
+
+        Sim_CardFailBlock (TEST_BLOCK, SIM_FAULT_CRC, 1);
+        SIM_CHECK (SD_RecoveryWrite (Data, TEST_ADDR, TEST_BLOCKS) == SD_OK);
+        SIM_CHECK (memcmp (Sim_CardImage () + TEST_ADDR, Data, sizeof (Data)) == 0);
+
+        Sim_CardFailBlock (TEST_BLOCK, SIM_FAULT_CRC, 1);
+        SIM_CHECK (Read () == SD_OK);
+        SIM_CHECK (memcmp (Buffer, Data, sizeof (Data)) == 0);
+
+        SIM_CHECK (Stats ().Transfers == 2);
+        SIM_CHECK (Stats ().Retries == 2);
+        SIM_CHECK (Stats ().CrcErrors == 2);
+        SIM_CHECK (Stats ().Failures == 0);
+        SIM_CHECK (Stats ().Downshifts == 0);
+        SIM_CHECK (SD_GetBusSpeed () == fastest);
+}
+
+/**
+ * @brief  Data timeouts count as timeouts, a command CRC as a CRC error.
+ */
+static void TestErrorKinds (void)
+{
+        SD_RecoveryInit ();
+
+        Sim_CardFailBlock (TEST_BLOCK, SIM_FAULT_TIMEOUT, 1);
+        SIM_CHECK (Read () == SD_OK);
+        Sim_CardFailCommand (18, 0, SIM_FAULT_CRC, 1);
+        SIM_CHECK (Read () == SD_OK);
+        SIM_CHECK (memcmp (Buffer, Data, sizeof (Data)) == 0);
+
+        SIM_CHECK (Stats ().Timeouts == 1);
+        SIM_CHECK (Stats ().CrcErrors == 1);
+        SIM_CHECK (Stats ().Retries == 2);
+}
+
+/**
+ * @brief  SD_RECOVERY_DOWNSHIFT_ERRORS errors in a row : one step down, the retry
+ *         at the lower speed succeeds. After SD_RECOVERY_UPSHIFT_STREAK clean
+ *         transfers one step up, never past the speed SD_Init negotiated.
+ */
+static void TestShift (SD_BusSpeed fastest)
+{
+        uint32_t i;
+
+        SD_RecoveryInit ();
+
+        Sim_CardFailBlock (TEST_BLOCK, SIM_FAULT_CRC, SD_RECOVERY_DOWNSHIFT_ERRORS);
+        SIM_CHECK (Read () == SD_OK);
+        SIM_CHECK (memcmp (Buffer, Data, sizeof (Data)) == 0);
+        SIM_CHECK (Stats ().Downshifts == 1);
+        SIM_CHECK (SD_GetBusSpeed () == fastest + 1);
+
+        /*!< The successful retry was the first clean transfer */
+        for (i = 1; i < SD_RECOVERY_UPSHIFT_STREAK - 1; i++) {
+                SIM_CHECK (SD_RecoveryRead (Buffer, TEST_ADDR, 1) == SD_OK);
+        }
+
+        SIM_CHECK (SD_GetBusSpeed () == fastest + 1);
+        SIM_CHECK (SD_RecoveryRead (Buffer, TEST_ADDR, 1) == SD_OK);
+        SIM_CHECK (SD_GetBusSpeed () == fastest);
+        SIM_CHECK (Stats ().Upshifts == 1);
+
+        for (i = 0; i < SD_RECOVERY_UPSHIFT_STREAK; i++) {
+                SIM_CHECK (SD_RecoveryRead (Buffer, TEST_ADDR, 1) == SD_OK);
+        }
+
+        SIM_CHECK (SD_GetBusSpeed () == fastest);
+        SIM_CHECK (Stats ().Upshifts == 1);
+}
+
+/**
+ * @brief  An error on every attempt : the layer gives up with the bus error,
+ *         having stepped down on the way, and the card is usable afterwards.
+ */
+static void TestGiveUp (SD_BusSpeed fastest)
+{
+        SD_RecoveryInit ();
+
+        Sim_CardFailBlock (TEST_BLOCK, SIM_FAULT_CRC, SD_RECOVERY_ATTEMPTS);
+        SIM_CHECK (Read () == SD_DATA_CRC_FAIL);
+        SIM_CHECK (Stats ().Failures == 1);
+        SIM_CHECK (Stats ().Retries == SD_RECOVERY_ATTEMPTS - 1);
+        SIM_CHECK (Stats ().CrcErrors == SD_RECOVERY_ATTEMPTS);
+        SIM_CHECK (Stats ().Downshifts == SD_RECOVERY_ATTEMPTS / SD_RECOVERY_DOWNSHIFT_ERRORS);
+        SIM_CHECK (SD_GetBusSpeed () == fastest + SD_RECOVERY_ATTEMPTS / SD_RECOVERY_DOWNSHIFT_ERRORS);
+
+        SIM_CHECK (Read () == SD_OK);
+        SIM_CHECK (memcmp (Buffer, Data, sizeof (Data)) == 0);
+        SIM_CHECK (SD_SetBusSpeed (fastest) == SD_OK);
+}
+
+static void Test (void)
+{
+        Sim_CardConfig config;
+        SD_BusSpeed fastest;
+
+        Sim_CardDefaults (&config);
+        Sim_CardInsert (&config);
+        Sim_BoardInit ();
+        SIM_CHECK (SD_Init () == SD_OK);
+        fastest = SD_GetBusSpeed ();
+        Fill (Data, sizeof (Data), 9);
+
+        TestRetry (fastest);
+        TestErrorKinds ();
+        TestShift (fastest);
+        TestGiveUp (fastest);
+}
+
+int main (void)
+{
+        return (Sim_Run (Test));
+}
@@ -0,0 +1,116 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <string.h>
+#include "sim.h"
+#include "sdio_high_level.h"
+
+/*
+ * The SDIO driver against the simulated card : initialisation, single and
+ * multi block transfers, erase. Prints what each step costs.
+ */
+
+#define TEST_BLOCKS                   64
+#define IMAGE_PATH                    "test_sdio.img"
+
+static uint8_t Buffer[TEST_BLOCKS * 512] __attribute__ ((aligned (4)));
+static uint8_t Check[TEST_BLOCKS * 512] __attribute__ ((aligned (4)));
+
+static void Fill (uint8_t *buffer, uint32_t size, uint32_t seed)
+{
+        uint32_t i;
+
+        for (i = 0; i < size; i++) {
+                buffer[i] = (uint8_t) (i * 7 + seed + (i >> 9));
+        }
+}
+
+static void Report (const char *title)
+{
+        Sim_Stats stats;
+
+        Sim_GetStats (&stats);
+        Sim_PrintStats (title, &stats);
+        Sim_ResetStats ();
+}
+
+static void TestInit (void)
+{
+        SD_CardInfo info;
+
+        SIM_CHECK (SD_Init () == SD_OK);
+        SIM_CHECK (SD_GetCardInfo (&info) == SD_OK);
+        SIM_CHECK (info.CardType == SDIO_HIGH_CAPACITY_SD_CARD);
+        SIM_CHECK (info.CardCapacity == (uint64_t) 64 * 1024 * 512);
+        SIM_CHECK (info.CardBlockSize == 512);
+        Report ("init");
+}
+
+static void TestSingleBlock (void)
+{
+        Fill (Buffer, 512, 1);
+        SIM_CHECK (SD_WriteBlock (Buffer, 10 * 512, 512) == SD_OK);
+        SIM_CHECK (SD_WaitWriteOperation () == SD_OK);
+        SIM_CHECK (SD_WaitReady () == SD_OK);
+        SIM_CHECK (memcmp (Sim_CardImage () + 10 * 512, Buffer, 512) == 0);
+        Report ("write 1 block");
+
+        memset (Check, 0, 512);
+        SIM_CHECK (SD_ReadBlock (Check, 10 * 512, 512) == SD_OK);
+        SIM_CHECK (SD_WaitReadOperation () == SD_OK);
+        SIM_CHECK (memcmp (Check, Buffer, 512) == 0);
+        Report ("read 1 block");
+}
+
+static void TestMultiBlock (void)
+{
+        Fill (Buffer, sizeof (Buffer), 2);
+        SIM_CHECK (SD_WriteMultiBlocks (Buffer, 100 * 512, 512, TEST_BLOCKS) == SD_OK);
+        SIM_CHECK (SD_WaitWriteOperation () == SD_OK);
+        SIM_CHECK (SD_WaitReady () == SD_OK);
+        SIM_CHECK (Sim_CardPendingBlocks () == 0);
+        SIM_CHECK (memcmp (Sim_CardImage () + 100 * 512, Buffer, sizeof (Buffer)) == 0);
+        Report ("write 64 blocks");
+
+        memset (Check, 0, sizeof (Check));
+        SIM_CHECK (SD_ReadMultiBlocks (Check, 100 * 512, 512, TEST_BLOCKS) == SD_OK);
+        SIM_CHECK (SD_WaitReadOperation () == SD_OK);
+        SIM_CHECK (memcmp (Check, Buffer, sizeof (Check)) == 0);
+        Report ("read 64 blocks");
+}
+
+static void TestErase (void)
+{
+        static const uint8_t Zero[512];
+
+        SIM_CHECK (SD_Erase (100 * 512, 163 * 512) == SD_OK);
+        SIM_CHECK (memcmp (Sim_CardImage () + 100 * 512, Zero, 512) == 0);
+        SIM_CHECK (memcmp (Sim_CardImage () + 163 * 512, Zero, 512) == 0);
+        Report ("erase 64 blocks");
+}
+
+static void Test (void)
+{
+        Sim_CardConfig config;
+
+        Sim_CardDefaults (&config);
+        config.ImagePath = IMAGE_PATH;
+        Sim_CardInsert (&config);
+        Sim_BoardInit ();
+        Sim_ResetStats ();
+
+        TestInit ();
+        TestSingleBlock ();
+        TestMultiBlock ();
+        TestErase ();
+}
+
+int main (void)
+{
+        return (Sim_Run (Test));
+}
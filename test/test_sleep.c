@@ -0,0 +1,201 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include "sim.h"
+#include "sd_time.h"
+#include "sdio_high_level.h"
+
+/*
+ * The waits sleep in WFI : CPU idle share and polling during transfers, then the
+ * same transfers with spurious SDIO, DMA and D0 EXTI interrupts injected every few
+ * microseconds. A wake up without its event must only cost one more look at the
+ * condition : same result, same duration, no error lost.
+ */
+
+#define TEST_BLOCKS                   64
+#define TEST_ADDR                     (4096 * 512)
+#define WAKE_PERIOD                   SIM_US (7)
+
+static uint8_t Buffer[TEST_BLOCKS * 512] __attribute__ ((aligned (4)));
+static uint8_t Data[TEST_BLOCKS * 512] __attribute__ ((aligned (4)));
+
+typedef struct {
+        SD_Error Result;
+        uint64_t Cycles;
+        uint32_t Idle;
+        uint32_t Wfi;
+        uint32_t StaReads;
+        uint8_t Same;
+} Run;
+
+static void Fill (uint8_t *buffer, uint32_t size, uint32_t seed)
+{
+        uint32_t i;
+
+        for (i = 0; i < size; i++) {
+                buffer[i] = (uint8_t) (i * 17 + seed + (i >> 9));
+        }
+}
+
+static void Start (void)
+{
+        Sim_ResetStats ();
+        SD_IdleReset ();
+}
+
+static void Finish (Run *run, uint64_t start, SD_Error result)
+{
+        Sim_Stats stats;
+
+        Sim_GetStats (&stats);
+        run->Result = result;
+        run->Cycles = Sim_Now () - start;
+        run->Idle = SD_IdlePercent ();
+        run->Wfi = stats.Wfi;
+        run->StaReads = stats.StaReads;
+}
+
+static void Read (Run *run)
+{
+        uint64_t start = Sim_Now ();
+        SD_Error result;
+
+        memset (Buffer, 0, sizeof (Buffer));
+        Start ();
+        result = SD_ReadMultiBlocks (Buffer, TEST_ADDR, 512, TEST_BLOCKS);
+
+        if (result == SD_OK) {
+                result = SD_WaitReadOperation ();
+        }
+
+        Finish (run, start, result);
+        run->Same = (memcmp (Buffer, Data, sizeof (Data)) == 0);
+}
+
+/**
+ * @brief  Write, then wait for the end of programming.
+ */
+static void Write (Run *run)
+{
+        uint64_t start = Sim_Now ();
+        SD_Error result;
+
+        Start ();
+        result = SD_WriteMultiBlocks (Data, TEST_ADDR, 512, TEST_BLOCKS);
+
+        if (result == SD_OK) {
+                result = SD_WaitWriteOperation ();
+        }
+
+        if (result == SD_OK) {
+                result = SD_WaitReady ();
+        }
+
+        Finish (run, start, result);
+        run->Same = (memcmp (Sim_CardImage () + TEST_ADDR, Data, sizeof (Data)) == 0) && !Sim_CardIsBusy ();
+}
+
+static void Print (const char *title, const Run *run)
+{
+        printf ("%-16s : %7.1f us, idle %3u %%, %4u WFI, %5u STA polls\n", title, (double) run->Cycles / (SIM_HZ / 1000000), (unsigned int) run->Idle,
+                (unsigned int) run->Wfi, (unsigned int) run->StaReads);
+}
+
+/**
+ * @brief  Quiet and with spurious wakes : same result, about the same time, and
+ *         the polling bounded by the number of wake ups.
+ */
+static void Compare (const char *title, const Run *quiet, const Run *noisy)
+{
+        Print (title, noisy);
+        SIM_CHECK (noisy->Result == SD_OK);
+        SIM_CHECK (noisy->Same);
+        SIM_CHECK (noisy->Cycles < quiet->Cycles + quiet->Cycles / 20);
+        SIM_CHECK (noisy->Wfi > quiet->Wfi);
+        SIM_CHECK (noisy->StaReads <= quiet->StaReads + 2 * noisy->Wfi);
+}
+
+/**
+ * @brief  Reads and writes without injected wakes : mostly asleep, little polling.
+ */
+static void TestQuiet (Run *read, Run *write)
+{
+        Write (write);
+        Print ("write", write);
+        SIM_CHECK (write->Result == SD_OK);
+        SIM_CHECK (write->Same);
+        SIM_CHECK (write->Idle >= 80);
+
+        Read (read);
+        Print ("read", read);
+        SIM_CHECK (read->Result == SD_OK);
+        SIM_CHECK (read->Same);
+        SIM_CHECK (read->Idle >= 80);
+        /*!< A few polls per command, none per block of data */
+        SIM_CHECK (read->StaReads < 4 * TEST_BLOCKS);
+        SIM_CHECK (write->StaReads < 4 * TEST_BLOCKS);
+}
+
+static void TestNoisy (const Run *read, const Run *write, int irqn, const char *name)
+{
+        char title[32];
+        Run run;
+
+        Sim_InjectWakes (irqn, WAKE_PERIOD);
+
+        snprintf (title, sizeof (title), "write + %s", name);
+        Write (&run);
+        Compare (title, write, &run);
+
+        snprintf (title, sizeof (title), "read + %s", name);
+        Read (&run);
+        Compare (title, read, &run);
+
+        Sim_InjectWakes (irqn, 0);
+}
+
+/**
+ * @brief  One spurious SDIO interrupt in the middle of a read, then a CRC error :
+ *         the error must still be reported, so the spurious one must not disarm
+ *         the SDIO interrupts.
+ */
+static void TestErrorAfterWake (void)
+{
+        memset (Buffer, 0, sizeof (Buffer));
+        Sim_CardFailBlock (TEST_ADDR / 512 + TEST_BLOCKS / 2, SIM_FAULT_CRC, 1);
+        SIM_CHECK (SD_ReadMultiBlocks (Buffer, TEST_ADDR, 512, TEST_BLOCKS) == SD_OK);
+        Sim_Advance (SIM_US (100));
+        NVIC_SetPendingIRQ (SDIO_IRQn);
+        SIM_CHECK (SD_WaitReadOperation () == SD_DATA_CRC_FAIL);
+        SIM_CHECK (SD_WaitReady () == SD_OK);
+}
+
+static void Test (void)
+{
+        Sim_CardConfig config;
+        Run read, write;
+
+        Sim_CardDefaults (&config);
+        Sim_CardInsert (&config);
+        Sim_BoardInit ();
+        SIM_CHECK (SD_Init () == SD_OK);
+        Fill (Data, sizeof (Data), 3);
+
+        TestQuiet (&read, &write);
+        TestNoisy (&read, &write, SDIO_IRQn, "SDIO");
+        TestNoisy (&read, &write, DMA2_Stream3_IRQn, "DMA");
+        TestNoisy (&read, &write, EXTI9_5_IRQn, "EXTI");
+        TestErrorAfterWake ();
+}
+
+int main (void)
+{
+        return (Sim_Run (Test));
+}
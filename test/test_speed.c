@@ -0,0 +1,104 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include "sim.h"
+#include "sdio_high_level.h"
+
+/*
+ * Bus clock negotiation in SD_Init : a high speed card ends at 48 MHz after one
+ * CMD6, a default speed one at 24 MHz. Transmission errors on CMD6 or on the
+ * block 0 verify read step the clock down instead of failing SD_Init, and the
+ * data moves at the clock reached.
+ */
+
+#define TEST_ADDR                     (700 * 512)
+#define CMD6_TRIES                    (SD_BUS_SPEED_INIT - SD_BUS_SPEED_DEFAULT + 1)
+
+static uint8_t Data[512] __attribute__ ((aligned (4)));
+static uint8_t Buffer[512] __attribute__ ((aligned (4)));
+
+/**
+ * @brief  Inserts a card, injects the faults and runs SD_Init. One block is then
+ *         written and read back at the negotiated clock.
+ * @param  highSpeed: the card accepts the CMD6 switch.
+ * @param  cmd6: fault on the CMD6 response, cmd6Count times.
+ * @param  block0: CRC errors on the verify read.
+ * @retval The speed SD_Init picked.
+ */
+static SD_BusSpeed Negotiate (uint8_t highSpeed, Sim_Fault cmd6, uint32_t cmd6Count, uint32_t block0)
+{
+        Sim_CardConfig config;
+        SD_CardInfo info;
+        Sim_Stats stats;
+        uint32_t i;
+
+        Sim_CardDefaults (&config);
+        config.HighSpeed = highSpeed;
+        config.InitPolls = 1;
+        Sim_CardInsert (&config);
+        Sim_ResetStats ();
+
+        if (cmd6Count) {
+                Sim_CardFailCommand (6, 0, cmd6, cmd6Count);
+        }
+
+        if (block0) {
+                Sim_CardFailBlock (0, SIM_FAULT_CRC, block0);
+        }
+
+        SIM_CHECK (SD_Init () == SD_OK);
+        Sim_GetStats (&stats);
+        /*!< One CMD6 per clock step from 24 MHz down to 400 KHz at most */
+        SIM_CHECK (stats.Commands[6] == ((cmd6Count < CMD6_TRIES) ? cmd6Count + 1 : CMD6_TRIES));
+        SIM_CHECK (stats.AppCommands[6] == 1);
+
+        SIM_CHECK (SD_GetCardInfo (&info) == SD_OK);
+        printf ("high speed %u, %u CMD6 faults, %u block 0 faults : %u Hz\n", highSpeed, cmd6Count, block0, (unsigned int) info.BusClock);
+
+        for (i = 0; i < sizeof (Data); i++) {
+                Data[i] = (uint8_t) (i * 3 + block0 + cmd6Count);
+        }
+
+        SIM_CHECK (SD_WriteBlock (Data, TEST_ADDR, 512) == SD_OK);
+        SIM_CHECK (SD_WaitWriteOperation () == SD_OK);
+        SIM_CHECK (SD_WaitReady () == SD_OK);
+        SIM_CHECK (SD_ReadBlock (Buffer, TEST_ADDR, 512) == SD_OK);
+        SIM_CHECK (SD_WaitReadOperation () == SD_OK);
+        SIM_CHECK (memcmp (Buffer, Data, sizeof (Data)) == 0);
+
+        return (SD_GetBusSpeed ());
+}
+
+static void Test (void)
+{
+        SD_CardInfo info;
+
+        Sim_BoardInit ();
+
+        SIM_CHECK (Negotiate (1, SIM_FAULT_NONE, 0, 0) == SD_BUS_SPEED_HIGH);
+        SIM_CHECK (SD_GetCardInfo (&info) == SD_OK && info.BusClock == 48000000);
+        SIM_CHECK (Negotiate (0, SIM_FAULT_NONE, 0, 0) == SD_BUS_SPEED_DEFAULT);
+        SIM_CHECK (SD_GetCardInfo (&info) == SD_OK && info.BusClock == 24000000);
+
+        /*!< CMD6 : one step down per error, no high speed after that */
+        SIM_CHECK (Negotiate (1, SIM_FAULT_CRC, 1, 0) == SD_BUS_SPEED_16MHZ);
+        SIM_CHECK (Negotiate (1, SIM_FAULT_TIMEOUT, 2, 0) == SD_BUS_SPEED_8MHZ);
+        SIM_CHECK (Negotiate (1, SIM_FAULT_CRC, 4, 0) == SD_BUS_SPEED_INIT);
+
+        /*!< The verify read */
+        SIM_CHECK (Negotiate (1, SIM_FAULT_NONE, 0, 1) == SD_BUS_SPEED_DEFAULT);
+        SIM_CHECK (Negotiate (1, SIM_FAULT_NONE, 0, 2) == SD_BUS_SPEED_16MHZ);
+        SIM_CHECK (Negotiate (1, SIM_FAULT_CRC, 1, 1) == SD_BUS_SPEED_8MHZ);
+}
+
+int main (void)
+{
+        return (Sim_Run (Test));
+}
@@ -0,0 +1,212 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include "sim.h"
+#include "sd_spi.h"
+
+/*
+ * The SPI transport (sd_spi.c) against the simulated SPI card, SDHC and SDSC :
+ * the identification and its commands, the data at the right place in the image,
+ * one command per transfer (plus CMD12 after a multiple block read), the blocks
+ * moved by the DMA and not polled, CRC errors both ways, a read timeout, erase.
+ * The card must be usable again after each error.
+ */
+
+#define BLOCK                         SD_BLOCKDEV_BLOCK_SIZE
+#define TEST_BLOCK                    3000
+#define TEST_BLOCKS                   32
+
+static uint8_t Data[TEST_BLOCKS * BLOCK] __attribute__ ((aligned (4)));
+static uint8_t Buffer[TEST_BLOCKS * BLOCK] __attribute__ ((aligned (4)));
+
+static void Fill (uint8_t *buffer, uint32_t size, uint32_t seed)
+{
+        uint32_t i;
+
+        for (i = 0; i < size; i++) {
+                buffer[i] = (uint8_t) (i * 7 + seed + (i >> 9) * 3);
+        }
+}
+
+static const uint8_t *Image (uint32_t block)
+{
+        return (Sim_SpiCardImage () + (size_t) block * BLOCK);
+}
+
+static uint32_t Us (uint64_t cycles)
+{
+        return ((uint32_t) (cycles / (SIM_HZ / 1000000)));
+}
+
+/**
+ * @brief  Inserts a card and identifies it : CMD0, CMD8, ACMD41 until ready, CMD58,
+ *         CMD59, CMD16 for SDSC only, the CSD and the SD status.
+ */
+static void Identify (Sim_CardConfig *config, uint8_t highCapacity)
+{
+        SD_BlockDevInfo info;
+        Sim_Stats stats;
+
+        Sim_CardDefaults (config);
+        config->HighCapacity = highCapacity;
+        config->InitPolls = 2;
+        Sim_SpiCardInsert (config);
+        Sim_ResetStats ();
+
+        SIM_CHECK (SD_DevInit (&SD_SpiDev) == SD_OK);
+        Sim_GetStats (&stats);
+        SIM_CHECK (stats.SpiCommands[0] == 1);
+        SIM_CHECK (stats.SpiCommands[8] == 1);
+        SIM_CHECK (stats.SpiCommands[55] == config->InitPolls + 2);
+        SIM_CHECK (stats.SpiCommands[41] == config->InitPolls + 1);
+        SIM_CHECK (stats.SpiCommands[58] == 1);
+        SIM_CHECK (stats.SpiCommands[59] == 1);
+        SIM_CHECK (stats.SpiCommands[16] == ((highCapacity) ? 0 : 1));
+        SIM_CHECK (stats.SpiCommands[9] == 1);
+        SIM_CHECK (stats.SpiCommands[13] == 1);
+
+        SIM_CHECK (SD_DevGetInfo (&SD_SpiDev, &info) == SD_OK);
+        SIM_CHECK (info.Blocks == config->Blocks);
+        SIM_CHECK (info.AuBlocks == SD_AuBlocks (config->AuSize));
+}
+
+/**
+ * @brief  Single and multiple block transfers : the image, the commands, and the
+ *         register accesses per block (DMA, not polling).
+ */
+static void TestTransfers (const char *name)
+{
+        Sim_Stats stats;
+        uint64_t start;
+        uint32_t writeUs, readUs;
+
+        Fill (Data, sizeof (Data), 1);
+        Sim_ResetStats ();
+        SIM_CHECK (SD_DevWrite (&SD_SpiDev, Data, TEST_BLOCK, 1) == SD_OK);
+        SIM_CHECK (SD_DevRead (&SD_SpiDev, Buffer, TEST_BLOCK, 1) == SD_OK);
+        Sim_GetStats (&stats);
+        SIM_CHECK (memcmp (Image (TEST_BLOCK), Data, BLOCK) == 0);
+        SIM_CHECK (memcmp (Buffer, Data, BLOCK) == 0);
+        SIM_CHECK (stats.SpiCommands[24] == 1 && stats.SpiCommands[17] == 1);
+        SIM_CHECK (stats.SpiCommands[25] == 0 && stats.SpiCommands[18] == 0 && stats.SpiCommands[12] == 0);
+
+        Fill (Data, sizeof (Data), 2);
+        Sim_ResetStats ();
+        start = Sim_Now ();
+        SIM_CHECK (SD_DevWrite (&SD_SpiDev, Data, TEST_BLOCK, TEST_BLOCKS) == SD_OK);
+        writeUs = Us (Sim_Now () - start);
+        SIM_CHECK (memcmp (Image (TEST_BLOCK), Data, sizeof (Data)) == 0);
+        SIM_CHECK (!Sim_SpiCardIsBusy ());
+
+        start = Sim_Now ();
+        SIM_CHECK (SD_DevRead (&SD_SpiDev, Buffer, TEST_BLOCK, TEST_BLOCKS) == SD_OK);
+        readUs = Us (Sim_Now () - start);
+        SIM_CHECK (memcmp (Buffer, Data, sizeof (Data)) == 0);
+        Sim_GetStats (&stats);
+
+        printf ("%s : %u blocks written in %u us, read in %u us, %u register accesses per block\n", name, TEST_BLOCKS, writeUs, readUs,
+                stats.Accesses / (2 * TEST_BLOCKS));
+        SIM_CHECK (stats.SpiCommands[25] == 1 && stats.SpiCommands[18] == 1 && stats.SpiCommands[12] == 1);
+        SIM_CHECK (stats.SpiBlocksWritten == TEST_BLOCKS);
+        /*!< Token and busy polling included : polling the bytes would be 4 accesses each */
+        SIM_CHECK (stats.Accesses < 2 * TEST_BLOCKS * 200);
+}
+
+/**
+ * @brief  A read block with a bad CRC16 and a write block the card rejects, in the
+ *         middle of multiple block transfers. The next transfers work.
+ */
+static void TestCrc (void)
+{
+        Fill (Data, sizeof (Data), 3);
+        SIM_CHECK (SD_DevWrite (&SD_SpiDev, Data, TEST_BLOCK, TEST_BLOCKS) == SD_OK);
+
+        Sim_SpiCardFailBlock (TEST_BLOCK + 5, SIM_FAULT_CRC, 1);
+        SIM_CHECK (SD_DevRead (&SD_SpiDev, Buffer, TEST_BLOCK, TEST_BLOCKS) == SD_DATA_CRC_FAIL);
+        SIM_CHECK (SD_DevRead (&SD_SpiDev, Buffer, TEST_BLOCK, TEST_BLOCKS) == SD_OK);
+        SIM_CHECK (memcmp (Buffer, Data, sizeof (Data)) == 0);
+
+        /*!< The blocks before the rejected one are written, not the others */
+        Fill (Buffer, sizeof (Buffer), 4);
+        Sim_SpiCardFailBlock (TEST_BLOCK + 3, SIM_FAULT_CRC, 1);
+        SIM_CHECK (SD_DevWrite (&SD_SpiDev, Buffer, TEST_BLOCK, TEST_BLOCKS) == SD_DATA_CRC_FAIL);
+        SIM_CHECK (!Sim_SpiCardIsBusy ());
+        SIM_CHECK (memcmp (Image (TEST_BLOCK), Buffer, 3 * BLOCK) == 0);
+        SIM_CHECK (memcmp (Image (TEST_BLOCK + 3), Data + 3 * BLOCK, sizeof (Data) - 3 * BLOCK) == 0);
+
+        SIM_CHECK (SD_DevWrite (&SD_SpiDev, Buffer, TEST_BLOCK, TEST_BLOCKS) == SD_OK);
+        SIM_CHECK (memcmp (Image (TEST_BLOCK), Buffer, sizeof (Buffer)) == 0);
+}
+
+/**
+ * @brief  A block which never comes : SD_DATA_TIMEOUT after SD_SPI_READ_TIMEOUT_US,
+ *         single and multiple block.
+ */
+static void TestTimeout (void)
+{
+        uint64_t start;
+        uint32_t us;
+
+        Sim_SpiCardFailBlock (TEST_BLOCK + 1, SIM_FAULT_TIMEOUT, 1);
+        start = Sim_Now ();
+        SIM_CHECK (SD_DevRead (&SD_SpiDev, Buffer, TEST_BLOCK, 4) == SD_DATA_TIMEOUT);
+        us = Us (Sim_Now () - start);
+        SIM_CHECK (us >= SD_SPI_READ_TIMEOUT_US && us < SD_SPI_READ_TIMEOUT_US + SD_SPI_READ_TIMEOUT_US / 10);
+
+        Sim_SpiCardFailBlock (TEST_BLOCK, SIM_FAULT_TIMEOUT, 1);
+        SIM_CHECK (SD_DevRead (&SD_SpiDev, Buffer, TEST_BLOCK, 1) == SD_DATA_TIMEOUT);
+
+        SIM_CHECK (SD_DevRead (&SD_SpiDev, Buffer, TEST_BLOCK, 4) == SD_OK);
+        SIM_CHECK (memcmp (Buffer, Image (TEST_BLOCK), 4 * BLOCK) == 0);
+}
+
+static void TestErase (void)
+{
+        Sim_Stats stats;
+        uint32_t i;
+        uint8_t zero = 1;
+
+        Sim_ResetStats ();
+        SIM_CHECK (SD_DevErase (&SD_SpiDev, TEST_BLOCK + 1, 8) == SD_OK);
+        Sim_GetStats (&stats);
+        SIM_CHECK (stats.SpiCommands[32] == 1 && stats.SpiCommands[33] == 1 && stats.SpiCommands[38] == 1);
+        SIM_CHECK (!Sim_SpiCardIsBusy ());
+
+        for (i = 0; i < 8 * BLOCK; i++) {
+                zero &= (Image (TEST_BLOCK + 1)[i] == 0);
+        }
+
+        SIM_CHECK (zero);
+        SIM_CHECK (Image (TEST_BLOCK)[0] != 0 || Image (TEST_BLOCK)[1] != 0);
+        SIM_CHECK (Image (TEST_BLOCK + 9)[0] != 0 || Image (TEST_BLOCK + 9)[1] != 0);
+}
+
+static void Test (void)
+{
+        Sim_CardConfig config;
+
+        Sim_BoardInit ();
+
+        Identify (&config, 1);
+        TestTransfers ("SDHC");
+        TestCrc ();
+        TestTimeout ();
+        TestErase ();
+
+        /*!< Byte addressed : the blocks must land at the same place */
+        Identify (&config, 0);
+        TestTransfers ("SDSC");
+        TestCrc ();
+}
+
+int main (void)
+{
+        return (Sim_Run (Test));
+}
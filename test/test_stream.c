@@ -0,0 +1,136 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include "sim.h"
+#include "sdio_high_level.h"
+
+/*
+ * Streaming write session against one SD_WriteMultiBlocks per buffer refill :
+ * the same log, chunk after chunk. Commands, card busy time and total time per
+ * block for both.
+ */
+
+#define CHUNK_BLOCKS                  8
+#define CHUNKS                        32
+#define LOG_BLOCKS                    (CHUNK_BLOCKS * CHUNKS)
+#define LOG_ADDR                      (1024 * 512)
+
+static uint8_t Log[LOG_BLOCKS * 512] __attribute__ ((aligned (4)));
+
+typedef struct {
+        uint32_t Commands;
+        uint64_t BusyCycles;
+        uint64_t Cycles;
+} Cost;
+
+static void Fill (uint8_t *buffer, uint32_t size, uint32_t seed)
+{
+        uint32_t i;
+
+        for (i = 0; i < size; i++) {
+                buffer[i] = (uint8_t) (i * 13 + seed + (i >> 9));
+        }
+}
+
+static void Measure (Cost *cost, uint64_t start)
+{
+        Sim_Stats stats;
+
+        Sim_GetStats (&stats);
+        cost->Commands = stats.CommandTotal;
+        cost->BusyCycles = stats.CardBusyCycles;
+        cost->Cycles = Sim_Now () - start;
+        SIM_CHECK (stats.BlocksWritten == LOG_BLOCKS);
+}
+
+static void Print (const char *title, const Cost *cost)
+{
+        printf ("%-10s : %3u commands, %.2f per block, busy %.1f us per block, %.1f us per block\n", title, cost->Commands,
+                (double) cost->Commands / LOG_BLOCKS, (double) cost->BusyCycles / LOG_BLOCKS / (SIM_HZ / 1000000),
+                (double) cost->Cycles / LOG_BLOCKS / (SIM_HZ / 1000000));
+}
+
+/**
+ * @brief  The log written the old way : CMD55, ACMD23, CMD25, CMD12 and a
+ *         programming cycle per chunk.
+ */
+static void WriteChunks (Cost *cost, uint32_t seed)
+{
+        uint64_t start = Sim_Now ();
+        uint32_t i;
+
+        Fill (Log, sizeof (Log), seed);
+        Sim_ResetStats ();
+
+        for (i = 0; i < CHUNKS; i++) {
+                SIM_CHECK (SD_WriteMultiBlocks (Log + i * CHUNK_BLOCKS * 512, LOG_ADDR + (uint64_t) i * CHUNK_BLOCKS * 512, 512, CHUNK_BLOCKS) == SD_OK);
+                SIM_CHECK (SD_WaitWriteOperation () == SD_OK);
+                SIM_CHECK (SD_WaitReady () == SD_OK);
+        }
+
+        Measure (cost, start);
+        SIM_CHECK (memcmp (Sim_CardImage () + LOG_ADDR, Log, sizeof (Log)) == 0);
+}
+
+/**
+ * @brief  The same log in one stream : the data path stays open between chunks.
+ */
+static void WriteStream (Cost *cost, uint32_t seed)
+{
+        uint64_t start = Sim_Now ();
+        uint32_t i;
+
+        Fill (Log, sizeof (Log), seed);
+        Sim_ResetStats ();
+
+        SIM_CHECK (SD_StreamOpen (LOG_ADDR, LOG_BLOCKS) == SD_OK);
+        SIM_CHECK (SD_StreamOpen (LOG_ADDR, LOG_BLOCKS) == SD_REQUEST_PENDING);
+
+        for (i = 0; i < CHUNKS; i++) {
+                SIM_CHECK (SD_StreamWrite (Log + i * CHUNK_BLOCKS * 512, CHUNK_BLOCKS) == SD_OK);
+                SIM_CHECK (SD_WaitWriteOperation () == SD_OK);
+        }
+
+        SIM_CHECK (SD_StreamGetBlocks () == LOG_BLOCKS);
+        SIM_CHECK (SD_StreamClose () == SD_OK);
+        SIM_CHECK (SD_WaitReady () == SD_OK);
+        Measure (cost, start);
+        SIM_CHECK (memcmp (Sim_CardImage () + LOG_ADDR, Log, sizeof (Log)) == 0);
+
+        SIM_CHECK (SD_StreamWrite (Log, 1) == SD_ERROR);
+        SIM_CHECK (SD_StreamClose () == SD_ERROR);
+}
+
+static void Test (void)
+{
+        Sim_CardConfig config;
+        Cost chunks, stream;
+
+        Sim_CardDefaults (&config);
+        Sim_CardInsert (&config);
+        Sim_BoardInit ();
+        SIM_CHECK (SD_Init () == SD_OK);
+
+        WriteChunks (&chunks, 1);
+        WriteStream (&stream, 2);
+        Print ("chunks", &chunks);
+        Print ("stream", &stream);
+
+        /*!< One command sequence for the whole log, not one per chunk */
+        SIM_CHECK (chunks.Commands >= 4 * CHUNKS);
+        SIM_CHECK (stream.Commands < 8);
+        SIM_CHECK (stream.BusyCycles < chunks.BusyCycles);
+        SIM_CHECK (stream.Cycles < chunks.Cycles);
+}
+
+int main (void)
+{
+        return (Sim_Run (Test));
+}
@@ -0,0 +1,138 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * The deadlines of sd_time.c against a fake clock, without the simulator : the
+ * tick source and the sleep are redefined, so the time only moves when the test
+ * says so. Deadlines across a counter wrap and longer than one wrap, elapsed time,
+ * the idle accounting.
+ */
+
+static uint32_t FakeTicks;
+static uint32_t FakeSleepTicks;
+
+#define SD_TIME_NOW()                 (FakeTicks)
+#define SD_TIME_HZ                    168000000
+#define SD_TIME_SLEEP()               (FakeTicks += FakeSleepTicks)
+
+#include "sd_time.c"
+
+#define TICKS_US                      (SD_TIME_HZ / 1000000)
+#define CHECK(cond)                   Check ((cond) != 0, #cond, __LINE__)
+
+static uint32_t Failed;
+
+static void Check (int ok, const char *expr, int line)
+{
+        if (!ok) {
+                printf ("FAIL %s:%d : %s\n", __FILE__, line, expr);
+                ++Failed;
+        }
+}
+
+/**
+ * @brief  Advances the clock by us microseconds in steps of step, checking the
+ *         deadline after each.
+ * @retval Number of steps until it expired, 0 if it never did.
+ */
+static uint32_t RunUntilExpired (SD_Deadline *deadline, uint32_t us, uint32_t step)
+{
+        uint32_t steps;
+
+        for (steps = 1; steps * step <= us; steps++) {
+                FakeTicks += step * TICKS_US;
+
+                if (SD_DeadlineExpired (deadline)) {
+                        return (steps);
+                }
+        }
+
+        return (0);
+}
+
+/**
+ * @brief  Expires exactly at its time, not one tick before, wherever the counter is.
+ */
+static void TestExact (uint32_t start)
+{
+        SD_Deadline deadline;
+
+        FakeTicks = start;
+        SD_DeadlineStart (&deadline, 1000);
+        FakeTicks += 1000 * TICKS_US - 1;
+        CHECK (!SD_DeadlineExpired (&deadline));
+        FakeTicks += 1;
+        CHECK (SD_DeadlineExpired (&deadline));
+
+        /*!< Stays expired */
+        CHECK (SD_DeadlineExpired (&deadline));
+
+        FakeTicks = start;
+        SD_DeadlineStart (&deadline, 0);
+        CHECK (SD_DeadlineExpired (&deadline));
+}
+
+/**
+ * @brief  A 60 s deadline (2.3 wraps at 168 MHz) checked every 10 ms.
+ */
+static void TestLong (void)
+{
+        SD_Deadline deadline;
+
+        FakeTicks = 0xF0000000;
+        SD_DeadlineStart (&deadline, 60000000);
+        CHECK (RunUntilExpired (&deadline, 70000000, 10000) == 6000);
+}
+
+/**
+ * @brief  Elapsed time across the wrap.
+ */
+static void TestElapsed (void)
+{
+        uint32_t since;
+
+        FakeTicks = 0xFFFFFFFF - 10 * TICKS_US;
+        since = SD_TIME_NOW ();
+        FakeTicks += 250 * TICKS_US;
+        CHECK (SD_TimeElapsedUs (since) == 250);
+}
+
+/**
+ * @brief  Idle share : sleeps of 3 ms between 1 ms of work, over several wraps.
+ */
+static void TestIdle (void)
+{
+        uint32_t i;
+
+        FakeTicks = 0x80000000;
+        FakeSleepTicks = 3000 * TICKS_US;
+        SD_IdleReset ();
+        CHECK (SD_IdlePercent () == 0);
+
+        for (i = 0; i < 20000; i++) {
+                FakeTicks += 1000 * TICKS_US;
+                SD_Sleep ();
+        }
+
+        CHECK (SD_IdlePercent () == 75);
+}
+
+int main (void)
+{
+        TestExact (0);
+        TestExact (0xFFFFFFFF - 500 * TICKS_US);
+        TestLong ();
+        TestElapsed ();
+        TestIdle ();
+
+        printf ("%s (%u failed checks)\n", (Failed) ? "FAILED" : "PASSED", (unsigned int) Failed);
+        return (Failed != 0);
+}
@@ -0,0 +1,222 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include "sim.h"
+#include "sd_trace.h"
+#include "sdio_high_level.h"
+
+/*
+ * The instrumentation (sd_trace.c), built twice : test_trace_on with the driver
+ * compiled with SD_TRACE_ENABLE, where the counters must agree with what the
+ * simulated SDIO and DMA saw, the ring must keep the newest events in time order
+ * and no event may be lost to the interrupts ; test_trace without it, where the
+ * stubs must link and read as zero.
+ */
+
+#define TEST_BLOCKS                   16
+#define TEST_ADDR                     (2048 * 512)
+#define TRANSFERS                     8
+#define PUSHES                        2000
+
+static uint8_t Buffer[TEST_BLOCKS * 512] __attribute__ ((aligned (4)));
+static SD_TraceEvent Events[2 * SD_TRACE_DEPTH];
+
+/**
+ * @brief  TRANSFERS writes, each followed by the wait for the end of programming,
+ *         then as many reads.
+ */
+static void Transfers (void)
+{
+        uint32_t i;
+
+        for (i = 0; i < TRANSFERS; i++) {
+                SIM_CHECK (SD_WriteMultiBlocks (Buffer, TEST_ADDR + (uint64_t) i * sizeof (Buffer), 512, TEST_BLOCKS) == SD_OK);
+                SIM_CHECK (SD_WaitWriteOperation () == SD_OK);
+                SIM_CHECK (SD_WaitReady () == SD_OK);
+        }
+
+        for (i = 0; i < TRANSFERS; i++) {
+                SIM_CHECK (SD_ReadMultiBlocks (Buffer, TEST_ADDR + (uint64_t) i * sizeof (Buffer), 512, TEST_BLOCKS) == SD_OK);
+                SIM_CHECK (SD_WaitReadOperation () == SD_OK);
+        }
+}
+
+#ifdef SD_TRACE_ENABLE
+static uint32_t Sum (const uint32_t *counts, uint32_t n)
+{
+        uint32_t sum = 0;
+
+        while (n--) {
+                sum += *counts++;
+        }
+
+        return (sum);
+}
+
+/**
+ * @brief  Counters against the simulator's own : commands sent, SDIO and DMA
+ *         interrupts taken, one event per hook call.
+ */
+static void TestCounters (void)
+{
+        SD_TraceCounters counters;
+        Sim_Stats stats;
+        uint64_t start = Sim_Now ();
+
+        SD_TraceReset ();
+        Sim_ResetStats ();
+        Transfers ();
+        SD_TraceGetCounters (&counters);
+        Sim_GetStats (&stats);
+
+        printf ("%u commands waited for in %u us, %u SDIO IRQs, %u DMA TC, %u events\n", Sum (counters.Cmd, 64),
+                (unsigned int) (counters.SpinCycles / (SIM_HZ / 1000000)), Sum (counters.Irq, SD_TRACE_SDIO_FLAGS), counters.DmaTc, counters.Events);
+
+        SIM_CHECK (counters.Cmd[18] == stats.Commands[18]);
+        SIM_CHECK (counters.Cmd[25] == stats.Commands[25]);
+        SIM_CHECK (counters.Cmd[12] == stats.Commands[12]);
+        SIM_CHECK (counters.Cmd[13] == stats.Commands[13]);
+        SIM_CHECK (counters.Cmd[18] == TRANSFERS);
+        SIM_CHECK (counters.Cmd[25] == TRANSFERS);
+        SIM_CHECK (counters.CmdErrors == 0);
+        SIM_CHECK (counters.SpinCycles > 0);
+        SIM_CHECK (counters.SpinCycles < Sim_Now () - start);
+
+        /*!< DATAEND is STA bit 8 */
+        SIM_CHECK (counters.Irq[8] == 2 * TRANSFERS);
+        SIM_CHECK (counters.DmaTc == stats.Interrupts[DMA2_Stream3_IRQn + 16]);
+        SIM_CHECK (counters.DmaFifoErrors == 0);
+        SIM_CHECK (counters.Events == Sum (counters.Cmd, 64) + stats.Interrupts[SDIO_IRQn + 16] + counters.DmaTc);
+}
+
+/**
+ * @brief  A CMD13 without a response : one error counted, the last event says
+ *         which command and why.
+ */
+static void TestError (void)
+{
+        SD_TraceCounters counters;
+        uint32_t n;
+
+        SD_TraceReset ();
+        Sim_CardFailCommand (13, 0, SIM_FAULT_TIMEOUT, 1);
+        SIM_CHECK (SD_GetState () == SD_CARD_ERROR);
+
+        SD_TraceGetCounters (&counters);
+        SIM_CHECK (counters.CmdErrors == 1);
+        SIM_CHECK (counters.Cmd[13] == 1);
+
+        n = SD_TraceRead (Events, 2 * SD_TRACE_DEPTH);
+        SIM_CHECK (n == counters.Events);
+        SIM_CHECK (n > 0);
+        SIM_CHECK ((n > 0) && (Events[n - 1].type == SD_TRACE_EV_CMD_ERROR));
+        SIM_CHECK ((n > 0) && (Events[n - 1].code == 13));
+        SIM_CHECK ((n > 0) && (Events[n - 1].arg & SDIO_FLAG_CTIMEOUT));
+
+        SIM_CHECK (SD_GetState () == SD_CARD_TRANSFER);
+}
+
+/**
+ * @brief  More events than the ring holds : the newest SD_TRACE_DEPTH come back,
+ *         oldest first, and a shorter read gets the tail of the longer one.
+ */
+static void TestRing (void)
+{
+        SD_TraceEvent newest[4];
+        uint32_t i, n;
+        uint8_t ordered = 1;
+
+        SD_TraceReset ();
+        Transfers ();
+        Transfers ();
+
+        n = SD_TraceRead (Events, 2 * SD_TRACE_DEPTH);
+        SIM_CHECK (n == SD_TRACE_DEPTH);
+
+        for (i = 1; i < n; i++) {
+                ordered &= ((int32_t) (Events[i].time - Events[i - 1].time) >= 0);
+        }
+
+        SIM_CHECK (ordered);
+        SIM_CHECK (SD_TraceRead (newest, 4) == 4);
+        SIM_CHECK (memcmp (newest, Events + n - 4, sizeof (newest)) == 0);
+}
+
+/**
+ * @brief  Events pushed by the thread while SDIO interrupts push theirs : none
+ *         lost, the thread's counters exact.
+ */
+static void TestConcurrent (void)
+{
+        SD_TraceCounters counters;
+        Sim_Stats stats;
+        uint32_t i;
+
+        SD_TraceReset ();
+        Sim_ResetStats ();
+        Sim_InjectWakes (SDIO_IRQn, SIM_US (1));
+
+        for (i = 0; i < PUSHES; i++) {
+                SD_TraceCmd (1, 10, 0);
+        }
+
+        Sim_InjectWakes (SDIO_IRQn, 0);
+        SD_TraceGetCounters (&counters);
+        Sim_GetStats (&stats);
+
+        printf ("%u thread events, %u from interrupts\n", PUSHES, stats.Interrupts[SDIO_IRQn + 16]);
+        SIM_CHECK (stats.Interrupts[SDIO_IRQn + 16] > 0);
+        SIM_CHECK (counters.Cmd[1] == PUSHES);
+        SIM_CHECK (counters.SpinCycles == 10 * PUSHES);
+        SIM_CHECK (counters.Events == PUSHES + stats.Interrupts[SDIO_IRQn + 16]);
+}
+#else
+/**
+ * @brief  Tracing off : the API links, reads as zero and empty.
+ */
+static void TestStubs (void)
+{
+        SD_TraceCounters counters;
+
+        memset (&counters, 0xFF, sizeof (counters));
+        SD_TraceReset ();
+        Transfers ();
+        SD_TraceGetCounters (&counters);
+        SIM_CHECK (counters.Events == 0);
+        SIM_CHECK (counters.Cmd[18] == 0);
+        SIM_CHECK (counters.SpinCycles == 0);
+        SIM_CHECK (SD_TraceRead (Events, 2 * SD_TRACE_DEPTH) == 0);
+        SD_TraceDump ();
+}
+#endif
+
+static void Test (void)
+{
+        Sim_CardConfig config;
+
+        Sim_CardDefaults (&config);
+        Sim_CardInsert (&config);
+        Sim_BoardInit ();
+        SIM_CHECK (SD_Init () == SD_OK);
+
+#ifdef SD_TRACE_ENABLE
+        TestCounters ();
+        TestError ();
+        TestRing ();
+        TestConcurrent ();
+#else
+        TestStubs ();
+#endif
+}
+
+int main (void)
+{
+        return (Sim_Run (Test));
+}
@@ -0,0 +1,202 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#include <string.h>
+#include "sim.h"
+#include "sdio_high_level.h"
+
+/*
+ * Scatter-gather transfers : contiguous entries are coalesced into bigger double
+ * buffer chunks (fewer DMA IRQs), a DMA IRQ served too late fails the transfer
+ * instead of corrupting memory, FIFO and transfer errors of the stream.
+ */
+
+#define TEST_BLOCKS                   16
+#define TEST_ADDR                     (300 * 512)
+#define EXC_DMA                       (16 + DMA2_Stream3_IRQn)
+
+static uint8_t Pool[2 * TEST_BLOCKS * 512] __attribute__ ((aligned (4)));
+static uint8_t Data[TEST_BLOCKS * 512] __attribute__ ((aligned (4)));
+
+static void Fill (uint8_t *buffer, uint32_t size, uint32_t seed)
+{
+        uint32_t i;
+
+        for (i = 0; i < size; i++) {
+                buffer[i] = (uint8_t) (i * 11 + seed + (i >> 9));
+        }
+}
+
+/**
+ * @brief  Compares the vector with the reference data, entry after entry.
+ */
+static uint8_t Same (const SD_IoVec *vec, uint32_t count)
+{
+        uint32_t i, offset = 0;
+
+        for (i = 0; i < count; i++) {
+                if (memcmp (vec[i].buffer, Data + offset, vec[i].NumberOfBlocks * 512) != 0) {
+                        return (0);
+                }
+
+                offset += vec[i].NumberOfBlocks * 512;
+        }
+
+        return (1);
+}
+
+/**
+ * @brief  Copies the reference data into the vector.
+ */
+static void Scatter (const SD_IoVec *vec, uint32_t count)
+{
+        uint32_t i, offset = 0;
+
+        for (i = 0; i < count; i++) {
+                memcpy (vec[i].buffer, Data + offset, vec[i].NumberOfBlocks * 512);
+                offset += vec[i].NumberOfBlocks * 512;
+        }
+}
+
+/**
+ * @brief  Reads the vector and returns the number of DMA interrupts it took : one
+ *         per chunk, plus the TC of the stream disable at the end.
+ */
+static uint32_t Read (const SD_IoVec *vec, uint32_t count, SD_Error expected)
+{
+        Sim_Stats stats;
+
+        memset (Pool, 0, sizeof (Pool));
+        Sim_ResetStats ();
+        SIM_CHECK (SD_ReadMultiBlocksVec (vec, count, TEST_ADDR) == SD_OK);
+        SIM_CHECK (SD_WaitReadOperation () == expected);
+        Sim_GetStats (&stats);
+        return (stats.Interrupts[EXC_DMA]);
+}
+
+/**
+ * @brief  {A,1} {A+1,3} are one 4 block run, {B,4} and {C,8} are runs too : 4 block
+ *         chunks, one DMA IRQ per chunk instead of per block.
+ */
+static void TestCoalesced (void)
+{
+        SD_IoVec vec[] = {
+                { Pool, 1 },
+                { Pool + 512, 3 },
+                { Pool + 6 * 512, 4 },
+                { Pool + 12 * 512, 8 }
+        };
+        uint32_t irqs;
+
+        Scatter (vec, 4);
+        Sim_ResetStats ();
+        SIM_CHECK (SD_WriteMultiBlocksVec (vec, 4, TEST_ADDR) == SD_OK);
+        SIM_CHECK (SD_WaitWriteOperation () == SD_OK);
+        SIM_CHECK (SD_WaitReady () == SD_OK);
+        SIM_CHECK (memcmp (Sim_CardImage () + TEST_ADDR, Data, sizeof (Data)) == 0);
+
+        irqs = Read (vec, 4, SD_OK);
+        SIM_CHECK (Same (vec, 4));
+        SIM_CHECK (irqs == TEST_BLOCKS / 4 + 1);
+}
+
+/**
+ * @brief  Scattered single blocks : nothing to coalesce, one IRQ per block.
+ */
+static void TestScattered (void)
+{
+        SD_IoVec vec[TEST_BLOCKS];
+        uint32_t i;
+
+        for (i = 0; i < TEST_BLOCKS; i++) {
+                vec[i].buffer = Pool + (TEST_BLOCKS - 1 - i) * 2 * 512;
+                vec[i].NumberOfBlocks = 1;
+        }
+
+        SIM_CHECK (Read (vec, TEST_BLOCKS, SD_OK) == TEST_BLOCKS + 1);
+        SIM_CHECK (Same (vec, TEST_BLOCKS));
+}
+
+/**
+ * @brief  The DMA IRQ is held off for several chunk times : the DMA wraps around
+ *         into buffers nobody reloaded. SD_DMA_LATE, then the driver recovers.
+ */
+static void TestMissedSwap (void)
+{
+        SD_IoVec vec[TEST_BLOCKS];
+        uint32_t i;
+
+        for (i = 0; i < TEST_BLOCKS; i++) {
+                vec[i].buffer = Pool + i * 2 * 512;
+                vec[i].NumberOfBlocks = 1;
+        }
+
+        memset (Pool, 0, sizeof (Pool));
+        SIM_CHECK (SD_ReadMultiBlocksVec (vec, TEST_BLOCKS, TEST_ADDR) == SD_OK);
+        NVIC_DisableIRQ (DMA2_Stream3_IRQn);
+        Sim_Advance (SIM_US (500));
+        NVIC_EnableIRQ (DMA2_Stream3_IRQn);
+        SIM_CHECK (SD_WaitReadOperation () == SD_DMA_LATE);
+
+        /*!< Only the first two buffers were ever loaded */
+        SIM_CHECK (memcmp (vec[2].buffer, "\0\0\0\0", 4) == 0);
+
+        SIM_CHECK (SD_WaitReady () == SD_OK);
+        SIM_CHECK (Read (vec, TEST_BLOCKS, SD_OK) == TEST_BLOCKS + 1);
+        SIM_CHECK (Same (vec, TEST_BLOCKS));
+}
+
+/**
+ * @brief  FIFO error in the middle of a vector : reported, not fatal. Transfer
+ *         error : the stream stops, the transfer fails.
+ */
+static void TestDmaErrors (void)
+{
+        SD_IoVec vec[] = {
+                { Pool, 8 },
+                { Pool + 10 * 512, 8 }
+        };
+
+        memset (Pool, 0, sizeof (Pool));
+        SIM_CHECK (SD_ReadMultiBlocksVec (vec, 2, TEST_ADDR) == SD_OK);
+        Sim_Advance (SIM_US (200));
+        Sim_DmaFail (2, 3, 0x01);
+        SIM_CHECK (SD_WaitReadOperation () == SD_OK);
+        SIM_CHECK (Same (vec, 2));
+
+        SIM_CHECK (SD_ReadMultiBlocksVec (vec, 2, TEST_ADDR) == SD_OK);
+        Sim_Advance (SIM_US (100));
+        Sim_DmaFail (2, 3, 0x08);
+        SIM_CHECK (SD_WaitReadOperation () == SD_DMA_ERROR);
+
+        SIM_CHECK (SD_WaitReady () == SD_OK);
+        Read (vec, 2, SD_OK);
+        SIM_CHECK (Same (vec, 2));
+}
+
+static void Test (void)
+{
+        Sim_CardConfig config;
+
+        Sim_CardDefaults (&config);
+        Sim_CardInsert (&config);
+        Sim_BoardInit ();
+
+        SIM_CHECK (SD_Init () == SD_OK);
+        Fill (Data, sizeof (Data), 5);
+
+        TestCoalesced ();
+        TestScattered ();
+        TestMissedSwap ();
+        TestDmaErrors ();
+}
+
+int main (void)
+{
+        return (Sim_Run (Test));
+}
@@ -0,0 +1,36 @@
+/****************************************************************************
+ *                                                                          *
+ *  Author : lukasz.iwaszkiewicz@gmail.com                                  *
+ *  ~~~~~~~~                                                                *
+ *  License : see COPYING file for details.                                 *
+ *  ~~~~~~~~~                                                               *
+ ****************************************************************************/
+
+#ifndef USB_CONF_H_
+#define USB_CONF_H_
+
+/*
+ * USB OTG driver configuration of the host build (test_msc) : a full speed
+ * device. Only the MSC class is compiled, the endpoint calls are the harness.
+ */
+
+#include "stm32f4xx.h"
+
+#define USB_OTG_FS_CORE
+
+#define RX_FIFO_FS_SIZE               128
+#define TX0_FIFO_FS_SIZE              64
+#define TX1_FIFO_FS_SIZE              128
+#define TX2_FIFO_FS_SIZE              0
+#define TX3_FIFO_FS_SIZE              0
+
+#define USE_DEVICE_MODE
+
+#define __ALIGN_BEGIN
+#define __ALIGN_END
+
+#ifndef __packed
+#define __packed                      __attribute__ ((__packed__))
+#endif
+
+#endif /* USB_CONF_H_ */